@@ -0,0 +1,563 @@
+/*
+	ActionJournal.cpp: Write-ahead log of the actions run by the rules, so an
+					interrupted chain of actions can be picked up again
+	Released under the MIT license.
+*/
+
+#include "ActionJournal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include <Autolock.h>
+#include <Directory.h>
+#include <FindDirectory.h>
+#include <Path.h>
+
+#include "FilerDefs.h"
+#include "FilerRule.h"
+#include "PatternProcessor.h"
+#include "RuleRunner.h"
+
+/*
+	Every Filer writes its own journal into the "Journal" folder of the
+	settings, and keeps it locked with flock() for as long as it runs. A
+	journal that can be locked by someone else therefore belongs to a Filer
+	that went away without finishing its work.
+
+	The records are flattened BMessages, written one after the other:
+
+		'jbeg'	a rule starts on a file: "chain", "rule", "path", "first", and
+				what the rule's regular expressions found ("capture",
+				"group")
+		'jint'	an action is about to run: "chain", "index", "type", "path",
+				and for actions putting the file somewhere else, "target"
+				and whether something already was there ("existed")
+		'jdon'	an action finished: "chain", "index", and the "path" the file
+				now has, if it still exists
+		'jend'	the rule is done with the file: "chain"
+
+	An intent has to be on the disk before its action starts, everything
+	else may come later. So WillRun() is the only call waiting for fsync(),
+	and it takes along what was recorded before it, i.e. the completion of
+	the previous action and the start of a new chain. Threads syncing at
+	the same time share one fsync().
+
+	A record cut short by a crash simply ends the journal.
+*/
+
+static const char* const kJournalFolder = "Journal";
+
+// Once nothing is going on anymore, a journal growing larger than this
+// starts over
+static const off_t kCompactSize = 256 * 1024;
+
+enum {
+	JOURNAL_BEGIN	= 'jbeg',
+	JOURNAL_INTENT	= 'jint',
+	JOURNAL_DONE	= 'jdon',
+	JOURNAL_END		= 'jend'
+};
+
+
+struct PendingChain {
+	int64		chain;
+	BString		rule;
+	BString		path;
+	int32		actions;
+	int32		done;
+	int32		intent;
+	int8		type;
+	BString		target;
+	bool		existed;
+	bool		ended;
+	BMessage	captures;
+};
+
+
+struct ResumedChain {
+	FilerRule*	rule;
+	entry_ref	ref;
+	int32		first;
+	int64		chain;
+	BMessage	captures;
+};
+
+
+static PendingChain*
+FindChain(BObjectList<PendingChain>& chains, int64 chain)
+{
+	// Records usually belong to one of the latest chains
+	for (int32 i = chains.CountItems() - 1; i >= 0; i--) {
+		if (chains.ItemAt(i)->chain == chain)
+			return chains.ItemAt(i);
+	}
+	return NULL;
+}
+
+
+static void
+ReadJournal(int fd, BObjectList<PendingChain>& chains)
+{
+	BMallocIO data;
+	char buffer[16384];
+	ssize_t bytes;
+	while ((bytes = read(fd, buffer, sizeof(buffer))) > 0)
+		data.Write(buffer, bytes);
+	data.Seek(0, SEEK_SET);
+
+	BMessage record;
+	while (record.Unflatten(&data) == B_OK) {
+		int64 id;
+		if (record.FindInt64("chain", &id) != B_OK)
+			break;
+
+		if (record.what == JOURNAL_BEGIN) {
+			PendingChain* chain = new PendingChain;
+			chain->chain = id;
+			chain->rule = record.GetString("rule", "");
+			chain->path = record.GetString("path", "");
+			chain->actions = record.GetInt32("actions", 0);
+			chain->done = record.GetInt32("first", 0) - 1;
+			chain->intent = -1;
+			chain->type = -1;
+			chain->existed = false;
+			chain->ended = false;
+			chain->captures = record;
+			chains.AddItem(chain);
+			continue;
+		}
+
+		PendingChain* chain = FindChain(chains, id);
+		if (chain == NULL)
+			continue;
+
+		switch (record.what) {
+			case JOURNAL_INTENT:
+				chain->intent = record.GetInt32("index", -1);
+				chain->type = record.GetInt8("type", -1);
+				chain->target = record.GetString("target", "");
+				chain->existed = record.GetBool("existed", false);
+				break;
+			case JOURNAL_DONE:
+				chain->done = record.GetInt32("index", -1);
+				chain->path = record.GetString("path", "");
+				break;
+			case JOURNAL_END:
+				chain->ended = true;
+				break;
+		}
+	}
+}
+
+
+static FilerRule*
+FindRule(BObjectList<FilerRule>* ruleList, const PendingChain& chain)
+{
+	for (int32 i = 0; i < ruleList->CountItems(); i++) {
+		FilerRule* rule = ruleList->ItemAt(i);
+		if (chain.rule == rule->GetDescription()
+			&& rule->CountActions() == chain.actions)
+			return rule;
+	}
+	return NULL;
+}
+
+
+/*
+	Figures out where an unfinished chain has to go on. If an action was
+	about to run, the file tells whether it did: a file still in its old
+	place hasn't been moved, renamed or thrown away, so the action runs
+	again. A copy it may have left behind halfway is removed first. A file
+	found at a target that was free before has been moved already, and its
+	chain continues with the next action.
+
+	Opening a file, archiving it or running a command on it can't be told
+	apart from not having happened, so these run once more.
+*/
+static bool
+ResolveChain(BObjectList<FilerRule>* ruleList, const PendingChain& chain,
+	ResumedChain& resumed)
+{
+	FilerRule* rule = FindRule(ruleList, chain);
+	if (rule == NULL) {
+		printf("\tCouldn't resume rule '%s' for %s: the rule has changed\n",
+			chain.rule.String(), chain.path.String());
+		return false;
+	}
+
+	BString path(chain.path);
+	BEntry current(path.String());
+	int32 first = chain.done + 1;
+
+	if (chain.intent > chain.done) {
+		int8 type = -1;
+		rule->ActionAt(chain.intent)->FindInt8("type", &type);
+		if (type != chain.type) {
+			printf("\tCouldn't resume rule '%s' for %s: the rule has "
+				"changed\n", chain.rule.String(), path.String());
+			return false;
+		}
+
+		if (current.Exists()) {
+			if ((type == ACTION_MOVE || type == ACTION_COPY)
+				&& !chain.existed && !chain.target.IsEmpty()) {
+				BEntry partial(chain.target.String());
+				if (partial.Exists()) {
+					printf("\tRemoving unfinished %s\n", chain.target.String());
+					partial.Remove();
+				}
+			}
+			first = chain.intent;
+		} else if (!chain.target.IsEmpty() && !chain.existed
+			&& BEntry(chain.target.String()).Exists()) {
+			path = chain.target;
+			first = chain.intent + 1;
+		} else if (type == ACTION_DELETE) {
+			return false;
+		} else {
+			printf("\tCouldn't resume rule '%s': %s has gone missing\n",
+				chain.rule.String(), path.String());
+			return false;
+		}
+	} else if (!current.Exists()) {
+		printf("\tCouldn't resume rule '%s': %s has gone missing\n",
+			chain.rule.String(), path.String());
+		return false;
+	}
+
+	if (first >= rule->CountActions())
+		return false;
+
+	if (BEntry(path.String()).GetRef(&resumed.ref) != B_OK)
+		return false;
+
+	resumed.rule = rule;
+	resumed.first = first;
+	resumed.chain = -1;
+	resumed.captures = chain.captures;
+	return true;
+}
+
+
+ActionJournal::ActionJournal()
+	:
+	fLock("action journal"),
+	fSyncLock("action journal sync"),
+	fFD(-1),
+	fSequence(0),
+	fSynced(0),
+	fNextChain(0),
+	fOpenChains(0),
+	fSize(0)
+{
+}
+
+
+ActionJournal::~ActionJournal()
+{
+	Close();
+}
+
+
+status_t
+ActionJournal::Open()
+{
+	if (fFD >= 0)
+		return B_OK;
+
+	BPath path;
+	status_t status = find_directory(B_USER_SETTINGS_DIRECTORY, &path);
+	if (status != B_OK)
+		return status;
+
+	path.Append(kSettingsFolder);
+	path.Append(kJournalFolder);
+	create_directory(path.Path(), 0777);
+	fDirectory = path.Path();
+
+	// The team ID alone could be handed out again after a crash
+	fName.SetToFormat("%" B_PRId32 "-%" B_PRId64, (int32)getpid(),
+		real_time_clock_usecs());
+	path.Append(fName.String());
+
+	fFD = open(path.Path(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+	if (fFD < 0)
+		return errno;
+
+	fcntl(fFD, F_SETFD, FD_CLOEXEC);
+	if (flock(fFD, LOCK_EX | LOCK_NB) != 0) {
+		status = errno;
+		close(fFD);
+		fFD = -1;
+		unlink(path.Path());
+		return status;
+	}
+
+	return B_OK;
+}
+
+
+void
+ActionJournal::Close()
+{
+	if (fFD < 0)
+		return;
+
+	Sync();
+
+	// A journal with nothing unfinished in it isn't of any use anymore
+	if (fOpenChains == 0) {
+		BPath path(fDirectory.String(), fName.String());
+		unlink(path.Path());
+	}
+
+	close(fFD);
+	fFD = -1;
+}
+
+
+int64
+ActionJournal::BeginChain(const FilerRule* rule, const entry_ref& ref,
+	int32 first, const PatternContext* context)
+{
+	BPath path(&ref);
+	if (fFD < 0 || path.InitCheck() != B_OK)
+		return -1;
+
+	int64 chain = atomic_add64(&fNextChain, 1);
+	atomic_add(&fOpenChains, 1);
+
+	BMessage record(JOURNAL_BEGIN);
+	record.AddInt64("chain", chain);
+	record.AddString("rule", rule->GetDescription());
+	record.AddString("path", path.Path());
+	record.AddInt32("actions", rule->CountActions());
+	record.AddInt32("first", first);
+	if (context != NULL)
+		context->ArchiveCaptures(record);
+	_Append(record);
+
+	return chain;
+}
+
+
+status_t
+ActionJournal::WillRun(int64 chain, int32 index, int8 type,
+	const entry_ref& ref, const char* target)
+{
+	if (chain < 0)
+		return B_OK;
+
+	BPath path(&ref);
+
+	BMessage record(JOURNAL_INTENT);
+	record.AddInt64("chain", chain);
+	record.AddInt32("index", index);
+	record.AddInt8("type", type);
+	record.AddString("path", path.Path() != NULL ? path.Path() : "");
+	if (target != NULL && target[0] != '\0') {
+		record.AddString("target", target);
+		record.AddBool("existed", BEntry(target).Exists());
+	}
+
+	return _Sync(_Append(record));
+}
+
+
+void
+ActionJournal::Done(int64 chain, int32 index, const entry_ref& ref)
+{
+	if (chain < 0)
+		return;
+
+	BMessage record(JOURNAL_DONE);
+	record.AddInt64("chain", chain);
+	record.AddInt32("index", index);
+
+	BEntry entry(&ref);
+	BPath path;
+	if (entry.Exists() && entry.GetPath(&path) == B_OK)
+		record.AddString("path", path.Path());
+
+	_Append(record);
+}
+
+
+void
+ActionJournal::EndChain(int64 chain)
+{
+	if (chain < 0)
+		return;
+
+	BMessage record(JOURNAL_END);
+	record.AddInt64("chain", chain);
+	_Append(record);
+
+	if (atomic_add(&fOpenChains, -1) == 1)
+		_Compact();
+}
+
+
+status_t
+ActionJournal::Sync()
+{
+	if (fFD < 0)
+		return B_OK;
+
+	fLock.Lock();
+	int64 sequence = fSequence;
+	fLock.Unlock();
+
+	return _Sync(sequence);
+}
+
+
+int32
+ActionJournal::Recover(BObjectList<FilerRule>* ruleList, RuleRunner& runner)
+{
+	BDirectory directory(fDirectory.String());
+	if (fFD < 0 || directory.InitCheck() != B_OK)
+		return 0;
+
+	BObjectList<ResumedChain> resumed(20, true);
+	bool announced = false;
+
+	BEntry entry;
+	while (directory.GetNextEntry(&entry) == B_OK) {
+		char name[B_FILE_NAME_LENGTH];
+		entry.GetName(name);
+		if (fName == name)
+			continue;
+
+		BPath path;
+		entry.GetPath(&path);
+		int fd = open(path.Path(), O_RDONLY);
+		if (fd < 0)
+			continue;
+
+		// Still in use by a running Filer
+		if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+			close(fd);
+			continue;
+		}
+
+		BObjectList<PendingChain> chains(20, true);
+		ReadJournal(fd, chains);
+
+		for (int32 i = 0; i < chains.CountItems(); i++) {
+			PendingChain* chain = chains.ItemAt(i);
+			if (chain->ended)
+				continue;
+
+			if (!announced) {
+				printf("Looking into rules interrupted earlier\n");
+				announced = true;
+			}
+
+			ResumedChain* next = new ResumedChain;
+			if (!ResolveChain(ruleList, *chain, *next)) {
+				delete next;
+				continue;
+			}
+
+			// Taken over into our own journal before the old one goes
+			PatternContext context(next->ref);
+			context.UnarchiveCaptures(next->captures);
+			next->chain = BeginChain(next->rule, next->ref, next->first,
+				&context);
+			resumed.AddItem(next);
+		}
+
+		Sync();
+		unlink(path.Path());
+		close(fd);
+	}
+
+	for (int32 i = 0; i < resumed.CountItems(); i++) {
+		ResumedChain* next = resumed.ItemAt(i);
+		printf("Resuming rule '%s' at action %" B_PRId32 "\n",
+			next->rule->GetDescription(), next->first + 1);
+		PatternContext context(next->ref);
+		context.UnarchiveCaptures(next->captures);
+		runner.RunActions(next->rule, next->ref, next->first, next->chain,
+			&context);
+	}
+
+	return resumed.CountItems();
+}
+
+
+int64
+ActionJournal::_Append(const BMessage& record)
+{
+	BAutolock _(fLock);
+
+	record.Flatten(&fBuffer);
+	return ++fSequence;
+}
+
+
+status_t
+ActionJournal::_Sync(int64 sequence)
+{
+	BAutolock _(fSyncLock);
+
+	// Someone else's fsync() took our records along
+	if (fSynced >= sequence)
+		return B_OK;
+
+	fLock.Lock();
+	int64 written = fSequence;
+	const char* data = (const char*)fBuffer.Buffer();
+	size_t length = fBuffer.BufferLength();
+	status_t status = B_OK;
+	while (length > 0) {
+		ssize_t bytes = write(fFD, data, length);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			status = errno;
+			break;
+		}
+		data += bytes;
+		length -= bytes;
+		fSize += bytes;
+	}
+	fBuffer.SetSize(0);
+	fBuffer.Seek(0, SEEK_SET);
+	fLock.Unlock();
+
+	if (status == B_OK && fsync(fFD) != 0)
+		status = errno;
+
+	if (status != B_OK) {
+		printf("\tCouldn't write the action journal: %s\n", strerror(status));
+		return status;
+	}
+
+	fSynced = written;
+	return B_OK;
+}
+
+
+void
+ActionJournal::_Compact()
+{
+	BAutolock syncLocker(fSyncLock);
+	BAutolock locker(fLock);
+
+	// Another chain may have started in the meantime
+	if (fOpenChains > 0 || fSize + (off_t)fBuffer.BufferLength()
+			< kCompactSize)
+		return;
+
+	fBuffer.SetSize(0);
+	fBuffer.Seek(0, SEEK_SET);
+	if (ftruncate(fFD, 0) == 0)
+		fSize = 0;
+	fSynced = fSequence;
+}
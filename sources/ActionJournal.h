@@ -0,0 +1,65 @@
+/*
+	ActionJournal.h: Write-ahead log of the actions run by the rules, so an
+					interrupted chain of actions can be picked up again
+	Released under the MIT license.
+*/
+
+#ifndef ACTION_JOURNAL_H
+#define ACTION_JOURNAL_H
+
+#include <DataIO.h>
+#include <Entry.h>
+#include <Locker.h>
+#include <Message.h>
+#include <String.h>
+
+#include "ObjectList.h"
+
+class FilerRule;
+class PatternContext;
+class RuleRunner;
+
+class ActionJournal
+{
+public:
+							ActionJournal();
+							~ActionJournal();
+
+			status_t		Open();
+			void			Close();
+
+			int64			BeginChain(const FilerRule* rule,
+								const entry_ref& ref, int32 first = 0,
+								const PatternContext* context = NULL);
+			status_t		WillRun(int64 chain, int32 index, int8 type,
+								const entry_ref& ref, const char* target);
+			void			Done(int64 chain, int32 index,
+								const entry_ref& ref);
+			void			EndChain(int64 chain);
+
+			status_t		Sync();
+
+	// Resumes the chains left unfinished by Filers that are gone, returns
+	// how many were picked up again
+			int32			Recover(BObjectList<FilerRule>* ruleList,
+								RuleRunner& runner);
+
+private:
+			int64			_Append(const BMessage& record);
+			status_t		_Sync(int64 sequence);
+			void			_Compact();
+
+			BLocker			fLock;
+			BLocker			fSyncLock;
+			int				fFD;
+			BString			fDirectory;
+			BString			fName;
+			BMallocIO		fBuffer;
+			int64			fSequence;
+			int64			fSynced;
+			int64			fNextChain;
+			int32			fOpenChains;
+			off_t			fSize;
+};
+
+#endif	// ACTION_JOURNAL_H
@@ -66,11 +66,19 @@ ActionView::ActionView(const char* name, BMessage* action, const int32& flags)
 		"\%BASENAME\%\tFile name without extension\n"
 		"\%FOLDER\%\t\tFull location of the folder which contains the file\n"
 		"\%FULLPATH\%\t\tFull location of the file\n"
+		"\%FILES\%\t\t\tAll files reaching a shell command, run in batches\n"
 		"\%DATE\%\t\t\tCurrent date in the format MM-DD-YYYY\n"
 		"\%EURODATE\%\t\tCurrent date in the format DD-MM-YYYY\n"
 		"\%REVERSEDATE\%\tCurrent date in the format YYYY-MM-DD\n"
 		"\%TIME\%\t\t\tCurrent time using 24-hour time\n"
-		"\%ATTR:xxxx\%\t\tAn extended attribute of the file",
+		"\%ATTR:xxxx\%\t\tAn extended attribute of the file\n"
+		"\%SIZE\%\t\t\tFile size in bytes, or \%SIZE:KB\%, MB, GB\n"
+		"\%MTIME\%\t\tLast modified as YYYY-MM-DD, or \%MTIME:$d.$m.$Y\%\n"
+		"\%MIME\%\t\t\tFile type, or \%MIME:super\%, \%MIME:sub\%\n"
+		"\%HASH\%\t\t\tChecksum of the contents, or its start: \%HASH:2\%\n"
+		"\%COUNTER\%\t\tNumber counting up per file, or \%COUNTER:4\%\n"
+		"\%1\%, \%2\%, ...\t\tGroups found by a \"matches pattern\" test\n"
+		"\%MATCH:name\%\tA group named with (?<name>...)",
 		"Tooltip, do not translate the %variables%"));
 	fValueBox->SetToolTip(toolTip.String());
 }
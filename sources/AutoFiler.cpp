@@ -1,26 +1,246 @@
 /*
-	AutoFiler: Watcher daemon which executes the Filer on monitored folders
+	AutoFiler: Watcher daemon which runs the Filer's rules on monitored folders
 	Released under the MIT license.
 	Written by DarkWyrm <darkwyrm@gmail.com>, Copyright 2008
 	Contributed by:
 		Owen Pan <owen.pan@yahoo.com>, 2017
 */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Directory.h>
 #include <Locker.h>
+#include <MessageRunner.h>
 #include <NodeMonitor.h>
-#include <Roster.h>
+#include <PropertyInfo.h>
 #include <String.h>
 
 #include "AutoFiler.h"
+#include "CatchUpScan.h"
+#include "Debouncer.h"
+#include "EventLog.h"
+#include "EventQueue.h"
 #include "FilerDefs.h"
+#include "FilingPool.h"
+#include "FilingStats.h"
+#include "FolderTree.h"
 #include "RefStorage.h"
+#include "RuleEngine.h"
+#include "RuleRunner.h"
+#include "StatsSocket.h"
+#include "Sweeper.h"
+#include "Watcher.h"
+#include "WorkQueue.h"
+
+/*
+	The rules are run right here, by the workers of the FilingPool, instead
+	of starting the Filer for every file. They are loaded once, and again
+	whenever the Filer saves them. Events are only ever handed over, so
+	filing never holds them up.
+
+	New files are held back by the Debouncer until they were left alone for
+	a moment, so they aren't filed while they're still being written, or
+	filed again for every write.
+
+	Files sent to the AutoFiler, by Tracker or a script, are filed right
+	away, ahead of the others, and aren't held up by the limits on how many
+	files to file per second.
+
+	The watched folders, and their subfolders, are read and looked through
+	on threads of their own. Folders only start being watched once they
+	were all read, so the files that turned up in them meanwhile are caught
+	up on then, as are those in folders created or moved to one.
+
+	Once all files handed to the FilingPool are done, none are held back,
+	and no folders are being read, the watched folders get a new mark. It's
+	saved once in a while, and when the AutoFiler quits. Files that turn up after it,
+	while the AutoFiler isn't running, are caught up on when it starts.
+
+	Changes of the watched folders' own times or attributes, like those
+	Tracker makes when a folder is opened, don't file anything. Only when a
+	folder was modified without the entries that changed being reported is
+	it looked through again, for the files changed since the last look.
+
+	The watched folders on a volume that's unmounted are put aside until
+	it's mounted again, and then caught up on like when the AutoFiler
+	starts. Their marks stay as they were, so whatever wasn't filed on it
+	yet is then.
+
+	Files that only become due by getting old are found by the Sweeper,
+	which looks through the folders it was set up for on a schedule.
+
+	What the AutoFiler is up to can be asked with MSG_GET_STATUS, the
+	"Stats" property, or read from its StatsSocket.
+
+	For load tests, the events can be recorded with --record <log>, and
+	played back with --replay <log> --tree <folder> --settings <folder>
+	[--speed <n>|max], once the AutoFiler that's running is quit. A replay
+	only watches the tree, and takes its settings and rules from the given
+	folder instead of the Filer's. It leaves the queue, the journal and the
+	marks of the watched folders alone, and prints how fast the files were
+	filed, and the memory used, once they all are.
+*/
+
+// How often to look for files that are done being written
+static const bigtime_t kSettleInterval = 250000;
+
+// How often to look for sweeps that are due
+static const bigtime_t kSweepCheckInterval = 60000000;
+
+// Leaves time for events of the last files to come in, in seconds
+static const time_t kMarkSlack = 2;
+
+// How often the marks are saved at most
+static const bigtime_t kMarkInterval = 10000000;
+
+// When a watched folder's entries were last looked at, and what its
+// modification time was then. Whether it changed is only looked at with
+// the next settle check, however many events come in before.
+struct FolderScan {
+	node_ref	folder;
+	time_t		modified;
+	time_t		scanned;
+	// Its modification time is to be looked at
+	bool		changed;
+	// Entries were reported since, which account for the change
+	bool		reported;
+	bool		due;
+};
+
+static property_info sProperties[] = {
+	{ "Stats", { B_GET_PROPERTY, 0 }, { B_DIRECT_SPECIFIER, 0 },
+		"Returns what the AutoFiler has filed, and how long it took.",
+		0, { B_MESSAGE_TYPE }
+	},
+
+	{ 0 }
+};
 
-App::App()
+App::App(EventRecorder* recorder, EventReplayer* replayer)
 	:
-	BApplication(kAutoFilerSignature)
+	BApplication(kAutoFilerSignature),
+	fEngine(new RuleEngine),
+	fPool(NULL),
+	fStats(new FilingStats),
+	fStatsSocket(NULL),
+	fQueue(replayer == NULL ? new EventQueue : NULL),
+	fWatcher(replayer == NULL ? Watcher::Create(this) : new ReplayWatcher),
+	fTree(new FolderTree(*fWatcher)),
+	fDebouncer(new Debouncer(*fWatcher)),
+	fSettleRunner(NULL),
+	fScans(20, true),
+	fSweeper(NULL),
+	fSweepRunner(NULL),
+	fMarkRunner(NULL),
+	fPendingMark(0),
+	fMarksSaved(0),
+	fRecorder(recorder),
+	fReplayer(replayer),
+	fReplayStarted(false),
+	fReplayDone(false),
+	fEarlyRefs(B_REFS_RECEIVED),
+	fInFlight(0),
+	fScanning(0),
+	fRescanning(false)
 {
-	LoadFolders();
+	fEngine->LoadSettings();
+	fEngine->LoadRules();
+	fDebouncer->LoadSettings();
+	fTree->LoadSettings();
+
+	// What was left in the queue is filed first
+	if (fQueue != NULL && fQueue->Open() == B_OK)
+		fInFlight = fQueue->CountPending();
+	else {
+		delete fQueue;
+		fQueue = NULL;
+	}
+
+	gFolders.Reload();
+	gFolders.LoadMarks();
+	UpdateSubsets();
+	if (fReplayer == NULL && fWatcher->WatchVolumes() != B_OK)
+		printf("\tCouldn't watch for volumes being mounted\n");
+}
+
+
+App::~App()
+{
+	delete fMarkRunner;
+	delete fSweepRunner;
+	delete fSettleRunner;
+	delete fReplayer;
+	delete fRecorder;
+	delete fQueue;
+	delete fDebouncer;
+	delete fTree;
+	delete fWatcher;
+	delete fEngine;
+	delete fStats;
+}
+
+
+void
+App::ReadyToRun()
+{
+	// Whatever a Filer or AutoFiler that's gone left unfinished comes first.
+	// A replay leaves that to the AutoFiler that's used.
+	if (fReplayer == NULL && fEngine->OpenJournal() == B_OK) {
+		ConflictChoice conflicts;
+		fEngine->ResumeInterrupted(conflicts);
+	}
+
+	fPool = new FilingPool(*fEngine, fQueue, fStats);
+	fPool->Run();
+	if (fInFlight > 0)
+		fPool->PostMessage(MSG_QUEUE_FILLED);
+	RefsReceived(&fEarlyRefs);
+
+	// The files that turned up since the folders' marks are caught up on
+	// once they're watched. A replay starts then.
 	StartWatching();
+	if (fReplayer != NULL)
+		return;
+
+	fSweeper = new Sweeper(BMessenger(this));
+	fSweeper->LoadSettings();
+	fSweeper->StartDue();
+
+	BMessage check(MSG_CHECK_SWEEPS);
+	fSweepRunner = new BMessageRunner(this, &check, kSweepCheckInterval);
+
+	fStatsSocket = new StatsSocket(BMessenger(this));
+	if (fStatsSocket->Start() != B_OK)
+		printf("\tCouldn't open the stats socket\n");
+}
+
+
+bool
+App::QuitRequested()
+{
+	StopWatching();
+	if (fReplayer == NULL) {
+		UpdateMarks();
+		SaveMarks();
+	}
+
+	// A sweep being run is picked up again next time
+	delete fSweeper;
+	fSweeper = NULL;
+
+	delete fStatsSocket;
+	fStatsSocket = NULL;
+
+	// Waits for the files being filed, the others are picked up from the
+	// queue next time
+	if (fPool != NULL && fPool->Lock()) {
+		fPool->Quit();
+		fPool = NULL;
+	}
+
+	return true;
 }
 
 
@@ -31,14 +251,116 @@ App::MessageReceived(BMessage* msg)
 	{
 		case MSG_REFRESH_FOLDERS:
 		{
-			StopWatching();
-			ReloadFolders();
-			StartWatching();
+			// Only the folders that were added or removed change
+			BObjectList<node_ref> added(20, true);
+			BObjectList<node_ref> removed(20, true);
+			if (gFolders.Reload(&added, &removed) != B_OK)
+				break;
+
+			for (int32 i = 0; i < removed.CountItems(); i++)
+				fTree->RemoveRoot(*removed.ItemAt(i));
+			WatchRoots(added);
+
+			BObjectList<node_ref> roots(20, true);
+			GetRoots(roots);
+			ResetScans(roots);
+
+			// Their rules may have changed as well
+			UpdateSubsets();
+			if (fSweeper != NULL)
+				fSweeper->LoadSettings();
 			break;
 		}
 		case B_NODE_MONITOR:
+		case MSG_WATCH_EVENT:
+		{
+			WatchEvent event;
+			if (fWatcher->GetEvent(msg, event))
+				HandleEvent(event);
+			break;
+		}
+		case MSG_FOLDERS_FOUND:
+		{
+			FoldersFound(msg);
+			break;
+		}
+		case MSG_CAUGHT_UP:
+		{
+			ScanDone(msg);
+			break;
+		}
+		case MSG_CHECK_SETTLED:
+		{
+			CheckSettled();
+			break;
+		}
+		case MSG_CHECK_SWEEPS:
+		{
+			if (fSweeper != NULL)
+				fSweeper->StartDue();
+			break;
+		}
+		case MSG_SWEPT:
+		{
+			Dispatch(*msg);
+			break;
+		}
+		case MSG_FILING_DONE:
+		{
+			int32 count;
+			if (msg->FindInt32("count", &count) == B_OK)
+				fInFlight -= count;
+			UpdateMarks();
+			break;
+		}
+		case MSG_SAVE_MARKS:
+		{
+			SaveMarks();
+			break;
+		}
+		case MSG_FILES_OFFLINE:
+		{
+			// The volume's event may not be in yet, and the marks of its
+			// folders mustn't pass the files
+			int32 device;
+			int32 count;
+			if (msg->FindInt32("device", &device) == B_OK)
+				VolumeUnmounted(device);
+			if (msg->FindInt32("count", &count) == B_OK)
+				fInFlight -= count;
+			UpdateMarks();
+			break;
+		}
+		case MSG_REPLAY_DONE:
+		{
+			fReplayDone = true;
+			UpdateMarks();
+			break;
+		}
+		case MSG_GET_STATUS:
+		{
+			BMessage status(B_REPLY);
+			GetStatus(status);
+			msg->SendReply(&status);
+			break;
+		}
+		case B_GET_PROPERTY:
 		{
-			HandleNodeMonitoring(msg);
+			BMessage specifier;
+			const char* property;
+			if (msg->GetCurrentSpecifier(NULL, &specifier) != B_OK
+				|| specifier.FindString("property", &property) != B_OK
+				|| strcmp(property, "Stats") != 0) {
+				BApplication::MessageReceived(msg);
+				break;
+			}
+
+			BMessage status;
+			GetStatus(status);
+			BMessage reply(B_REPLY);
+			reply.AddMessage("result", &status);
+			reply.AddInt32("error", B_OK);
+			msg->SendReply(&reply);
 			break;
 		}
 		default:
@@ -48,158 +370,669 @@ App::MessageReceived(BMessage* msg)
 }
 
 
+void
+App::RefsReceived(BMessage* msg)
+{
+	// Those the AutoFiler was launched with come before the pool
+	if (fPool == NULL) {
+		entry_ref ref;
+		for (int32 i = 0; msg->FindRef("refs", i, &ref) == B_OK; i++)
+			fEarlyRefs.AddRef("refs", &ref);
+		return;
+	}
+
+	BMessage refs(B_REFS_RECEIVED);
+	refs.AddInt32("priority", PRIORITY_INTERACTIVE);
+
+	int32 count = 0;
+	entry_ref ref;
+	for (int32 i = 0; msg->FindRef("refs", i, &ref) == B_OK; i++) {
+		refs.AddRef("refs", &ref);
+		count++;
+	}
+
+	if (count > 0 && fPool->PostMessage(&refs) == B_OK)
+		fInFlight += count;
+}
+
+
+status_t
+App::GetSupportedSuites(BMessage* msg)
+{
+	msg->AddString("suites", "suite/vnd.dw-AutoFiler");
+
+	BPropertyInfo prop_info(sProperties);
+	msg->AddFlat("messages", &prop_info);
+	return BApplication::GetSupportedSuites(msg);
+}
+
+
+BHandler*
+App::ResolveSpecifier(BMessage* msg, int32 index, BMessage* specifier,
+	int32 form, const char* property)
+{
+	BPropertyInfo prop_info(sProperties);
+	if (prop_info.FindMatch(msg, index, specifier, form, property) >= 0)
+		return this;
+
+	return BApplication::ResolveSpecifier(msg, index, specifier, form,
+		property);
+}
+
+
 void
 App::StartWatching()
 {
-	gRefLock.Lock();
+	BObjectList<node_ref> roots(20, true);
+	GetRoots(roots);
+	ResetScans(roots);
+	WatchRoots(roots);
+}
+
+
+void
+App::GetRoots(BObjectList<node_ref>& roots)
+{
+	if (fReplayer != NULL) {
+		roots.AddItem(new node_ref(fReplayer->Root()));
+		return;
+	}
+
+	gFolders.ReadLock();
 	
-	for (int32 i = 0; i < gRefStructList.CountItems(); i++)
+	for (int32 i = 0; i < gFolders.CountFolders(); i++)
 	{
-		RefStorage* refholder = (RefStorage*)gRefStructList.ItemAt(i);
-		watch_node(&refholder->nref, B_WATCH_ALL, this);
+		RefStorage* refholder = gFolders.FolderAt(i);
+		roots.AddItem(new node_ref(refholder->nref));
 	}
 	
-	gRefLock.Unlock();
+	gFolders.ReadUnlock();
 }
 
 
-static void
-LaunchFiler(const entry_ref& ref)
+void
+App::ResetScans(const BObjectList<node_ref>& roots)
 {
-	static uint32 launchTime = real_time_clock();
+	// Those still watched keep when they were looked at
+	for (int32 i = fScans.CountItems() - 1; i >= 0; i--) {
+		bool found = false;
+		for (int32 j = 0; j < roots.CountItems() && !found; j++)
+			found = *roots.ItemAt(j) == fScans.ItemAt(i)->folder;
+		if (!found)
+			delete fScans.RemoveItemAt(i);
+	}
+
+	for (int32 i = 0; i < roots.CountItems(); i++) {
+		if (ScanFor(*roots.ItemAt(i)) != NULL)
+			continue;
+
+		FolderScan* scan = new FolderScan;
+		scan->folder = *roots.ItemAt(i);
+		scan->modified = 0;
+		scan->scanned = time(NULL);
+		scan->changed = false;
+		scan->reported = false;
+		scan->due = false;
+		BDirectory(&scan->folder).GetModificationTime(&scan->modified);
+		fScans.AddItem(scan);
+	}
+}
+
+
+FolderScan*
+App::ScanFor(const node_ref& folder)
+{
+	// There are only a few watched folders
+	for (int32 i = 0; i < fScans.CountItems(); i++) {
+		if (fScans.ItemAt(i)->folder == folder)
+			return fScans.ItemAt(i);
+	}
+	return NULL;
+}
+
+
+void
+App::GetStatus(BMessage& status)
+{
+	status.AddInt32("held back", fDebouncer->CountPending());
+	status.AddInt32("in flight", fInFlight);
+	status.AddInt32("unwatched folders", fTree->CountUnwatched());
+	if (fPool != NULL)
+		fPool->GetStatus(status);
+	fStats->Archive(status);
+}
+
+
+void
+App::HoldBack(const entry_ref& ref)
+{
+	fDebouncer->Add(ref);
+	StartSettling();
+}
+
+
+void
+App::StartSettling()
+{
+	if (fSettleRunner == NULL) {
+		BMessage msg(MSG_CHECK_SETTLED);
+		fSettleRunner = new BMessageRunner(this, &msg, kSettleInterval);
+	}
+}
+
+
+void
+App::CheckSettled()
+{
+	bool rescanning = RescanFolders();
 
-	RefStorage* refholder;
-	team_id team;
-	entry_ref dirRef;
-	BEntry dir, file(&ref);
 	BMessage msg(B_REFS_RECEIVED);
+	if (fDebouncer->CollectSettled(msg) > 0)
+		Dispatch(msg);
 
-	file.GetParent(&dir);
-	dir.GetRef(&dirRef);
-	msg.AddRef("refs", &ref);
+	if (fDebouncer->CountPending() == 0 && !rescanning) {
+		delete fSettleRunner;
+		fSettleRunner = NULL;
+	}
+}
 
-	gRefLock.Lock();
 
-	for (int32 i = 0; i < gRefStructList.CountItems(); i++)
-	{
-		refholder = (RefStorage*) gRefStructList.ItemAt(i);
+void
+App::EntriesChanged(const node_ref& folder)
+{
+	FolderScan* scan = ScanFor(folder);
+	if (scan == NULL)
+		return;
 
-		if (refholder->ref == dirRef)
-		{
-			if (refholder->doAll && real_time_clock() > launchTime)
-				refholder->doAll = false;
+	// The change of its modification time is accounted for
+	scan->changed = true;
+	scan->reported = true;
+	StartSettling();
+}
 
-			msg.AddBool(kDoAll, refholder->doAll);
-			msg.AddBool(kReplace, refholder->replace);
-			break;
+
+void
+App::FolderChanged(const node_ref& folder)
+{
+	FolderScan* scan = ScanFor(folder);
+	if (scan == NULL)
+		return;
+
+	scan->changed = true;
+	StartSettling();
+}
+
+
+bool
+App::RescanFolders()
+{
+	for (int32 i = 0; i < fScans.CountItems(); i++) {
+		FolderScan* folder = fScans.ItemAt(i);
+		if (!folder->changed)
+			continue;
+
+		bool reported = folder->reported;
+		folder->changed = false;
+		folder->reported = false;
+
+		// Only its other times or its permissions changed, or the entries
+		// that did were reported
+		time_t modified;
+		if (BDirectory(&folder->folder).GetModificationTime(&modified)
+				!= B_OK || modified == folder->modified)
+			continue;
+
+		folder->modified = modified;
+		if (!reported)
+			folder->due = true;
+	}
+
+	// However often they change, they're looked through once in a while,
+	// and one scan at a time
+	if (fRescanning)
+		return true;
+
+	CatchUpScan* scan = new CatchUpScan;
+	time_t now = time(NULL);
+
+	for (int32 i = 0; i < fScans.CountItems(); i++) {
+		FolderScan* folder = fScans.ItemAt(i);
+		if (!folder->due)
+			continue;
+
+		scan->AddFolder(folder->folder, folder->scanned - kMarkSlack);
+		folder->scanned = now;
+		folder->due = false;
+	}
+
+	if (scan->CountFolders() == 0) {
+		delete scan;
+		return false;
+	}
+
+	fRescanning = true;
+	StartScan(scan, true);
+	return true;
+}
+
+
+void
+App::Dispatch(BMessage& refs)
+{
+	if (fPool == NULL)
+		return;
+
+	// Files that couldn't be queued are handed over right away
+	BMessage direct(B_REFS_RECEIVED);
+	int32 queued = 0;
+	int32 count = 0;
+
+	// Swept files may come with their own rules
+	const char* ruleSet = refs.GetString("ruleset", NULL);
+	if (ruleSet != NULL)
+		direct.AddString("ruleset", ruleSet);
+
+	// Latency is taken from when the files turned up, if that's known
+	bigtime_t now = real_time_clock_usecs();
+
+	entry_ref ref;
+	for (int32 i = 0; refs.FindRef("refs", i, &ref) == B_OK; i++) {
+		bigtime_t seen;
+		if (refs.FindInt64("when", i, &seen) != B_OK)
+			seen = now;
+
+		if (fQueue != NULL && fQueue->Append(ref, ruleSet, seen) == B_OK)
+			queued++;
+		else {
+			direct.AddRef("refs", &ref);
+			direct.AddInt64("when", seen);
+			count++;
 		}
 	}
 
-	be_roster->Launch(kFilerSignature, &msg, &team);
+	if (queued > 0) {
+		fQueue->Flush();
+		fPool->PostMessage(MSG_QUEUE_FILLED);
+		fInFlight += queued;
+	}
+
+	if (count > 0 && fPool->PostMessage(&direct) == B_OK)
+		fInFlight += count;
+}
 
-	if (!refholder->doAll)
-	{
-		BMessage reply;
-		be_app_messenger.SetTo(NULL, team);
 
-		if (be_app_messenger.SendMessage(MSG_AUTO_FILER, &reply) == B_OK)
-		{
-			reply.FindBool(kDoAll, &refholder->doAll);
-			reply.FindBool(kReplace, &refholder->replace);
+void
+App::WatchRoots(const BObjectList<node_ref>& roots)
+{
+	if (roots.IsEmpty())
+		return;
+
+	// Files that turn up while the folders are read are caught up on
+	// afterwards
+	BMessage done(MSG_FOLDERS_FOUND);
+	done.AddInt64("started", time(NULL));
+
+	// A replay needs to know which folders to make for them
+	if (fRecorder != NULL) {
+		for (int32 i = 0; i < roots.CountItems(); i++)
+			fRecorder->RecordRoot(*roots.ItemAt(i));
+	}
+
+	fScanning++;
+	fTree->AddRoots(roots, BMessenger(this), done);
+}
+
+
+void
+App::FoldersFound(BMessage* msg)
+{
+	BObjectList<node_ref> folders(20, true);
+	BObjectList<node_ref> roots(20, true);
+	BObjectList<node_ref> added(20, true);
+	fTree->Merge(msg, folders, roots, added);
+	fScanning--;
+	ScanAdded(added);
+
+	if (fReplayer != NULL) {
+		if (!fReplayStarted && fReplayer->Start(BMessenger(this)) != B_OK) {
+			printf("\tCouldn't start the replay\n");
+			PostMessage(B_QUIT_REQUESTED);
 		}
+		fReplayStarted = true;
+		return;
 	}
 
-	launchTime = real_time_clock();
+	// Folders that weren't watched before have nothing to catch up on,
+	// but what turned up while they were read
+	time_t started = msg->GetInt64("started", 0) - kMarkSlack;
+
+	CatchUpScan* scan = new CatchUpScan;
 
-	gRefLock.Unlock();
+	gFolders.ReadLock();
+	for (int32 i = 0; i < folders.CountItems(); i++) {
+		RefStorage* refholder = gFolders.Find(*roots.ItemAt(i));
+		scan->AddFolder(*folders.ItemAt(i), refholder != NULL
+			&& refholder->mark > 0 ? refholder->mark : started);
+	}
+	gFolders.ReadUnlock();
+
+	StartScan(scan, false);
+	UpdateMarks();
 }
 
 
 void
-App::HandleNodeMonitoring(BMessage* msg)
+App::ScanAdded(const BObjectList<node_ref>& folders)
 {
-	int32 op;
-	msg->FindInt32("opcode", &op);
-	
-	switch (op)
+	if (folders.IsEmpty())
+		return;
+
+	// Everything in them is new to the watched folder
+	CatchUpScan* scan = new CatchUpScan;
+	for (int32 i = 0; i < folders.CountItems(); i++)
+		scan->AddFolder(*folders.ItemAt(i), 0);
+	StartScan(scan, false);
+}
+
+
+void
+App::StartScan(CatchUpScan* scan, bool holdBack)
+{
+	if (scan->CountFolders() == 0) {
+		delete scan;
+		return;
+	}
+
+	BMessage done(MSG_CAUGHT_UP);
+	done.AddBool("hold back", holdBack);
+
+	fScanning++;
+	scan->Start(BMessenger(this), done);
+}
+
+
+void
+App::ScanDone(BMessage* msg)
+{
+	CatchUpScan* scan;
+	if (msg->FindPointer("scan", (void**)&scan) != B_OK)
+		return;
+
+	fScanning--;
+
+	if (msg->GetBool("hold back", false)) {
+		fRescanning = false;
+
+		// Files that are held back already only get their timer reset
+		for (int32 i = 0; i < scan->CountFiles(); i++) {
+			const CaughtFile* file = scan->FileAt(i);
+			if (!fDebouncer->IsTemporary(file->ref.name))
+				HoldBack(file->ref);
+		}
+		delete scan;
+		UpdateMarks();
+		return;
+	}
+
+	// Files that weren't changed for a while are filed right away
+	time_t settled = time(NULL) - fDebouncer->QuietPeriod() / 1000000;
+	BMessage refs(B_REFS_RECEIVED);
+	int32 count = 0;
+
+	for (int32 i = 0; i < scan->CountFiles(); i++) {
+		const CaughtFile* file = scan->FileAt(i);
+		if (fDebouncer->IsTemporary(file->ref.name))
+			continue;
+
+		if (file->changed < settled) {
+			refs.AddRef("refs", &file->ref);
+			count++;
+		} else
+			HoldBack(file->ref);
+	}
+
+	if (count > 0)
+		Dispatch(refs);
+
+	printf("Caught up on %" B_PRId32 " files in %" B_PRId32 " folders\n",
+		scan->CountFiles(), scan->CountFolders());
+
+	delete scan;
+	UpdateMarks();
+}
+
+
+void
+App::VolumeMounted(dev_t device)
+{
+	BObjectList<node_ref> added(20, true);
+	gFolders.VolumeMounted(device, added);
+	if (added.IsEmpty())
+		return;
+
+	printf("\tWatching %" B_PRId32 " folders on a volume that was mounted\n",
+		added.CountItems());
+
+	// Caught up on from their marks once they're watched
+	WatchRoots(added);
+	BObjectList<node_ref> roots(20, true);
+	GetRoots(roots);
+	ResetScans(roots);
+	UpdateSubsets();
+}
+
+
+void
+App::VolumeUnmounted(dev_t device)
+{
+	BObjectList<node_ref> removed(20, true);
+	gFolders.VolumeUnmounted(device, removed);
+
+	if (!removed.IsEmpty()) {
+		printf("\tPutting aside %" B_PRId32 " folders on a volume that was "
+			"unmounted\n", removed.CountItems());
+
+		for (int32 i = 0; i < removed.CountItems(); i++)
+			fTree->RemoveRoot(*removed.ItemAt(i));
+		BObjectList<node_ref> roots(20, true);
+		GetRoots(roots);
+		ResetScans(roots);
+		UpdateSubsets();
+	}
+
+	// Files held back on it can't be filed anymore, even those in a
+	// subfolder of a folder on another volume
+	fDebouncer->RemoveVolume(device);
+	UpdateMarks();
+}
+
+
+void
+App::UpdateMarks()
+{
+	if (fInFlight > 0 || fScanning > 0 || fDebouncer->CountPending() > 0)
+		return;
+
+	// The watched folders weren't watched
+	if (fReplayer != NULL) {
+		if (fReplayDone) {
+			ReportReplay();
+			fReplayDone = false;
+			PostMessage(B_QUIT_REQUESTED);
+		}
+		return;
+	}
+
+	// Everything that turned up before is filed, even if more turns up
+	// until the mark is saved
+	fPendingMark = time(NULL) - kMarkSlack;
+
+	bigtime_t due = fMarksSaved + kMarkInterval - system_time();
+	if (due <= 0)
+		SaveMarks();
+	else if (fMarkRunner == NULL) {
+		BMessage msg(MSG_SAVE_MARKS);
+		fMarkRunner = new BMessageRunner(this, &msg, due, 1);
+	}
+}
+
+
+void
+App::SaveMarks()
+{
+	delete fMarkRunner;
+	fMarkRunner = NULL;
+
+	if (fPendingMark == 0)
+		return;
+
+	gFolders.SaveMarks(fPendingMark);
+	fPendingMark = 0;
+	fMarksSaved = system_time();
+}
+
+
+void
+App::ReportReplay()
+{
+	BMessage stats;
+	fStats->Archive(stats);
+	BMessage latency;
+	stats.FindMessage("latency", &latency);
+	BMessage filingTime;
+	stats.FindMessage("filing time", &filingTime);
+
+	double seconds = (system_time() - fReplayer->Started()) / 1000000.0;
+	if (seconds <= 0)
+		seconds = 1;
+
+	int64 filed = stats.GetInt64("filed", 0);
+	printf("Replayed %" B_PRId64 " events in %.2f seconds, %.0f per second\n",
+		fReplayer->CountEvents(), seconds,
+		fReplayer->CountEvents() / seconds);
+	printf("\tFiled %" B_PRId64 " files, %.0f per second, %" B_PRId64
+		" failed\n", filed, filed / seconds, stats.GetInt64("failed", 0));
+	printf("\tWaited to be filed: p50 %" B_PRId64 " us, p90 %" B_PRId64
+		" us, p99 %" B_PRId64 " us, max %" B_PRId64 " us\n",
+		latency.GetInt64("p50", 0), latency.GetInt64("p90", 0),
+		latency.GetInt64("p99", 0), latency.GetInt64("max", 0));
+	printf("\tFiling took: p50 %" B_PRId64 " us, p90 %" B_PRId64
+		" us, p99 %" B_PRId64 " us, max %" B_PRId64 " us\n",
+		filingTime.GetInt64("p50", 0), filingTime.GetInt64("p90", 0),
+		filingTime.GetInt64("p99", 0), filingTime.GetInt64("max", 0));
+	printf("\tPeak memory: %" B_PRId64 " KiB\n",
+		fReplayer->PeakMemory() / 1024);
+}
+
+
+void
+App::UpdateSubsets()
+{
+	BObjectList<RuleSubset> subsets(20, true);
+
+	gFolders.ReadLock();
+	for (int32 i = 0; i < gFolders.CountFolders(); i++) {
+		RefStorage* refholder = gFolders.FolderAt(i);
+		RuleSubset* subset = new RuleSubset;
+		subset->folder = refholder->nref;
+		subset->rules = refholder->rules;
+		subset->sets = refholder->ruleSets;
+		subsets.AddItem(subset);
+	}
+	gFolders.ReadUnlock();
+
+	fEngine->SetSubsets(subsets);
+}
+
+
+void
+App::HandleEvent(const WatchEvent& event)
+{
+	fStats->EventsReceived(1);
+
+	if (fRecorder != NULL)
+		fRecorder->Record(event);
+
+	switch (event.opcode)
 	{
-		case B_ENTRY_CREATED:
+		case WATCH_CREATED:
 		{
-			BString name;
-			entry_ref ref;
-			
-			msg->FindInt32("device", &ref.device);
-			msg->FindInt64("directory", &ref.directory);
-			msg->FindString("name", &name);
-			ref.set_name(name.String());
+			entry_ref ref(event.directory.device, event.directory.node,
+				event.name.String());
+			EntriesChanged(event.directory);
 
-			LaunchFiler(ref);
+			// New subfolders are watched as well, along with what was put
+			// in them before
+			BObjectList<node_ref> added(20, true);
+			fTree->FolderAdded(event.directory, event.name.String(), &added);
+			ScanAdded(added);
+
+			// Downloads are picked up once they get their final name
+			if (!fDebouncer->IsTemporary(event.name.String()))
+				HoldBack(ref);
 			break;
 		}
-		case B_ENTRY_MOVED:
+		case WATCH_MOVED:
 		{
 			// We only care if we're monitoring the "to" directory because
 			// the Filer doesn't care about files that aren't there anymore
-			node_ref nref;
-			msg->FindInt32("device", &nref.device);
-			msg->FindInt64("to directory", &nref.node);
-			
-			gRefLock.Lock();
-			
-			bool match = false;
-			for (int32 i = 0; i < gRefStructList.CountItems(); i++)
+			bool match = fTree->Contains(event.directory);
+			EntriesChanged(event.directory);
+			EntriesChanged(event.fromDirectory);
+
+			// A subfolder leaves its place in the tree, and takes up a new
+			// one if it's still in there, or in a folder still being read
+			fTree->FolderRemoved(event.node);
+			BObjectList<node_ref> added(20, true);
+			fTree->FolderAdded(event.directory, event.name.String(), &added);
+			ScanAdded(added);
+
+			if (match && !fDebouncer->IsTemporary(event.name.String()))
 			{
-				RefStorage* refholder = (RefStorage*)gRefStructList.ItemAt(i);
-				if (nref == refholder->nref)
-				{
-					match = true;
-					break;
-				}
+				entry_ref ref(event.directory.device, event.directory.node,
+					event.name.String());
+				HoldBack(ref);
 			}
-			
-			gRefLock.Unlock();
-			
-			if (match)
+			else
 			{
-				BString name;
-				entry_ref ref;
-				msg->FindString("name", &name);
-				ref.device = nref.device;
-				ref.directory = nref.node;
-				ref.set_name(name.String());
-
-				LaunchFiler(ref);
+				// It may have been held back under its old name
+				fDebouncer->Remove(event.node);
 			}
 			break;
 		}
-		case B_STAT_CHANGED:
-		case B_ATTR_CHANGED:
+		case WATCH_REMOVED:
 		{
-			node_ref nref;
-			msg->FindInt32("device", &nref.device);
-			msg->FindInt64("node", &nref.node);
-			
-			gRefLock.Lock();
-			
-			bool match = false;
-			entry_ref ref;
-			for (int32 i = 0; i < gRefStructList.CountItems(); i++)
-			{
-				RefStorage* refholder = (RefStorage*)gRefStructList.ItemAt(i);
-				if (nref == refholder->nref)
-				{
-					ref = refholder->ref;
-					match = true;
-					break;
-				}
-			}
-			
-			gRefLock.Unlock();
-			
-			if (match)
-			{
-				LaunchFiler(ref);
-			}
+			EntriesChanged(event.directory);
+			fDebouncer->Remove(event.node);
+			fTree->FolderRemoved(event.node);
+			break;
+		}
+		case WATCH_STAT_CHANGED:
+		case WATCH_ATTR_CHANGED:
+		{
+			// The event only names the node. Files are only watched while
+			// they're held back, so it's one of those, or a watched folder.
+			if (fDebouncer->Touch(event.node))
+				break;
+
+			// A watched folder itself, which is never filed. Its attributes
+			// don't change what's in it.
+			if (event.opcode == WATCH_STAT_CHANGED
+				&& fTree->Contains(event.node))
+				FolderChanged(event.node);
+
+			// Anything else is a file that settled and was let go before the
+			// event came in
+			break;
+		}
+		case WATCH_MOUNTED:
+		{
+			VolumeMounted(event.node.device);
+			break;
+		}
+		case WATCH_UNMOUNTED:
+		{
+			VolumeUnmounted(event.node.device);
 			break;
 		}
 		default:
@@ -211,14 +1044,65 @@ App::HandleNodeMonitoring(BMessage* msg)
 void
 App::StopWatching()
 {
-	stop_watching(this);
+	fWatcher->UnwatchAll();
 }
 
 
 int
 main(int argc, char** argv)
 {
-	App app;
+	const char* recordPath = NULL;
+	const char* replayPath = NULL;
+	const char* treePath = NULL;
+	const char* settingsPath = NULL;
+	double speed = 1;
+
+	for (int i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--record") == 0)
+			recordPath = argv[++i];
+		else if (strcmp(argv[i], "--replay") == 0)
+			replayPath = argv[++i];
+		else if (strcmp(argv[i], "--tree") == 0)
+			treePath = argv[++i];
+		else if (strcmp(argv[i], "--settings") == 0)
+			settingsPath = argv[++i];
+		else if (strcmp(argv[i], "--speed") == 0) {
+			i++;
+			speed = strcmp(argv[i], "max") == 0 ? 0 : atof(argv[i]);
+		}
+	}
+
+	EventRecorder* recorder = NULL;
+	if (recordPath != NULL) {
+		recorder = new EventRecorder;
+		status_t status = recorder->Open(recordPath);
+		if (status != B_OK) {
+			fprintf(stderr, "Couldn't open %s: %s\n", recordPath,
+				strerror(status));
+			return 1;
+		}
+	}
+
+	EventReplayer* replayer = NULL;
+	if (replayPath != NULL) {
+		if (treePath == NULL || settingsPath == NULL || speed < 0) {
+			fprintf(stderr, "Usage: AutoFiler --replay <log> --tree <folder> "
+				"--settings <folder> [--speed <n>|max]\n");
+			return 1;
+		}
+
+		RuleEngine::SetSettingsFolder(settingsPath);
+
+		replayer = new EventReplayer(replayPath, treePath, speed);
+		status_t status = replayer->Prepare();
+		if (status != B_OK) {
+			fprintf(stderr, "Couldn't replay %s: %s\n", replayPath,
+				strerror(status));
+			return 1;
+		}
+	}
+
+	App app(recorder, replayer);
 	app.Run();
 	
 	return 0;
@@ -1,5 +1,5 @@
 /*
-	AutoFiler: Watcher daemon which executes the Filer on monitored folders
+	AutoFiler: Watcher daemon which runs the Filer's rules on monitored folders
 	Written by DarkWyrm <darkwyrm@gmail.com>, Copyright 2008
 	Released under the MIT license.
 */
@@ -8,18 +8,96 @@
 #define AUTOFILER_H
 
 #include <Application.h>
+#include <Entry.h>
 #include <Message.h>
 
+#include "ObjectList.h"
+
+class BMessageRunner;
+class CatchUpScan;
+class Debouncer;
+class EventQueue;
+class EventRecorder;
+class EventReplayer;
+class FilingPool;
+class FilingStats;
+class FolderTree;
+class RuleEngine;
+class StatsSocket;
+class Sweeper;
+class Watcher;
+struct FolderScan;
+struct WatchEvent;
+
 class App : public BApplication
 {
 public:
-			App();
+			// Both may be NULL, and are deleted with the App
+			App(EventRecorder* recorder = NULL,
+				EventReplayer* replayer = NULL);
+			~App();
+	void	ReadyToRun();
 	void	MessageReceived(BMessage* msg);
+	void	RefsReceived(BMessage* msg);
+	bool	QuitRequested();
+
+	status_t	GetSupportedSuites(BMessage* msg);
+	BHandler*	ResolveSpecifier(BMessage* msg, int32 index,
+					BMessage* specifier, int32 form, const char* property);
 
 private:
-	void	HandleNodeMonitoring(BMessage* msg);
+	void	HandleEvent(const WatchEvent& event);
+	void	HoldBack(const entry_ref& ref);
+	void	StartSettling();
+	void	CheckSettled();
+	void	EntriesChanged(const node_ref& folder);
+	void	FolderChanged(const node_ref& folder);
+	bool	RescanFolders();
+	void	Dispatch(BMessage& refs);
+	void	WatchRoots(const BObjectList<node_ref>& roots);
+	void	FoldersFound(BMessage* msg);
+	void	ScanAdded(const BObjectList<node_ref>& folders);
+	void	StartScan(CatchUpScan* scan, bool holdBack);
+	void	ScanDone(BMessage* msg);
+	void	VolumeMounted(dev_t device);
+	void	VolumeUnmounted(dev_t device);
+	void	UpdateMarks();
+	void	SaveMarks();
+	void	UpdateSubsets();
+	void	GetStatus(BMessage& status);
+	void	GetRoots(BObjectList<node_ref>& roots);
+	void	ResetScans(const BObjectList<node_ref>& roots);
+	FolderScan*	ScanFor(const node_ref& folder);
+	void	ReportReplay();
 	void	StartWatching();
 	void	StopWatching();
+
+	RuleEngine*		fEngine;
+	FilingPool*		fPool;
+	FilingStats*	fStats;
+	StatsSocket*	fStatsSocket;
+	EventQueue*		fQueue;
+	Watcher*		fWatcher;
+	FolderTree*		fTree;
+	Debouncer*		fDebouncer;
+	BMessageRunner*	fSettleRunner;
+	BObjectList<FolderScan> fScans;
+	Sweeper*		fSweeper;
+	BMessageRunner*	fSweepRunner;
+	BMessageRunner*	fMarkRunner;
+	// The mark to save next, or 0, and when they were saved last
+	time_t			fPendingMark;
+	bigtime_t		fMarksSaved;
+	EventRecorder*	fRecorder;
+	EventReplayer*	fReplayer;
+	bool			fReplayStarted;
+	bool			fReplayDone;
+	BMessage		fEarlyRefs;
+	int32			fInFlight;
+	// Folder walks and scans that aren't done yet
+	int32			fScanning;
+	// A changed watched folder is being looked through
+	bool			fRescanning;
 };
 
 #endif	// AUTOFILER_H
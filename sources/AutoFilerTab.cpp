@@ -32,6 +32,18 @@ static const char* const kStartAutoFiler = B_TRANSLATE("Start AutoFiler");
 static const char* const kStopAutoFiler = B_TRANSLATE("Stop AutoFiler");
 
 
+static BString
+FormatLatency(bigtime_t latency)
+{
+	BString text;
+	if (latency < 1000000)
+		text.SetToFormat(B_TRANSLATE("%d ms"), (int)(latency / 1000));
+	else
+		text.SetToFormat(B_TRANSLATE("%.1f s"), latency / 1000000.0);
+	return text;
+}
+
+
 AutoFilerTab::AutoFilerTab()
 	:
 	BView(B_TRANSLATE("AutoFiler"), B_SUPPORTS_LAYOUT),
@@ -82,6 +94,11 @@ AutoFilerTab::_BuildLayout()
 	fStartStop = new BButton("startstop", kStartAutoFiler,
 		new BMessage(MSG_STARTSTOP_AUTOFILER));
 
+	fStatsView = new BStringView("stats", "");
+	fErrorView = new BStringView("error", "");
+	fStatsView->SetExplicitMaxSize(BSize(B_SIZE_UNLIMITED, B_SIZE_UNSET));
+	fErrorView->SetExplicitMaxSize(BSize(B_SIZE_UNLIMITED, B_SIZE_UNSET));
+
 	BPath path;
 	find_directory(B_USER_SETTINGS_DIRECTORY, &path);
 	path.Append(gPrefsPath);
@@ -130,6 +147,8 @@ AutoFilerTab::_BuildLayout()
 					.AddGlue()
 					.End()
 				.End()
+			.Add(fStatsView)
+			.Add(fErrorView)
 			.End()
 		.End();
 
@@ -156,7 +175,7 @@ AutoFilerTab::AttachedToWindow()
 	}
 	BMessage msg(MSG_UPDATE_LABEL);
 	messenger.SendMessage(&msg);
-	fRunner	= new BMessageRunner(this, &msg, 0.5 * 6000000); // x * seconds
+	fRunner	= new BMessageRunner(this, &msg, 1000000); // every second
 
 	BView::AttachedToWindow();
 }
@@ -220,6 +239,11 @@ AutoFilerTab::MessageReceived(BMessage* msg)
 			UpdateAutoFilerLabel();
 			break;
 		}
+		case B_REPLY:
+		{
+			UpdateStats(msg);
+			break;
+		}
 		case MSG_SHOW_ADD_PANEL:
 		{
 			fFilePanel->Show();
@@ -328,10 +352,69 @@ AutoFilerTab::ToggleAutoFiler()
 void
 AutoFilerTab::UpdateAutoFilerLabel()
 {
-	if (be_roster->IsRunning(kAutoFilerSignature))
+	if (be_roster->IsRunning(kAutoFilerSignature)) {
 		fStartStop->SetLabel(kStopAutoFiler);
-	else
+
+		// The answer comes back as a B_REPLY
+		BMessage msg(MSG_GET_STATUS);
+		BMessenger msgr(kAutoFilerSignature);
+		msgr.SendMessage(&msg, this);
+	} else {
 		fStartStop->SetLabel(kStartAutoFiler);
+		UpdateStats(NULL);
+	}
+}
+
+
+void
+AutoFilerTab::UpdateStats(BMessage* status)
+{
+	if (status == NULL) {
+		fStatsView->SetText("");
+		fErrorView->SetText("");
+		return;
+	}
+
+	BMessage latency;
+	status->FindMessage("latency", &latency);
+
+	BString text(B_TRANSLATE("Filed: %filed% (%rate% per second), "
+		"waiting: %waiting%, latency: %p50% (99%: %p99%)"));
+	BString rate;
+	rate.SetToFormat("%.1f", status->GetDouble("files per second", 0));
+	BString filed;
+	filed << status->GetInt64("filed", 0);
+	BString waiting;
+	waiting << status->GetInt32("pending", 0) + status->GetInt32("waiting", 0)
+		+ status->GetInt32("held back", 0);
+
+	text.ReplaceFirst("%filed%", filed.String());
+	text.ReplaceFirst("%rate%", rate.String());
+	text.ReplaceFirst("%waiting%", waiting.String());
+	text.ReplaceFirst("%p50%",
+		FormatLatency(latency.GetInt64("p50", 0)).String());
+	text.ReplaceFirst("%p99%",
+		FormatLatency(latency.GetInt64("p99", 0)).String());
+	fStatsView->SetText(text.String());
+
+	// The latest error is the last one
+	type_code type;
+	int32 count;
+	BMessage error;
+	if (status->GetInfo("error", &type, &count) != B_OK
+		|| status->FindMessage("error", count - 1, &error) != B_OK) {
+		fErrorView->SetText("");
+		return;
+	}
+
+	text = B_TRANSLATE("Failed: %failed%, last: '%rule%' on %path%: %error%");
+	BString failed;
+	failed << status->GetInt64("failed", 0);
+	text.ReplaceFirst("%failed%", failed.String());
+	text.ReplaceFirst("%rule%", error.GetString("rule", ""));
+	text.ReplaceFirst("%path%", error.GetString("path", ""));
+	text.ReplaceFirst("%error%", error.GetString("error", ""));
+	fErrorView->SetText(text.String());
 }
 
 
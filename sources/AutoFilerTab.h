@@ -16,6 +16,7 @@
 #include <ListView.h>
 #include <MessageRunner.h>
 #include <ScrollView.h>
+#include <StringView.h>
 
 #include "AutoFilerList.h"
 #include "TypedRefFilter.h"
@@ -41,12 +42,15 @@ private:
 	bool			IsFolderUnique(BString newpath);
 	void			ToggleAutoFiler();
 	void			UpdateAutoFilerLabel();
+	void			UpdateStats(BMessage* status);
 	
 	AutoFilerList*	fFolderList;
 	BScrollView*	fScrollView;
 
 	BCheckBox*		fAutorunBox;
 	BButton*		fStartStop;
+	BStringView*	fStatsView;
+	BStringView*	fErrorView;
 	
 	BButton*		fAddButton;
 	BButton*		fRemoveButton;
@@ -0,0 +1,182 @@
+/*
+	CatchUpScan.cpp: Finds the files that turned up in the watched folders while
+				the AutoFiler wasn't running
+	Released under the MIT license.
+*/
+
+#include "CatchUpScan.h"
+
+#include <dirent.h>
+#include <string.h>
+
+#include <Directory.h>
+#include <OS.h>
+
+/*
+	Each watched folder has a mark, the last time the AutoFiler had filed
+	everything that turned up there. When it starts, the folders are read,
+	and the files changed since then are filed, like those turning up
+	while it's running.
+
+	The time a file was moved to the folder is the time its status changed,
+	as its modification time is kept when it's moved.
+*/
+
+struct CatchUpFolder {
+	node_ref					node;
+	time_t						since;
+	BObjectList<CaughtFile>*	files;
+};
+
+struct ScanRun {
+	BObjectList<CatchUpFolder>*	folders;
+	int32						next;
+};
+
+
+static void
+ScanFolder(CatchUpFolder* folder)
+{
+	BDirectory directory(&folder->node);
+	if (directory.InitCheck() != B_OK)
+		return;
+
+	char buffer[8192];
+	struct dirent* dirents = (struct dirent*)buffer;
+
+	int32 count;
+	while ((count = directory.GetNextDirents(dirents, sizeof(buffer))) > 0) {
+		struct dirent* entry = dirents;
+		for (int32 i = 0; i < count; i++, entry = (struct dirent*)
+				((char*)entry + entry->d_reclen)) {
+			const char* name = entry->d_name;
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+				continue;
+
+			// Subfolders are watched, and read, on their own
+			struct stat st;
+			if (directory.GetStatFor(name, &st) != B_OK
+				|| S_ISDIR(st.st_mode))
+				continue;
+
+			time_t changed = max_c(st.st_mtime, st.st_ctime);
+			if (changed < folder->since)
+				continue;
+
+			CaughtFile* file = new CaughtFile;
+			file->ref.device = folder->node.device;
+			file->ref.directory = folder->node.node;
+			file->ref.set_name(name);
+			file->changed = changed;
+			folder->files->AddItem(file);
+		}
+	}
+}
+
+
+CatchUpScan::CatchUpScan()
+	:
+	fFolders(20, true),
+	fFiles(20, true)
+{
+}
+
+
+CatchUpScan::~CatchUpScan()
+{
+	for (int32 i = 0; i < fFolders.CountItems(); i++)
+		delete fFolders.ItemAt(i)->files;
+}
+
+
+void
+CatchUpScan::AddFolder(const node_ref& node, time_t since)
+{
+	CatchUpFolder* folder = new CatchUpFolder;
+	folder->node = node;
+	folder->since = since;
+	folder->files = new BObjectList<CaughtFile>(20, false);
+	fFolders.AddItem(folder);
+}
+
+
+void
+CatchUpScan::Run()
+{
+	int32 count = fFolders.CountItems();
+	if (count == 0)
+		return;
+
+	ScanRun run;
+	run.folders = &fFolders;
+	run.next = 0;
+
+	system_info info;
+	get_system_info(&info);
+	int32 jobs = min_c((int32)info.cpu_count, count);
+
+	thread_id* threads = new thread_id[jobs];
+	int32 started = 0;
+	for (int32 i = 1; i < jobs; i++) {
+		threads[started] = spawn_thread(_ScanThread, "catch up scan",
+			B_LOW_PRIORITY, &run);
+		if (threads[started] >= 0 && resume_thread(threads[started]) == B_OK)
+			started++;
+	}
+
+	_ScanThread(&run);
+
+	for (int32 i = 0; i < started; i++) {
+		status_t exitValue;
+		wait_for_thread(threads[i], &exitValue);
+	}
+	delete[] threads;
+
+	// In the order of the folders, and as they were read
+	for (int32 i = 0; i < count; i++)
+		fFiles.AddList(fFolders.ItemAt(i)->files);
+}
+
+
+void
+CatchUpScan::Start(const BMessenger& target, const BMessage& done)
+{
+	fTarget = target;
+	fDone = done;
+
+	thread_id thread = spawn_thread(_Run, "catch up", B_LOW_PRIORITY, this);
+	if (thread < 0 || resume_thread(thread) != B_OK)
+		_Run(this);
+}
+
+
+status_t
+CatchUpScan::_Run(void* data)
+{
+	CatchUpScan* scan = (CatchUpScan*)data;
+	scan->Run();
+
+	BMessage done(scan->fDone);
+	done.AddPointer("scan", scan);
+	if (scan->fTarget.SendMessage(&done) != B_OK)
+		delete scan;
+	return B_OK;
+}
+
+
+status_t
+CatchUpScan::_ScanThread(void* data)
+{
+	ScanRun* run = (ScanRun*)data;
+	int32 count = run->folders->CountItems();
+
+	for (;;) {
+		int32 index = atomic_add(&run->next, 1);
+		if (index >= count)
+			break;
+
+		ScanFolder(run->folders->ItemAt(index));
+	}
+
+	return B_OK;
+}
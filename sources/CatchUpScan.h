@@ -0,0 +1,59 @@
+/*
+	CatchUpScan.h: Finds the files that turned up in the watched folders while
+				the AutoFiler wasn't running
+	Released under the MIT license.
+*/
+
+#ifndef CATCH_UP_SCAN_H
+#define CATCH_UP_SCAN_H
+
+#include <time.h>
+
+#include <Entry.h>
+#include <Message.h>
+#include <Messenger.h>
+#include <Node.h>
+
+#include "ObjectList.h"
+
+struct CatchUpFolder;
+
+struct CaughtFile {
+	entry_ref	ref;
+	time_t		changed;
+};
+
+class CatchUpScan
+{
+public:
+							CatchUpScan();
+							~CatchUpScan();
+
+	// Files in the folder created, changed or moved there at or after the
+	// time are caught
+			void			AddFolder(const node_ref& folder, time_t since);
+			int32			CountFolders() const
+								{ return fFolders.CountItems(); }
+
+	// Reads the folders side by side
+			void			Run();
+	// Runs on a thread of its own, and sends the done message to the target
+	// with the scan as "scan", which the target deletes
+			void			Start(const BMessenger& target,
+								const BMessage& done);
+
+			int32			CountFiles() const { return fFiles.CountItems(); }
+			const CaughtFile* FileAt(int32 index) const
+								{ return fFiles.ItemAt(index); }
+
+private:
+	static	status_t		_Run(void* data);
+	static	status_t		_ScanThread(void* data);
+
+			BObjectList<CatchUpFolder> fFolders;
+			BObjectList<CaughtFile> fFiles;
+			BMessenger		fTarget;
+			BMessage		fDone;
+};
+
+#endif	// CATCH_UP_SCAN_H
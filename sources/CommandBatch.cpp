@@ -0,0 +1,286 @@
+/*
+	CommandBatch.cpp: Collects the files for "Shell command" actions using
+					%FILES% and runs them as few times as possible
+	Released under the MIT license.
+*/
+
+#include "CommandBatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Autolock.h>
+#include <OS.h>
+#include <Path.h>
+
+#include "PatternProcessor.h"
+#include "ProcessRunner.h"
+
+/*
+	A command like "optipng -o7 %FILES%" isn't run once per file. Instead,
+	the paths of all files reaching it during one run of the Filer are
+	collected, and the command is started with as many of them as fit on a
+	command line, just like xargs does it.
+
+	Other patterns in the command are expanded per file before it is handed
+	to AddFile(), so files whose command turns out the same share a batch,
+	and e.g. "tar -rf '%FOLDER%/all.tar' %FILES%" gets one batch per folder.
+	Where %FILES% is goes along with it, as the expanded command may have
+	more of them in names.
+*/
+
+static const char* const kFilesPattern = "%FILES%";
+
+// Leaves room for the shell and whatever it puts into the environment of
+// the command
+static const size_t kCommandLineSlack = 4096;
+
+extern char** environ;
+
+
+class PendingCommand
+{
+public:
+	PendingCommand(const char* command, int32 filesAt)
+		:
+		fCommand(command),
+		fFilesAt(filesAt),
+		fFiles(20, true)
+	{
+	}
+
+	BString				fCommand;
+	int32				fFilesAt;
+	BObjectList<BString>	fFiles;
+};
+
+
+struct BatchRun {
+	BObjectList<BString>*	lines;
+	int32*					results;
+	int32					next;
+};
+
+
+static BString
+QuoteForShell(const char* string)
+{
+	BString quoted(string);
+	quoted.ReplaceAll("'", "'\\''");
+	quoted.Prepend("'");
+	quoted.Append("'");
+	return quoted;
+}
+
+
+static size_t
+MaxCommandLength()
+{
+	long argMax = sysconf(_SC_ARG_MAX);
+	if (argMax <= 0)
+		argMax = 32768;
+
+	size_t environment = 0;
+	for (char** env = environ; env != NULL && *env != NULL; env++)
+		environment += strlen(*env) + 1 + sizeof(char*);
+
+	if ((size_t)argMax < environment + 2 * kCommandLineSlack)
+		return kCommandLineSlack;
+
+	return argMax - environment - kCommandLineSlack;
+}
+
+
+CommandBatch::CommandBatch()
+	:
+	fCommands(20, true),
+	fLock("command batch")
+{
+}
+
+
+CommandBatch::~CommandBatch()
+{
+}
+
+
+bool
+CommandBatch::IsBatchCommand(const char* command)
+{
+	return command != NULL && strstr(command, kFilesPattern) != NULL;
+}
+
+
+void
+CommandBatch::Expand(const char* command, PatternContext& context,
+	BString& expanded, int32& filesAt)
+{
+	BString head(command);
+	BString tail;
+	int32 pos = head.FindFirst(kFilesPattern);
+	head.CopyInto(tail, pos + strlen(kFilesPattern),
+		head.Length() - pos - strlen(kFilesPattern));
+	head.Truncate(pos);
+
+	BString expandedTail;
+	PatternTemplate(head.String()).Expand(context, expanded);
+	PatternTemplate(tail.String()).Expand(context, expandedTail);
+
+	filesAt = expanded.Length();
+	expanded << kFilesPattern << expandedTail;
+}
+
+
+void
+CommandBatch::AddFile(const char* command, int32 filesAt,
+	const entry_ref& ref)
+{
+	BPath path(&ref);
+	if (path.InitCheck() != B_OK)
+		return;
+
+	BAutolock _(fLock);
+
+	PendingCommand* pending = NULL;
+	for (int32 i = 0; i < fCommands.CountItems(); i++) {
+		if (fCommands.ItemAt(i)->fCommand == command
+			&& fCommands.ItemAt(i)->fFilesAt == filesAt) {
+			pending = fCommands.ItemAt(i);
+			break;
+		}
+	}
+
+	if (pending == NULL) {
+		pending = new PendingCommand(command, filesAt);
+		fCommands.AddItem(pending);
+	}
+
+	pending->fFiles.AddItem(new BString(QuoteForShell(path.Path())));
+}
+
+
+status_t
+CommandBatch::Run(int32 jobs)
+{
+	BObjectList<BString> lines(20, true);
+	_BuildCommandLines(lines);
+	fCommands.MakeEmpty();
+
+	int32 count = lines.CountItems();
+	if (count == 0)
+		return B_OK;
+
+	if (jobs <= 0) {
+		system_info info;
+		get_system_info(&info);
+		jobs = info.cpu_count;
+	}
+	if (jobs > count)
+		jobs = count;
+
+	BatchRun run;
+	run.lines = &lines;
+	run.results = new int32[count];
+	run.next = 0;
+
+	thread_id* threads = new thread_id[jobs];
+	int32 started = 0;
+	for (int32 i = 1; i < jobs; i++) {
+		threads[started] = spawn_thread(_RunnerThread, "command batch",
+			B_NORMAL_PRIORITY, &run);
+		if (threads[started] >= 0 && resume_thread(threads[started]) == B_OK)
+			started++;
+	}
+
+	// This thread lends a hand as well, so nothing is lost when no
+	// additional threads could be spawned
+	_RunnerThread(&run);
+
+	for (int32 i = 0; i < started; i++) {
+		status_t exitValue;
+		wait_for_thread(threads[i], &exitValue);
+	}
+	delete[] threads;
+
+	status_t status = B_OK;
+	for (int32 i = 0; i < count; i++) {
+		if (run.results[i]) {
+			printf("\tShell command batch %" B_PRId32 "/%" B_PRId32
+				"\n\t\tPossible error: command returned %" B_PRId32 "\n",
+				i + 1, count, run.results[i]);
+			status = B_ERROR;
+		} else {
+			printf("\tShell command batch %" B_PRId32 "/%" B_PRId32 "\n",
+				i + 1, count);
+		}
+	}
+	delete[] run.results;
+
+	return status;
+}
+
+
+void
+CommandBatch::_BuildCommandLines(BObjectList<BString>& lines)
+{
+	size_t maxLength = MaxCommandLength();
+
+	for (int32 i = 0; i < fCommands.CountItems(); i++) {
+		PendingCommand* pending = fCommands.ItemAt(i);
+
+		BString head(pending->fCommand);
+		BString tail;
+		int32 pos = pending->fFilesAt;
+		head.CopyInto(tail, pos + strlen(kFilesPattern),
+			head.Length() - pos - strlen(kFilesPattern));
+		head.Truncate(pos);
+
+		BString files;
+		for (int32 j = 0; j < pending->fFiles.CountItems(); j++) {
+			const BString* file = pending->fFiles.ItemAt(j);
+
+			// A file always goes into a batch, even if it alone doesn't fit
+			if (!files.IsEmpty() && head.Length() + files.Length() + 1
+					+ file->Length() + tail.Length() > maxLength) {
+				lines.AddItem(new BString(BString(head) << files << tail));
+				files = "";
+			}
+
+			if (!files.IsEmpty())
+				files << ' ';
+			files << *file;
+		}
+
+		if (!files.IsEmpty())
+			lines.AddItem(new BString(BString(head) << files << tail));
+	}
+}
+
+
+status_t
+CommandBatch::_RunnerThread(void* data)
+{
+	BatchRun* run = (BatchRun*)data;
+	int32 count = run->lines->CountItems();
+
+	for (;;) {
+		int32 index = atomic_add(&run->next, 1);
+		if (index >= count)
+			break;
+
+		const char* line = run->lines->ItemAt(index)->String();
+		printf("\tShell command batch %" B_PRId32 "/%" B_PRId32 ": %s\n",
+			index + 1, count, line);
+
+		BStringList arguments;
+		ProcessRunner::ShellArguments(line, arguments);
+
+		int32 result;
+		status_t status = ProcessRunner::Default()->Run(arguments, &result);
+		run->results[index] = status != B_OK ? status : result;
+	}
+
+	return B_OK;
+}
@@ -0,0 +1,50 @@
+/*
+	CommandBatch.h: Collects the files for "Shell command" actions using
+					%FILES% and runs them as few times as possible
+	Released under the MIT license.
+*/
+
+#ifndef COMMAND_BATCH_H
+#define COMMAND_BATCH_H
+
+#include <Entry.h>
+#include <Locker.h>
+#include <String.h>
+
+#include "ObjectList.h"
+
+class PatternContext;
+class PendingCommand;
+
+class CommandBatch
+{
+public:
+							CommandBatch();
+							~CommandBatch();
+
+	// Tells by the command as it's set in the rule, before its patterns are
+	// expanded
+	static	bool			IsBatchCommand(const char* command);
+	// Expands the patterns before and after %FILES% for the file, and tells
+	// where %FILES% ended up. A file name with %FILES% in it stays a name.
+	static	void			Expand(const char* command, PatternContext& context,
+								BString& expanded, int32& filesAt);
+
+	// May be called by several threads at once
+			void			AddFile(const char* command, int32 filesAt,
+								const entry_ref& ref);
+			int32			CountCommands() const
+								{ return fCommands.CountItems(); }
+
+			status_t		Run(int32 jobs = 1);
+
+private:
+			void			_BuildCommandLines(BObjectList<BString>& lines);
+
+	static	status_t		_RunnerThread(void* data);
+
+	BObjectList<PendingCommand>	fCommands;
+	BLocker					fLock;
+};
+
+#endif	// COMMAND_BATCH_H
@@ -29,6 +29,7 @@
 
 static const uint32 kReplace = 'RPLC';
 static const uint32 kSkip = 'SKIP';
+static const uint32 kKeepBoth = 'KPBT';
 
 
 static BStringView*
@@ -52,7 +53,7 @@ ConflictWindow::ConflictWindow(const char* srcFolder, const entry_ref& srcFile,
 			| B_AUTO_UPDATE_SIZE_LIMITS),
 	fFile(srcFile.name),
 	fDoAll(new BCheckBox("", B_TRANSLATE("Do this for all files"), NULL)),
-	fReplace(false),
+	fChoice(CONFLICT_SKIP),
 	fSem(create_sem(0, "")),
 	fStripeView(NULL)
 {
@@ -65,6 +66,8 @@ ConflictWindow::ConflictWindow(const char* srcFolder, const entry_ref& srcFile,
 	BButton* replace = new BButton("", B_TRANSLATE("Replace"),
 		new BMessage(kReplace));
 	BButton* skip = new BButton("", B_TRANSLATE("Skip"), new BMessage(kSkip));
+	BButton* keepBoth = new BButton("", B_TRANSLATE("Keep both"),
+		new BMessage(kKeepBoth));
 
 	BLayoutBuilder::Group<>(this, B_HORIZONTAL, B_USE_ITEM_SPACING)
 		.Add(fStripeView)
@@ -94,6 +97,7 @@ ConflictWindow::ConflictWindow(const char* srcFolder, const entry_ref& srcFile,
 			.AddGroup(B_HORIZONTAL)
 				.AddGlue()
 				.Add(skip)
+				.Add(keepBoth)
 				.Add(replace)
 				.AddGlue()
 				.End()
@@ -103,7 +107,7 @@ ConflictWindow::ConflictWindow(const char* srcFolder, const entry_ref& srcFile,
 }
 
 
-bool
+int32
 ConflictWindow::Go(bool& doAll)
 {
 	CenterOnScreen();
@@ -116,12 +120,12 @@ ConflictWindow::Go(bool& doAll)
 
 	doAll = fDoAll->Value() == B_CONTROL_ON;
 
-	bool flag = fReplace;
-		// save the flag before it's destroyed by Quit() below
+	int32 choice = fChoice;
+		// save the choice before it's destroyed by Quit() below
 
 	if (Lock()) Quit();
 
-	return flag;
+	return choice;
 }
 
 
@@ -130,7 +134,13 @@ ConflictWindow::MessageReceived(BMessage* msg)
 {
 	switch (msg->what) {
 		case kReplace:
-			fReplace = true;
+			fChoice = CONFLICT_REPLACE;
+			delete_sem(fSem);
+			break;
+		case kKeepBoth:
+			fChoice = CONFLICT_KEEP_BOTH;
+			delete_sem(fSem);
+			break;
 		case kSkip:
 			delete_sem(fSem);
 				// unblock the thread that was blocked in Go()
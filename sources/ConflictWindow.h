@@ -15,11 +15,17 @@
 
 #include "StripeView.h"
 
+enum {
+	CONFLICT_SKIP,
+	CONFLICT_REPLACE,
+	CONFLICT_KEEP_BOTH
+};
+
 class ConflictWindow : public BWindow
 {
 	const char*	fFile;
 	BCheckBox*	fDoAll;
-	bool		fReplace;
+	int32		fChoice;
 	StripeView*	fStripeView;
 
 	// The semaphore below is used to block the thread that created this
@@ -36,7 +42,7 @@ public:
 			ConflictWindow(const char* srcFolder, const entry_ref& srcFile,
 				const char* destFolder, const entry_ref& destFile,
 				const char* desc);
-	bool	Go(bool& doAll);
+	int32	Go(bool& doAll);
 };
 
 #endif	// CONFLICT_WINDOW_H
@@ -0,0 +1,276 @@
+/*
+	Debouncer.cpp: Holds back the files turning up in the watched folders until
+				they're no longer being written to
+	Released under the MIT license.
+*/
+
+#include "Debouncer.h"
+
+#include <string.h>
+
+#include "RuleEngine.h"
+#include "Watcher.h"
+
+/*
+	A download shows up as soon as the browser creates the file, and is then
+	written to for a while, each write showing up as a change of its size.
+	Instead of filing it right away, and again for every change, the file is
+	watched on its own and only filed once it was left alone for the quiet
+	period.
+
+	Files with a temporary name aren't held back at all. They're picked up
+	when they're renamed to their final name, which shows up as a move.
+
+	Every change of a held back file looks it up by its node, so they're
+	kept in a hash table as well. The list keeps their order, and settled
+	files are taken out of it in one go.
+*/
+
+// How long a file has to stay unchanged before it's filed
+static const bigtime_t kDefaultQuietPeriod = 2000000;
+
+static const int32 kInitialTableSize = 64;
+
+static const char* kDefaultTemporarySuffixes[] = {
+	".part",
+	".crdownload",
+	".download",
+	".tmp",
+	NULL
+};
+
+
+Debouncer::Debouncer(Watcher& watcher)
+	:
+	fWatcher(watcher),
+	fPending(20, false),
+	fTable(NULL),
+	fTableSize(0),
+	fQuietPeriod(kDefaultQuietPeriod)
+{
+	for (int32 i = 0; kDefaultTemporarySuffixes[i] != NULL; i++)
+		fTemporarySuffixes.Add(kDefaultTemporarySuffixes[i]);
+
+	_Resize(kInitialTableSize);
+}
+
+
+Debouncer::~Debouncer()
+{
+	for (int32 i = 0; i < fPending.CountItems(); i++)
+		_Release(fPending.ItemAt(i));
+	delete[] fTable;
+}
+
+
+void
+Debouncer::LoadSettings()
+{
+	BMessage msg;
+	if (RuleEngine::ReadSettings(msg) != B_OK)
+		return;
+
+	// In milliseconds
+	int32 quiet;
+	if (msg.FindInt32("quietperiod", &quiet) == B_OK && quiet >= 0)
+		fQuietPeriod = quiet * 1000LL;
+
+	// Any given suffixes replace the default ones
+	BString suffix;
+	for (int32 i = 0; msg.FindString("tempsuffix", i, &suffix) == B_OK; i++) {
+		if (i == 0)
+			fTemporarySuffixes.MakeEmpty();
+		fTemporarySuffixes.Add(suffix);
+	}
+}
+
+
+bool
+Debouncer::IsTemporary(const char* name) const
+{
+	BString string(name);
+	for (int32 i = 0; i < fTemporarySuffixes.CountStrings(); i++) {
+		BString suffix = fTemporarySuffixes.StringAt(i);
+		if (string.Length() > suffix.Length() && string.IEndsWith(suffix))
+			return true;
+	}
+	return false;
+}
+
+
+void
+Debouncer::Add(const entry_ref& ref)
+{
+	BNode node(&ref);
+	struct stat st;
+	node_ref nodeRef;
+	if (node.GetStat(&st) != B_OK || node.GetNodeRef(&nodeRef) != B_OK)
+		return;
+
+	Pending* pending = _Find(nodeRef);
+	if (pending != NULL) {
+		pending->ref = ref;
+		pending->size = st.st_size;
+		pending->lastChange = system_time();
+		return;
+	}
+
+	pending = new Pending;
+	pending->ref = ref;
+	pending->node = nodeRef;
+	pending->size = st.st_size;
+	pending->lastChange = system_time();
+	pending->firstSeen = real_time_clock_usecs();
+
+	// The watched folders send their changes already, and no longer
+	// watching one of them afterwards would end that as well
+	pending->watched = !S_ISDIR(st.st_mode)
+		&& fWatcher.WatchFile(nodeRef) == B_OK;
+
+	if (fPending.CountItems() >= fTableSize)
+		_Resize(fTableSize * 2);
+
+	uint32 index = _Hash(nodeRef);
+	pending->hashNext = fTable[index];
+	fTable[index] = pending;
+
+	fPending.AddItem(pending);
+}
+
+
+bool
+Debouncer::Touch(const node_ref& node)
+{
+	Pending* pending = _Find(node);
+	if (pending == NULL)
+		return false;
+
+	pending->lastChange = system_time();
+	return true;
+}
+
+
+void
+Debouncer::Remove(const node_ref& node)
+{
+	Pending* pending = _Find(node);
+	if (pending == NULL)
+		return;
+
+	fPending.RemoveItem(pending);
+	_Release(pending);
+}
+
+
+void
+Debouncer::RemoveVolume(dev_t device)
+{
+	int32 count = 0;
+	for (int32 i = 0; i < fPending.CountItems(); i++) {
+		Pending* pending = fPending.ItemAt(i);
+		if (pending->node.device == device)
+			_Release(pending);
+		else
+			fPending.SwapWithItem(count++, pending);
+	}
+	_Compact(count);
+}
+
+
+int32
+Debouncer::CollectSettled(BMessage& refs)
+{
+	bigtime_t now = system_time();
+	int32 count = 0;
+	int32 kept = 0;
+
+	// In the order they turned up, moving those that stay to the front
+	for (int32 i = 0; i < fPending.CountItems(); i++) {
+		Pending* pending = fPending.ItemAt(i);
+		if (now - pending->lastChange < fQuietPeriod) {
+			fPending.SwapWithItem(kept++, pending);
+			continue;
+		}
+
+		// Not every write is reported, so the size has to be the same as well
+		struct stat st;
+		if (BNode(&pending->ref).GetStat(&st) != B_OK) {
+			_Release(pending);
+			continue;
+		}
+		if (st.st_size != pending->size) {
+			pending->size = st.st_size;
+			pending->lastChange = now;
+			fPending.SwapWithItem(kept++, pending);
+			continue;
+		}
+
+		refs.AddRef("refs", &pending->ref);
+		refs.AddInt64("when", pending->firstSeen);
+		_Release(pending);
+		count++;
+	}
+	_Compact(kept);
+
+	return count;
+}
+
+
+uint32
+Debouncer::_Hash(const node_ref& node) const
+{
+	uint64 hash = (uint64)node.node * 31 + node.device;
+	return (uint32)(hash ^ (hash >> 32)) & (fTableSize - 1);
+}
+
+
+Debouncer::Pending*
+Debouncer::_Find(const node_ref& node) const
+{
+	Pending* pending = fTable[_Hash(node)];
+	while (pending != NULL && pending->node != node)
+		pending = pending->hashNext;
+	return pending;
+}
+
+
+// Takes the file out of the table, but not out of the list
+void
+Debouncer::_Release(Pending* pending)
+{
+	Pending** link = &fTable[_Hash(pending->node)];
+	while (*link != NULL && *link != pending)
+		link = &(*link)->hashNext;
+	if (*link != NULL)
+		*link = pending->hashNext;
+
+	if (pending->watched)
+		fWatcher.Unwatch(pending->node);
+	delete pending;
+}
+
+
+// Drops what's left behind the first count files
+void
+Debouncer::_Compact(int32 count)
+{
+	while (fPending.CountItems() > count)
+		fPending.RemoveItemAt(fPending.CountItems() - 1);
+}
+
+
+void
+Debouncer::_Resize(int32 size)
+{
+	delete[] fTable;
+	fTable = new Pending*[size];
+	fTableSize = size;
+	memset(fTable, 0, sizeof(Pending*) * size);
+
+	for (int32 i = 0; i < fPending.CountItems(); i++) {
+		Pending* pending = fPending.ItemAt(i);
+		uint32 index = _Hash(pending->node);
+		pending->hashNext = fTable[index];
+		fTable[index] = pending;
+	}
+}
@@ -0,0 +1,76 @@
+/*
+	Debouncer.h: Holds back the files turning up in the watched folders until
+				they're no longer being written to
+	Released under the MIT license.
+*/
+
+#ifndef DEBOUNCER_H
+#define DEBOUNCER_H
+
+#include <Entry.h>
+#include <Message.h>
+#include <Node.h>
+#include <StringList.h>
+
+#include "ObjectList.h"
+
+class Watcher;
+
+class Debouncer
+{
+public:
+							Debouncer(Watcher& watcher);
+							~Debouncer();
+
+	// Reads the quiet period and the temporary name suffixes from the
+	// Filer settings
+			void			LoadSettings();
+
+			bigtime_t		QuietPeriod() const { return fQuietPeriod; }
+	// Names of files still being downloaded or unpacked, like "x.part"
+			bool			IsTemporary(const char* name) const;
+
+	// Starts holding back the file, or, if it's held back already, notes
+	// the change and its new name
+			void			Add(const entry_ref& ref);
+	// Returns false if the node isn't held back
+			bool			Touch(const node_ref& node);
+			void			Remove(const node_ref& node);
+	// Drops the files of a volume that was unmounted
+			void			RemoveVolume(dev_t device);
+
+	// Moves the files that were left alone for the quiet period, and didn't
+	// change their size either, to the B_REFS_RECEIVED message, along with
+	// when each first turned up, as "when"
+			int32			CollectSettled(BMessage& refs);
+			int32			CountPending() const
+								{ return fPending.CountItems(); }
+
+private:
+			struct Pending {
+				entry_ref	ref;
+				node_ref	node;
+				off_t		size;
+				bigtime_t	lastChange;
+				// In real time
+				bigtime_t	firstSeen;
+				bool		watched;
+				Pending*	hashNext;
+			};
+
+			uint32			_Hash(const node_ref& node) const;
+			Pending*		_Find(const node_ref& node) const;
+			void			_Release(Pending* pending);
+			void			_Compact(int32 count);
+			void			_Resize(int32 size);
+
+			Watcher&		fWatcher;
+			// In the order they turned up, and by node
+			BObjectList<Pending> fPending;
+			Pending**		fTable;
+			int32			fTableSize;
+			bigtime_t		fQuietPeriod;
+			BStringList		fTemporarySuffixes;
+};
+
+#endif	// DEBOUNCER_H
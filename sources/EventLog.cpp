@@ -0,0 +1,571 @@
+/*
+	EventLog.cpp: Records the AutoFiler's watch events, and plays them back
+				against a folder of made up files for load tests
+	Released under the MIT license.
+*/
+
+#include "EventLog.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Directory.h>
+#include <Message.h>
+
+#include "FilerDefs.h"
+
+/*
+	The log starts with kLogMagic and kLogVersion. Each event is then
+	written as its opcode, the microseconds since the one before, the
+	volume, the nodes of the entry, its folder and the folder it was moved
+	from, and the entry's name, with its length up front. Nodes that aren't
+	known are -1. Whenever folders are watched, the roots among them are
+	written as events of their own, with kRootRecord as their opcode.
+
+	For a replay, each folder of the log gets a folder of its own in the
+	tree, named after its volume and node. The folders are the roots, and
+	those the events' entries are in; other nodes are files, so their
+	changes reach the Debouncer as they did. The events are acted out in
+	them: files are made, moved, removed, written to and given attributes,
+	though they stay empty but for what's written. The events are then sent
+	with the nodes of the tree in place of the recorded ones.
+
+	The AutoFiler runs the rules of the settings folder it's given on the
+	tree, which is best an empty folder.
+*/
+
+static const uint32 kLogMagic = 'AFev';
+static const uint32 kLogVersion = 3;
+
+// Marks a watched root, rather than an event
+static const uint8 kRootRecord = 0xff;
+
+// How much of the log is written or read at once
+static const size_t kBufferSize = 65536;
+
+// How often the memory used is looked at while replaying
+static const bigtime_t kSampleInterval = 100000;
+
+struct ReplayedFolder {
+	node_ref	recorded;
+	node_ref	node;
+	BString		path;
+};
+
+struct ReplayedFile {
+	node_ref	recorded;
+	node_ref	node;
+	BString		path;
+};
+
+
+static int
+CompareNodes(const node_ref& a, const node_ref& b)
+{
+	if (a.device != b.device)
+		return a.device < b.device ? -1 : 1;
+	if (a.node != b.node)
+		return a.node < b.node ? -1 : 1;
+	return 0;
+}
+
+
+static int
+CompareFolders(const ReplayedFolder* a, const ReplayedFolder* b)
+{
+	return CompareNodes(a->recorded, b->recorded);
+}
+
+
+static int
+CompareFiles(const ReplayedFile* a, const ReplayedFile* b)
+{
+	return CompareNodes(a->recorded, b->recorded);
+}
+
+
+EventRecorder::EventRecorder()
+	:
+	fLastEvent(0)
+{
+}
+
+
+EventRecorder::~EventRecorder()
+{
+	_Flush();
+}
+
+
+status_t
+EventRecorder::Open(const char* path)
+{
+	status_t status = fFile.SetTo(path, B_WRITE_ONLY | B_CREATE_FILE
+		| B_ERASE_FILE);
+	if (status != B_OK)
+		return status;
+
+	fBuffer.Write(&kLogMagic, sizeof(kLogMagic));
+	fBuffer.Write(&kLogVersion, sizeof(kLogVersion));
+	fLastEvent = system_time();
+	return B_OK;
+}
+
+
+void
+EventRecorder::Record(const WatchEvent& event)
+{
+	if (fFile.InitCheck() != B_OK)
+		return;
+
+	bigtime_t now = system_time();
+	uint32 delta = (uint32)min_c(now - fLastEvent, (bigtime_t)0xffffffff);
+	fLastEvent = now;
+
+	// Moves only happen within a volume
+	int32 device = event.node.device;
+	if (device < 0) {
+		device = event.directory.device >= 0 ? event.directory.device
+			: event.fromDirectory.device;
+	}
+
+	uint8 opcode = event.opcode;
+	int64 node = event.node.node;
+	int64 directory = event.directory.node;
+	int64 fromDirectory = event.fromDirectory.node;
+	uint8 nameLength = min_c(event.name.Length(), 255);
+
+	fBuffer.Write(&opcode, sizeof(opcode));
+	fBuffer.Write(&delta, sizeof(delta));
+	fBuffer.Write(&device, sizeof(device));
+	fBuffer.Write(&node, sizeof(node));
+	fBuffer.Write(&directory, sizeof(directory));
+	fBuffer.Write(&fromDirectory, sizeof(fromDirectory));
+	fBuffer.Write(&nameLength, sizeof(nameLength));
+	fBuffer.Write(event.name.String(), nameLength);
+
+	if (fBuffer.BufferLength() >= kBufferSize)
+		_Flush();
+}
+
+
+void
+EventRecorder::RecordRoot(const node_ref& root)
+{
+	WatchEvent event;
+	event.opcode = kRootRecord;
+	event.node = root;
+	Record(event);
+}
+
+
+void
+EventRecorder::_Flush()
+{
+	if (fBuffer.BufferLength() == 0)
+		return;
+
+	ssize_t written = fFile.Write(fBuffer.Buffer(), fBuffer.BufferLength());
+	if (written != (ssize_t)fBuffer.BufferLength())
+		printf("\tCouldn't write the event log\n");
+
+	fBuffer.SetSize(0);
+	fBuffer.Seek(0, SEEK_SET);
+}
+
+
+EventReplayer::EventReplayer(const char* logPath, const char* treePath,
+	double speed)
+	:
+	fLogPath(logPath),
+	fTreePath(treePath),
+	fSpeed(speed),
+	fFolders(20, true),
+	fFiles(100, true),
+	fBuffer(new char[kBufferSize]),
+	fBufferLength(0),
+	fBufferPosition(0),
+	fThread(-1),
+	fQuitting(0),
+	fEvents(0),
+	fStarted(0),
+	fPeakMemory(0)
+{
+}
+
+
+EventReplayer::~EventReplayer()
+{
+	atomic_set(&fQuitting, 1);
+	if (fThread >= 0) {
+		status_t result;
+		wait_for_thread(fThread, &result);
+	}
+
+	delete[] fBuffer;
+}
+
+
+status_t
+EventReplayer::Prepare()
+{
+	BFile file;
+	status_t status = _Open(file);
+	if (status != B_OK)
+		return status;
+
+	int32 count = 0;
+	WatchEvent event;
+	bigtime_t delta;
+	while (_ReadEvent(file, event, delta)) {
+		if (event.opcode == kRootRecord) {
+			_AddFolder(event.node);
+			continue;
+		}
+
+		_AddFolder(event.directory);
+		_AddFolder(event.fromDirectory);
+		count++;
+	}
+
+	create_directory(fTreePath.String(), 0755);
+	BDirectory root(fTreePath.String());
+	status = root.GetNodeRef(&fRoot);
+	if (status != B_OK)
+		return status;
+
+	for (int32 i = 0; i < fFolders.CountItems(); i++) {
+		ReplayedFolder* folder = fFolders.ItemAt(i);
+		folder->path = fTreePath;
+		folder->path << "/" << folder->recorded.device << "-"
+			<< folder->recorded.node;
+
+		create_directory(folder->path.String(), 0755);
+		BDirectory directory(folder->path.String());
+		status = directory.GetNodeRef(&folder->node);
+		if (status != B_OK)
+			return status;
+	}
+
+	printf("\tReplaying %" B_PRId32 " events in %" B_PRId32 " folders\n",
+		count, fFolders.CountItems());
+	return B_OK;
+}
+
+
+status_t
+EventReplayer::Start(const BMessenger& target)
+{
+	fTarget = target;
+
+	fThread = spawn_thread(_ReplayThread, "event replayer",
+		B_NORMAL_PRIORITY, this);
+	if (fThread < 0)
+		return fThread;
+
+	return resume_thread(fThread);
+}
+
+
+int64
+EventReplayer::PeakMemory()
+{
+	return atomic_get64(&fPeakMemory);
+}
+
+
+status_t
+EventReplayer::_Open(BFile& file)
+{
+	status_t status = file.SetTo(fLogPath.String(), B_READ_ONLY);
+	if (status != B_OK)
+		return status;
+
+	fBufferLength = 0;
+	fBufferPosition = 0;
+
+	uint32 magic;
+	uint32 version;
+	if (!_Read(file, &magic, sizeof(magic)) || magic != kLogMagic
+		|| !_Read(file, &version, sizeof(version)) || version != kLogVersion)
+		return B_BAD_DATA;
+
+	return B_OK;
+}
+
+
+bool
+EventReplayer::_ReadEvent(BFile& file, WatchEvent& event, bigtime_t& delta)
+{
+	uint8 opcode;
+	uint32 recordedDelta;
+	int32 device;
+	int64 node;
+	int64 directory;
+	int64 fromDirectory;
+	uint8 nameLength;
+	char name[256];
+
+	if (!_Read(file, &opcode, sizeof(opcode))
+		|| !_Read(file, &recordedDelta, sizeof(recordedDelta))
+		|| !_Read(file, &device, sizeof(device))
+		|| !_Read(file, &node, sizeof(node))
+		|| !_Read(file, &directory, sizeof(directory))
+		|| !_Read(file, &fromDirectory, sizeof(fromDirectory))
+		|| !_Read(file, &nameLength, sizeof(nameLength))
+		|| !_Read(file, name, nameLength))
+		return false;
+
+	name[nameLength] = '\0';
+
+	event.opcode = opcode;
+	event.node = node_ref(device, node);
+	event.directory = node_ref(device, directory);
+	event.fromDirectory = node_ref(device, fromDirectory);
+	event.name = name;
+	delta = recordedDelta;
+	return true;
+}
+
+
+bool
+EventReplayer::_Read(BFile& file, void* data, size_t size)
+{
+	char* into = (char*)data;
+	while (size > 0) {
+		if (fBufferPosition == fBufferLength) {
+			ssize_t bytesRead = file.Read(fBuffer, kBufferSize);
+			if (bytesRead <= 0)
+				return false;
+			fBufferLength = bytesRead;
+			fBufferPosition = 0;
+		}
+
+		size_t length = min_c(size, fBufferLength - fBufferPosition);
+		memcpy(into, fBuffer + fBufferPosition, length);
+		fBufferPosition += length;
+		into += length;
+		size -= length;
+	}
+	return true;
+}
+
+
+void
+EventReplayer::_AddFolder(const node_ref& node)
+{
+	if (node.node < 0 || _FolderFor(node) != NULL)
+		return;
+
+	ReplayedFolder* folder = new ReplayedFolder;
+	folder->recorded = node;
+	fFolders.BinaryInsert(folder, CompareFolders);
+}
+
+
+void
+EventReplayer::_Replay()
+{
+	BFile file;
+	if (_Open(file) != B_OK) {
+		fTarget.SendMessage(MSG_REPLAY_DONE);
+		return;
+	}
+
+	fStarted = system_time();
+	bigtime_t offset = 0;
+	bigtime_t lastSample = 0;
+
+	WatchEvent event;
+	bigtime_t delta;
+	while (atomic_get(&fQuitting) == 0 && _ReadEvent(file, event, delta)) {
+		// Waits for the event's time from the start, so the waits don't
+		// add up to more than they should
+		offset += delta;
+		if (event.opcode == kRootRecord)
+			continue;
+
+		if (fSpeed > 0) {
+			bigtime_t due = fStarted + (bigtime_t)(offset / fSpeed);
+			bigtime_t now;
+			while ((now = system_time()) < due
+					&& atomic_get(&fQuitting) == 0) {
+				snooze(min_c(due - now, kSampleInterval));
+				_SampleMemory();
+			}
+		}
+
+		_Apply(event);
+
+		BMessage message;
+		Watcher::ArchiveEvent(event, message);
+		if (fTarget.SendMessage(&message) != B_OK)
+			break;
+		fEvents++;
+
+		if (system_time() - lastSample >= kSampleInterval) {
+			_SampleMemory();
+			lastSample = system_time();
+		}
+	}
+
+	fTarget.SendMessage(MSG_REPLAY_DONE);
+
+	// The files are still being filed after the last event
+	while (atomic_get(&fQuitting) == 0) {
+		_SampleMemory();
+		snooze(kSampleInterval);
+	}
+}
+
+
+void
+EventReplayer::_Apply(WatchEvent& event)
+{
+	ReplayedFolder* directory = _FolderFor(event.directory);
+	ReplayedFolder* fromDirectory = _FolderFor(event.fromDirectory);
+	ReplayedFolder* folder = _FolderFor(event.node);
+	ReplayedFile* file = _FileFor(event.node);
+
+	BString path;
+	if (directory != NULL)
+		path << directory->path << "/" << event.name;
+
+	// Removed entries may only be known by their name
+	if (file == NULL && directory != NULL
+		&& event.opcode == WATCH_REMOVED) {
+		for (int32 i = 0; i < fFiles.CountItems(); i++) {
+			if (fFiles.ItemAt(i)->path == path) {
+				file = fFiles.ItemAt(i);
+				break;
+			}
+		}
+	}
+
+	node_ref node;
+	if (folder != NULL)
+		node = folder->node;
+	else if (file != NULL)
+		node = file->node;
+
+	switch (event.opcode) {
+		case WATCH_CREATED:
+		case WATCH_MOVED:
+		{
+			// Subfolders are already there, side by side
+			if (folder != NULL)
+				break;
+
+			if (directory == NULL) {
+				// Moved out of the watched folders
+				if (file != NULL) {
+					unlink(file->path.String());
+					fFiles.RemoveItem(file);
+				}
+				break;
+			}
+
+			if (file != NULL && event.opcode == WATCH_MOVED
+				&& rename(file->path.String(), path.String()) == 0) {
+				file->path = path;
+				break;
+			}
+
+			// Moved in, or filed away since
+			BFile created(path.String(), B_WRITE_ONLY | B_CREATE_FILE
+				| B_ERASE_FILE);
+			if (created.InitCheck() != B_OK
+				|| created.GetNodeRef(&node) != B_OK)
+				break;
+
+			if (event.node.node < 0)
+				break;
+
+			if (file == NULL) {
+				file = new ReplayedFile;
+				file->recorded = event.node;
+				fFiles.BinaryInsert(file, CompareFiles);
+			}
+			file->node = node;
+			file->path = path;
+			break;
+		}
+		case WATCH_REMOVED:
+		{
+			if (file != NULL) {
+				unlink(file->path.String());
+				fFiles.RemoveItem(file);
+			}
+			break;
+		}
+		case WATCH_STAT_CHANGED:
+		{
+			if (file == NULL)
+				break;
+
+			BFile written(file->path.String(), B_WRITE_ONLY | B_OPEN_AT_END);
+			written.Write("\n", 1);
+			break;
+		}
+		case WATCH_ATTR_CHANGED:
+		{
+			if (file == NULL)
+				break;
+
+			BNode attributed(file->path.String());
+			attributed.WriteAttr("AutoFiler:replayed", B_INT64_TYPE, 0,
+				&fEvents, sizeof(fEvents));
+			break;
+		}
+		default:
+			break;
+	}
+
+	event.node = node;
+	event.directory = directory != NULL ? directory->node : node_ref();
+	event.fromDirectory = fromDirectory != NULL ? fromDirectory->node
+		: node_ref();
+}
+
+
+ReplayedFolder*
+EventReplayer::_FolderFor(const node_ref& node)
+{
+	ReplayedFolder key;
+	key.recorded = node;
+	return const_cast<ReplayedFolder*>(fFolders.BinarySearch(key,
+		CompareFolders));
+}
+
+
+ReplayedFile*
+EventReplayer::_FileFor(const node_ref& node)
+{
+	ReplayedFile key;
+	key.recorded = node;
+	return const_cast<ReplayedFile*>(fFiles.BinarySearch(key, CompareFiles));
+}
+
+
+void
+EventReplayer::_SampleMemory()
+{
+	int64 used = 0;
+	ssize_t cookie = 0;
+	area_info info;
+	while (get_next_area_info(B_CURRENT_TEAM, &cookie, &info) == B_OK)
+		used += info.ram_size;
+
+	// Only this thread sets it
+	if (used > atomic_get64(&fPeakMemory))
+		atomic_set64(&fPeakMemory, used);
+}
+
+
+status_t
+EventReplayer::_ReplayThread(void* data)
+{
+	((EventReplayer*)data)->_Replay();
+	return B_OK;
+}
@@ -0,0 +1,102 @@
+/*
+	EventLog.h: Records the AutoFiler's watch events, and plays them back
+				against a folder of made up files for load tests
+	Released under the MIT license.
+*/
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <DataIO.h>
+#include <File.h>
+#include <Messenger.h>
+#include <Node.h>
+#include <OS.h>
+#include <String.h>
+
+#include "ObjectList.h"
+#include "Watcher.h"
+
+struct ReplayedFolder;
+struct ReplayedFile;
+
+class EventRecorder
+{
+public:
+							EventRecorder();
+	// Writes what's left of the buffer
+							~EventRecorder();
+
+			status_t		Open(const char* path);
+			void			Record(const WatchEvent& event);
+	// A folder that's watched with its subfolders
+			void			RecordRoot(const node_ref& root);
+
+private:
+			void			_Flush();
+
+			BFile			fFile;
+			BMallocIO		fBuffer;
+			bigtime_t		fLastEvent;
+};
+
+
+class EventReplayer
+{
+public:
+	// The events are sent speed times as fast as they were recorded, or as
+	// fast as the target takes them with a speed of 0
+							EventReplayer(const char* logPath,
+								const char* treePath, double speed);
+	// Stops sending events
+							~EventReplayer();
+
+	// Reads the log, and makes a folder in the tree for each of its folders
+			status_t		Prepare();
+	// The folder to watch
+			const node_ref&	Root() const { return fRoot; }
+
+	// The events are sent to the target as MSG_WATCH_EVENT messages,
+	// followed by MSG_REPLAY_DONE
+			status_t		Start(const BMessenger& target);
+
+			int64			CountEvents() const { return fEvents; }
+			bigtime_t		Started() const { return fStarted; }
+	// The most memory the AutoFiler used since it started, in bytes
+			int64			PeakMemory();
+
+private:
+			status_t		_Open(BFile& file);
+			bool			_ReadEvent(BFile& file, WatchEvent& event,
+								bigtime_t& delta);
+			bool			_Read(BFile& file, void* data, size_t size);
+			void			_AddFolder(const node_ref& node);
+			void			_Replay();
+			void			_Apply(WatchEvent& event);
+			ReplayedFolder*	_FolderFor(const node_ref& node);
+			ReplayedFile*	_FileFor(const node_ref& node);
+			void			_SampleMemory();
+
+	static	status_t		_ReplayThread(void* data);
+
+			BString			fLogPath;
+			BString			fTreePath;
+			double			fSpeed;
+			node_ref		fRoot;
+			BMessenger		fTarget;
+			BObjectList<ReplayedFolder> fFolders;
+			BObjectList<ReplayedFile> fFiles;
+
+			// What's read of the log, but not taken yet
+			char*			fBuffer;
+			size_t			fBufferLength;
+			size_t			fBufferPosition;
+
+			thread_id		fThread;
+			int32			fQuitting;
+			int64			fEvents;
+			bigtime_t		fStarted;
+			int64			fPeakMemory;
+};
+
+#endif	// EVENT_LOG_H
@@ -0,0 +1,469 @@
+/*
+	EventQueue.cpp: The files waiting for the AutoFiler's rules, kept on disk
+				until they're filed
+	Released under the MIT license.
+*/
+
+#include "EventQueue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <Autolock.h>
+#include <Directory.h>
+#include <FindDirectory.h>
+#include <Path.h>
+
+#include "FilerDefs.h"
+
+/*
+	The files the AutoFiler is going to file are written to the "Queue"
+	folder of the settings, instead of being kept in messages, so a burst of
+	them doesn't pile up in memory, and none are lost when the AutoFiler
+	goes away before getting to them.
+
+	The queue is made of segments, numbered files written one after the
+	other. Each record is the length of what follows (uint16), the device
+	(int32) and directory (int64) of the file, the time its event came in
+	(int64), and its name. The name may be followed by a null and the name
+	of the rule set to run on it. A record cut short by a crash ends its
+	segment.
+
+	The file "Acknowledged" holds the segment and offset up to which all
+	files were filed. Segments before that one are removed. Files handed
+	out but not acknowledged yet are handed out again after a crash, so
+	a file may be filed twice, but never not at all.
+
+	Files may be filed out of order, so each one handed out is kept track
+	of until it's done. Only the files up to the first one still being
+	worked on are acknowledged.
+*/
+
+static const char* const kQueueFolder = "Queue";
+static const char* const kAcknowledgedFile = "Acknowledged";
+
+// Where a new segment is started
+static const off_t kSegmentSize = 1024 * 1024;
+
+static const size_t kRecordHeaderSize = sizeof(uint16) + sizeof(int32)
+	+ sizeof(int64) + sizeof(int64);
+
+
+EventQueue::EventQueue()
+	:
+	fLock("event queue"),
+	fFD(-1),
+	fWriteSegment(0),
+	fWriteOffset(0),
+	fFlushedOffset(0),
+	fHandedOut(64, true),
+	fFirstTicket(0),
+	fPending(0)
+{
+	fRead.segment = 0;
+	fRead.offset = 0;
+	fAcknowledged = fRead;
+}
+
+
+EventQueue::~EventQueue()
+{
+	Close();
+}
+
+
+status_t
+EventQueue::Open()
+{
+	BAutolock _(fLock);
+
+	if (fFD >= 0)
+		return B_OK;
+
+	BPath path;
+	status_t status = find_directory(B_USER_SETTINGS_DIRECTORY, &path);
+	if (status != B_OK)
+		return status;
+
+	path.Append(kSettingsFolder);
+	path.Append(kQueueFolder);
+	create_directory(path.Path(), 0777);
+	fDirectory = path.Path();
+
+	// Find the segments left behind
+	bool found = false;
+	uint32 first = 0;
+	uint32 last = 0;
+	BDirectory directory(fDirectory.String());
+	entry_ref ref;
+	while (directory.GetNextRef(&ref) == B_OK) {
+		char* end;
+		uint32 segment = strtoul(ref.name, &end, 10);
+		if (end == ref.name || *end != '\0')
+			continue;
+
+		if (!found || segment < first)
+			first = segment;
+		if (!found || segment > last)
+			last = segment;
+		found = true;
+	}
+
+	fAcknowledged.segment = first;
+	fAcknowledged.offset = 0;
+
+	BPath acknowledged(fDirectory.String(), kAcknowledgedFile);
+	int fd = open(acknowledged.Path(), O_RDONLY);
+	if (fd >= 0) {
+		uint32 segment;
+		int64 offset;
+		if (read(fd, &segment, sizeof(segment)) == sizeof(segment)
+			&& read(fd, &offset, sizeof(offset)) == sizeof(offset)) {
+			fAcknowledged.segment = segment;
+			fAcknowledged.offset = offset;
+		}
+		close(fd);
+	}
+
+	// New files go to a new segment, the last one may end in a torn record
+	fWriteSegment = found ? last + 1 : 0;
+	if (fWriteSegment < fAcknowledged.segment)
+		fWriteSegment = fAcknowledged.segment;
+
+	status = _OpenSegment(fWriteSegment);
+	if (status != B_OK)
+		return status;
+
+	fRead = fAcknowledged;
+	Position position = fRead;
+	fPending = _ReadRecords(position, NULL, 0);
+	fHandedOut.MakeEmpty();
+
+	_RemoveSegments(fAcknowledged.segment);
+
+	if (fPending > 0)
+		printf("%" B_PRId32 " files left in the queue\n", fPending);
+
+	return B_OK;
+}
+
+
+void
+EventQueue::Close()
+{
+	BAutolock _(fLock);
+
+	if (fFD < 0)
+		return;
+
+	Flush();
+	close(fFD);
+	fFD = -1;
+
+	// Nothing's left to be filed
+	if (fPending == 0) {
+		_RemoveSegments(fWriteSegment + 1);
+		unlink(BPath(fDirectory.String(), kAcknowledgedFile).Path());
+	}
+}
+
+
+status_t
+EventQueue::Append(const entry_ref& ref, const char* ruleSet, bigtime_t seen)
+{
+	BAutolock _(fLock);
+
+	if (fFD < 0)
+		return B_NO_INIT;
+
+	if (fWriteOffset >= kSegmentSize) {
+		status_t status = Flush();
+		if (status == B_OK)
+			status = _OpenSegment(fWriteSegment + 1);
+		if (status != B_OK)
+			return status;
+	}
+
+	uint16 nameLength = strlen(ref.name);
+	uint16 setLength = ruleSet != NULL && ruleSet[0] != '\0'
+		? strlen(ruleSet) + 1 : 0;
+	uint16 length = kRecordHeaderSize - sizeof(uint16) + nameLength
+		+ setLength;
+	int32 device = ref.device;
+	int64 directory = ref.directory;
+	int64 time = seen;
+
+	fBuffer.Write(&length, sizeof(length));
+	fBuffer.Write(&device, sizeof(device));
+	fBuffer.Write(&directory, sizeof(directory));
+	fBuffer.Write(&time, sizeof(time));
+	fBuffer.Write(ref.name, nameLength);
+	if (setLength > 0) {
+		fBuffer.Write("", 1);
+		fBuffer.Write(ruleSet, setLength - 1);
+	}
+
+	fWriteOffset += sizeof(length) + length;
+	fPending++;
+	return B_OK;
+}
+
+
+status_t
+EventQueue::Flush()
+{
+	BAutolock _(fLock);
+
+	if (fFD < 0)
+		return B_NO_INIT;
+	if (fBuffer.BufferLength() == 0)
+		return B_OK;
+
+	const char* data = (const char*)fBuffer.Buffer();
+	size_t length = fBuffer.BufferLength();
+	status_t status = B_OK;
+	while (length > 0) {
+		ssize_t bytes = write(fFD, data, length);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			status = errno;
+			break;
+		}
+		data += bytes;
+		length -= bytes;
+	}
+	fBuffer.SetSize(0);
+	fBuffer.Seek(0, SEEK_SET);
+
+	if (status == B_OK && fsync(fFD) != 0)
+		status = errno;
+
+	if (status != B_OK) {
+		printf("\tCouldn't write the queue: %s\n", strerror(status));
+		return status;
+	}
+
+	fFlushedOffset = fWriteOffset;
+	return B_OK;
+}
+
+
+int32
+EventQueue::Read(BObjectList<entry_ref>& refs, int32 max, int64* firstTicket,
+	BStringList* ruleSets, bigtime_t* seen)
+{
+	BAutolock _(fLock);
+
+	if (firstTicket != NULL)
+		*firstTicket = fFirstTicket + fHandedOut.CountItems();
+
+	return _ReadRecords(fRead, &refs, max, &fHandedOut, ruleSets, seen);
+}
+
+
+void
+EventQueue::Done(int64 ticket)
+{
+	BAutolock _(fLock);
+
+	HandedOut* handedOut = fHandedOut.ItemAt(ticket - fFirstTicket);
+	if (handedOut != NULL)
+		handedOut->done = true;
+}
+
+
+status_t
+EventQueue::Acknowledge()
+{
+	BAutolock _(fLock);
+
+	int32 count = 0;
+	while (count < fHandedOut.CountItems()
+		&& fHandedOut.ItemAt(count)->done)
+		count++;
+
+	if (count == 0)
+		return B_OK;
+
+	fAcknowledged = fHandedOut.ItemAt(count - 1)->end;
+	for (int32 i = 0; i < count; i++)
+		delete fHandedOut.RemoveItemAt(0);
+	fFirstTicket += count;
+	fPending -= count;
+
+	status_t status = _WriteAcknowledged();
+	_RemoveSegments(fAcknowledged.segment);
+	return status;
+}
+
+
+BString
+EventQueue::_SegmentPath(uint32 segment) const
+{
+	BString path(fDirectory);
+	path << "/" << BString().SetToFormat("%010" B_PRIu32, segment);
+	return path;
+}
+
+
+status_t
+EventQueue::_OpenSegment(uint32 segment)
+{
+	if (fFD >= 0)
+		close(fFD);
+
+	fFD = open(_SegmentPath(segment).String(),
+		O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (fFD < 0)
+		return errno;
+
+	fcntl(fFD, F_SETFD, FD_CLOEXEC);
+	fWriteSegment = segment;
+	fWriteOffset = 0;
+	fFlushedOffset = 0;
+	return B_OK;
+}
+
+
+int32
+EventQueue::_ReadRecords(Position& position, BObjectList<entry_ref>* refs,
+	int32 max, BObjectList<HandedOut>* handedOut, BStringList* ruleSets,
+	bigtime_t* seen)
+{
+	// No maximum counts them all
+	if (max <= 0)
+		max = 0x7fffffff;
+
+	int32 count = 0;
+	char buffer[64 * 1024];
+
+	while (count < max && position.segment <= fWriteSegment) {
+		size_t size = sizeof(buffer);
+
+		// Only what's on the disk for sure is handed out
+		if (position.segment == fWriteSegment) {
+			if (position.offset >= fFlushedOffset)
+				break;
+			if (fFlushedOffset - position.offset < (off_t)size)
+				size = fFlushedOffset - position.offset;
+		}
+
+		int fd = open(_SegmentPath(position.segment).String(), O_RDONLY);
+		ssize_t bytes = 0;
+		if (fd >= 0) {
+			bytes = pread(fd, buffer, size, position.offset);
+			close(fd);
+		}
+		if (bytes < 0)
+			bytes = 0;
+
+		size_t used = 0;
+		while (count < max && used + sizeof(uint16) <= (size_t)bytes) {
+			uint16 length;
+			memcpy(&length, buffer + used, sizeof(length));
+			if (length < kRecordHeaderSize - sizeof(uint16)
+				|| used + sizeof(length) + length > (size_t)bytes)
+				break;
+
+			if (refs != NULL) {
+				const char* record = buffer + used + sizeof(length);
+				int32 device;
+				int64 directory;
+				int64 time;
+				memcpy(&device, record, sizeof(device));
+				memcpy(&directory, record + sizeof(device), sizeof(directory));
+				memcpy(&time, record + sizeof(device) + sizeof(directory),
+					sizeof(time));
+
+				const char* text = record + kRecordHeaderSize - sizeof(uint16);
+				int32 textLength = length - (kRecordHeaderSize - sizeof(uint16));
+				BString name(text, textLength);
+
+				entry_ref* ref = new entry_ref;
+				ref->device = device;
+				ref->directory = directory;
+				ref->set_name(name.String());
+				refs->AddItem(ref);
+
+				if (ruleSets != NULL) {
+					BString ruleSet;
+					if (name.Length() + 1 < textLength) {
+						ruleSet.SetTo(text + name.Length() + 1,
+							textLength - name.Length() - 1);
+					}
+					ruleSets->Add(ruleSet);
+				}
+
+				if (seen != NULL)
+					seen[count] = time;
+			}
+
+			used += sizeof(length) + length;
+			count++;
+
+			if (handedOut != NULL) {
+				HandedOut* record = new HandedOut;
+				record->end.segment = position.segment;
+				record->end.offset = position.offset + used;
+				record->done = false;
+				handedOut->AddItem(record);
+			}
+		}
+
+		position.offset += used;
+
+		// A segment that's done, or ends in a torn record, is followed by
+		// the next one
+		if (used == 0 && count < max) {
+			if (position.segment == fWriteSegment)
+				break;
+			position.segment++;
+			position.offset = 0;
+		}
+	}
+
+	return count;
+}
+
+
+status_t
+EventQueue::_WriteAcknowledged()
+{
+	BPath path(fDirectory.String(), kAcknowledgedFile);
+	int fd = open(path.Path(), O_WRONLY | O_CREAT, 0600);
+	if (fd < 0)
+		return errno;
+
+	uint32 segment = fAcknowledged.segment;
+	int64 offset = fAcknowledged.offset;
+	status_t status = B_OK;
+	if (pwrite(fd, &segment, sizeof(segment), 0) != sizeof(segment)
+		|| pwrite(fd, &offset, sizeof(offset), sizeof(segment))
+			!= sizeof(offset)
+		|| fsync(fd) != 0)
+		status = errno;
+
+	close(fd);
+	return status;
+}
+
+
+void
+EventQueue::_RemoveSegments(uint32 before)
+{
+	BDirectory directory(fDirectory.String());
+	entry_ref ref;
+	while (directory.GetNextRef(&ref) == B_OK) {
+		char* end;
+		uint32 segment = strtoul(ref.name, &end, 10);
+		if (end == ref.name || *end != '\0' || segment >= before)
+			continue;
+
+		unlink(BPath(fDirectory.String(), ref.name).Path());
+	}
+}
@@ -0,0 +1,89 @@
+/*
+	EventQueue.h: The files waiting for the AutoFiler's rules, kept on disk
+				until they're filed
+	Released under the MIT license.
+*/
+
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <DataIO.h>
+#include <Entry.h>
+#include <Locker.h>
+#include <String.h>
+#include <StringList.h>
+
+#include "ObjectList.h"
+
+class EventQueue
+{
+public:
+							EventQueue();
+							~EventQueue();
+
+	// Picks up what was left in the queue when the AutoFiler went away
+			status_t		Open();
+			void			Close();
+
+	// Appended files are only safe on the disk after Flush(), which is
+	// meant to be called once for a bunch of them. A file may come with the
+	// rule set to run on it, and comes with the time its event came in, as
+	// real time in microseconds.
+			status_t		Append(const entry_ref& ref,
+								const char* ruleSet = NULL,
+								bigtime_t seen = 0);
+			status_t		Flush();
+
+	// Hands out up to max of the next files, without taking them from the
+	// queue. They get consecutive tickets, starting at the one returned in
+	// firstTicket. Once a file is filed, Done() is called with its ticket,
+	// and Acknowledge() takes the files done from the queue, up to the
+	// first one that isn't. Their times are put in seen, if given, which
+	// has room for max of them.
+			int32			Read(BObjectList<entry_ref>& refs, int32 max,
+								int64* firstTicket = NULL,
+								BStringList* ruleSets = NULL,
+								bigtime_t* seen = NULL);
+			void			Done(int64 ticket);
+			status_t		Acknowledge();
+
+	// Files appended, but not acknowledged yet
+			int32			CountPending() const { return fPending; }
+
+private:
+			struct Position {
+				uint32		segment;
+				off_t		offset;
+			};
+
+			// Where a file handed out ends in the queue
+			struct HandedOut {
+				Position	end;
+				bool		done;
+			};
+
+			BString			_SegmentPath(uint32 segment) const;
+			status_t		_OpenSegment(uint32 segment);
+			int32			_ReadRecords(Position& position,
+								BObjectList<entry_ref>* refs, int32 max,
+								BObjectList<HandedOut>* handedOut = NULL,
+								BStringList* ruleSets = NULL,
+								bigtime_t* seen = NULL);
+			status_t		_WriteAcknowledged();
+			void			_RemoveSegments(uint32 before);
+
+			BLocker			fLock;
+			BString			fDirectory;
+			int				fFD;
+			BMallocIO		fBuffer;
+			uint32			fWriteSegment;
+			off_t			fWriteOffset;
+			off_t			fFlushedOffset;
+			Position		fRead;
+			Position		fAcknowledged;
+			BObjectList<HandedOut> fHandedOut;
+			int64			fFirstTicket;
+			int32			fPending;
+};
+
+#endif	// EVENT_QUEUE_H
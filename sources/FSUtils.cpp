@@ -7,11 +7,16 @@
 
 #include "FSUtils.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <Alert.h>
+#include <Autolock.h>
 #include <Catalog.h>
 #include <Directory.h>
 #include <Errors.h>
@@ -23,6 +28,11 @@
 
 #include <fs_attr.h>
 
+#include "FileHash.h"
+#include "ObjectList.h"
+#include "ProcessRunner.h"
+#include "TargetFolder.h"
+
 
 #define COPY_BUFFER_SIZE 1024000
 
@@ -106,40 +116,406 @@ CheckCopiable(BEntry* src, BEntry* dest)
 }
 
 
+// Free space is looked up once per volume and batch, and then accounted for
+// locally with every copied file. See ResetCopySpace(). Files may be copied
+// by several threads at once.
+struct VolumeSpace {
+	dev_t	device;
+	off_t	freeBytes;
+};
+
+static BObjectList<VolumeSpace> sVolumeSpace(4, true);
+static BLocker sVolumeSpaceLock("volume space");
+
+static bool sHashCopies = true;
+static bool sVerifyCopies = false;
+
+
+void
+ResetCopySpace()
+{
+	BAutolock _(sVolumeSpaceLock);
+	sVolumeSpace.MakeEmpty();
+}
+
+
+static status_t
+ReserveCopySpace(dev_t device, off_t bytes)
+{
+	BAutolock _(sVolumeSpaceLock);
+
+	VolumeSpace* space = NULL;
+	for (int32 i = 0; i < sVolumeSpace.CountItems(); i++) {
+		if (sVolumeSpace.ItemAt(i)->device == device) {
+			space = sVolumeSpace.ItemAt(i);
+			break;
+		}
+	}
+
+	if (space == NULL) {
+		BVolume volume(device);
+		if (volume.InitCheck() != B_OK)
+			return volume.InitCheck();
+		if (volume.IsReadOnly())
+			return B_READ_ONLY_DEVICE;
+
+		space = new VolumeSpace;
+		space->device = device;
+		space->freeBytes = volume.FreeBytes();
+		sVolumeSpace.AddItem(space);
+	} else if (bytes > space->freeBytes) {
+		// Our bookkeeping may be too pessimistic, files could have been
+		// removed in the meantime. Ask the volume once more before giving up.
+		space->freeBytes = BVolume(device).FreeBytes();
+	}
+
+	if (bytes > space->freeBytes)
+		return B_DEVICE_FULL;
+
+	space->freeBytes -= bytes;
+	return B_OK;
+}
+
+
+// Gives back what a copy that failed had reserved
+static void
+ReleaseCopySpace(dev_t device, off_t bytes)
+{
+	BAutolock _(sVolumeSpaceLock);
+
+	for (int32 i = 0; i < sVolumeSpace.CountItems(); i++) {
+		VolumeSpace* space = sVolumeSpace.ItemAt(i);
+		if (space->device == device) {
+			space->freeBytes += bytes;
+			return;
+		}
+	}
+}
+
+
+static status_t
+CopyAttributes(BNode& source, BNode& dest)
+{
+	char name[B_ATTR_NAME_LENGTH];
+	char* buffer = NULL;
+	size_t bufferSize = 0;
+	status_t status = B_OK;
+
+	source.RewindAttrs();
+	while (source.GetNextAttrName(name) == B_OK) {
+		attr_info info;
+		if (source.GetAttrInfo(name, &info) != B_OK)
+			continue;
+
+		if ((size_t)info.size > bufferSize) {
+			char* newBuffer = (char*)realloc(buffer, info.size);
+			if (newBuffer == NULL) {
+				status = B_NO_MEMORY;
+				break;
+			}
+			buffer = newBuffer;
+			bufferSize = info.size;
+		}
+
+		ssize_t bytes = source.ReadAttr(name, info.type, 0, buffer, info.size);
+		if (bytes < 0)
+			continue;
+
+		dest.WriteAttr(name, info.type, 0, buffer, bytes);
+	}
+
+	free(buffer);
+	return status;
+}
+
+
+void
+SetCopyOptions(bool hash, bool verify)
+{
+	sHashCopies = hash || verify;
+	sVerifyCopies = verify;
+}
+
+
+#ifdef SEEK_HOLE
+// Finds the next run of data at or after pos. If the file system can't tell,
+// all of the rest is taken as data, and the file as no longer sparse.
+static void
+NextDataRun(int fd, off_t pos, off_t size, off_t& start, off_t& end,
+	bool& sparse)
+{
+	start = lseek(fd, pos, SEEK_DATA);
+	if (start < 0 && errno == ENXIO) {
+		// Only a hole is left
+		start = end = size;
+		return;
+	}
+	if (start < 0 || start > size) {
+		start = pos;
+		end = size;
+		sparse = false;
+		return;
+	}
+
+	end = lseek(fd, start, SEEK_HOLE);
+	if (end < 0 || end > size)
+		end = size;
+}
+#endif
+
+
+// Copies the data of a regular file. Holes in sparse files are skipped over
+// (and thus preserved on file systems that support them), dense files are
+// preallocated in one go to keep them from fragmenting.
+// If there's a hasher, it sees the data as it passes through, holes
+// included.
+static status_t
+CopyFileData(int sourceFD, int destFD, off_t size, char* buffer,
+	FileHasher* hasher)
+{
+	off_t dataStart = 0;
+	off_t dataEnd = size;
+	off_t hashed = 0;
+	bool sparse = false;
+
+#ifdef SEEK_HOLE
+	off_t hole = lseek(sourceFD, 0, SEEK_HOLE);
+	sparse = hole >= 0 && hole < size;
+	if (sparse)
+		NextDataRun(sourceFD, 0, size, dataStart, dataEnd, sparse);
+#endif
+
+	if (!sparse && size > 0)
+		posix_fallocate(destFD, 0, size);
+		// Only a hint, the copy works just as well without it
+
+	while (dataStart < size) {
+		for (off_t pos = dataStart; pos < dataEnd;) {
+			size_t toRead = COPY_BUFFER_SIZE;
+			if (dataEnd - pos < (off_t)toRead)
+				toRead = dataEnd - pos;
+
+			ssize_t bytesRead = pread(sourceFD, buffer, toRead, pos);
+			if (bytesRead < 0)
+				return errno;
+			if (bytesRead == 0)
+				break;
+
+			ssize_t bytesWritten = pwrite(destFD, buffer, bytesRead, pos);
+			if (bytesWritten < 0)
+				return errno;
+			if (bytesWritten != bytesRead)
+				return B_IO_ERROR;
+
+			if (hasher != NULL) {
+				hasher->UpdateZeros(pos - hashed);
+				hasher->Update(buffer, bytesRead);
+				hashed = pos + bytesRead;
+			}
+
+			pos += bytesRead;
+		}
+
+		if (!sparse)
+			break;
+
+#ifdef SEEK_HOLE
+		NextDataRun(sourceFD, dataEnd, size, dataStart, dataEnd, sparse);
+#endif
+	}
+
+	// Extends the file over a trailing hole
+	if (ftruncate(destFD, size) != 0)
+		return errno;
+
+	if (hasher != NULL)
+		hasher->UpdateZeros(size - hashed);
+
+	return B_OK;
+}
+
+
+// Reads the copy back and compares it with what was read from the source.
+// The data is flushed first, but reading it back is likely served from the
+// file cache, so this catches mistakes made on the way there, not the disk
+// failing to keep it.
+static status_t
+VerifyCopy(int destFD, TargetFolder& destDir, const char* name,
+	uint64 sourceHash)
+{
+	if (fsync(destFD) != 0)
+		return errno;
+
+	int fd = openat(destDir.FD(), name, O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	uint64 destHash;
+	status_t status = HashFile(fd, destHash);
+	close(fd);
+
+	if (status == B_OK && destHash != sourceHash) {
+		printf("\t\tThe copy of %s in %s doesn't match the original\n", name,
+			destDir.Path());
+		status = B_IO_ERROR;
+	}
+	return status;
+}
+
+
+static status_t
+CopyRegularFile(BEntry* srcentry, TargetFolder& destDir, const char* name,
+	bool clobber)
+{
+	BPath srcpath;
+	status_t status = srcentry->GetPath(&srcpath);
+	if (status != B_OK)
+		return status;
+
+	int sourceFD = open(srcpath.Path(), O_RDONLY);
+	if (sourceFD < 0)
+		return errno;
+
+	struct stat st;
+	if (fstat(sourceFD, &st) != 0) {
+		status = errno;
+		close(sourceFD);
+		return status;
+	}
+
+	// st_blocks is what the data really occupies, which is less than the
+	// file size for sparse files
+	off_t needed = min_c((off_t)st.st_blocks * 512, st.st_size);
+	dev_t device = destDir.NodeRef().device;
+	status = ReserveCopySpace(device, needed);
+	bool reserved = status == B_OK;
+
+	// Hashing a sparse file would mean hashing its holes zero by zero. Its
+	// copy isn't tagged then, unless it's verified anyway.
+	bool hash = sHashCopies && (sVerifyCopies || needed >= st.st_size);
+
+	// A file that's replaced stays as it is until the copy is complete,
+	// which then takes its place
+	BString copyName(name);
+	if (clobber) {
+		static int32 sCopyCount = 0;
+		copyName.SetToFormat(".filer-copy-%" B_PRId32 "-%" B_PRId32,
+			find_thread(NULL), atomic_add(&sCopyCount, 1));
+	}
+
+	int destFD = -1;
+	if (status == B_OK) {
+		destFD = openat(destDir.FD(), copyName.String(),
+			O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+		if (destFD < 0)
+			status = errno;
+	}
+
+	char* buffer = NULL;
+	if (status == B_OK) {
+		buffer = (char*)malloc(COPY_BUFFER_SIZE);
+		if (buffer == NULL)
+			status = B_NO_MEMORY;
+	}
+
+	FileHasher hasher;
+	if (status == B_OK) {
+		status = CopyFileData(sourceFD, destFD, st.st_size, buffer,
+			hash ? &hasher : NULL);
+	}
+	if (status == B_OK && sVerifyCopies) {
+		status = VerifyCopy(destFD, destDir, copyName.String(),
+			hasher.Digest());
+	}
+
+	free(buffer);
+	close(sourceFD);
+	if (destFD >= 0)
+		close(destFD);
+
+	// Only the file we made is removed
+	if (status != B_OK) {
+		if (destFD >= 0)
+			unlinkat(destDir.FD(), copyName.String(), 0);
+		if (reserved)
+			ReleaseCopySpace(device, needed);
+		return status;
+	}
+
+	BNode source(srcentry);
+	BNode dest(&destDir.Directory(), copyName.String());
+	if (source.InitCheck() == B_OK && dest.InitCheck() == B_OK) {
+		CopyAttributes(source, dest);
+
+		// Only the copy is tagged, writing to the source would change its
+		// status time and get it picked up again as a changed file
+		if (hash)
+			WriteFileHash(dest, hasher.Digest(), st);
+
+		dest.SetPermissions(st.st_mode);
+		dest.SetModificationTime(st.st_mtime);
+	}
+
+	if (clobber && renameat(destDir.FD(), copyName.String(), destDir.FD(),
+			name) != 0) {
+		status = errno;
+		unlinkat(destDir.FD(), copyName.String(), 0);
+		ReleaseCopySpace(device, needed);
+		return status;
+	}
+
+	return B_OK;
+}
+
+
 status_t
-CopyFile(BEntry* srcentry, BEntry* destentry, bool clobber)
+CopyFile(BEntry* srcentry, TargetFolder& destDir, bool clobber,
+	const char* name)
 {
-	if (!srcentry || !destentry)
+	if (!srcentry || destDir.InitCheck() != B_OK)
 		return B_ERROR;
 
-	if (!destentry->IsDirectory())
-		return B_ERROR;
+	if (srcentry->IsFile()) {
+		char leaf[B_FILE_NAME_LENGTH];
+		if (name == NULL) {
+			status_t status = srcentry->GetName(leaf);
+			if (status != B_OK)
+				return status;
+			name = leaf;
+		}
 
-	entry_ref ref;
-	srcentry->GetRef(&ref);
+		return CopyRegularFile(srcentry, destDir, name, clobber);
+	}
+
+	// Folders and links are left to copyattr, which knows how to recurse
+	// into them
 
 	BPath srcpath;
 	srcentry->GetPath(&srcpath);
 
-	BString srcstring(srcpath.Path());
-	srcstring.ReplaceAll("'", "'\\''");
-
-	BPath destpath;
-	destentry->GetPath(&destpath);
+	BString deststring(destDir.Path());
+	deststring << '/';
+	if (name != NULL)
+		deststring << name;
 
-	BString deststring(destpath.Path());
-	deststring.ReplaceAll("'", "'\\''");
+	BStringList arguments;
+	arguments.Add("copyattr");
+	arguments.Add("-r");
+	arguments.Add("-d");
+	arguments.Add(srcpath.Path());
+	arguments.Add(deststring);
 
-	BString command("copyattr -r -d ");
-	command << "'" << srcstring << "' '" << deststring << "/'";
-	int code = system(command.String());
+	int32 code;
+	status_t status = ProcessRunner::Default()->Run(arguments, &code);
+	if (status != B_OK)
+		return status;
 
-	return code;
+	return code == 0 ? B_OK : B_ERROR;
 }
 
 
 status_t
-MoveFile(BEntry* srcentry, BEntry* destentry, bool clobber)
+CopyFile(BEntry* srcentry, BEntry* destentry, bool clobber, const char* name)
 {
 	if (!srcentry || !destentry)
 		return B_ERROR;
@@ -147,54 +523,47 @@ MoveFile(BEntry* srcentry, BEntry* destentry, bool clobber)
 	if (!destentry->IsDirectory())
 		return B_ERROR;
 
-	BDirectory destDir(destentry);
-	status_t ret = destDir.InitCheck();
-	if (ret != B_OK)
-		return ret;
-
-	char destLeaf[B_FILE_NAME_LENGTH] = {'\0'};
-	srcentry->GetName(destLeaf);
-	if (destLeaf == NULL)
-		return B_ERROR;
+	TargetFolder destDir;
+	status_t status = destDir.SetTo(*destentry);
+	if (status != B_OK)
+		return status;
 
-	return srcentry->MoveTo(&destDir, destLeaf, clobber);
+	return CopyFile(srcentry, destDir, clobber, name);
 }
 
 
-#if 0
-const char* GetValidName(BEntry* entry)
+status_t
+MoveFile(BEntry* srcentry, TargetFolder& destDir, bool clobber,
+	const char* name)
 {
-	// given a particular location, this will (1) check to see if said entry
-	// exists and if it does, generates a filename which will work complete with
-	// the full path. The entry is also set to this new, valid path
+	if (!srcentry || destDir.InitCheck() != B_OK)
+		return B_ERROR;
 
-	BPath path;
-	entry->GetPath(&path);
+	char destLeaf[B_FILE_NAME_LENGTH] = {'\0'};
+	if (name == NULL) {
+		status_t ret = srcentry->GetName(destLeaf);
+		if (ret != B_OK)
+			return ret;
+		name = destLeaf;
+	}
 
-	if (entry->Exists()) {
-		// separate into path and leaf
-		char leafbase[B_FILE_NAME_LENGTH];
-		char newpath[B_PATH_NAME_LENGTH];
-		strcpy(leafbase, path.Leaf());
-		path.GetParent(&path);
+	return srcentry->MoveTo(&destDir.Directory(), name, clobber);
+}
 
-		int32 attempt = 1;
-		
-		do {
-			if (attempt > 1) {
-				sprintf(newpath, "%s/%s copy %ld", path.Path(),leafbase,
-					attempt);
-			} else
-				sprintf(newpath, "%s/%s copy", path.Path(),leafbase);
 
-			entry->SetTo(newpath);
+status_t
+MoveFile(BEntry* srcentry, BEntry* destentry, bool clobber, const char* name)
+{
+	if (!srcentry || !destentry)
+		return B_ERROR;
 
-			attempt++;
-		} while (entry->Exists());
+	if (!destentry->IsDirectory())
+		return B_ERROR;
 
-		return newpath;
-	}
+	TargetFolder destDir;
+	status_t ret = destDir.SetTo(*destentry);
+	if (ret != B_OK)
+		return ret;
 
-	return path.Path();
+	return MoveFile(srcentry, destDir, clobber, name);
 }
-#endif
@@ -12,10 +12,18 @@
 #define FS_CLOBBER 'fscl'
 #define FS_SKIP 'fssk'
 
-status_t	CheckCopiable(BEntry* src, BEntry* dest);
-status_t	CopyFile(BEntry* src, BEntry* dest, bool clobber);
-status_t	MoveFile(BEntry* src, BEntry* dest, bool clobber);
+class TargetFolder;
 
-const char*	GetValidName(BEntry* entry);
+status_t	CheckCopiable(BEntry* src, BEntry* dest);
+status_t	CopyFile(BEntry* src, BEntry* dest, bool clobber,
+				const char* name = NULL);
+status_t	CopyFile(BEntry* src, TargetFolder& dest, bool clobber,
+				const char* name = NULL);
+status_t	MoveFile(BEntry* src, BEntry* dest, bool clobber,
+				const char* name = NULL);
+status_t	MoveFile(BEntry* src, TargetFolder& dest, bool clobber,
+				const char* name = NULL);
+void		ResetCopySpace();
+void		SetCopyOptions(bool hash, bool verify);
 
 #endif	// FSUTILS_H_
@@ -0,0 +1,303 @@
+/*
+	FileHash.cpp: Fast checksums of file contents, kept in an attribute so
+				they don't have to be worked out again
+	Released under the MIT license.
+*/
+
+#include "FileHash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ByteOrder.h>
+#include <Path.h>
+#include <TypeConstants.h>
+
+/*
+	XXH64 goes through memory several times faster than any disk delivers
+	data, so a file can be hashed while it's being copied without slowing
+	the copy down. The same hash is used wherever files are compared.
+
+	The attribute holds the hash, together with the size and modification
+	time of the file it was taken from, all little endian.
+*/
+
+static const uint64 kPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64 kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64 kPrime3 = 0x165667B19E3779F9ULL;
+static const uint64 kPrime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64 kPrime5 = 0x27D4EB2F165667C5ULL;
+
+static const size_t kHashBufferSize = 1024 * 1024;
+
+
+struct FileHashAttr {
+	uint64	hash;
+	int64	size;
+	int64	modified;
+};
+
+
+static inline uint64
+RotateLeft(uint64 value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+
+static inline uint64
+Read64(const uint8* data)
+{
+	uint64 value;
+	memcpy(&value, data, sizeof(value));
+	return B_LENDIAN_TO_HOST_INT64(value);
+}
+
+
+static inline uint32
+Read32(const uint8* data)
+{
+	uint32 value;
+	memcpy(&value, data, sizeof(value));
+	return B_LENDIAN_TO_HOST_INT32(value);
+}
+
+
+static inline uint64
+Round(uint64 accumulator, uint64 input)
+{
+	accumulator += input * kPrime2;
+	accumulator = RotateLeft(accumulator, 31);
+	return accumulator * kPrime1;
+}
+
+
+static inline uint64
+MergeRound(uint64 accumulator, uint64 value)
+{
+	accumulator ^= Round(0, value);
+	return accumulator * kPrime1 + kPrime4;
+}
+
+
+FileHasher::FileHasher(uint64 seed)
+{
+	Reset(seed);
+}
+
+
+void
+FileHasher::Reset(uint64 seed)
+{
+	fSeed = seed;
+	fState[0] = seed + kPrime1 + kPrime2;
+	fState[1] = seed + kPrime2;
+	fState[2] = seed;
+	fState[3] = seed - kPrime1;
+	fBuffered = 0;
+	fLength = 0;
+}
+
+
+void
+FileHasher::Update(const void* data, size_t length)
+{
+	const uint8* input = (const uint8*)data;
+	const uint8* end = input + length;
+	fLength += length;
+
+	if (fBuffered + length < sizeof(fBuffer)) {
+		memcpy(fBuffer + fBuffered, input, length);
+		fBuffered += length;
+		return;
+	}
+
+	if (fBuffered > 0) {
+		size_t fill = sizeof(fBuffer) - fBuffered;
+		memcpy(fBuffer + fBuffered, input, fill);
+		input += fill;
+		for (int i = 0; i < 4; i++)
+			fState[i] = Round(fState[i], Read64(fBuffer + i * 8));
+		fBuffered = 0;
+	}
+
+	// The four lanes are independent of each other, which lets the CPU
+	// work on them side by side
+	uint64 v1 = fState[0];
+	uint64 v2 = fState[1];
+	uint64 v3 = fState[2];
+	uint64 v4 = fState[3];
+	while (input + 32 <= end) {
+		v1 = Round(v1, Read64(input));
+		v2 = Round(v2, Read64(input + 8));
+		v3 = Round(v3, Read64(input + 16));
+		v4 = Round(v4, Read64(input + 24));
+		input += 32;
+	}
+	fState[0] = v1;
+	fState[1] = v2;
+	fState[2] = v3;
+	fState[3] = v4;
+
+	if (input < end) {
+		fBuffered = end - input;
+		memcpy(fBuffer, input, fBuffered);
+	}
+}
+
+
+void
+FileHasher::UpdateZeros(off_t length)
+{
+	static const uint8 zeros[4096] = { 0 };
+
+	while (length > 0) {
+		size_t chunk = length < (off_t)sizeof(zeros) ? length : sizeof(zeros);
+		Update(zeros, chunk);
+		length -= chunk;
+	}
+}
+
+
+uint64
+FileHasher::Digest() const
+{
+	uint64 hash;
+	if (fLength >= 32) {
+		hash = RotateLeft(fState[0], 1) + RotateLeft(fState[1], 7)
+			+ RotateLeft(fState[2], 12) + RotateLeft(fState[3], 18);
+		for (int i = 0; i < 4; i++)
+			hash = MergeRound(hash, fState[i]);
+	} else
+		hash = fSeed + kPrime5;
+
+	hash += fLength;
+
+	const uint8* input = fBuffer;
+	const uint8* end = fBuffer + fBuffered;
+	while (input + 8 <= end) {
+		hash ^= Round(0, Read64(input));
+		hash = RotateLeft(hash, 27) * kPrime1 + kPrime4;
+		input += 8;
+	}
+	if (input + 4 <= end) {
+		hash ^= (uint64)Read32(input) * kPrime1;
+		hash = RotateLeft(hash, 23) * kPrime2 + kPrime3;
+		input += 4;
+	}
+	while (input < end) {
+		hash ^= *input * kPrime5;
+		hash = RotateLeft(hash, 11) * kPrime1;
+		input++;
+	}
+
+	hash ^= hash >> 33;
+	hash *= kPrime2;
+	hash ^= hash >> 29;
+	hash *= kPrime3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+
+status_t
+WriteFileHash(BNode& node, uint64 hash, const struct stat& st)
+{
+	FileHashAttr attr;
+	attr.hash = B_HOST_TO_LENDIAN_INT64(hash);
+	attr.size = B_HOST_TO_LENDIAN_INT64(st.st_size);
+	attr.modified = B_HOST_TO_LENDIAN_INT64(st.st_mtime);
+
+	ssize_t bytes = node.WriteAttr(FILER_HASH_ATTR, B_RAW_TYPE, 0, &attr,
+		sizeof(attr));
+	if (bytes < 0)
+		return bytes;
+	return bytes == sizeof(attr) ? B_OK : B_IO_ERROR;
+}
+
+
+status_t
+ReadFileHash(BNode& node, uint64& hash, const struct stat& st)
+{
+	FileHashAttr attr;
+	ssize_t bytes = node.ReadAttr(FILER_HASH_ATTR, B_RAW_TYPE, 0, &attr,
+		sizeof(attr));
+	if (bytes < 0)
+		return bytes;
+	if (bytes != sizeof(attr)
+		|| B_LENDIAN_TO_HOST_INT64(attr.size) != st.st_size
+		|| B_LENDIAN_TO_HOST_INT64(attr.modified) != st.st_mtime)
+		return B_ENTRY_NOT_FOUND;
+
+	hash = B_LENDIAN_TO_HOST_INT64(attr.hash);
+	return B_OK;
+}
+
+
+status_t
+HashFile(int fd, uint64& hash)
+{
+	char* buffer = (char*)malloc(kHashBufferSize);
+	if (buffer == NULL)
+		return B_NO_MEMORY;
+
+	FileHasher hasher;
+	off_t pos = 0;
+	status_t status = B_OK;
+	for (;;) {
+		ssize_t bytes = pread(fd, buffer, kHashBufferSize, pos);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			status = errno;
+			break;
+		}
+		if (bytes == 0)
+			break;
+
+		hasher.Update(buffer, bytes);
+		pos += bytes;
+	}
+	free(buffer);
+
+	if (status == B_OK)
+		hash = hasher.Digest();
+	return status;
+}
+
+
+status_t
+GetFileHash(const entry_ref& ref, uint64& hash)
+{
+	BPath path(&ref);
+	if (path.InitCheck() != B_OK)
+		return path.InitCheck();
+
+	int fd = open(path.Path(), O_RDONLY);
+	if (fd < 0)
+		return errno;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		status_t status = errno;
+		close(fd);
+		return status;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		return B_BAD_TYPE;
+	}
+
+	BNode node(&ref);
+	if (node.InitCheck() == B_OK && ReadFileHash(node, hash, st) == B_OK) {
+		close(fd);
+		return B_OK;
+	}
+
+	status_t status = HashFile(fd, hash);
+	close(fd);
+	return status;
+}
@@ -0,0 +1,48 @@
+/*
+	FileHash.h: Fast checksums of file contents, kept in an attribute so
+				they don't have to be worked out again
+	Released under the MIT license.
+*/
+
+#ifndef FILE_HASH_H
+#define FILE_HASH_H
+
+#include <sys/stat.h>
+
+#include <Entry.h>
+#include <Node.h>
+#include <SupportDefs.h>
+
+#define FILER_HASH_ATTR "Filer:xxh64"
+
+// Streaming XXH64, see https://github.com/Cyan4973/xxHash
+class FileHasher
+{
+public:
+							FileHasher(uint64 seed = 0);
+
+			void			Reset(uint64 seed = 0);
+			void			Update(const void* data, size_t length);
+			void			UpdateZeros(off_t length);
+			uint64			Digest() const;
+
+private:
+			uint64			fState[4];
+			uint8			fBuffer[32];
+			uint32			fBuffered;
+			uint64			fLength;
+			uint64			fSeed;
+};
+
+// The hash is only taken from the attribute as long as size and
+// modification time of the file are still the same
+status_t	WriteFileHash(BNode& node, uint64 hash, const struct stat& st);
+status_t	ReadFileHash(BNode& node, uint64& hash, const struct stat& st);
+
+// Reads the file only if there's no valid hash stored with it yet. The hash
+// isn't stored, as that would change the status time of the file, which
+// makes it look changed to the catch-up scans.
+status_t	GetFileHash(const entry_ref& ref, uint64& hash);
+status_t	HashFile(int fd, uint64& hash);
+
+#endif	// FILE_HASH_H
@@ -11,12 +11,15 @@
 
 static const char*	kDoAll = "all";
 static const char*	kReplace = "rpl";
+static const char*	kKeepBoth = "kpb";
 static const char*	kPointer = "ptr";
 static const char*	kEnDash = "\xE2\x80\x93";
 static const char*	kFilerSignature = "application/x-vnd.dw-Filer";
 static const char*	kAutoFilerSignature = "application/x-vnd.dw-AutoFiler";
 static const char	kSettingsFolder[] = "Filer";
 static const char	kSettingsFile[] = "Filer_settings";
+static const char	kRulesFile[] = "FilerRules";
+static const char	kRuleSetsFile[] = "FilerRuleSets";
 
 #define MSG_AUTO_FILER			'auto'
 
@@ -60,6 +63,20 @@ static const char	kSettingsFile[] = "Filer_settings";
 #define MSG_FOLDER_SELECTED		'flsl'
 #define MSG_FOLDER_CHOSEN		'flch'
 #define MSG_REFRESH_FOLDERS		'flrf'
+#define MSG_RELOAD_RULES		'rlrl'
+#define MSG_CHECK_SETTLED		'stld'
+#define MSG_FILING_DONE			'fldn'
+#define MSG_QUEUE_FILLED		'qfil'
+#define MSG_CHECK_IDLE			'idle'
+#define MSG_GET_STATUS			'gsts'
+#define MSG_CHECK_SWEEPS		'swck'
+#define MSG_SWEPT				'swpt'
+#define MSG_WATCH_EVENT			'wevt'
+#define MSG_REPLAY_DONE			'rpdn'
+#define MSG_FOLDERS_FOUND		'flfd'
+#define MSG_CAUGHT_UP			'cgup'
+#define MSG_SAVE_MARKS			'svmk'
+#define MSG_FILES_OFFLINE		'flof'
 
 #define MSG_ACTION_CHOSEN		'acch'
 #define MSG_ACTION_PANEL		'acpn'
@@ -11,17 +11,25 @@
 
 #include "FilerRule.h"
 
+#include "PatternProcessor.h"
+#include "RegexMatcher.h"
+#include "RuleRunner.h"
+
 static int64 sIDCounter = 0;
 
 FilerRule::FilerRule()
 	:
 	fTestList(NULL),
+	fMatcherList(NULL),
  	fActionList(NULL),
+	fTemplateList(NULL),
 	fMode(FILER_RULE_ALL),
 	fDisabled(false)
 {
 	fTestList = new BObjectList<BMessage>(20, true);
+	fMatcherList = new BObjectList<RegexMatcher>(20, true);
 	fActionList = new BObjectList<BMessage>(20, true);
+	fTemplateList = new BObjectList<PatternTemplate>(20, true);
 
 	fID = sIDCounter++;
 }
@@ -30,12 +38,16 @@ FilerRule::FilerRule()
 FilerRule::FilerRule(FilerRule& rule)
 	:
 	fTestList(NULL),
+	fMatcherList(NULL),
  	fActionList(NULL),
+	fTemplateList(NULL),
 	fMode(FILER_RULE_ALL),
 	fDisabled(false)
 {
 	fTestList = new BObjectList<BMessage>(20, true);
+	fMatcherList = new BObjectList<RegexMatcher>(20, true);
 	fActionList = new BObjectList<BMessage>(20, true);
+	fTemplateList = new BObjectList<PatternTemplate>(20, true);
 
 	fID = sIDCounter++;
 
@@ -46,7 +58,9 @@ FilerRule::FilerRule(FilerRule& rule)
 FilerRule::FilerRule(BMessage* data)
 {
 	fTestList = new BObjectList<BMessage>(20, true);
+	fMatcherList = new BObjectList<RegexMatcher>(20, true);
 	fActionList = new BObjectList<BMessage>(20, true);
+	fTemplateList = new BObjectList<PatternTemplate>(20, true);
 
 	fDisabled = data->GetBool("_disabled", true);
 	data->FindString("_desc", &fDescription);
@@ -57,11 +71,11 @@ FilerRule::FilerRule(BMessage* data)
 
 	BMessage test;
 	for (int i = 0; data->FindMessage("test", i, &test) == B_OK; i++)
-		fTestList->AddItem(new BMessage(test));
+		AddTest(new BMessage(test));
 
 	BMessage action;
 	for (int i = 0; data->FindMessage("action", i, &action) == B_OK; i++)
-		fActionList->AddItem(new BMessage(action));
+		AddAction(new BMessage(action));
 
 	fID = sIDCounter++;
 }
@@ -70,7 +84,9 @@ FilerRule::FilerRule(BMessage* data)
 FilerRule::~FilerRule()
 {
 	delete fTestList;
+	delete fMatcherList;
 	delete fActionList;
+	delete fTemplateList;
 }
 
 
@@ -125,16 +141,25 @@ FilerRule::SetDescription(const char* desc)
 void
 FilerRule::AddTest(BMessage* item, const int32& index)
 {
-	if (index < 0)
+	RegexMatcher* matcher = NULL;
+	int8 mode = item->GetInt8("mode", -1);
+	if (mode == MODE_MATCH || mode == MODE_NOMATCH)
+		matcher = new RegexMatcher(item->GetString("value", ""));
+
+	if (index < 0) {
 		fTestList->AddItem(item);
-	else
+		fMatcherList->AddItem(matcher);
+	} else {
 		fTestList->AddItem(item, index);
+		fMatcherList->AddItem(matcher, index);
+	}
 }
 
 
 BMessage*
 FilerRule::RemoveTest(const int32& index)
 {
+	delete fMatcherList->RemoveItemAt(index);
 	return fTestList->RemoveItemAt(index);
 }
 
@@ -153,19 +178,33 @@ FilerRule::CountTests() const
 }
 
 
+const RegexMatcher*
+FilerRule::TestMatcherAt(const int32& index) const
+{
+	return fMatcherList->ItemAt(index);
+}
+
+
 void
 FilerRule::AddAction(BMessage* item, const int32& index)
 {
-	if (index < 0)
+	PatternTemplate* pattern = new PatternTemplate(
+		item->GetString("value", ""));
+
+	if (index < 0) {
 		fActionList->AddItem(item);
-	else
+		fTemplateList->AddItem(pattern);
+	} else {
 		fActionList->AddItem(item, index);
+		fTemplateList->AddItem(pattern, index);
+	}
 }
 
 
 BMessage*
 FilerRule::RemoveAction(const int32& index)
 {
+	delete fTemplateList->RemoveItemAt(index);
 	return fActionList->RemoveItemAt(index);
 }
 
@@ -184,11 +223,20 @@ FilerRule::CountActions() const
 }
 
 
+const PatternTemplate*
+FilerRule::ActionTemplateAt(const int32& index) const
+{
+	return fTemplateList->ItemAt(index);
+}
+
+
 void
 FilerRule::MakeEmpty()
 {
 	fTestList->MakeEmpty();
+	fMatcherList->MakeEmpty();
 	fActionList->MakeEmpty();
+	fTemplateList->MakeEmpty();
 }
 
 
@@ -19,6 +19,9 @@
 
 #include "ObjectList.h"
 
+class PatternTemplate;
+class RegexMatcher;
+
 typedef enum
 {
 	FILER_RULE_ALL = 0,
@@ -47,11 +50,15 @@ public:
 			BMessage*			RemoveTest(const int32& index);
 			BMessage*			TestAt(const int32& index);
 			int32				CountTests() const;
+	// The regular expression of a test that has one, compiled once
+			const RegexMatcher*	TestMatcherAt(const int32& index) const;
 
 			void				AddAction(BMessage* action, const int32& index = -1);
 			BMessage*			RemoveAction(const int32& index);
 			BMessage*			ActionAt(const int32& index);
 			int32				CountActions() const;
+	// The action's value, taken apart once for expanding it for every file
+			const PatternTemplate* ActionTemplateAt(const int32& index) const;
 
 			void				MakeEmpty();
 	virtual	void				PrintToStream();
@@ -64,7 +71,9 @@ public:
 
 private:
 	BObjectList<BMessage>*		fTestList;
+	BObjectList<RegexMatcher>*	fMatcherList;
 	BObjectList<BMessage>*		fActionList;
+	BObjectList<PatternTemplate>* fTemplateList;
 	filer_rule_mode				fMode;
 	BString						fDescription;
 	int64						fID;
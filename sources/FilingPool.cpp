@@ -0,0 +1,609 @@
+/*
+	FilingPool.cpp: The AutoFiler's threads running the rules on the files
+				turning up in the watched folders
+	Released under the MIT license.
+*/
+
+#include "FilingPool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <Application.h>
+#include <Directory.h>
+#include <Entry.h>
+#include <MessageRunner.h>
+#include <NodeMonitor.h>
+#include <OS.h>
+#include <Path.h>
+#include <Volume.h>
+
+#include "EventQueue.h"
+#include "FilerDefs.h"
+#include "FilingStats.h"
+#include "RefStorage.h"
+#include "RuleEngine.h"
+#include "RuleRunner.h"
+#include "WorkQueue.h"
+
+/*
+	The looper only hands out the files, the workers file them. Files
+	written to the EventQueue are announced by MSG_QUEUE_FILLED, and read
+	from it as long as there's room in the WorkQueue. Those that aren't
+	come as B_REFS_RECEIVED, and are kept aside while there's no room, as
+	the looper never waits for it. With "filingworkers" in the Filer settings,
+	that many workers file side by side, or one per CPU with 0. Files of one
+	folder are still filed one after the other, in the order they arrived.
+
+	Files sent by other applications are filed first, then the small ones
+	that were just changed, and then the rest, like those caught up on.
+	Each file waits for the Throttle, unless it was sent. With "idleonly",
+	files going to be copied or archived are put back until the system is
+	idle.
+
+	As long as more files are waiting, they make up one batch, so shell
+	commands using %FILES% get all of them at once. The batch ends once no
+	worker has anything left to do. Files are only taken from the queue
+	once their batch is done.
+
+	The rules are watched, and loaded again a moment after the Filer saved
+	them, which usually takes more than one write.
+*/
+
+// How long to wait for the rules to be saved completely
+static const bigtime_t kReloadDelay = 500000;
+
+// "Do this for all files" only holds for files arriving in one go
+static const bigtime_t kDoAllTimeout = 1000000;
+
+// How many files are read from the queue at a time, how many the workers
+// may have waiting, and after how many a batch ends even if more are waiting
+static const int32 kReadAhead = 32;
+static const int32 kWorkCapacity = 256;
+static const int32 kMaxBatch = 256;
+
+// Files changed longer ago are filed with the bulk, in seconds
+static const time_t kRecentlyChanged = 60;
+
+// How often the system is checked for being idle, and how often a waiting
+// worker checks whether the AutoFiler is quitting
+static const bigtime_t kIdleCheckInterval = 1000000;
+static const bigtime_t kThrottleSlice = 100000;
+
+
+// Files in subfolders share the choices made for the watched folder above
+static node_ref
+WatchedFolderOf(const entry_ref& ref)
+{
+	node_ref node(ref.device, ref.directory);
+	for (;;) {
+		gFolders.ReadLock();
+		bool watched = gFolders.Find(node) != NULL;
+		gFolders.ReadUnlock();
+		if (watched)
+			return node;
+
+		BDirectory directory(&node);
+		BEntry entry;
+		BEntry parent;
+		if (directory.InitCheck() != B_OK || directory.IsRootDirectory()
+			|| directory.GetEntry(&entry) != B_OK
+			|| entry.GetParent(&parent) != B_OK
+			|| parent.GetNodeRef(&node) != B_OK)
+			return node_ref();
+	}
+}
+
+
+FilingPool::FilingPool(RuleEngine& engine, EventQueue* queue,
+	FilingStats* stats)
+	:
+	BLooper("filing pool"),
+	fEngine(engine),
+	fQueue(queue),
+	fStats(stats),
+	fWork(NULL),
+	fOverflow(20, true),
+	fIdleRunner(NULL),
+	fThreads(NULL),
+	fThreadCount(0),
+	fInBatch(0),
+	fFiledInBatch(0),
+	fWaitingForRoom(0),
+	fThrottled(0),
+	fReloadPending(false)
+{
+	pthread_rwlock_init(&fBatchLock, NULL);
+	fThrottle.LoadSettings();
+
+	int32 workers;
+	BMessage settings;
+	if (RuleEngine::ReadSettings(settings) != B_OK
+		|| settings.FindInt32("filingworkers", &workers) != B_OK)
+		workers = 1;
+
+	if (workers <= 0) {
+		system_info info;
+		get_system_info(&info);
+		workers = info.cpu_count;
+	}
+
+	fWork = new WorkQueue(kWorkCapacity, workers);
+	fThreads = new thread_id[workers];
+	for (int32 i = 0; i < workers; i++) {
+		fThreads[fThreadCount] = spawn_thread(_WorkerThread, "filing worker",
+			B_NORMAL_PRIORITY, this);
+		if (fThreads[fThreadCount] >= 0
+			&& resume_thread(fThreads[fThreadCount]) == B_OK)
+			fThreadCount++;
+	}
+
+	if (fThreadCount == 0)
+		printf("Couldn't start the filing workers\n");
+
+	_WatchRules();
+	_UpdateIdleCheck();
+}
+
+
+FilingPool::~FilingPool()
+{
+	stop_watching(this);
+	delete fIdleRunner;
+
+	// What the workers took is filed, the rest stays in the EventQueue
+	fWork->Close();
+	for (int32 i = 0; i < fThreadCount; i++) {
+		status_t exitValue;
+		wait_for_thread(fThreads[i], &exitValue);
+	}
+	_EndBatch();
+	_KeepRemaining();
+
+	delete[] fThreads;
+	delete fWork;
+	pthread_rwlock_destroy(&fBatchLock);
+}
+
+
+void
+FilingPool::MessageReceived(BMessage* message)
+{
+	switch (message->what) {
+		case B_REFS_RECEIVED:
+		{
+			// These aren't anywhere else, so they're kept until there's
+			// room, after those kept already
+			int32 priority;
+			if (message->FindInt32("priority", &priority) != B_OK)
+				priority = -1;
+			const char* ruleSet = message->GetString("ruleset", NULL);
+
+			entry_ref ref;
+			for (int32 i = 0; message->FindRef("refs", i, &ref) == B_OK;
+					i++) {
+				FilingJob* job = new FilingJob;
+				job->ref = ref;
+				job->ticket = -1;
+				job->priority = priority >= 0 ? priority : _PriorityOf(ref);
+				job->ruleSet = ruleSet;
+				if (message->FindInt64("when", i, &job->seen) != B_OK)
+					job->seen = 0;
+				fOverflow.AddItem(job);
+			}
+
+			_FeedOverflow();
+			break;
+		}
+
+		case MSG_QUEUE_FILLED:
+			_FeedQueued();
+			break;
+
+		case MSG_RELOAD_RULES:
+			fReloadPending = false;
+			fEngine.LoadSettings();
+			fThrottle.LoadSettings();
+			_UpdateIdleCheck();
+			if (fEngine.LoadRules() == B_OK)
+				printf("Loaded the changed rules\n");
+			break;
+
+		case MSG_CHECK_IDLE:
+			fWork->SetSystemIdle(fThrottle.IsSystemIdle());
+			break;
+
+		case B_NODE_MONITOR:
+			_RulesChanged(message);
+			break;
+
+		default:
+			BLooper::MessageReceived(message);
+			break;
+	}
+}
+
+
+void
+FilingPool::GetStatus(BMessage& status)
+{
+	status.AddInt32("pending", fQueue != NULL ? fQueue->CountPending() : 0);
+	status.AddInt32("waiting", fWork->CountQueued());
+	status.AddInt32("deferred", fWork->CountDeferred());
+	status.AddInt32("throttled", atomic_get(&fThrottled));
+	status.AddInt32("workers", fThreadCount);
+}
+
+
+int32
+FilingPool::_PriorityOf(const entry_ref& ref)
+{
+	struct stat st;
+	if (BEntry(&ref).GetStat(&st) != B_OK)
+		return PRIORITY_NORMAL;
+
+	time_t changed = max_c(st.st_mtime, st.st_ctime);
+	if (st.st_size >= fThrottle.BulkSize()
+		|| time(NULL) - changed > kRecentlyChanged)
+		return PRIORITY_BULK;
+
+	return PRIORITY_NORMAL;
+}
+
+
+void
+FilingPool::_FeedQueued()
+{
+	if (!_FeedOverflow() || fQueue == NULL)
+		return;
+
+	int32 room = fWork->CountFree();
+	if (room == 0) {
+		_WaitForRoom();
+		return;
+	}
+
+	int32 max = min_c(room, kReadAhead);
+	BObjectList<entry_ref> refs(max, true);
+	BStringList ruleSets;
+	bigtime_t seen[kReadAhead];
+	int64 ticket;
+	int32 count = fQueue->Read(refs, max, &ticket, &ruleSets, seen);
+
+	for (int32 i = 0; i < count; i++) {
+		const entry_ref& ref = *refs.ItemAt(i);
+		BString ruleSet = ruleSets.StringAt(i);
+		fWork->Push(ref, ticket + i, _PriorityOf(ref), false,
+			ruleSet.IsEmpty() ? NULL : ruleSet.String(), seen[i]);
+	}
+
+	// There may be more
+	if (count == max)
+		PostMessage(MSG_QUEUE_FILLED);
+}
+
+
+// Returns false if not all of them fit
+bool
+FilingPool::_FeedOverflow()
+{
+	int32 count = fOverflow.CountItems();
+	int32 pushed = 0;
+	status_t status = B_OK;
+	while (pushed < count) {
+		const FilingJob* job = fOverflow.ItemAt(pushed);
+		status = fWork->Push(job->ref, -1, job->priority, false,
+			_RuleSetOf(*job), job->seen);
+		if (status == B_WOULD_BLOCK)
+			break;
+		pushed++;
+	}
+
+	// The rest moves up in one go
+	for (int32 i = 0; i < pushed; i++)
+		delete fOverflow.ItemAt(i);
+	for (int32 i = pushed; i < count; i++)
+		fOverflow.SwapWithItem(i - pushed, fOverflow.ItemAt(i));
+	while (fOverflow.CountItems() > count - pushed)
+		fOverflow.RemoveItemAt(fOverflow.CountItems() - 1);
+
+	if (status != B_WOULD_BLOCK)
+		return true;
+
+	_WaitForRoom();
+	return false;
+}
+
+
+void
+FilingPool::_WaitForRoom()
+{
+	// The next worker taking a file lets us know. It may have done so
+	// already.
+	atomic_set(&fWaitingForRoom, 1);
+	if (fWork->CountFree() > 0 && atomic_and(&fWaitingForRoom, 0) != 0)
+		PostMessage(MSG_QUEUE_FILLED);
+}
+
+
+void
+FilingPool::_Work()
+{
+	bigtime_t lastFiled = 0;
+
+	FilingJob job;
+	while (fWork->Pop(job) == B_OK) {
+		node_ref folder = WatchedFolderOf(job.ref);
+
+		if (job.priority != PRIORITY_INTERACTIVE) {
+			// Heavy files only go once the system is idle, which Pop() takes
+			// care of after the first time
+			if (fThrottle.IdleOnly() && !job.heavy
+				&& fEngine.IsHeavy(job.ref, folder, _RuleSetOf(job))) {
+				job.heavy = true;
+				fWork->Defer(job);
+				if (atomic_and(&fWaitingForRoom, 0) != 0)
+					PostMessage(MSG_QUEUE_FILLED);
+				if (fWork->IsIdle())
+					_EndBatch();
+				continue;
+			}
+
+			// When quitting, it's left for the next time
+			if (!_Throttle(job, folder)) {
+				fWork->PutBack(job);
+				fWork->Done(job);
+				continue;
+			}
+		}
+
+		pthread_rwlock_rdlock(&fBatchLock);
+
+		if (atomic_test_and_set(&fInBatch, 1, 0) == 0)
+			fEngine.BeginBatch();
+
+		int32 filed = atomic_get(&fFiledInBatch);
+		if (_FileRef(job, folder, lastFiled))
+			filed = atomic_add(&fFiledInBatch, 1) + 1;
+		else {
+			// The AutoFiler puts their folders aside with their marks
+			// before it counts them as done
+			BMessage offline(MSG_FILES_OFFLINE);
+			offline.AddInt32("device", job.ref.device);
+			offline.AddInt32("count", 1);
+			be_app->PostMessage(&offline);
+		}
+		if (job.ticket >= 0 && fQueue != NULL)
+			fQueue->Done(job.ticket);
+
+		pthread_rwlock_unlock(&fBatchLock);
+
+		fWork->Done(job);
+		if (atomic_and(&fWaitingForRoom, 0) != 0)
+			PostMessage(MSG_QUEUE_FILLED);
+
+		if (filed >= kMaxBatch || fWork->IsIdle())
+			_EndBatch();
+	}
+}
+
+
+const char*
+FilingPool::_RuleSetOf(const FilingJob& job)
+{
+	return job.ruleSet.IsEmpty() ? NULL : job.ruleSet.String();
+}
+
+
+bool
+FilingPool::_Throttle(const FilingJob& job, const node_ref& folder)
+{
+	off_t size;
+	if (BEntry(&job.ref).GetSize(&size) != B_OK)
+		size = 0;
+
+	bigtime_t wait = fThrottle.Reserve(folder, size);
+	if (wait <= 0)
+		return true;
+
+	if (atomic_add(&fThrottled, 1) == 0)
+		printf("\tThrottling the filing\n");
+
+	bigtime_t until = system_time() + wait;
+	bool closed = false;
+	while (!closed && system_time() < until) {
+		snooze(min_c(until - system_time(), kThrottleSlice));
+		closed = fWork->IsClosed();
+	}
+
+	atomic_add(&fThrottled, -1);
+	return !closed;
+}
+
+
+// Returns false if the file's volume was unmounted
+bool
+FilingPool::_FileRef(const FilingJob& job, const node_ref& folder,
+	bigtime_t& lastFiled)
+{
+	// Files on a volume that was unmounted are caught up on once it's
+	// back, as their watched folder keeps its mark
+	if (BVolume(job.ref.device).InitCheck() != B_OK)
+		return false;
+
+	// Each watched folder remembers what the user chose for conflicts
+	ConflictChoice conflicts;
+	bool timedOut = system_time() - lastFiled > kDoAllTimeout;
+
+	gFolders.ReadLock();
+	RefStorage* refholder = gFolders.Find(folder);
+	if (refholder != NULL) {
+		conflicts.doAll = refholder->doAll && !timedOut;
+		conflicts.replace = refholder->replace;
+		conflicts.keepBoth = refholder->keepBoth;
+	}
+	gFolders.ReadUnlock();
+
+	BObjectList<RuleOutcome> outcomes(4, true);
+	bigtime_t started = system_time();
+	bigtime_t startedReal = real_time_clock_usecs();
+	fEngine.FileRef(job.ref, conflicts, folder, _RuleSetOf(job),
+		fStats != NULL ? &outcomes : NULL);
+	lastFiled = system_time();
+
+	// Files whose event isn't known waited since they were handed over
+	if (fStats != NULL) {
+		bigtime_t waited = job.seen > 0
+			? startedReal - job.seen : started - job.queued;
+		fStats->Filed(job.ref, folder, outcomes, waited, lastFiled - started);
+	}
+
+	// The folders may have been reloaded in the meantime
+	gFolders.WriteLock();
+	refholder = gFolders.Find(folder);
+	if (refholder != NULL) {
+		refholder->doAll = conflicts.doAll;
+		refholder->replace = conflicts.replace;
+		refholder->keepBoth = conflicts.keepBoth;
+	}
+	gFolders.WriteUnlock();
+	return true;
+}
+
+
+void
+FilingPool::_EndBatch()
+{
+	// Waits for the files being filed, and keeps the workers from starting
+	// on others until the batch is done
+	pthread_rwlock_wrlock(&fBatchLock);
+
+	if (fInBatch != 0) {
+		fEngine.EndBatch();
+
+		// The files are done with, including their batched shell commands
+		if (fQueue != NULL)
+			fQueue->Acknowledge();
+
+		// Lets the AutoFiler know once everything it handed over is done
+		BMessage done(MSG_FILING_DONE);
+		done.AddInt32("count", fFiledInBatch);
+		be_app->PostMessage(&done);
+
+		fFiledInBatch = 0;
+		fInBatch = 0;
+	}
+
+	pthread_rwlock_unlock(&fBatchLock);
+}
+
+
+// The files that were sent, rather than queued, are written to the
+// EventQueue, so they're filed next time
+void
+FilingPool::_KeepRemaining()
+{
+	BObjectList<FilingJob> remaining(20, true);
+	fWork->TakeRemaining(remaining);
+
+	int32 kept = 0;
+	int32 lost = 0;
+	for (int32 i = 0; i < remaining.CountItems() + fOverflow.CountItems();
+			i++) {
+		const FilingJob* job = i < remaining.CountItems()
+			? remaining.ItemAt(i)
+			: fOverflow.ItemAt(i - remaining.CountItems());
+		if (job->ticket >= 0)
+			continue;
+
+		if (fQueue != NULL
+			&& fQueue->Append(job->ref, _RuleSetOf(*job), job->seen) == B_OK)
+			kept++;
+		else
+			lost++;
+	}
+
+	if (kept > 0 && fQueue->Flush() != B_OK)
+		lost += kept;
+	if (lost > 0)
+		printf("\tCouldn't keep %" B_PRId32 " files for the next time\n", lost);
+}
+
+
+void
+FilingPool::_WatchRules()
+{
+	stop_watching(this);
+
+	BPath path;
+	if (RuleEngine::GetSettingsPath(path) != B_OK)
+		return;
+
+	// The folder, for the files being replaced or created, and the files,
+	// for being written to
+	node_ref nodeRef;
+	if (BEntry(path.Path()).GetNodeRef(&nodeRef) == B_OK)
+		watch_node(&nodeRef, B_WATCH_DIRECTORY, this);
+
+	const char* names[] = { kRulesFile, kRuleSetsFile, kSettingsFile };
+	for (int32 i = 0; i < 3; i++) {
+		BPath file(path.Path(), names[i]);
+		if (BEntry(file.Path()).GetNodeRef(&nodeRef) == B_OK)
+			watch_node(&nodeRef, B_WATCH_STAT, this);
+	}
+}
+
+
+void
+FilingPool::_RulesChanged(BMessage* message)
+{
+	int32 opcode;
+	if (message->FindInt32("opcode", &opcode) != B_OK)
+		return;
+
+	if (opcode != B_STAT_CHANGED) {
+		const char* name;
+		if (message->FindString("name", &name) != B_OK
+			|| (strcmp(name, kRulesFile) != 0
+				&& strcmp(name, kRuleSetsFile) != 0
+				&& strcmp(name, kSettingsFile) != 0))
+			return;
+
+		_WatchRules();
+	}
+
+	if (fReloadPending)
+		return;
+
+	BMessage reload(MSG_RELOAD_RULES);
+	BMessageRunner::StartSending(BMessenger(this), &reload, kReloadDelay, 1);
+	fReloadPending = true;
+}
+
+
+void
+FilingPool::_UpdateIdleCheck()
+{
+	if (!fThrottle.IdleOnly()) {
+		delete fIdleRunner;
+		fIdleRunner = NULL;
+		fWork->SetSystemIdle(true);
+		return;
+	}
+
+	if (fIdleRunner == NULL) {
+		fWork->SetSystemIdle(false);
+		BMessage check(MSG_CHECK_IDLE);
+		fIdleRunner = new BMessageRunner(BMessenger(this), &check,
+			kIdleCheckInterval);
+	}
+}
+
+
+status_t
+FilingPool::_WorkerThread(void* data)
+{
+	((FilingPool*)data)->_Work();
+	return B_OK;
+}
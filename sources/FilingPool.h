@@ -0,0 +1,77 @@
+/*
+	FilingPool.h: The AutoFiler's threads running the rules on the files
+				turning up in the watched folders
+	Released under the MIT license.
+*/
+
+#ifndef FILING_POOL_H
+#define FILING_POOL_H
+
+#include <pthread.h>
+
+#include <Entry.h>
+#include <Looper.h>
+
+#include "ObjectList.h"
+#include "Throttle.h"
+
+class BMessageRunner;
+class EventQueue;
+class FilingStats;
+class RuleEngine;
+class WorkQueue;
+struct FilingJob;
+
+class FilingPool : public BLooper
+{
+public:
+							FilingPool(RuleEngine& engine,
+								EventQueue* queue = NULL,
+								FilingStats* stats = NULL);
+	// Lets the workers finish the files they were handed
+							~FilingPool();
+
+	virtual	void			MessageReceived(BMessage* message);
+
+	// How many files are waiting, and whether they're held back
+			void			GetStatus(BMessage& status);
+
+private:
+			int32			_PriorityOf(const entry_ref& ref);
+			void			_FeedQueued();
+			bool			_FeedOverflow();
+			void			_WaitForRoom();
+			void			_Work();
+	static	const char*		_RuleSetOf(const FilingJob& job);
+			bool			_Throttle(const FilingJob& job,
+								const node_ref& folder);
+			bool			_FileRef(const FilingJob& job,
+								const node_ref& folder, bigtime_t& lastFiled);
+			void			_EndBatch();
+			void			_KeepRemaining();
+			void			_WatchRules();
+			void			_RulesChanged(BMessage* message);
+			void			_UpdateIdleCheck();
+
+	static	status_t		_WorkerThread(void* data);
+
+			RuleEngine&		fEngine;
+			EventQueue*		fQueue;
+			FilingStats*	fStats;
+			WorkQueue*		fWork;
+			// Files sent that didn't fit into fWork yet
+			BObjectList<FilingJob> fOverflow;
+			Throttle		fThrottle;
+			BMessageRunner*	fIdleRunner;
+			thread_id*		fThreads;
+			int32			fThreadCount;
+
+			pthread_rwlock_t fBatchLock;
+			int32			fInBatch;
+			int32			fFiledInBatch;
+			int32			fWaitingForRoom;
+			int32			fThrottled;
+			bool			fReloadPending;
+};
+
+#endif	// FILING_POOL_H
@@ -0,0 +1,399 @@
+/*
+	FilingStats.cpp: Counts what the AutoFiler does, and how long it takes
+	Released under the MIT license.
+*/
+
+#include "FilingStats.h"
+
+#include <string.h>
+
+#include <Autolock.h>
+#include <Directory.h>
+#include <Entry.h>
+#include <OS.h>
+#include <Path.h>
+
+#include "RefStorage.h"
+#include "RuleEngine.h"
+
+/*
+	The stats are kept since the AutoFiler started. Besides the totals
+	there are the files filed per second over the last minute, the
+	percentiles of how long files waited to be filed and how long filing
+	them took, the counts of each watched folder and each rule, and the
+	last errors the actions ran into.
+
+	A file is filed once it went through the rules, matched once one of
+	them passed its tests, and failed if the actions of one of them did.
+
+	The workers count their files while the stats are read, so the paths
+	of the folders are looked up after letting go of the lock, from the
+	watched folders where possible.
+*/
+
+// Each power of two is split into this many buckets
+static const int32 kSubBucketBits = 4;
+static const int32 kSubBuckets = 1 << kSubBucketBits;
+// Enough for more than a day, in microseconds
+static const int32 kMaxExponent = 40;
+static const int32 kBucketCount
+	= (kMaxExponent - kSubBucketBits + 2) * kSubBuckets;
+
+// The files per second are taken over this many seconds
+static const int32 kRateSeconds = 60;
+
+static const int32 kMaxErrors = 20;
+
+struct FolderCounts {
+	node_ref	folder;
+	int64		filed;
+	int64		matched;
+	int64		failed;
+};
+
+struct RuleCounts {
+	BString		rule;
+	int64		matched;
+	int64		failed;
+};
+
+struct RecentError {
+	time_t		when;
+	BString		path;
+	BString		rule;
+	status_t	status;
+};
+
+
+LatencyHistogram::LatencyHistogram()
+	:
+	fBuckets(new int64[kBucketCount]),
+	fCount(0),
+	fSum(0),
+	fMax(0)
+{
+	memset(fBuckets, 0, kBucketCount * sizeof(int64));
+}
+
+
+LatencyHistogram::~LatencyHistogram()
+{
+	delete[] fBuckets;
+}
+
+
+void
+LatencyHistogram::Record(bigtime_t latency)
+{
+	if (latency < 0)
+		latency = 0;
+
+	fBuckets[_BucketOf(latency)]++;
+	fCount++;
+	fSum += latency;
+	if (latency > fMax)
+		fMax = latency;
+}
+
+
+bigtime_t
+LatencyHistogram::Percentile(double share) const
+{
+	if (fCount == 0)
+		return 0;
+
+	int64 wanted = (int64)(share * fCount + 0.5);
+	if (wanted < 1)
+		wanted = 1;
+
+	int64 seen = 0;
+	for (int32 i = 0; i < kBucketCount; i++) {
+		seen += fBuckets[i];
+		if (seen >= wanted)
+			return min_c(_HighestIn(i), fMax);
+	}
+	return fMax;
+}
+
+
+void
+LatencyHistogram::Archive(BMessage& into) const
+{
+	into.AddInt64("count", fCount);
+	into.AddInt64("mean", fCount > 0 ? fSum / fCount : 0);
+	into.AddInt64("p50", Percentile(0.5));
+	into.AddInt64("p90", Percentile(0.9));
+	into.AddInt64("p99", Percentile(0.99));
+	into.AddInt64("p999", Percentile(0.999));
+	into.AddInt64("max", fMax);
+
+	// Each bucket by the highest value in it
+	for (int32 i = 0; i < kBucketCount; i++) {
+		if (fBuckets[i] == 0)
+			continue;
+		into.AddInt64("bucket", _HighestIn(i));
+		into.AddInt64("bucket count", fBuckets[i]);
+	}
+}
+
+
+int32
+LatencyHistogram::_BucketOf(bigtime_t value)
+{
+	if (value < kSubBuckets)
+		return value;
+
+	int32 exponent = 0;
+	for (bigtime_t rest = value; rest > 1; rest >>= 1)
+		exponent++;
+	if (exponent > kMaxExponent)
+		return kBucketCount - 1;
+
+	// The bits below the highest one pick the bucket
+	int32 shift = exponent - kSubBucketBits;
+	return (shift + 1) * kSubBuckets + (value >> shift) - kSubBuckets;
+}
+
+
+bigtime_t
+LatencyHistogram::_HighestIn(int32 bucket)
+{
+	if (bucket < kSubBuckets)
+		return bucket;
+
+	int32 shift = bucket / kSubBuckets - 1;
+	bigtime_t first = (bigtime_t)(bucket % kSubBuckets + kSubBuckets) << shift;
+	return first + ((bigtime_t)1 << shift) - 1;
+}
+
+
+FilingStats::FilingStats()
+	:
+	fLock("filing stats"),
+	fStarted(real_time_clock()),
+	fEvents(0),
+	fFiled(0),
+	fMatched(0),
+	fFailed(0),
+	fPerSecond(new int32[kRateSeconds]),
+	fLastSecond(0),
+	fFolders(20, true),
+	fRules(20, true),
+	fErrors(kMaxErrors, true)
+{
+	memset(fPerSecond, 0, kRateSeconds * sizeof(int32));
+}
+
+
+FilingStats::~FilingStats()
+{
+	delete[] fPerSecond;
+}
+
+
+void
+FilingStats::EventsReceived(int32 count)
+{
+	BAutolock _(fLock);
+	fEvents += count;
+}
+
+
+void
+FilingStats::Filed(const entry_ref& ref, const node_ref& folder,
+	const BObjectList<RuleOutcome>& outcomes, bigtime_t latency,
+	bigtime_t time)
+{
+	// Looked up before taking the lock, like the folders' paths
+	BString errorPath;
+	for (int32 i = 0; i < outcomes.CountItems(); i++) {
+		if (outcomes.ItemAt(i)->status < B_OK) {
+			BPath path(&ref);
+			errorPath = path.Path() != NULL ? path.Path() : ref.name;
+			break;
+		}
+	}
+
+	BAutolock _(fLock);
+
+	bool matched = outcomes.CountItems() > 0;
+	bool failed = false;
+
+	for (int32 i = 0; i < outcomes.CountItems(); i++) {
+		const RuleOutcome* outcome = outcomes.ItemAt(i);
+		RuleCounts* rule = _RuleCountsFor(outcome->rule);
+		rule->matched++;
+		if (outcome->status >= B_OK)
+			continue;
+
+		rule->failed++;
+		failed = true;
+
+		if (fErrors.CountItems() == kMaxErrors)
+			delete fErrors.RemoveItemAt(0);
+
+		RecentError* error = new RecentError;
+		error->when = real_time_clock();
+		error->path = errorPath;
+		error->rule = outcome->rule;
+		error->status = outcome->status;
+		fErrors.AddItem(error);
+	}
+
+	fFiled++;
+	if (matched)
+		fMatched++;
+	if (failed)
+		fFailed++;
+
+	FolderCounts* counts = _FolderCountsFor(folder);
+	counts->filed++;
+	if (matched)
+		counts->matched++;
+	if (failed)
+		counts->failed++;
+
+	// Clears the seconds nothing was filed in since
+	bigtime_t now = system_time() / 1000000;
+	_FilesPerSecond(now);
+	fPerSecond[now % kRateSeconds]++;
+
+	fLatency.Record(latency);
+	fFilingTime.Record(time);
+}
+
+
+void
+FilingStats::Archive(BMessage& stats)
+{
+	BObjectList<FolderCounts> folders(20, true);
+	_Archive(stats, folders);
+
+	for (int32 i = 0; i < folders.CountItems(); i++) {
+		const FolderCounts* counts = folders.ItemAt(i);
+
+		BString path;
+		gFolders.ReadLock();
+		RefStorage* refholder = gFolders.Find(counts->folder);
+		if (refholder != NULL)
+			path = refholder->path;
+		gFolders.ReadUnlock();
+
+		if (path.IsEmpty()) {
+			BPath folderPath;
+			BEntry entry;
+			BDirectory directory(&counts->folder);
+			if (directory.GetEntry(&entry) == B_OK
+				&& entry.GetPath(&folderPath) == B_OK)
+				path = folderPath.Path();
+		}
+
+		BMessage folder;
+		folder.AddString("path", path);
+		folder.AddInt64("filed", counts->filed);
+		folder.AddInt64("matched", counts->matched);
+		folder.AddInt64("failed", counts->failed);
+		stats.AddMessage("folder", &folder);
+	}
+}
+
+
+void
+FilingStats::_Archive(BMessage& stats, BObjectList<FolderCounts>& folders)
+{
+	BAutolock _(fLock);
+
+	stats.AddInt64("started", fStarted);
+	stats.AddInt64("events", fEvents);
+	stats.AddInt64("filed", fFiled);
+	stats.AddInt64("matched", fMatched);
+	stats.AddInt64("failed", fFailed);
+	stats.AddDouble("files per second",
+		_FilesPerSecond(system_time() / 1000000));
+
+	BMessage latency;
+	fLatency.Archive(latency);
+	stats.AddMessage("latency", &latency);
+
+	BMessage filingTime;
+	fFilingTime.Archive(filingTime);
+	stats.AddMessage("filing time", &filingTime);
+
+	for (int32 i = 0; i < fFolders.CountItems(); i++)
+		folders.AddItem(new FolderCounts(*fFolders.ItemAt(i)));
+
+	for (int32 i = 0; i < fRules.CountItems(); i++) {
+		const RuleCounts* counts = fRules.ItemAt(i);
+		BMessage rule;
+		rule.AddString("name", counts->rule);
+		rule.AddInt64("matched", counts->matched);
+		rule.AddInt64("failed", counts->failed);
+		stats.AddMessage("rule", &rule);
+	}
+
+	// The latest last
+	for (int32 i = 0; i < fErrors.CountItems(); i++) {
+		const RecentError* recent = fErrors.ItemAt(i);
+		BMessage error;
+		error.AddInt64("when", recent->when);
+		error.AddString("path", recent->path);
+		error.AddString("rule", recent->rule);
+		error.AddString("error", strerror(recent->status));
+		stats.AddMessage("error", &error);
+	}
+}
+
+
+FolderCounts*
+FilingStats::_FolderCountsFor(const node_ref& folder)
+{
+	// There are only a few watched folders
+	for (int32 i = 0; i < fFolders.CountItems(); i++) {
+		if (fFolders.ItemAt(i)->folder == folder)
+			return fFolders.ItemAt(i);
+	}
+
+	FolderCounts* counts = new FolderCounts;
+	counts->folder = folder;
+	counts->filed = 0;
+	counts->matched = 0;
+	counts->failed = 0;
+	fFolders.AddItem(counts);
+	return counts;
+}
+
+
+RuleCounts*
+FilingStats::_RuleCountsFor(const BString& rule)
+{
+	for (int32 i = 0; i < fRules.CountItems(); i++) {
+		if (fRules.ItemAt(i)->rule == rule)
+			return fRules.ItemAt(i);
+	}
+
+	RuleCounts* counts = new RuleCounts;
+	counts->rule = rule;
+	counts->matched = 0;
+	counts->failed = 0;
+	fRules.AddItem(counts);
+	return counts;
+}
+
+
+double
+FilingStats::_FilesPerSecond(bigtime_t now)
+{
+	if (fLastSecond == 0)
+		fLastSecond = now;
+
+	// The seconds gone by since the last file start over
+	for (bigtime_t second = fLastSecond + 1;
+			second <= now && second <= fLastSecond + kRateSeconds; second++)
+		fPerSecond[second % kRateSeconds] = 0;
+	fLastSecond = now;
+
+	int64 count = 0;
+	for (int32 i = 0; i < kRateSeconds; i++)
+		count += fPerSecond[i];
+	return (double)count / kRateSeconds;
+}
@@ -0,0 +1,94 @@
+/*
+	FilingStats.h: Counts what the AutoFiler does, and how long it takes
+	Released under the MIT license.
+*/
+
+#ifndef FILING_STATS_H
+#define FILING_STATS_H
+
+#include <Entry.h>
+#include <Locker.h>
+#include <Message.h>
+#include <Node.h>
+
+#include "ObjectList.h"
+
+struct FolderCounts;
+struct RecentError;
+struct RuleCounts;
+struct RuleOutcome;
+
+// Buckets growing with the value, so percentiles are off by less than
+// 1/16th, like an HdrHistogram
+class LatencyHistogram
+{
+public:
+							LatencyHistogram();
+							~LatencyHistogram();
+
+			void			Record(bigtime_t latency);
+
+			int64			Count() const { return fCount; }
+	// The value at or below which the given share of them are
+			bigtime_t		Percentile(double share) const;
+
+	// The count, a few percentiles, and the non-empty buckets
+			void			Archive(BMessage& into) const;
+
+private:
+							LatencyHistogram(const LatencyHistogram&);
+			LatencyHistogram& operator=(const LatencyHistogram&);
+
+	static	int32			_BucketOf(bigtime_t value);
+	static	bigtime_t		_HighestIn(int32 bucket);
+
+			int64*			fBuckets;
+			int64			fCount;
+			bigtime_t		fSum;
+			bigtime_t		fMax;
+};
+
+class FilingStats
+{
+public:
+							FilingStats();
+							~FilingStats();
+
+			void			EventsReceived(int32 count);
+	// A file was run through the rules of the folder. The latency is how
+	// long it waited to be filed, the time how long that took.
+			void			Filed(const entry_ref& ref, const node_ref& folder,
+								const BObjectList<RuleOutcome>& outcomes,
+								bigtime_t latency, bigtime_t time);
+
+	// All of it, with the folders by path and the rules by name
+			void			Archive(BMessage& stats);
+
+private:
+	// Everything but the folders, which are copied
+			void			_Archive(BMessage& stats,
+								BObjectList<FolderCounts>& folders);
+			FolderCounts*	_FolderCountsFor(const node_ref& folder);
+			RuleCounts*		_RuleCountsFor(const BString& rule);
+			double			_FilesPerSecond(bigtime_t now);
+
+			BLocker			fLock;
+			bigtime_t		fStarted;
+			int64			fEvents;
+			int64			fFiled;
+			int64			fMatched;
+			int64			fFailed;
+
+			// Files filed each of the last seconds
+			int32*			fPerSecond;
+			bigtime_t		fLastSecond;
+
+			LatencyHistogram fLatency;
+			LatencyHistogram fFilingTime;
+
+			BObjectList<FolderCounts> fFolders;
+			BObjectList<RuleCounts> fRules;
+			BObjectList<RecentError> fErrors;
+};
+
+#endif	// FILING_STATS_H
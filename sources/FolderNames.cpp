@@ -0,0 +1,378 @@
+/*
+	FolderNames.cpp: Keeps the names found in target folders at hand, so name
+					conflicts can be found and resolved without searching
+	Released under the MIT license.
+*/
+
+#include "FolderNames.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Autolock.h>
+#include <Entry.h>
+#include <Locker.h>
+
+#include "ObjectList.h"
+
+/*
+	When thousands of files with the same name land in one folder, trying
+	"name copy", "name copy 2", ... one after the other would ask the file
+	system about every name taken so far, again for every file. Instead,
+	the names of a folder are read in one go into a hash table, which also
+	remembers for each name how far its copies got already.
+
+	The table can only be trusted as far as the Filer itself is concerned.
+	A name it doesn't know may still have been taken by someone else, so
+	files are always put in place without replacing anything, and a name
+	turning out to be taken is added and the next one tried. A name it
+	knows is checked on the disk, before it's reported as a conflict.
+*/
+
+static const uint32 kInitialTableSize = 64;
+static const int32 kMaxFolders = 32;
+
+
+struct NameEntry {
+	NameEntry*	next;
+	uint32		hash;
+	int32		nextCopy;
+	char		name[1];
+};
+
+
+static uint32
+HashName(const char* name)
+{
+	// FNV-1a
+	uint32 hash = 2166136261U;
+	while (*name != '\0') {
+		hash ^= (uint8)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+FolderNames::FolderNames(const node_ref& folder)
+	:
+	fFolder(folder),
+	fTable(NULL),
+	fTableSize(0),
+	fCount(0)
+{
+	_Resize(kInitialTableSize);
+}
+
+
+FolderNames::~FolderNames()
+{
+	for (uint32 i = 0; i < fTableSize; i++) {
+		NameEntry* entry = fTable[i];
+		while (entry != NULL) {
+			NameEntry* next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+	delete[] fTable;
+}
+
+
+status_t
+FolderNames::Load(BDirectory& directory)
+{
+	status_t status = directory.Rewind();
+	if (status != B_OK)
+		return status;
+
+	// Reads as many entries at a time as fit into the buffer
+	char buffer[8192];
+	dirent* dirents = (dirent*)buffer;
+	int32 count;
+	while ((count = directory.GetNextDirents(dirents, sizeof(buffer))) > 0) {
+		dirent* entry = dirents;
+		for (int32 i = 0; i < count; i++) {
+			if (strcmp(entry->d_name, ".") != 0
+				&& strcmp(entry->d_name, "..") != 0)
+				Add(entry->d_name);
+			entry = (dirent*)((char*)entry + entry->d_reclen);
+		}
+	}
+
+	return B_OK;
+}
+
+
+bool
+FolderNames::Contains(const char* name) const
+{
+	return _Find(name, HashName(name)) != NULL;
+}
+
+
+void
+FolderNames::Add(const char* name)
+{
+	uint32 hash = HashName(name);
+	if (_Find(name, hash) == NULL)
+		_Insert(name, hash);
+}
+
+
+void
+FolderNames::Remove(const char* name)
+{
+	uint32 hash = HashName(name);
+	NameEntry** link = &fTable[hash & (fTableSize - 1)];
+	while (*link != NULL) {
+		NameEntry* entry = *link;
+		if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+			*link = entry->next;
+			free(entry);
+			fCount--;
+			return;
+		}
+		link = &entry->next;
+	}
+}
+
+
+void
+FolderNames::GetFreeName(const char* name, BString& freeName)
+{
+	uint32 hash = HashName(name);
+	NameEntry* original = _Find(name, hash);
+	if (original == NULL)
+		original = _Insert(name, hash);
+	if (original == NULL) {
+		freeName = name;
+		return;
+	}
+
+	BString base(name);
+	BString extension;
+	int32 dot = base.FindLast('.');
+	if (dot > 0) {
+		base.CopyInto(extension, dot, base.Length() - dot);
+		base.Truncate(dot);
+	}
+
+	for (;;) {
+		int32 copy = original->nextCopy++;
+
+		BString suffix(" copy");
+		if (copy > 1)
+			suffix << ' ' << copy;
+
+		freeName = base;
+		int32 maxLength = B_FILE_NAME_LENGTH - 1 - suffix.Length()
+			- extension.Length();
+		if (freeName.Length() > maxLength) {
+			// Don't cut a UTF-8 character in half
+			while (maxLength > 0
+				&& (freeName.ByteAt(maxLength) & 0xc0) == 0x80)
+				maxLength--;
+			freeName.Truncate(maxLength);
+		}
+		freeName << suffix << extension;
+
+		if (!Contains(freeName.String()))
+			break;
+	}
+
+	Add(freeName.String());
+}
+
+
+NameEntry*
+FolderNames::_Find(const char* name, uint32 hash) const
+{
+	NameEntry* entry = fTable[hash & (fTableSize - 1)];
+	while (entry != NULL) {
+		if (entry->hash == hash && strcmp(entry->name, name) == 0)
+			return entry;
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+
+NameEntry*
+FolderNames::_Insert(const char* name, uint32 hash)
+{
+	if (fCount >= fTableSize)
+		_Resize(fTableSize * 2);
+
+	size_t length = strlen(name);
+	NameEntry* entry = (NameEntry*)malloc(sizeof(NameEntry) + length);
+	if (entry == NULL)
+		return NULL;
+
+	entry->hash = hash;
+	entry->nextCopy = 1;
+	memcpy(entry->name, name, length + 1);
+
+	NameEntry** bucket = &fTable[hash & (fTableSize - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	fCount++;
+
+	return entry;
+}
+
+
+void
+FolderNames::_Resize(uint32 size)
+{
+	NameEntry** table = new NameEntry*[size];
+	memset(table, 0, sizeof(NameEntry*) * size);
+
+	for (uint32 i = 0; i < fTableSize; i++) {
+		NameEntry* entry = fTable[i];
+		while (entry != NULL) {
+			NameEntry* next = entry->next;
+			NameEntry** bucket = &table[entry->hash & (size - 1)];
+			entry->next = *bucket;
+			*bucket = entry;
+			entry = next;
+		}
+	}
+
+	delete[] fTable;
+	fTable = table;
+	fTableSize = size;
+}
+
+
+//	#pragma mark - The folders in use
+
+
+static BLocker sFoldersLock("folder names");
+static BObjectList<FolderNames> sFolders(kMaxFolders, true);
+
+
+static FolderNames*
+FindFolder(const node_ref& folder)
+{
+	for (int32 i = 0; i < sFolders.CountItems(); i++) {
+		FolderNames* names = sFolders.ItemAt(i);
+		if (names->Folder() == folder) {
+			// Keeps the most recently used ones at the front
+			if (i > 0) {
+				sFolders.RemoveItemAt(i);
+				sFolders.AddItem(names, 0);
+			}
+			return names;
+		}
+	}
+	return NULL;
+}
+
+
+static FolderNames*
+GetFolder(BDirectory& directory)
+{
+	node_ref folder;
+	if (directory.GetNodeRef(&folder) != B_OK)
+		return NULL;
+
+	FolderNames* names = FindFolder(folder);
+	if (names != NULL)
+		return names;
+
+	names = new FolderNames(folder);
+	if (names->Load(directory) != B_OK) {
+		delete names;
+		return NULL;
+	}
+
+	sFolders.AddItem(names, 0);
+	if (sFolders.CountItems() > kMaxFolders)
+		delete sFolders.RemoveItemAt(sFolders.CountItems() - 1);
+
+	return names;
+}
+
+
+bool
+NameTaken(BDirectory& directory, const char* name)
+{
+	BAutolock _(sFoldersLock);
+
+	FolderNames* names = GetFolder(directory);
+	if (names == NULL)
+		return BEntry(&directory, name).Exists();
+
+	if (!names->Contains(name))
+		return false;
+
+	// Someone else might have removed it in the meantime
+	if (BEntry(&directory, name).Exists())
+		return true;
+
+	names->Remove(name);
+	return false;
+}
+
+
+void
+GetFreeName(BDirectory& directory, const char* name, BString& freeName)
+{
+	BAutolock _(sFoldersLock);
+
+	FolderNames* names = GetFolder(directory);
+	if (names != NULL) {
+		names->GetFreeName(name, freeName);
+		return;
+	}
+
+	// Without the names, there's nothing but asking for every one of them
+	node_ref none;
+	FolderNames folder(none);
+	for (;;) {
+		folder.GetFreeName(name, freeName);
+		if (!BEntry(&directory, freeName.String()).Exists())
+			break;
+	}
+}
+
+
+void
+NameAdded(BDirectory& directory, const char* name)
+{
+	BAutolock _(sFoldersLock);
+
+	node_ref folder;
+	if (directory.GetNodeRef(&folder) != B_OK)
+		return;
+
+	FolderNames* names = FindFolder(folder);
+	if (names != NULL)
+		names->Add(name);
+}
+
+
+void
+NameRemoved(const node_ref& folder, const char* name)
+{
+	BAutolock _(sFoldersLock);
+
+	FolderNames* names = FindFolder(folder);
+	if (names != NULL)
+		names->Remove(name);
+}
+
+
+void
+ForgetFolderNames(const node_ref& folder)
+{
+	BAutolock _(sFoldersLock);
+
+	FolderNames* names = FindFolder(folder);
+	if (names != NULL) {
+		sFolders.RemoveItem(names, false);
+		delete names;
+	}
+}
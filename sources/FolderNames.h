@@ -0,0 +1,53 @@
+/*
+	FolderNames.h: Keeps the names found in target folders at hand, so name
+					conflicts can be found and resolved without searching
+	Released under the MIT license.
+*/
+
+#ifndef FOLDER_NAMES_H
+#define FOLDER_NAMES_H
+
+#include <Directory.h>
+#include <Node.h>
+#include <String.h>
+
+struct NameEntry;
+
+class FolderNames
+{
+public:
+							FolderNames(const node_ref& folder);
+							~FolderNames();
+
+			status_t		Load(BDirectory& directory);
+			const node_ref&	Folder() const { return fFolder; }
+
+			bool			Contains(const char* name) const;
+			void			Add(const char* name);
+			void			Remove(const char* name);
+
+	// Hands out "name copy", "name copy 2" and so on, with the extension
+	// kept at the end, and takes the name for itself
+			void			GetFreeName(const char* name, BString& freeName);
+
+private:
+			NameEntry*		_Find(const char* name, uint32 hash) const;
+			NameEntry*		_Insert(const char* name, uint32 hash);
+			void			_Resize(uint32 size);
+
+			node_ref		fFolder;
+			NameEntry**		fTable;
+			uint32			fTableSize;
+			uint32			fCount;
+};
+
+// These look after the FolderNames of recently used folders. The names are
+// read once, and kept up to date with what the Filer itself puts there.
+bool		NameTaken(BDirectory& directory, const char* name);
+void		GetFreeName(BDirectory& directory, const char* name,
+				BString& freeName);
+void		NameAdded(BDirectory& directory, const char* name);
+void		NameRemoved(const node_ref& folder, const char* name);
+void		ForgetFolderNames(const node_ref& folder);
+
+#endif	// FOLDER_NAMES_H
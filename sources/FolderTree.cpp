@@ -0,0 +1,598 @@
+/*
+	FolderTree.cpp: The subfolders of the watched folders, watched as well, so
+				files turning up anywhere below them are filed
+	Released under the MIT license.
+*/
+
+#include "FolderTree.h"
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Directory.h>
+#include <Message.h>
+#include <OS.h>
+
+#include "RuleEngine.h"
+#include "Watcher.h"
+
+/*
+	With "subfolderdepth" in the Filer settings, the AutoFiler watches the
+	folders below its watched folders, down to that many levels, or all of
+	them with -1. Folders whose name matches one of the "excludefolder"
+	globs, like ".git" or "node_modules", are left out along with everything
+	below them. Other volumes mounted somewhere below aren't entered.
+
+	As whole project trees can be watched that way, each folder only takes
+	a small entry, referring to its parent, its first child and its
+	siblings by index, so removing a tree only takes as long as it's big.
+	They're found through a hash table of their node_refs, chained through
+	the entries as well.
+
+	Reading big trees takes a while, so the watched folders are read on
+	threads of their own, and only watched once the looper gets what was
+	found. The files that turned up in them meanwhile are left to the one
+	that asked, the folders are kept until then. Every folder takes a node
+	monitor, and there are only so many of them; the folders that can't be
+	watched keep an entry, and are counted until they're gone or watched.
+*/
+
+static const int32 kInitialCapacity = 64;
+
+struct FoundFolder {
+	node_ref	node;
+	node_ref	parent;
+	int32		depth;
+};
+
+struct TreeWalk {
+	TreeWalk()
+		:
+		roots(20, true),
+		found(20, true),
+		next(0)
+	{
+	}
+
+	BObjectList<node_ref>					roots;
+	BObjectList<BObjectList<FoundFolder> >	found;
+	int32									next;
+	int32									maxDepth;
+	BStringList								excludes;
+	BMessenger								target;
+	BMessage								done;
+};
+
+
+static uint32
+HashNodeRef(const node_ref& node)
+{
+	uint64 hash = (uint64)node.node * 31 + node.device;
+	return (uint32)(hash ^ (hash >> 32));
+}
+
+
+static bool
+IsExcluded(const char* name, const BStringList& excludes)
+{
+	for (int32 i = 0; i < excludes.CountStrings(); i++) {
+		if (fnmatch(excludes.StringAt(i).String(), name, 0) == 0)
+			return true;
+	}
+	return false;
+}
+
+
+// Adds the folder, and then its subfolders level by level, so every one
+// comes after its parent
+static void
+WalkFolder(const node_ref& start, const node_ref& parent, int32 depth,
+	int32 maxDepth, const BStringList& excludes,
+	BObjectList<FoundFolder>& found)
+{
+	FoundFolder* first = new FoundFolder;
+	first->node = start;
+	first->parent = parent;
+	first->depth = depth;
+	found.AddItem(first);
+
+	char buffer[8192];
+	struct dirent* dirents = (struct dirent*)buffer;
+
+	for (int32 i = 0; i < found.CountItems(); i++) {
+		node_ref node = found.ItemAt(i)->node;
+		depth = found.ItemAt(i)->depth;
+		if (maxDepth >= 0 && depth >= maxDepth)
+			continue;
+
+		BDirectory directory(&node);
+		if (directory.InitCheck() != B_OK)
+			continue;
+
+		int32 count;
+		while ((count = directory.GetNextDirents(dirents, sizeof(buffer)))
+				> 0) {
+			struct dirent* entry = dirents;
+			for (int32 j = 0; j < count; j++, entry = (struct dirent*)
+					((char*)entry + entry->d_reclen)) {
+				const char* name = entry->d_name;
+				if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+					|| IsExcluded(name, excludes))
+					continue;
+
+				// Neither links nor other volumes are followed
+				struct stat st;
+				if (directory.GetStatFor(name, &st) != B_OK
+					|| !S_ISDIR(st.st_mode) || st.st_dev != node.device)
+					continue;
+
+				FoundFolder* folder = new FoundFolder;
+				folder->node = node_ref(st.st_dev, st.st_ino);
+				folder->parent = node;
+				folder->depth = depth + 1;
+				found.AddItem(folder);
+			}
+		}
+	}
+}
+
+
+FolderTree::FolderTree(Watcher& watcher)
+	:
+	fWatcher(watcher),
+	fMaxDepth(0),
+	fFolders(NULL),
+	fCapacity(0),
+	fUsed(0),
+	fCount(0),
+	fFree(-1),
+	fBuckets(NULL),
+	fBucketCount(0),
+	fUnwatched(0),
+	fWalks(0),
+	fWaiting(20, true)
+{
+	_Grow();
+	_Rehash(kInitialCapacity);
+}
+
+
+FolderTree::~FolderTree()
+{
+	free(fFolders);
+	delete[] fBuckets;
+}
+
+
+void
+FolderTree::LoadSettings()
+{
+	fMaxDepth = 0;
+	fExcludes.MakeEmpty();
+
+	BMessage msg;
+	if (RuleEngine::ReadSettings(msg) != B_OK)
+		return;
+
+	if (msg.FindInt32("subfolderdepth", &fMaxDepth) != B_OK)
+		fMaxDepth = 0;
+
+	BString exclude;
+	for (int32 i = 0; msg.FindString("excludefolder", i, &exclude) == B_OK;
+			i++)
+		fExcludes.Add(exclude);
+}
+
+
+void
+FolderTree::AddRoots(const BObjectList<node_ref>& roots,
+	const BMessenger& target, const BMessage& done)
+{
+	TreeWalk* walk = new TreeWalk;
+	for (int32 i = 0; i < roots.CountItems(); i++) {
+		walk->roots.AddItem(new node_ref(*roots.ItemAt(i)));
+		walk->found.AddItem(new BObjectList<FoundFolder>(20, true));
+	}
+	walk->maxDepth = fMaxDepth;
+	walk->excludes = fExcludes;
+	walk->target = target;
+	walk->done = done;
+	fWalks++;
+
+	thread_id thread = spawn_thread(_Walk, "folder walk", B_LOW_PRIORITY,
+		walk);
+	if (thread < 0 || resume_thread(thread) != B_OK)
+		_Walk(walk);
+}
+
+
+void
+FolderTree::Merge(BMessage* done, BObjectList<node_ref>& folders,
+	BObjectList<node_ref>& roots, BObjectList<node_ref>& added)
+{
+	TreeWalk* walk;
+	if (done->FindPointer("walk", (void**)&walk) != B_OK)
+		return;
+
+	for (int32 i = 0; i < walk->roots.CountItems(); i++) {
+		int32 count = folders.CountItems();
+		_Merge(*walk->found.ItemAt(i), &folders);
+		for (int32 j = count; j < folders.CountItems(); j++)
+			roots.AddItem(new node_ref(*walk->roots.ItemAt(i)));
+	}
+
+	delete walk;
+	fWalks--;
+
+	// Those whose parent is still unknown wait for the other walks
+	int32 count = fWaiting.CountItems();
+	int32 kept = 0;
+	for (int32 i = 0; i < count; i++) {
+		AddedFolder* folder = fWaiting.ItemAt(i);
+		if (_IndexOf(folder->parent) < 0 && fWalks > 0) {
+			fWaiting.SwapWithItem(kept++, folder);
+			continue;
+		}
+
+		FolderAdded(folder->parent, folder->name.String(), &added);
+		delete folder;
+	}
+	while (fWaiting.CountItems() > kept)
+		fWaiting.RemoveItemAt(fWaiting.CountItems() - 1);
+}
+
+
+void
+FolderTree::RemoveRoot(const node_ref& root)
+{
+	int32 index = _IndexOf(root);
+	if (index >= 0)
+		_RemoveSubtree(index);
+}
+
+
+bool
+FolderTree::Contains(const node_ref& node) const
+{
+	int32 index = _IndexOf(node);
+	return index >= 0 && fFolders[index].watched;
+}
+
+
+void
+FolderTree::GetFolders(BObjectList<node_ref>& folders,
+	BObjectList<node_ref>& roots) const
+{
+	for (int32 i = 0; i < fUsed; i++) {
+		if (fFolders[i].depth < 0 || !fFolders[i].watched)
+			continue;
+
+		folders.AddItem(new node_ref(fFolders[i].node));
+		roots.AddItem(new node_ref(fFolders[_RootOf(i)].node));
+	}
+}
+
+
+void
+FolderTree::FolderAdded(const node_ref& parent, const char* name,
+	BObjectList<node_ref>* added)
+{
+	int32 parentIndex = _IndexOf(parent);
+	if (parentIndex < 0) {
+		// Its parent may only be known once the folders being read are
+		if (fWalks > 0 && parent.node >= 0) {
+			AddedFolder* folder = new AddedFolder;
+			folder->parent = parent;
+			folder->name = name;
+			fWaiting.AddItem(folder);
+		}
+		return;
+	}
+	if (!fFolders[parentIndex].watched)
+		return;
+
+	int32 depth = fFolders[parentIndex].depth + 1;
+	if ((fMaxDepth >= 0 && depth > fMaxDepth) || IsExcluded(name, fExcludes))
+		return;
+
+	BDirectory directory(&parent);
+	struct stat st;
+	if (directory.GetStatFor(name, &st) != B_OK || !S_ISDIR(st.st_mode)
+		|| st.st_dev != parent.device)
+		return;
+
+	node_ref node(st.st_dev, st.st_ino);
+	int32 index = _IndexOf(node);
+	if (index >= 0 && fFolders[index].watched)
+		return;
+
+	// A folder moved here may bring a whole tree along
+	BObjectList<FoundFolder> found(20, true);
+	WalkFolder(node, parent, depth, fMaxDepth, fExcludes, found);
+	_Merge(found, added);
+}
+
+
+void
+FolderTree::FolderRemoved(const node_ref& node)
+{
+	int32 index = _IndexOf(node);
+	if (index >= 0 && fFolders[index].parent >= 0)
+		_RemoveSubtree(index);
+}
+
+
+int32
+FolderTree::_IndexOf(const node_ref& node) const
+{
+	int32 index = fBuckets[HashNodeRef(node) & (fBucketCount - 1)];
+	while (index >= 0 && fFolders[index].node != node)
+		index = fFolders[index].hashNext;
+	return index;
+}
+
+
+int32
+FolderTree::_Insert(const node_ref& node, int32 parent, int32 depth,
+	bool watched)
+{
+	int32 index = fFree;
+	if (index >= 0)
+		fFree = fFolders[index].hashNext;
+	else {
+		if (fUsed == fCapacity)
+			_Grow();
+		index = fUsed++;
+	}
+
+	Folder& folder = fFolders[index];
+	folder.node = node;
+	folder.parent = parent;
+	folder.depth = depth;
+	folder.firstChild = -1;
+	folder.previousSibling = -1;
+	folder.nextSibling = -1;
+	folder.watched = watched;
+	if (parent >= 0) {
+		folder.nextSibling = fFolders[parent].firstChild;
+		if (folder.nextSibling >= 0)
+			fFolders[folder.nextSibling].previousSibling = index;
+		fFolders[parent].firstChild = index;
+	}
+	if (!watched)
+		fUnwatched++;
+
+	uint32 bucket = HashNodeRef(node) & (fBucketCount - 1);
+	folder.hashNext = fBuckets[bucket];
+	fBuckets[bucket] = index;
+
+	if (++fCount > fBucketCount)
+		_Rehash(fBucketCount * 2);
+
+	return index;
+}
+
+
+int32
+FolderTree::_RootOf(int32 index) const
+{
+	while (fFolders[index].parent >= 0)
+		index = fFolders[index].parent;
+	return index;
+}
+
+
+void
+FolderTree::_RemoveSubtree(int32 index)
+{
+	_Detach(index);
+
+	// Goes down to the first children, then on to the siblings, and back
+	// up to the parents, so the tree is freed as it's gone through
+	int32 folder = index;
+	for (;;) {
+		while (fFolders[folder].firstChild >= 0)
+			folder = fFolders[folder].firstChild;
+
+		int32 next = fFolders[folder].nextSibling;
+		int32 parent = fFolders[folder].parent;
+		if (fFolders[folder].watched)
+			fWatcher.Unwatch(fFolders[folder].node);
+		_Unlink(folder);
+
+		if (folder == index)
+			break;
+		if (next >= 0) {
+			fFolders[parent].firstChild = next;
+			folder = next;
+		} else {
+			fFolders[parent].firstChild = -1;
+			folder = parent;
+		}
+	}
+}
+
+
+// Takes the folder from its parent's children
+void
+FolderTree::_Detach(int32 index)
+{
+	Folder& folder = fFolders[index];
+	if (folder.previousSibling >= 0)
+		fFolders[folder.previousSibling].nextSibling = folder.nextSibling;
+	else if (folder.parent >= 0)
+		fFolders[folder.parent].firstChild = folder.nextSibling;
+	if (folder.nextSibling >= 0)
+		fFolders[folder.nextSibling].previousSibling = folder.previousSibling;
+
+	folder.parent = -1;
+	folder.previousSibling = -1;
+	folder.nextSibling = -1;
+}
+
+
+void
+FolderTree::_Unlink(int32 index)
+{
+	int32* link = &fBuckets[HashNodeRef(fFolders[index].node)
+		& (fBucketCount - 1)];
+	while (*link >= 0 && *link != index)
+		link = &fFolders[*link].hashNext;
+	if (*link == index)
+		*link = fFolders[index].hashNext;
+
+	if (!fFolders[index].watched)
+		fUnwatched--;
+
+	// Free entries have no depth, and are chained through hashNext as well
+	fFolders[index].depth = -1;
+	fFolders[index].hashNext = fFree;
+	fFree = index;
+	fCount--;
+}
+
+
+void
+FolderTree::_Merge(BObjectList<FoundFolder>& found,
+	BObjectList<node_ref>* added)
+{
+	// Folders that couldn't be watched keep their place in the tree, so
+	// they're tried again when they're found again, and are let go of with
+	// it. Those that are gone meanwhile are left out.
+	int32 failed = 0;
+	status_t error = B_OK;
+
+	for (int32 i = 0; i < found.CountItems(); i++) {
+		FoundFolder* folder = found.ItemAt(i);
+		int32 index = _IndexOf(folder->node);
+		if (index >= 0 && fFolders[index].watched)
+			continue;
+
+		int32 parent = -1;
+		if (folder->depth > 0) {
+			parent = _IndexOf(folder->parent);
+			if (parent < 0)
+				continue;
+		}
+
+		status_t status = fWatcher.WatchFolder(folder->node,
+			folder->depth == 0);
+		if (status == B_ENTRY_NOT_FOUND)
+			continue;
+		if (status != B_OK) {
+			if (error == B_OK)
+				error = status;
+			failed++;
+			if (index < 0)
+				_Insert(folder->node, parent, folder->depth, false);
+			continue;
+		}
+
+		if (index >= 0) {
+			fFolders[index].watched = true;
+			fUnwatched--;
+		} else
+			_Insert(folder->node, parent, folder->depth, true);
+		if (added != NULL)
+			added->AddItem(new node_ref(folder->node));
+	}
+
+	if (failed > 0) {
+		printf("\tCouldn't watch %" B_PRId32 " folders: %s\n", failed,
+			strerror(error));
+	}
+}
+
+
+void
+FolderTree::_Grow()
+{
+	int32 capacity = fCapacity > 0 ? fCapacity * 2 : kInitialCapacity;
+	Folder* folders = (Folder*)realloc(fFolders, capacity * sizeof(Folder));
+	if (folders == NULL)
+		return;
+
+	fFolders = folders;
+	fCapacity = capacity;
+}
+
+
+void
+FolderTree::_Rehash(int32 bucketCount)
+{
+	delete[] fBuckets;
+	fBuckets = new int32[bucketCount];
+	fBucketCount = bucketCount;
+	for (int32 i = 0; i < bucketCount; i++)
+		fBuckets[i] = -1;
+
+	for (int32 i = 0; i < fUsed; i++) {
+		if (fFolders[i].depth < 0)
+			continue;
+
+		uint32 bucket = HashNodeRef(fFolders[i].node) & (bucketCount - 1);
+		fFolders[i].hashNext = fBuckets[bucket];
+		fBuckets[bucket] = i;
+	}
+}
+
+
+status_t
+FolderTree::_Walk(void* data)
+{
+	TreeWalk* walk = (TreeWalk*)data;
+	int32 count = walk->roots.CountItems();
+
+	// Only worth it with subfolders to read
+	int32 jobs = 1;
+	if (walk->maxDepth != 0 && count > 1) {
+		system_info info;
+		get_system_info(&info);
+		jobs = min_c((int32)info.cpu_count, count);
+	}
+
+	thread_id* threads = new thread_id[jobs];
+	int32 started = 0;
+	for (int32 i = 1; i < jobs; i++) {
+		threads[started] = spawn_thread(_WalkThread, "folder walk",
+			B_LOW_PRIORITY, walk);
+		if (threads[started] >= 0 && resume_thread(threads[started]) == B_OK)
+			started++;
+	}
+
+	_WalkThread(walk);
+
+	for (int32 i = 0; i < started; i++) {
+		status_t exitValue;
+		wait_for_thread(threads[i], &exitValue);
+	}
+	delete[] threads;
+
+	BMessage done(walk->done);
+	done.AddPointer("walk", walk);
+	if (walk->target.SendMessage(&done) != B_OK)
+		delete walk;
+	return B_OK;
+}
+
+
+status_t
+FolderTree::_WalkThread(void* data)
+{
+	TreeWalk* walk = (TreeWalk*)data;
+	int32 count = walk->roots.CountItems();
+
+	for (;;) {
+		int32 index = atomic_add(&walk->next, 1);
+		if (index >= count)
+			break;
+
+		WalkFolder(*walk->roots.ItemAt(index), node_ref(), 0,
+			walk->maxDepth, walk->excludes, *walk->found.ItemAt(index));
+	}
+
+	return B_OK;
+}
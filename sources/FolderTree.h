@@ -0,0 +1,118 @@
+/*
+	FolderTree.h: The subfolders of the watched folders, watched as well, so
+				files turning up anywhere below them are filed
+	Released under the MIT license.
+*/
+
+#ifndef FOLDER_TREE_H
+#define FOLDER_TREE_H
+
+#include <Message.h>
+#include <Messenger.h>
+#include <Node.h>
+#include <String.h>
+#include <StringList.h>
+
+#include "ObjectList.h"
+
+class Watcher;
+struct FoundFolder;
+
+class FolderTree
+{
+public:
+							FolderTree(Watcher& watcher);
+							~FolderTree();
+
+	// Reads how deep to go below the watched folders, and which folders to
+	// leave out, from the Filer settings. Only applies to folders added
+	// afterwards.
+			void			LoadSettings();
+
+	// Reads the folders and their subfolders side by side, on threads of
+	// their own, and sends the done message to the target with what was
+	// found. It's watched once it's handed to Merge(). Folders added
+	// meanwhile to folders that aren't known yet wait for it.
+			void			AddRoots(const BObjectList<node_ref>& roots,
+								const BMessenger& target,
+								const BMessage& done);
+	// Watches what AddRoots() found, and adds the folders that weren't
+	// watched yet to folders, along with the watched folder each is in.
+	// The folders that were added while they were read, and are watched
+	// now, are added to added, as everything in them is new.
+			void			Merge(BMessage* done,
+								BObjectList<node_ref>& folders,
+								BObjectList<node_ref>& roots,
+								BObjectList<node_ref>& added);
+			void			RemoveRoot(const node_ref& root);
+
+			bool			Contains(const node_ref& node) const;
+			int32			CountFolders() const { return fCount; }
+	// Folders that should be watched, but couldn't be. They're tried again
+	// whenever they're found again.
+			int32			CountUnwatched() const { return fUnwatched; }
+	// Every folder watched, along with the watched folder it's in
+			void			GetFolders(BObjectList<node_ref>& folders,
+								BObjectList<node_ref>& roots) const;
+
+	// A folder was created in, or moved to, the folder parent. It's watched
+	// if parent is, and it's neither too deep nor left out. The folders that
+	// are watched from now on are added to added, if given, as what's in
+	// them may have turned up before.
+			void			FolderAdded(const node_ref& parent,
+								const char* name,
+								BObjectList<node_ref>* added = NULL);
+	// A subfolder was removed or moved elsewhere. The watched folders
+	// themselves stay.
+			void			FolderRemoved(const node_ref& node);
+
+private:
+			struct Folder {
+				node_ref	node;
+				int32		parent;
+				int32		hashNext;
+				int32		depth;
+				int32		firstChild;
+				int32		nextSibling;
+				int32		previousSibling;
+				bool		watched;
+			};
+
+			struct AddedFolder {
+				node_ref	parent;
+				BString		name;
+			};
+
+			int32			_IndexOf(const node_ref& node) const;
+			int32			_Insert(const node_ref& node, int32 parent,
+								int32 depth, bool watched);
+			int32			_RootOf(int32 index) const;
+			void			_RemoveSubtree(int32 index);
+			void			_Unlink(int32 index);
+			void			_Detach(int32 index);
+			void			_Merge(BObjectList<FoundFolder>& found,
+								BObjectList<node_ref>* added);
+			void			_Grow();
+			void			_Rehash(int32 bucketCount);
+
+	static	status_t		_Walk(void* data);
+	static	status_t		_WalkThread(void* data);
+
+			Watcher&		fWatcher;
+			int32			fMaxDepth;
+			BStringList		fExcludes;
+
+			Folder*			fFolders;
+			int32			fCapacity;
+			int32			fUsed;
+			int32			fCount;
+			int32			fFree;
+			int32*			fBuckets;
+			int32			fBucketCount;
+			int32			fUnwatched;
+			// Walks that weren't merged yet, and the folders added meanwhile
+			int32			fWalks;
+			BObjectList<AddedFolder> fWaiting;
+};
+
+#endif	// FOLDER_TREE_H
@@ -6,133 +6,742 @@
 
 #include "PatternProcessor.h"
 
-#include <Node.h>
-#include <Path.h>
+#include <MimeType.h>
+#include <OS.h>
 #include <TypeConstants.h>
 
 #include <fs_attr.h>
 #include <stdio.h>
-#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FileHash.h"
 
 /*
 	Patterns in Filer
-	
+
 	Regular expressions will probably be supported later, but for now there
 	is a way to substitute attributes of the file being processed into the
 	value string of a particular action before it is executed by the RuleRunner.
-	
+
 	Each attribute is places between two percent signs - %BASENAME%, for
 	example.
-	
+
 	%FILENAME%	- full name of the file
 	%EXTENSION%	- just the extension of the file
 	%BASENAME% -  file name without extension
-	%FILEPATH% - full name and location of the file
+	%FULLPATH% - full name and location of the file
 	%FOLDER% - the location of the folder containing the file
-	
-	%DATE% - The current date in the format MM-DD-YYYY
-	%EURODATE% - The current date in the format DD-MM-YYYY
+
+	%DATE% - The current date in the format DD-MM-YYYY
+	%EURODATE% - The current date in the format MM-DD-YYYY
 	%REVERSEDATE% - The current date in the format YYYY-MM-DD
 	%TIME% - The current time
 	%ATTR:xxxx% - An attribute of the file. Note that this needs to be
 				the internal name of the attributes, such as META:email
+
+	%SIZE% - The size of the file in bytes. %SIZE:KB%, %SIZE:MB% and
+				%SIZE:GB% give it in whole kilo-, mega- or gigabytes.
+	%MTIME% - When the file was last modified, as YYYY-MM-DD. A strftime()
+				format can follow the colon, with '$' in place of '%', e.g.
+				%MTIME:$Y/$m%.
+	%MIME% - The file type, e.g. image/png. %MIME:super% and %MIME:sub% are
+				just the part before or after the slash.
+	%HASH% - The checksum of the file contents, 16 hexadecimal digits.
+				%HASH:2% gives only the first two of them.
+	%COUNTER% - A number counting up for every file processed. %COUNTER:4%
+				pads it with zeros to four digits.
+	%1%, %2%, ... - What the groups of a "matches pattern" test found.
+	%MATCH:name% - The same for a named group, (?<name>...), or a number.
+
+	A pattern is taken apart once, into a list of tokens, each either a piece
+	of text to be copied as it is or a variable. Both point into the pattern
+	itself, so expanding it only writes to the output. Anything between
+	percent signs that isn't a variable is kept as it is, e.g. %FILES% for
+	the shell command batches.
+
+	Nothing about the file is looked up before a variable needs it, so only
+	patterns with %HASH% ever read the file, and only once for all the
+	actions of a rule.
 */
 
-BString
-ProcessPatterns(const char* instr, const entry_ref& ref)
+enum {
+	TOKEN_TEXT,
+	TOKEN_FILENAME,
+	TOKEN_BASENAME,
+	TOKEN_EXTENSION,
+	TOKEN_FULLPATH,
+	TOKEN_FOLDER,
+	TOKEN_DATE,
+	TOKEN_EURODATE,
+	TOKEN_REVERSEDATE,
+	TOKEN_TIME,
+	TOKEN_ATTR,
+	TOKEN_SIZE,
+	TOKEN_MTIME,
+	TOKEN_MIME,
+	TOKEN_HASH,
+	TOKEN_COUNTER,
+	TOKEN_MATCH
+};
+
+// Whether a variable is followed by ":argument"
+enum {
+	ARGUMENT_NONE,
+	ARGUMENT_OPTIONAL,
+	ARGUMENT_REQUIRED
+};
+
+enum {
+	MIME_TYPE,
+	MIME_SUPERTYPE,
+	MIME_SUBTYPE
+};
+
+// What a PatternContext already knows
+enum {
+	KNOWN_PATH		= 0x01,
+	KNOWN_BASENAME	= 0x02,
+	KNOWN_NOW		= 0x04,
+	KNOWN_NODE		= 0x08,
+	KNOWN_STAT		= 0x10,
+	KNOWN_MIME		= 0x20,
+	KNOWN_HASH		= 0x40,
+	KNOWN_COUNTER	= 0x80
+};
+
+struct PatternToken {
+	uint8	type;
+	// The argument, or the text
+	int32	offset;
+	int32	length;
+	// What the argument means, where it's a number
+	int32	number;
+};
+
+struct PatternVariable {
+	const char*	name;
+	uint8		type;
+	uint8		argument;
+};
+
+static const PatternVariable kVariables[] = {
+	{ "FILENAME",		TOKEN_FILENAME,		ARGUMENT_NONE },
+	{ "BASENAME",		TOKEN_BASENAME,		ARGUMENT_NONE },
+	{ "EXTENSION",		TOKEN_EXTENSION,	ARGUMENT_NONE },
+	{ "FULLPATH",		TOKEN_FULLPATH,		ARGUMENT_NONE },
+	{ "FOLDER",			TOKEN_FOLDER,		ARGUMENT_NONE },
+	{ "DATE",			TOKEN_DATE,			ARGUMENT_NONE },
+	{ "EURODATE",		TOKEN_EURODATE,		ARGUMENT_NONE },
+	{ "REVERSEDATE",	TOKEN_REVERSEDATE,	ARGUMENT_NONE },
+	{ "TIME",			TOKEN_TIME,			ARGUMENT_NONE },
+	{ "ATTR",			TOKEN_ATTR,			ARGUMENT_REQUIRED },
+	{ "SIZE",			TOKEN_SIZE,			ARGUMENT_OPTIONAL },
+	{ "MTIME",			TOKEN_MTIME,		ARGUMENT_OPTIONAL },
+	{ "MIME",			TOKEN_MIME,			ARGUMENT_OPTIONAL },
+	{ "HASH",			TOKEN_HASH,			ARGUMENT_OPTIONAL },
+	{ "COUNTER",		TOKEN_COUNTER,		ARGUMENT_OPTIONAL },
+	{ "MATCH",			TOKEN_MATCH,		ARGUMENT_REQUIRED }
+};
+static const int32 kVariableCount
+	= sizeof(kVariables) / sizeof(kVariables[0]);
+
+static const char kDefaultTimeFormat[] = "$Y-$m-$d";
+static const int32 kHashDigits = 16;
+static const int32 kMaxCounterDigits = 20;
+static const int32 kMaxCaptures = 99;
+
+static int64 sCounter = 0;
+
+
+// Returns the number of a capture, if the string is one, or 0
+static int32
+ParseCaptureNumber(const char* string, int32 length)
 {
-	if (!instr)
-		return BString();
+	if (length < 1 || length > 2)
+		return 0;
 
-	BString outstr(instr);
+	int32 number = 0;
+	for (int32 i = 0; i < length; i++) {
+		if (string[i] < '0' || string[i] > '9')
+			return 0;
+		number = number * 10 + string[i] - '0';
+	}
+	return number <= kMaxCaptures ? number : 0;
+}
+
+
+// Works out what the argument of a variable stands for, as far as that
+// doesn't depend on the file. Returns false if it makes no sense.
+static bool
+ParseArgument(uint8 type, const char* argument, int32 length, int32& number)
+{
+	BString string(argument, length);
+	number = 0;
+
+	switch (type) {
+		case TOKEN_MATCH:
+			// A group by name otherwise
+			number = ParseCaptureNumber(argument, length);
+			return true;
+
+		case TOKEN_SIZE:
+			if (length == 0)
+				return true;
+			if (string.ICompare("KB") == 0)
+				number = 10;
+			else if (string.ICompare("MB") == 0)
+				number = 20;
+			else if (string.ICompare("GB") == 0)
+				number = 30;
+			else
+				return false;
+			return true;
 
-	// Handle filename-based patterns
-	BString basename(ref.name), extension;
+		case TOKEN_MIME:
+			if (length == 0)
+				number = MIME_TYPE;
+			else if (string.ICompare("super") == 0)
+				number = MIME_SUPERTYPE;
+			else if (string.ICompare("sub") == 0)
+				number = MIME_SUBTYPE;
+			else
+				return false;
+			return true;
 
-	int32 strpos = basename.FindFirst(".");
-	if (strpos >= 0) {
-		extension = basename.String() + strpos;
-		basename.Truncate(strpos);
+		case TOKEN_HASH:
+		case TOKEN_COUNTER:
+		{
+			if (length == 0) {
+				number = type == TOKEN_HASH ? kHashDigits : 0;
+				return true;
+			}
+			char* end;
+			number = strtol(string.String(), &end, 10);
+			int32 limit = type == TOKEN_HASH ? kHashDigits : kMaxCounterDigits;
+			return *end == '\0' && number > 0 && number <= limit;
+		}
+
+		default:
+			return true;
 	}
+}
+
+
+PatternContext::PatternContext(const entry_ref& ref)
+	:
+	fRef(ref),
+	fKnown(0),
+	fBaseNameLength(0),
+	fHash(0),
+	fCounter(0)
+{
+}
 
-	outstr.ReplaceAll("%FILENAME%", ref.name);
-	outstr.ReplaceAll("%BASENAME%", basename.String());
-	outstr.ReplaceAll("%EXTENSION%", extension.String());
 
-	BString pathstr = BPath(&ref).Path();
-	outstr.ReplaceAll("%FULLPATH%", pathstr.String());
+void
+PatternContext::SetTo(const entry_ref& ref)
+{
+	if (ref == fRef)
+		return;
 
-	pathstr.ReplaceLast(BPath(&ref).Leaf(),"");
-	outstr.ReplaceAll("%FOLDER%", pathstr.String());
+	// It's still the same file, only somewhere else, so it keeps its number
+	fRef = ref;
+	fKnown &= KNOWN_COUNTER;
+	fNode.Unset();
+}
 
-	// Date-based patterns
-	time_t currenttime = time(NULL);
-	struct tm timedata = *localtime(&currenttime);
 
-	char timestr[64];
-	if (outstr.FindFirst("%DATE%") >= 0) {
-		sprintf(timestr,"%.2d-%.2d-%d",timedata.tm_mday, timedata.tm_mon + 1,
-			timedata.tm_year + 1900);
-		outstr.ReplaceAll("%DATE%", timestr);
+const char*
+PatternContext::Path()
+{
+	if ((fKnown & KNOWN_PATH) == 0) {
+		fPath.SetTo(&fRef);
+		fKnown |= KNOWN_PATH;
 	}
+	return fPath.Path() != NULL ? fPath.Path() : "";
+}
+
+
+int32
+PatternContext::FolderLength()
+{
+	// The path up to and including the last slash
+	const char* path = Path();
+	const char* slash = strrchr(path, '/');
+	return slash != NULL ? slash - path + 1 : 0;
+}
 
-	if (outstr.FindFirst("%EURODATE%") >= 0) {
-		sprintf(timestr,"%.2d-%.2d-%d",timedata.tm_mon + 1, timedata.tm_mday,
-			timedata.tm_year + 1900);
-		outstr.ReplaceAll("%EURODATE%", timestr);
+
+int32
+PatternContext::BaseNameLength()
+{
+	if ((fKnown & KNOWN_BASENAME) == 0) {
+		const char* dot = strchr(fRef.name, '.');
+		fBaseNameLength = dot != NULL ? dot - fRef.name : strlen(fRef.name);
+		fKnown |= KNOWN_BASENAME;
+	}
+	return fBaseNameLength;
+}
+
+
+const struct tm&
+PatternContext::Now()
+{
+	if ((fKnown & KNOWN_NOW) == 0) {
+		time_t currenttime = time(NULL);
+		localtime_r(&currenttime, &fNow);
+		fKnown |= KNOWN_NOW;
+	}
+	return fNow;
+}
+
+
+BNode*
+PatternContext::Node()
+{
+	if ((fKnown & KNOWN_NODE) == 0) {
+		fNode.SetTo(&fRef);
+		fKnown |= KNOWN_NODE;
+	}
+	return fNode.InitCheck() == B_OK ? &fNode : NULL;
+}
+
+
+const struct stat*
+PatternContext::Stat()
+{
+	if ((fKnown & KNOWN_STAT) == 0) {
+		BNode* node = Node();
+		if (node == NULL || node->GetStat(&fStat) != B_OK)
+			return NULL;
+		fKnown |= KNOWN_STAT;
+	}
+	return &fStat;
+}
+
+
+const char*
+PatternContext::MimeType()
+{
+	if ((fKnown & KNOWN_MIME) == 0) {
+		BMimeType mimeType;
+		if (BMimeType::GuessMimeType(&fRef, &mimeType) == B_OK)
+			fMimeType = mimeType.Type();
+		else
+			fMimeType = B_FILE_MIME_TYPE;
+		fKnown |= KNOWN_MIME;
 	}
+	return fMimeType.String();
+}
+
+
+bool
+PatternContext::Hash(uint64& hash)
+{
+	if ((fKnown & KNOWN_HASH) == 0) {
+		const struct stat* st = Stat();
+		if (st == NULL || !S_ISREG(st->st_mode))
+			return false;
+		if (ReadFileHash(fNode, fHash, *st) != B_OK
+			&& GetFileHash(fRef, fHash) != B_OK)
+			return false;
+		fKnown |= KNOWN_HASH;
+	}
+	hash = fHash;
+	return true;
+}
+
+
+int64
+PatternContext::Counter()
+{
+	if ((fKnown & KNOWN_COUNTER) == 0) {
+		fCounter = atomic_add64(&sCounter, 1) + 1;
+		fKnown |= KNOWN_COUNTER;
+	}
+	return fCounter;
+}
+
+
+void
+PatternContext::AddCapture(const char* name, const char* text, int32 length)
+{
+	fCaptureNames.Add(name);
+	fCaptures.Add(BString(text, length));
+}
+
+
+void
+PatternContext::ClearCaptures()
+{
+	fCaptureNames.MakeEmpty();
+	fCaptures.MakeEmpty();
+}
+
+
+int32
+PatternContext::CountCaptures() const
+{
+	return fCaptures.CountStrings();
+}
+
+
+const char*
+PatternContext::CaptureAt(int32 index) const
+{
+	if (index < 0 || index >= fCaptures.CountStrings())
+		return NULL;
+	return fCaptures.StringAt(index).String();
+}
+
 
-	if (outstr.FindFirst("%REVERSEDATE%") >= 0) {
-		sprintf(timestr,"%d-%.2d-%.2d",timedata.tm_year + 1900,
-			timedata.tm_mon + 1, timedata.tm_mday);
-		outstr.ReplaceAll("%REVERSEDATE%", timestr);
+const char*
+PatternContext::Capture(const char* name) const
+{
+	for (int32 i = 0; i < fCaptureNames.CountStrings(); i++) {
+		if (fCaptureNames.StringAt(i) == name)
+			return fCaptures.StringAt(i).String();
 	}
+	return NULL;
+}
+
 
-	if (outstr.FindFirst("%TIME%") >= 0) {
-		sprintf(timestr,"%.2d:%.2d:%.2d",timedata.tm_hour, timedata.tm_min,
-			timedata.tm_sec);
-		outstr.ReplaceAll("%TIME%", timestr);
+void
+PatternContext::ArchiveCaptures(BMessage& into) const
+{
+	for (int32 i = 0; i < fCaptures.CountStrings(); i++) {
+		into.AddString("capture", fCaptures.StringAt(i));
+		into.AddString("group", fCaptureNames.StringAt(i));
 	}
-	
-	// Attribute-based patterns
-	strpos = outstr.FindFirst("%ATTR:");
-	while (strpos >= 0)
-	{
-		int32 strendpos = outstr.FindFirst("%",strpos + 1);
-		if (strendpos >= 0) {
-			BString string, attrname, attrpattern;
-			attrname = outstr.String() + strpos;
+}
+
 
-			attrpattern = attrname;
+void
+PatternContext::UnarchiveCaptures(const BMessage& from)
+{
+	ClearCaptures();
+
+	const char* capture;
+	for (int32 i = 0; from.FindString("capture", i, &capture) == B_OK; i++)
+		AddCapture(from.GetString("group", i, ""), capture, strlen(capture));
+}
+
+
+PatternTemplate::PatternTemplate(const char* pattern)
+	:
+	fTokens(NULL),
+	fCount(0),
+	fCapacity(0)
+{
+	SetTo(pattern);
+}
+
+
+PatternTemplate::~PatternTemplate()
+{
+	free(fTokens);
+}
 
-			attrname.RemoveFirst("%ATTR:");
-			attrname.RemoveFirst("%");
 
-			attr_info info;
-			BNode node(&ref);
-			if (node.InitCheck() != B_OK) {
-				outstr.RemoveAll(attrpattern.String());
-				strpos = outstr.FindFirst("%ATTR:");
+void
+PatternTemplate::SetTo(const char* pattern)
+{
+	fPattern = pattern;
+	fCount = 0;
+
+	const char* string = fPattern.String();
+	int32 length = fPattern.Length();
+	int32 textStart = 0;
+	int32 pos = 0;
+
+	while (pos < length) {
+		const char* start = strchr(string + pos, '%');
+		if (start == NULL)
+			break;
+		const char* end = strchr(start + 1, '%');
+		if (end == NULL)
+			break;
+
+		// The name ends at the first colon, the argument is what follows
+		const char* name = start + 1;
+		const char* colon = (const char*)memchr(name, ':', end - name);
+		int32 nameLength = (colon != NULL ? colon : end) - name;
+		const char* argument = colon != NULL ? colon + 1 : end;
+		int32 argumentLength = end - argument;
+
+		uint8 type = TOKEN_TEXT;
+		int32 number = 0;
+		if (colon == NULL) {
+			number = ParseCaptureNumber(name, nameLength);
+			if (number > 0)
+				type = TOKEN_MATCH;
+		}
+		for (int32 i = 0; type == TOKEN_TEXT && i < kVariableCount; i++) {
+			const PatternVariable& variable = kVariables[i];
+			if ((int32)strlen(variable.name) != nameLength
+				|| strncmp(variable.name, name, nameLength) != 0)
 				continue;
+
+			if (colon != NULL ? variable.argument == ARGUMENT_NONE
+					: variable.argument == ARGUMENT_REQUIRED)
+				break;
+			if (variable.argument == ARGUMENT_REQUIRED && argumentLength == 0)
+				break;
+			if (ParseArgument(variable.type, argument, argumentLength, number))
+				type = variable.type;
+			break;
+		}
+
+		if (type == TOKEN_TEXT) {
+			// Not a variable, but the closing '%' may start one
+			pos = end - string;
+			continue;
+		}
+
+		int32 variableStart = start - string;
+		if (variableStart > textStart)
+			_AddToken(TOKEN_TEXT, textStart, variableStart - textStart);
+
+		_AddToken(type, argument - string, argumentLength, number);
+
+		pos = textStart = end + 1 - string;
+	}
+
+	if (length > textStart)
+		_AddToken(TOKEN_TEXT, textStart, length - textStart);
+}
+
+
+bool
+PatternTemplate::HasVariables() const
+{
+	for (int32 i = 0; i < fCount; i++) {
+		if (fTokens[i].type != TOKEN_TEXT)
+			return true;
+	}
+	return false;
+}
+
+
+void
+PatternTemplate::Expand(PatternContext& context, BString& output) const
+{
+	output = "";
+
+	const char* pattern = fPattern.String();
+	const entry_ref& ref = context.Ref();
+	char buffer[64];
+
+	for (int32 i = 0; i < fCount; i++) {
+		const PatternToken& token = fTokens[i];
+
+		switch (token.type) {
+			case TOKEN_TEXT:
+				output.Append(pattern + token.offset, token.length);
+				break;
+
+			case TOKEN_FILENAME:
+				output.Append(ref.name);
+				break;
+			case TOKEN_BASENAME:
+				output.Append(ref.name, context.BaseNameLength());
+				break;
+			case TOKEN_EXTENSION:
+				output.Append(ref.name + context.BaseNameLength());
+				break;
+			case TOKEN_FULLPATH:
+				output.Append(context.Path());
+				break;
+			case TOKEN_FOLDER:
+				output.Append(context.Path(), context.FolderLength());
+				break;
+
+			case TOKEN_DATE:
+			{
+				const struct tm& now = context.Now();
+				snprintf(buffer, sizeof(buffer), "%.2d-%.2d-%d", now.tm_mday,
+					now.tm_mon + 1, now.tm_year + 1900);
+				output.Append(buffer);
+				break;
+			}
+			case TOKEN_EURODATE:
+			{
+				const struct tm& now = context.Now();
+				snprintf(buffer, sizeof(buffer), "%.2d-%.2d-%d",
+					now.tm_mon + 1, now.tm_mday, now.tm_year + 1900);
+				output.Append(buffer);
+				break;
+			}
+			case TOKEN_REVERSEDATE:
+			{
+				const struct tm& now = context.Now();
+				snprintf(buffer, sizeof(buffer), "%d-%.2d-%.2d",
+					now.tm_year + 1900, now.tm_mon + 1, now.tm_mday);
+				output.Append(buffer);
+				break;
 			}
+			case TOKEN_TIME:
+			{
+				const struct tm& now = context.Now();
+				snprintf(buffer, sizeof(buffer), "%.2d:%.2d:%.2d", now.tm_hour,
+					now.tm_min, now.tm_sec);
+				output.Append(buffer);
+				break;
+			}
+
+			case TOKEN_ATTR:
+			{
+				BNode* node = context.Node();
+				if (node == NULL)
+					break;
 
-			if (node.GetAttrInfo(attrname.String(), &info) == B_OK) {
-				if (info.type == B_STRING_TYPE) {
-					node.ReadAttrString(attrname.String(), &string);
-					outstr.ReplaceAll(attrpattern.String(), string.String());
+				char name[B_ATTR_NAME_LENGTH];
+				int32 length = min_c(token.length, B_ATTR_NAME_LENGTH - 1);
+				memcpy(name, pattern + token.offset, length);
+				name[length] = '\0';
+
+				attr_info info;
+				if (node->GetAttrInfo(name, &info) != B_OK)
+					break;
+
+				if (info.type == B_STRING_TYPE && info.size > 0) {
+					// Read straight into the output
+					int32 end = output.Length();
+					char* data = output.LockBuffer(end + info.size + 1);
+					ssize_t bytes = node->ReadAttr(name, B_STRING_TYPE, 0,
+						data + end, info.size);
+					data[end + max_c(bytes, 0)] = '\0';
+					output.UnlockBuffer(-1);
 				} else if (info.type == B_INT32_TYPE) {
-					int32 attrdata;
-					if (node.ReadAttr(attrname.String(), B_INT32_TYPE, 0,
-						(void*)&attrdata, sizeof(int32)) == B_OK) {
-						string = "";
-						string << attrdata;
-						outstr.ReplaceAll(attrpattern.String(),
-							string.String());
+					int32 value;
+					if (node->ReadAttr(name, B_INT32_TYPE, 0, &value,
+							sizeof(value)) == sizeof(value)) {
+						snprintf(buffer, sizeof(buffer), "%" B_PRId32, value);
+						output.Append(buffer);
 					}
 				}
+				break;
+			}
+
+			case TOKEN_SIZE:
+			{
+				const struct stat* st = context.Stat();
+				if (st == NULL)
+					break;
+				snprintf(buffer, sizeof(buffer), "%" B_PRIdOFF,
+					st->st_size >> token.number);
+				output.Append(buffer);
+				break;
+			}
+
+			case TOKEN_MTIME:
+			{
+				const struct stat* st = context.Stat();
+				if (st == NULL)
+					break;
+
+				// The format uses '$' for the '%' that ends the variable
+				char format[B_FILE_NAME_LENGTH];
+				const char* argument = token.length > 0
+					? pattern + token.offset : kDefaultTimeFormat;
+				int32 length = token.length > 0
+					? token.length : (int32)strlen(kDefaultTimeFormat);
+				length = min_c(length, (int32)sizeof(format) - 1);
+				for (int32 j = 0; j < length; j++)
+					format[j] = argument[j] == '$' ? '%' : argument[j];
+				format[length] = '\0';
+
+				struct tm modified;
+				time_t mtime = st->st_mtime;
+				localtime_r(&mtime, &modified);
+
+				char date[B_FILE_NAME_LENGTH];
+				size_t dateLength = strftime(date, sizeof(date), format,
+					&modified);
+				output.Append(date, dateLength);
+				break;
+			}
+
+			case TOKEN_MIME:
+			{
+				const char* type = context.MimeType();
+				const char* slash = strchr(type, '/');
+				if (token.number == MIME_TYPE || slash == NULL)
+					output.Append(type);
+				else if (token.number == MIME_SUPERTYPE)
+					output.Append(type, slash - type);
+				else
+					output.Append(slash + 1);
+				break;
+			}
+
+			case TOKEN_HASH:
+			{
+				uint64 hash;
+				if (!context.Hash(hash))
+					break;
+				snprintf(buffer, sizeof(buffer), "%016" B_PRIx64, hash);
+				output.Append(buffer, token.number);
+				break;
+			}
+
+			case TOKEN_COUNTER:
+				snprintf(buffer, sizeof(buffer), "%0*" B_PRId64,
+					(int)token.number, context.Counter());
+				output.Append(buffer);
+				break;
+
+			case TOKEN_MATCH:
+			{
+				const char* capture;
+				if (token.number > 0)
+					capture = context.CaptureAt(token.number - 1);
+				else {
+					BString name(pattern + token.offset, token.length);
+					capture = context.Capture(name.String());
+				}
+				if (capture != NULL)
+					output.Append(capture);
+				break;
 			}
 		}
-		strpos = outstr.FindFirst("%ATTR:");
 	}
+}
+
+
+void
+PatternTemplate::_AddToken(uint8 type, int32 offset, int32 length,
+	int32 number)
+{
+	if (fCount == fCapacity) {
+		int32 capacity = fCapacity > 0 ? fCapacity * 2 : 8;
+		PatternToken* tokens = (PatternToken*)realloc(fTokens,
+			capacity * sizeof(PatternToken));
+		if (tokens == NULL)
+			return;
+		fTokens = tokens;
+		fCapacity = capacity;
+	}
+
+	PatternToken& token = fTokens[fCount++];
+	token.type = type;
+	token.offset = offset;
+	token.length = length;
+	token.number = number;
+}
+
+
+BString
+ProcessPatterns(const char* instr, const entry_ref& ref)
+{
+	if (!instr)
+		return BString();
+
+	PatternTemplate pattern(instr);
+	PatternContext context(ref);
+
+	BString outstr;
+	pattern.Expand(context, outstr);
 	return outstr;
 }
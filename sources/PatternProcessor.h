@@ -7,8 +7,98 @@
 #ifndef PATTERN_PROCESSOR_H
 #define PATTERN_PROCESSOR_H
 
+#include <sys/stat.h>
+#include <time.h>
+
 #include <Entry.h>
+#include <Message.h>
+#include <Node.h>
+#include <Path.h>
 #include <String.h>
+#include <StringList.h>
+
+struct PatternToken;
+
+// What's known about the file a pattern is expanded for. Everything is
+// only looked up when a pattern asks for it, and then kept for the next
+// pattern expanded for the same file.
+class PatternContext
+{
+public:
+							PatternContext(const entry_ref& ref);
+
+	// Starts over if the file isn't the same anymore, e.g. after it has
+	// been moved or renamed
+			void			SetTo(const entry_ref& ref);
+			const entry_ref& Ref() const { return fRef; }
+
+			const char*		Path();
+			int32			FolderLength();
+			int32			BaseNameLength();
+			const struct tm& Now();
+			BNode*			Node();
+			const struct stat* Stat();
+			const char*		MimeType();
+			bool			Hash(uint64& hash);
+	// Taken from a counter shared by everyone, once per file
+			int64			Counter();
+
+	// What the groups of the rule's regular expressions found. These stay
+	// with the file, even when it's moved or renamed.
+			void			AddCapture(const char* name, const char* text,
+								int32 length);
+			void			ClearCaptures();
+			int32			CountCaptures() const;
+			const char*		CaptureAt(int32 index) const;
+			const char*		Capture(const char* name) const;
+
+			void			ArchiveCaptures(BMessage& into) const;
+			void			UnarchiveCaptures(const BMessage& from);
+
+private:
+			entry_ref		fRef;
+			uint32			fKnown;
+			BPath			fPath;
+			int32			fBaseNameLength;
+			struct tm		fNow;
+			BNode			fNode;
+			struct stat		fStat;
+			BString			fMimeType;
+			uint64			fHash;
+			int64			fCounter;
+			BStringList		fCaptures;
+			BStringList		fCaptureNames;
+};
+
+
+// A pattern taken apart into the text between the variables and the
+// variables themselves, so it can be expanded in one go
+class PatternTemplate
+{
+public:
+							PatternTemplate(const char* pattern = NULL);
+							~PatternTemplate();
+
+			void			SetTo(const char* pattern);
+			const char*		Pattern() const { return fPattern.String(); }
+			bool			HasVariables() const;
+
+			void			Expand(PatternContext& context,
+								BString& output) const;
+
+private:
+							PatternTemplate(const PatternTemplate& other);
+			PatternTemplate& operator=(const PatternTemplate& other);
+
+			void			_AddToken(uint8 type, int32 offset, int32 length,
+								int32 number = 0);
+
+			BString			fPattern;
+			PatternToken*	fTokens;
+			int32			fCount;
+			int32			fCapacity;
+};
+
 
 BString ProcessPatterns(const char* instr, const entry_ref& ref);
 
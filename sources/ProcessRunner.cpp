@@ -0,0 +1,480 @@
+/*
+	ProcessRunner.cpp: Starts external programs for the actions, with time
+					limits and a cap on how many run at the same time
+	Released under the MIT license.
+*/
+
+#include "ProcessRunner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <Autolock.h>
+
+/*
+	Programs are started with posix_spawn() and the exact argument list the
+	action asks for. A shell is only involved if it is put there on purpose,
+	see ShellArguments().
+
+	Everything a program writes to stdout and stderr is captured and ends up
+	in the Filer's output, line by line, tagged with the process ID. If a
+	program is still running when its time is up, it's sent a SIGTERM and,
+	a little later, a SIGKILL.
+
+	Run() waits for the program to finish, Start() returns right away and
+	lets a thread of its own keep an eye on the program. Both wait for a
+	free slot first if as many programs as allowed are running already.
+*/
+
+extern char** environ;
+
+static const bigtime_t kDefaultTimeout = 10 * 60 * 1000000LL;
+static const bigtime_t kKillGracePeriod = 2 * 1000000LL;
+
+
+struct ProcessRunner::Process {
+	BStringList		arguments;
+	bigtime_t		deadline;
+	pid_t			pid;
+	int				outFD;
+	int				errFD;
+	thread_id		thread;
+	int32			exitCode;
+	ProcessRunner*	runner;
+};
+
+
+struct OutputStream {
+	int				fd;
+	const char*		name;
+	BString			pending;
+};
+
+
+static void
+LogOutput(OutputStream& stream, pid_t pid, bool flush)
+{
+	int32 end;
+	while ((end = stream.pending.FindFirst('\n')) >= 0) {
+		BString line;
+		stream.pending.MoveInto(line, 0, end + 1);
+		line.Truncate(end);
+		printf("\t\t[%d] %s: %s\n", (int)pid, stream.name, line.String());
+	}
+
+	if (flush && !stream.pending.IsEmpty()) {
+		printf("\t\t[%d] %s: %s\n", (int)pid, stream.name,
+			stream.pending.String());
+		stream.pending = "";
+	}
+}
+
+
+static void
+Terminate(pid_t pid)
+{
+	kill(pid, SIGTERM);
+
+	bigtime_t until = system_time() + kKillGracePeriod;
+	while (system_time() < until) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return;
+		snooze(20000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+
+ProcessRunner::ProcessRunner()
+	:
+	fLock("process runner"),
+	fSlots(-1),
+	fConcurrency(0),
+	fSlotDebt(0),
+	fTimeout(kDefaultTimeout),
+	fRunning(10, false)
+{
+	system_info info;
+	get_system_info(&info);
+	SetConcurrency(info.cpu_count * 2);
+}
+
+
+ProcessRunner::~ProcessRunner()
+{
+	WaitForAll();
+	delete_sem(fSlots);
+}
+
+
+ProcessRunner*
+ProcessRunner::Default()
+{
+	static ProcessRunner sDefault;
+	return &sDefault;
+}
+
+
+void
+ProcessRunner::SetConcurrency(int32 limit)
+{
+	if (limit < 1)
+		limit = 1;
+
+	BAutolock _(fLock);
+
+	if (fSlots < 0) {
+		fSlots = create_sem(limit, "process slots");
+		fConcurrency = limit;
+		return;
+	}
+
+	// Slots taken by programs still running are given up once they end,
+	// so lowering the limit never waits for them
+	if (limit > fConcurrency) {
+		int32 more = limit - fConcurrency;
+		int32 forgiven = min_c(more, fSlotDebt);
+		fSlotDebt -= forgiven;
+		if (more > forgiven)
+			release_sem_etc(fSlots, more - forgiven, 0);
+	} else if (limit < fConcurrency) {
+		for (int32 i = fConcurrency - limit; i > 0; i--) {
+			if (acquire_sem_etc(fSlots, 1, B_RELATIVE_TIMEOUT, 0) != B_OK)
+				fSlotDebt++;
+		}
+	}
+
+	fConcurrency = limit;
+}
+
+
+void
+ProcessRunner::SetTimeout(bigtime_t timeout)
+{
+	fTimeout = timeout;
+}
+
+
+status_t
+ProcessRunner::Run(const BStringList& arguments, int32* exitCode)
+{
+	Process process;
+	process.arguments = arguments;
+	process.thread = -1;
+	process.runner = this;
+
+	status_t status = _Spawn(&process);
+	if (status != B_OK)
+		return status;
+
+	status = _Watch(&process);
+	_ReleaseSlot();
+
+	if (exitCode != NULL)
+		*exitCode = process.exitCode;
+
+	return status;
+}
+
+
+status_t
+ProcessRunner::Start(const BStringList& arguments)
+{
+	Process* process = new Process;
+	process->arguments = arguments;
+	process->thread = -1;
+	process->runner = this;
+
+	status_t status = _Spawn(process);
+	if (status != B_OK) {
+		delete process;
+		return status;
+	}
+
+	process->thread = spawn_thread(_WatchThread, "process watcher",
+		B_NORMAL_PRIORITY, process);
+	if (process->thread < 0) {
+		// No thread to spare: watch it here and now
+		status = _Watch(process);
+		_ReleaseSlot();
+		delete process;
+		return status;
+	}
+
+	fLock.Lock();
+	fRunning.AddItem(process);
+	fLock.Unlock();
+
+	resume_thread(process->thread);
+	return B_OK;
+}
+
+
+void
+ProcessRunner::WaitForAll()
+{
+	for (;;) {
+		thread_id thread;
+		{
+			BAutolock _(fLock);
+			if (fRunning.IsEmpty())
+				return;
+			thread = fRunning.ItemAt(0)->thread;
+		}
+
+		status_t result;
+		wait_for_thread(thread, &result);
+	}
+}
+
+
+void
+ProcessRunner::ShellArguments(const char* command, BStringList& arguments)
+{
+	arguments.MakeEmpty();
+	arguments.Add("/bin/sh");
+	arguments.Add("-c");
+	arguments.Add(command);
+}
+
+
+status_t
+ProcessRunner::_Spawn(Process* process)
+{
+	int32 count = process->arguments.CountStrings();
+	if (count == 0)
+		return B_BAD_VALUE;
+
+	while (acquire_sem(fSlots) == B_INTERRUPTED)
+		;
+
+	int outPipe[2];
+	int errPipe[2];
+	if (pipe(outPipe) != 0) {
+		status_t status = errno;
+		_ReleaseSlot();
+		return status;
+	}
+	if (pipe(errPipe) != 0) {
+		status_t status = errno;
+		close(outPipe[0]);
+		close(outPipe[1]);
+		_ReleaseSlot();
+		return status;
+	}
+
+	// Keeps other programs started in the meantime from inheriting our
+	// pipes, which would hold them open until those end as well
+	for (int i = 0; i < 2; i++) {
+		fcntl(outPipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(errPipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+		O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, errPipe[1], STDERR_FILENO);
+
+	// StringAt() hands out copies, they need a place to live until the
+	// program is started
+	const char** argv = new const char*[count + 1];
+	BString* strings = new BString[count];
+	for (int32 i = 0; i < count; i++) {
+		strings[i] = process->arguments.StringAt(i);
+		argv[i] = strings[i].String();
+	}
+	argv[count] = NULL;
+
+	pid_t pid;
+	int result = posix_spawnp(&pid, argv[0], &actions, NULL,
+		(char* const*)argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	delete[] argv;
+	delete[] strings;
+
+	close(outPipe[1]);
+	close(errPipe[1]);
+
+	if (result != 0) {
+		close(outPipe[0]);
+		close(errPipe[0]);
+		_ReleaseSlot();
+		printf("\t\tCouldn't start %s: %s\n",
+			process->arguments.StringAt(0).String(), strerror(result));
+		return result;
+	}
+
+	process->pid = pid;
+	process->outFD = outPipe[0];
+	process->errFD = errPipe[0];
+	process->exitCode = 0;
+	process->deadline = fTimeout > 0 ? system_time() + fTimeout
+		: B_INFINITE_TIMEOUT;
+
+	return B_OK;
+}
+
+
+status_t
+ProcessRunner::_Watch(Process* process)
+{
+	OutputStream streams[2];
+	streams[0].fd = process->outFD;
+	streams[0].name = "stdout";
+	streams[1].fd = process->errFD;
+	streams[1].name = "stderr";
+
+	bool timedOut = false;
+	int openStreams = 2;
+	char buffer[4096];
+
+	while (openStreams > 0 && !timedOut) {
+		struct pollfd fds[2];
+		OutputStream* polled[2];
+		int count = 0;
+		for (int i = 0; i < 2; i++) {
+			if (streams[i].fd < 0)
+				continue;
+			fds[count].fd = streams[i].fd;
+			fds[count].events = POLLIN;
+			fds[count].revents = 0;
+			polled[count] = &streams[i];
+			count++;
+		}
+
+		int timeout = -1;
+		if (process->deadline != B_INFINITE_TIMEOUT) {
+			bigtime_t left = process->deadline - system_time();
+			if (left <= 0) {
+				timedOut = true;
+				break;
+			}
+			timeout = (int)min_c(left / 1000 + 1, 1000);
+		}
+
+		int ready = poll(fds, count, timeout);
+		if (ready < 0 && errno != EINTR)
+			break;
+		if (ready <= 0)
+			continue;
+
+		for (int i = 0; i < count; i++) {
+			if (fds[i].revents == 0)
+				continue;
+
+			OutputStream& stream = *polled[i];
+			ssize_t bytes = read(stream.fd, buffer, sizeof(buffer));
+			if (bytes > 0) {
+				stream.pending.Append(buffer, bytes);
+				LogOutput(stream, process->pid, false);
+			} else if (bytes == 0 || errno != EINTR) {
+				close(stream.fd);
+				stream.fd = -1;
+				openStreams--;
+			}
+		}
+	}
+
+	for (int i = 0; i < 2; i++) {
+		LogOutput(streams[i], process->pid, true);
+		if (streams[i].fd >= 0)
+			close(streams[i].fd);
+	}
+
+	// The program may have closed its output, but still be busy
+	int status = 0;
+	status_t waitError = B_OK;
+	while (!timedOut) {
+		pid_t result = waitpid(process->pid, &status, WNOHANG);
+		if (result == process->pid)
+			break;
+		if (result < 0 && errno != EINTR) {
+			waitError = errno;
+			break;
+		}
+
+		if (process->deadline != B_INFINITE_TIMEOUT
+			&& system_time() >= process->deadline)
+			timedOut = true;
+		else
+			snooze(10000);
+	}
+
+	if (timedOut) {
+		printf("\t\t[%d] Killed %s after %" B_PRId64 " seconds\n",
+			(int)process->pid, process->arguments.StringAt(0).String(),
+			process->runner->Timeout() / 1000000);
+		Terminate(process->pid);
+		process->exitCode = PROCESS_TIMED_OUT;
+		return B_TIMED_OUT;
+	}
+
+	// Whether it worked isn't known
+	if (waitError != B_OK) {
+		printf("\t\t[%d] Couldn't wait for %s: %s\n", (int)process->pid,
+			process->arguments.StringAt(0).String(), strerror(waitError));
+		return waitError;
+	}
+
+	if (WIFEXITED(status))
+		process->exitCode = WEXITSTATUS(status);
+	else {
+		printf("\t\t[%d] %s ended by signal %d\n", (int)process->pid,
+			process->arguments.StringAt(0).String(), WTERMSIG(status));
+		process->exitCode = 128 + WTERMSIG(status);
+	}
+
+	return B_OK;
+}
+
+
+status_t
+ProcessRunner::_WatchThread(void* data)
+{
+	Process* process = (Process*)data;
+	status_t status = _Watch(process);
+
+	if (process->exitCode != 0 && status == B_OK) {
+		printf("\t\t[%d] %s returned %" B_PRId32 "\n", (int)process->pid,
+			process->arguments.StringAt(0).String(), process->exitCode);
+	}
+
+	process->runner->_Finished(process);
+	return status;
+}
+
+
+void
+ProcessRunner::_Finished(Process* process)
+{
+	BAutolock _(fLock);
+
+	fRunning.RemoveItem(process);
+	_ReleaseSlot();
+	delete process;
+}
+
+
+void
+ProcessRunner::_ReleaseSlot()
+{
+	BAutolock _(fLock);
+
+	if (fSlotDebt > 0)
+		fSlotDebt--;
+	else
+		release_sem(fSlots);
+}
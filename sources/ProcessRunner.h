@@ -0,0 +1,60 @@
+/*
+	ProcessRunner.h: Starts external programs for the actions, with time
+					limits and a cap on how many run at the same time
+	Released under the MIT license.
+*/
+
+#ifndef PROCESS_RUNNER_H
+#define PROCESS_RUNNER_H
+
+#include <Locker.h>
+#include <OS.h>
+#include <String.h>
+#include <StringList.h>
+
+#include "ObjectList.h"
+
+// Exit code reported for programs that had to be killed
+#define PROCESS_TIMED_OUT	-1
+
+class ProcessRunner
+{
+public:
+								ProcessRunner();
+								~ProcessRunner();
+
+	static	ProcessRunner*		Default();
+
+			void				SetConcurrency(int32 limit);
+			void				SetTimeout(bigtime_t timeout);
+			bigtime_t			Timeout() const { return fTimeout; }
+
+	// Both take the program and its arguments as they are, no shell is
+	// involved. Use ShellArguments() to get one.
+			status_t			Run(const BStringList& arguments,
+									int32* exitCode = NULL);
+			status_t			Start(const BStringList& arguments);
+			void				WaitForAll();
+
+	static	void				ShellArguments(const char* command,
+									BStringList& arguments);
+
+private:
+	struct Process;
+
+			status_t			_Spawn(Process* process);
+	static	status_t			_Watch(Process* process);
+	static	status_t			_WatchThread(void* data);
+			void				_Finished(Process* process);
+			void				_ReleaseSlot();
+
+			BLocker				fLock;
+			sem_id				fSlots;
+			int32				fConcurrency;
+			// Slots given up by lowering the limit while they were taken
+			int32				fSlotDebt;
+			bigtime_t			fTimeout;
+			BObjectList<Process>	fRunning;
+};
+
+#endif	// PROCESS_RUNNER_H
@@ -6,22 +6,41 @@
 		Owen Pan <owen.pan@yahoo.com>, 2017
 */
 
-#include <Autolock.h>
+#include <string.h>
+
+#include <Directory.h>
 #include <File.h>
 #include <FindDirectory.h>
 #include <Path.h>
+#include <StringList.h>
+#include <Volume.h>
+#include <VolumeRoster.h>
 
 #include "RefStorage.h"
 
-BList gRefStructList;
-BLocker gRefLock;
+FolderRegistry gFolders;
 
 const char gPrefsPath[] = "Filer/AutoFilerFolders";
+static const char kMarksPath[] = "Filer/AutoFilerMarks";
+
+static const int32 kInitialTableSize = 64;
+
+struct OfflineFolder {
+	BString		path;
+	BStringList	rules;
+	BStringList	ruleSets;
+	time_t		mark;
+};
+
 
 RefStorage::RefStorage(const entry_ref& fileref)
 	:
 	doAll(false),
-	replace(false)
+	replace(false),
+	keepBoth(false),
+	mark(0),
+	fHashNext(NULL),
+	fListed(false)
 {
 	SetData(fileref);
 }
@@ -34,26 +53,108 @@ RefStorage::SetData(const entry_ref& fileref)
 	if (entry.Exists()) {
 		entry.GetRef(&ref);
 		entry.GetNodeRef(&nref);
+		path = BPath(&ref).Path();
 	}
 }
 
 
-status_t
-LoadFolders(BListView* folderList)
+// A folder that isn't below the mount point of any mounted volume, only
+// in the root file system that holds the mount points, is on a volume
+// that isn't mounted
+static bool
+OnMissingVolume(const char* path)
+{
+	BVolumeRoster roster;
+	BVolume volume;
+	while (roster.GetNextVolume(&volume) == B_OK) {
+		BDirectory root;
+		BEntry entry;
+		BPath mountPoint;
+		if (volume.GetRootDirectory(&root) != B_OK
+			|| root.GetEntry(&entry) != B_OK
+			|| entry.GetPath(&mountPoint) != B_OK)
+			continue;
+
+		size_t length = strlen(mountPoint.Path());
+		if (length > 1 && strncmp(path, mountPoint.Path(), length) == 0
+			&& (path[length] == '/' || path[length] == '\0'))
+			return false;
+	}
+	return true;
+}
+
+
+static void
+ReadRules(const BMessage& folderRules, BStringList& rules,
+	BStringList& ruleSets)
+{
+	rules.MakeEmpty();
+	ruleSets.MakeEmpty();
+
+	BString name;
+	for (int32 i = 0; folderRules.FindString("rule", i, &name) == B_OK; i++)
+		rules.Add(name);
+	for (int32 i = 0; folderRules.FindString("set", i, &name) == B_OK; i++)
+		ruleSets.Add(name);
+}
+
+
+// Each path is followed by a "rules" message, with the names of the rules
+// and rule sets run on its files. Those are kept for the folders that are
+// still there.
+static status_t
+WriteFolders(const BStringList& paths)
 {
 	BPath path;
 	find_directory(B_USER_SETTINGS_DIRECTORY, &path);
 	path.Append(gPrefsPath);
 
-	if (!BEntry(path.Path()).Exists())
-		return B_OK;
+	BMessage old;
+	BFile oldFile(path.Path(), B_READ_ONLY);
+	if (oldFile.InitCheck() == B_OK)
+		old.Unflatten(&oldFile);
+	oldFile.Unset();
 
-	if (folderList == NULL) {
-		BAutolock autolock(&gRefLock);
-		if (!autolock.IsLocked())
-			return B_BUSY;
+	BMessage msg;
+	for (int32 i = 0; i < paths.CountStrings(); i++) {
+		msg.AddString("path", paths.StringAt(i));
+
+		BMessage rules;
+		BString oldPath;
+		for (int32 j = 0; old.FindString("path", j, &oldPath) == B_OK; j++) {
+			if (oldPath == paths.StringAt(i)) {
+				old.FindMessage("rules", j, &rules);
+				break;
+			}
+		}
+		msg.AddMessage("rules", &rules);
 	}
 
+	BFile file(path.Path(),B_READ_WRITE | B_CREATE_FILE | B_ERASE_FILE);
+	status_t status = file.InitCheck();
+	if (status != B_OK)
+		return status;
+
+	status = msg.Flatten(&file);
+	return status;
+}
+
+
+// Reads the saved folders that still exist, and saves them again, if some
+// were gone or they were saved in the old format. Those on a volume that
+// isn't mounted are kept, and only listed as offline.
+static status_t
+ReadFolders(BStringList& paths, BObjectList<entry_ref>* refs,
+	BObjectList<BMessage>* rules = NULL,
+	BObjectList<OfflineFolder>* offline = NULL)
+{
+	BPath path;
+	find_directory(B_USER_SETTINGS_DIRECTORY, &path);
+	path.Append(gPrefsPath);
+
+	if (!BEntry(path.Path()).Exists())
+		return B_OK;
+
 	BFile file(path.Path(), B_READ_ONLY);
 	status_t status = file.InitCheck();
 	if (status != B_OK)
@@ -65,41 +166,58 @@ LoadFolders(BListView* folderList)
 		return status;
 
 	int32 i;
-	int32 count = 0;
 
 	// try to load folders in the new paths format
 	BString str;
 	for (i = 0; msg.FindString("path", i, &str) == B_OK; i++) {
 		BEntry entry(str.String());
 		if (entry.InitCheck() != B_OK || !entry.Exists()
-			|| !entry.IsDirectory())
+			|| !entry.IsDirectory()) {
+			if (!OnMissingVolume(str.String()))
+				continue;
+
+			if (offline != NULL) {
+				OfflineFolder* folder = new OfflineFolder;
+				folder->path = str;
+				folder->mark = 0;
+				BMessage folderRules;
+				msg.FindMessage("rules", i, &folderRules);
+				ReadRules(folderRules, folder->rules, folder->ruleSets);
+				offline->AddItem(folder);
+			}
+
+			paths.Add(str);
 			continue;
+		}
 
-		if (folderList == NULL) {
+		if (refs != NULL) {
 			entry_ref ref;
 			if (entry.GetRef(&ref) != B_OK)
 				continue;
 
-			gRefStructList.AddItem(new RefStorage(ref));
-		} else
-			folderList->AddItem(new BStringItem(str));
+			refs->AddItem(new entry_ref(ref));
+		}
 
-		count++;
+		if (rules != NULL) {
+			BMessage* folderRules = new BMessage;
+			msg.FindMessage("rules", i, folderRules);
+			rules->AddItem(folderRules);
+		}
+
+		paths.Add(str);
 	}
 
 	if (i > 0) {
 		// at least one data field in paths format was found
 
-		if (count < i)
-			SaveFolders(folderList);
+		if (paths.CountStrings() < i)
+			WriteFolders(paths);
 
 		return B_OK;
 	}
 
 	// folders are not in paths format, so load them in refs format
 
-	count = 0;
-
 	entry_ref ref;
 	for (i = 0; msg.FindRef("refs", i, &ref) == B_OK; i++) {
 		BEntry entry(&ref);
@@ -107,36 +225,31 @@ LoadFolders(BListView* folderList)
 			|| !entry.IsDirectory())
 			continue;
 
-		if (folderList == NULL)
-			gRefStructList.AddItem(new RefStorage(ref));
-		else
-			folderList->AddItem(new BStringItem(BPath(&ref).Path()));
+		if (refs != NULL)
+			refs->AddItem(new entry_ref(ref));
+		if (rules != NULL)
+			rules->AddItem(new BMessage);
 
-		count++;
+		paths.Add(BPath(&ref).Path());
 	}
 
-	if (count > 0)
-		SaveFolders(folderList);	// save folders in the new paths format
+	if (paths.CountStrings() > 0)
+		WriteFolders(paths);	// save folders in the new paths format
 
 	return B_OK;
 }
 
 
 status_t
-ReloadFolders()
+LoadFolders(BListView* folderList)
 {
-	BAutolock autolock(&gRefLock);
-	if (!autolock.IsLocked())
-		return B_BUSY;
-
-	for (int32 i = 0; i < gRefStructList.CountItems(); i++)
-	{
-		RefStorage* refholder = (RefStorage*)gRefStructList.ItemAt(i);
-		delete refholder;
-	}
-	gRefStructList.MakeEmpty();
+	BStringList paths;
+	status_t status = ReadFolders(paths, NULL);
+	if (status != B_OK)
+		return status;
 
-	LoadFolders();
+	for (int32 i = 0; i < paths.CountStrings(); i++)
+		folderList->AddItem(new BStringItem(paths.StringAt(i)));
 
 	return B_OK;
 }
@@ -145,36 +258,410 @@ ReloadFolders()
 status_t
 SaveFolders(const BListView* folderList)
 {
-	int32 count;
+	BStringList paths;
 
 	if (folderList == NULL) {
-		BAutolock autolock(&gRefLock);
-		if (!autolock.IsLocked())
+		if (!gFolders.ReadLock())
 			return B_BUSY;
 
-		count = gRefStructList.CountItems();
-	} else
-		count = folderList->CountItems();
+		for (int32 i = 0; i < gFolders.CountFolders(); i++)
+			paths.Add(BPath(&gFolders.FolderAt(i)->ref).Path());
+		gFolders.GetOfflinePaths(paths);
+
+		gFolders.ReadUnlock();
+	} else {
+		for (int32 i = 0; i < folderList->CountItems(); i++)
+			paths.Add(((BStringItem*) folderList->ItemAt(i))->Text());
+	}
+
+	return WriteFolders(paths);
+}
+
+
+//	#pragma mark - FolderRegistry
+
+
+FolderRegistry::FolderRegistry()
+	:
+	fFolders(20, true),
+	fOffline(20, true),
+	fTable(NULL),
+	fTableSize(0)
+{
+	pthread_rwlock_init(&fLock, NULL);
+	_Resize(kInitialTableSize);
+}
+
+
+FolderRegistry::~FolderRegistry()
+{
+	delete[] fTable;
+	pthread_rwlock_destroy(&fLock);
+}
+
+
+bool
+FolderRegistry::ReadLock()
+{
+	return pthread_rwlock_rdlock(&fLock) == 0;
+}
+
+
+void
+FolderRegistry::ReadUnlock()
+{
+	pthread_rwlock_unlock(&fLock);
+}
+
+
+bool
+FolderRegistry::WriteLock()
+{
+	return pthread_rwlock_wrlock(&fLock) == 0;
+}
+
+
+void
+FolderRegistry::WriteUnlock()
+{
+	pthread_rwlock_unlock(&fLock);
+}
+
+
+RefStorage*
+FolderRegistry::Find(const node_ref& node) const
+{
+	RefStorage* folder = fTable[_Hash(node)];
+	while (folder != NULL && folder->nref != node)
+		folder = folder->fHashNext;
+	return folder;
+}
+
+
+RefStorage*
+FolderRegistry::FindParent(const entry_ref& ref) const
+{
+	node_ref node;
+	node.device = ref.device;
+	node.node = ref.directory;
+	return Find(node);
+}
+
+
+void
+FolderRegistry::GetOfflinePaths(BStringList& paths) const
+{
+	for (int32 i = 0; i < fOffline.CountItems(); i++)
+		paths.Add(fOffline.ItemAt(i)->path);
+}
+
+
+RefStorage*
+FolderRegistry::Add(const entry_ref& ref)
+{
+	if (!WriteLock())
+		return NULL;
+
+	RefStorage* folder = _Add(ref);
+
+	WriteUnlock();
+	return folder;
+}
+
+
+bool
+FolderRegistry::Remove(const node_ref& node)
+{
+	if (!WriteLock())
+		return false;
+
+	RefStorage* folder = Find(node);
+	if (folder != NULL)
+		_RemoveAt(fFolders.IndexOf(folder));
+
+	WriteUnlock();
+	return folder != NULL;
+}
+
+
+status_t
+FolderRegistry::LoadMarks()
+{
+	BPath path;
+	find_directory(B_USER_SETTINGS_DIRECTORY, &path);
+	path.Append(kMarksPath);
+
+	BFile file(path.Path(), B_READ_ONLY);
+	status_t status = file.InitCheck();
+	if (status != B_OK)
+		return status;
 
 	BMessage msg;
+	status = msg.Unflatten(&file);
+	if (status != B_OK)
+		return status;
+
+	if (!WriteLock())
+		return B_BUSY;
 
-	for (int32 i = 0; i < count; i++)
-		if (folderList == NULL) {
-			RefStorage* refholder = (RefStorage*)gRefStructList.ItemAt(i);
-			BPath path(&refholder->ref);
-			msg.AddString("path", path.Path());
-		} else
-			msg.AddString("path", ((BStringItem*) folderList->ItemAt(i))->Text());
+	BString folder;
+	int64 mark;
+	for (int32 i = 0; msg.FindString("path", i, &folder) == B_OK
+			&& msg.FindInt64("mark", i, &mark) == B_OK; i++) {
+		OfflineFolder* offline = _FindOffline(folder);
+		if (offline != NULL) {
+			offline->mark = mark;
+			continue;
+		}
+
+		node_ref node;
+		if (BEntry(folder.String()).GetNodeRef(&node) != B_OK)
+			continue;
+
+		RefStorage* refholder = Find(node);
+		if (refholder != NULL)
+			refholder->mark = mark;
+	}
+
+	WriteUnlock();
+	return B_OK;
+}
+
+
+status_t
+FolderRegistry::SaveMarks(time_t mark)
+{
+	if (!WriteLock())
+		return B_BUSY;
+
+	BMessage msg;
+	for (int32 i = 0; i < fFolders.CountItems(); i++) {
+		RefStorage* refholder = fFolders.ItemAt(i);
+		refholder->mark = mark;
+
+		msg.AddString("path", refholder->path);
+		msg.AddInt64("mark", refholder->mark);
+	}
+
+	// Nothing on the volumes that aren't mounted was filed since
+	for (int32 i = 0; i < fOffline.CountItems(); i++) {
+		msg.AddString("path", fOffline.ItemAt(i)->path);
+		msg.AddInt64("mark", fOffline.ItemAt(i)->mark);
+	}
+
+	WriteUnlock();
 
 	BPath path;
 	find_directory(B_USER_SETTINGS_DIRECTORY, &path);
-	path.Append(gPrefsPath);
+	path.Append(kMarksPath);
 
-	BFile file(path.Path(),B_READ_WRITE | B_CREATE_FILE | B_ERASE_FILE);
+	BFile file(path.Path(), B_READ_WRITE | B_CREATE_FILE | B_ERASE_FILE);
 	status_t status = file.InitCheck();
 	if (status != B_OK)
 		return status;
 
-	status = msg.Flatten(&file);
-	return status;
+	return msg.Flatten(&file);
+}
+
+
+status_t
+FolderRegistry::Reload(BObjectList<node_ref>* added,
+	BObjectList<node_ref>* removed)
+{
+	BStringList paths;
+	BObjectList<entry_ref> refs(20, true);
+	BObjectList<BMessage> rules(20, true);
+	BObjectList<OfflineFolder> offline(20, true);
+	status_t status = ReadFolders(paths, &refs, &rules, &offline);
+	if (status != B_OK)
+		return status;
+
+	if (!WriteLock())
+		return B_BUSY;
+
+	// Folders that went offline keep their marks
+	for (int32 i = 0; i < offline.CountItems(); i++) {
+		OfflineFolder* folder = offline.ItemAt(i);
+		OfflineFolder* old = _FindOffline(folder->path);
+		if (old != NULL)
+			folder->mark = old->mark;
+		for (int32 j = 0; j < fFolders.CountItems(); j++) {
+			if (fFolders.ItemAt(j)->path == folder->path)
+				folder->mark = fFolders.ItemAt(j)->mark;
+		}
+	}
+
+	fOffline.MakeEmpty();
+	while (!offline.IsEmpty())
+		fOffline.AddItem(offline.RemoveItemAt(0));
+
+	for (int32 i = 0; i < fFolders.CountItems(); i++)
+		fFolders.ItemAt(i)->fListed = false;
+
+	for (int32 i = 0; i < refs.CountItems(); i++) {
+		const entry_ref& ref = *refs.ItemAt(i);
+
+		node_ref node;
+		if (BEntry(&ref).GetNodeRef(&node) != B_OK)
+			continue;
+
+		// Folders watched already keep the choices made for conflicts
+		RefStorage* folder = Find(node);
+		if (folder != NULL) {
+			folder->ref = ref;
+			folder->path = BPath(&ref).Path();
+		} else {
+			folder = _Add(ref);
+			if (folder == NULL)
+				continue;
+			if (added != NULL)
+				added->AddItem(new node_ref(folder->nref));
+		}
+		folder->fListed = true;
+
+		ReadRules(*rules.ItemAt(i), folder->rules, folder->ruleSets);
+	}
+
+	for (int32 i = fFolders.CountItems() - 1; i >= 0; i--) {
+		RefStorage* folder = fFolders.ItemAt(i);
+		if (folder->fListed)
+			continue;
+
+		if (removed != NULL)
+			removed->AddItem(new node_ref(folder->nref));
+		_RemoveAt(i);
+	}
+
+	WriteUnlock();
+	return B_OK;
+}
+
+
+void
+FolderRegistry::VolumeMounted(dev_t device, BObjectList<node_ref>& added)
+{
+	if (!WriteLock())
+		return;
+
+	for (int32 i = fOffline.CountItems() - 1; i >= 0; i--) {
+		OfflineFolder* offline = fOffline.ItemAt(i);
+
+		BEntry entry(offline->path.String());
+		entry_ref ref;
+		node_ref node;
+		if (!entry.IsDirectory() || entry.GetRef(&ref) != B_OK
+			|| entry.GetNodeRef(&node) != B_OK || node.device != device)
+			continue;
+
+		RefStorage* folder = _Add(ref);
+		if (folder != NULL) {
+			folder->rules = offline->rules;
+			folder->ruleSets = offline->ruleSets;
+			folder->mark = offline->mark;
+			added.AddItem(new node_ref(folder->nref));
+		}
+		delete fOffline.RemoveItemAt(i);
+	}
+
+	WriteUnlock();
+}
+
+
+void
+FolderRegistry::VolumeUnmounted(dev_t device, BObjectList<node_ref>& removed)
+{
+	if (!WriteLock())
+		return;
+
+	for (int32 i = fFolders.CountItems() - 1; i >= 0; i--) {
+		RefStorage* folder = fFolders.ItemAt(i);
+		if (folder->nref.device != device)
+			continue;
+
+		OfflineFolder* offline = new OfflineFolder;
+		offline->path = folder->path;
+		offline->rules = folder->rules;
+		offline->ruleSets = folder->ruleSets;
+		offline->mark = folder->mark;
+		fOffline.AddItem(offline);
+
+		removed.AddItem(new node_ref(folder->nref));
+		_RemoveAt(i);
+	}
+
+	WriteUnlock();
+}
+
+
+uint32
+FolderRegistry::_Hash(const node_ref& node) const
+{
+	uint64 hash = (uint64)node.node * 31 + node.device;
+	return (uint32)(hash ^ (hash >> 32)) & (fTableSize - 1);
+}
+
+
+RefStorage*
+FolderRegistry::_Add(const entry_ref& ref)
+{
+	RefStorage* folder = new RefStorage(ref);
+	if (folder->nref.device < 0 || Find(folder->nref) != NULL) {
+		delete folder;
+		return NULL;
+	}
+
+	if (fFolders.CountItems() >= fTableSize)
+		_Resize(fTableSize * 2);
+
+	uint32 index = _Hash(folder->nref);
+	folder->fHashNext = fTable[index];
+	fTable[index] = folder;
+
+	fFolders.AddItem(folder);
+	return folder;
+}
+
+
+OfflineFolder*
+FolderRegistry::_FindOffline(const BString& path) const
+{
+	for (int32 i = 0; i < fOffline.CountItems(); i++) {
+		if (fOffline.ItemAt(i)->path == path)
+			return fOffline.ItemAt(i);
+	}
+	return NULL;
+}
+
+
+void
+FolderRegistry::_RemoveAt(int32 index)
+{
+	RefStorage* folder = fFolders.RemoveItemAt(index);
+	if (folder == NULL)
+		return;
+
+	RefStorage** link = &fTable[_Hash(folder->nref)];
+	while (*link != NULL && *link != folder)
+		link = &(*link)->fHashNext;
+	if (*link != NULL)
+		*link = folder->fHashNext;
+
+	delete folder;
+}
+
+
+void
+FolderRegistry::_Resize(int32 size)
+{
+	delete[] fTable;
+	fTable = new RefStorage*[size];
+	fTableSize = size;
+	memset(fTable, 0, sizeof(RefStorage*) * size);
+
+	for (int32 i = 0; i < fFolders.CountItems(); i++) {
+		RefStorage* folder = fFolders.ItemAt(i);
+		uint32 index = _Hash(folder->nref);
+		folder->fHashNext = fTable[index];
+		fTable[index] = folder;
+	}
 }
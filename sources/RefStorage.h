@@ -1,14 +1,21 @@
 #ifndef REFSTORAGE_H
 #define REFSTORAGE_H
 
+#include <pthread.h>
+#include <time.h>
+
 #include <Entry.h>
 #include <ListView.h>
+#include <Node.h>
 #include <String.h>
+#include <StringList.h>
+
+#include "ObjectList.h"
 
-extern BList gRefStructList;
-extern BLocker gRefLock;
 extern const char gPrefsPath[];
 
+struct OfflineFolder;
+
 
 class RefStorage
 {
@@ -18,12 +25,95 @@ public:
 
 	entry_ref	ref;
 	node_ref	nref;
+	// Where it is, for when its volume is gone
+	BString		path;
 	bool		doAll;
 	bool		replace;
+	bool		keepBoth;
+	// Everything that turned up before was filed, 0 if not known
+	time_t		mark;
+	// The only rules run on its files, by name, and the rule sets whose
+	// rules are. With neither, all rules are.
+	BStringList	rules;
+	BStringList	ruleSets;
+
+private:
+	friend class FolderRegistry;
+
+	RefStorage*	fHashNext;
+	bool		fListed;
 };
 
-status_t LoadFolders(BListView* folderList = NULL);
-status_t ReloadFolders();
+
+/*
+	The folders watched by the AutoFiler, looked up by their node_ref for
+	every event. Files are found by the node_ref made from the device and
+	directory of their entry_ref.
+
+	Lookups only need the read lock, and may run side by side. Adding and
+	removing folders, and changing the conflict choices of one, needs the
+	write lock.
+
+	Folders on a volume that isn't mounted are kept aside by their path,
+	along with their rules and their mark, until it is.
+*/
+class FolderRegistry
+{
+public:
+							FolderRegistry();
+							~FolderRegistry();
+
+			bool			ReadLock();
+			void			ReadUnlock();
+			bool			WriteLock();
+			void			WriteUnlock();
+
+	// These need one of the locks
+			RefStorage*		Find(const node_ref& node) const;
+			RefStorage*		FindParent(const entry_ref& ref) const;
+			int32			CountFolders() const
+								{ return fFolders.CountItems(); }
+			RefStorage*		FolderAt(int32 index) const
+								{ return fFolders.ItemAt(index); }
+			void			GetOfflinePaths(BStringList& paths) const;
+
+	// These take the write lock themselves
+			RefStorage*		Add(const entry_ref& ref);
+			bool			Remove(const node_ref& node);
+
+	// The marks are kept apart from the folders, so the Filer can save
+	// those without knowing about them
+			status_t		LoadMarks();
+			status_t		SaveMarks(time_t mark);
+
+	// Brings the folders in line with the saved ones. Only the folders that
+	// were added or removed are changed, and returned, if asked for.
+			status_t		Reload(BObjectList<node_ref>* added = NULL,
+								BObjectList<node_ref>* removed = NULL);
+
+	// Only the folders on the volume are added or removed, and returned
+			void			VolumeMounted(dev_t device,
+								BObjectList<node_ref>& added);
+			void			VolumeUnmounted(dev_t device,
+								BObjectList<node_ref>& removed);
+
+private:
+			uint32			_Hash(const node_ref& node) const;
+			RefStorage*		_Add(const entry_ref& ref);
+			OfflineFolder*	_FindOffline(const BString& path) const;
+			void			_RemoveAt(int32 index);
+			void			_Resize(int32 size);
+
+			pthread_rwlock_t fLock;
+			BObjectList<RefStorage> fFolders;
+			BObjectList<OfflineFolder> fOffline;
+			RefStorage**	fTable;
+			int32			fTableSize;
+};
+
+extern FolderRegistry gFolders;
+
+status_t LoadFolders(BListView* folderList);
 status_t SaveFolders(const BListView* folderList = NULL);
 
 #endif	// REFSTORAGE_H
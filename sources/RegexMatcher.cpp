@@ -0,0 +1,172 @@
+/*
+	RegexMatcher.cpp: A regular expression of a test, compiled once and then
+					matched against every file
+	Released under the MIT license.
+*/
+
+#include "RegexMatcher.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "PatternProcessor.h"
+
+/*
+	The tests "matches pattern" and "does not match pattern" use POSIX
+	extended regular expressions. Those don't know named groups, so a
+	"(?<name>" or "(?P<name>" is turned into a plain "(" before compiling,
+	remembering the name for the number of the group.
+
+	What the groups of a matching test found is handed on to the actions
+	of the rule, as %1%, %2%, ... or %MATCH:name%.
+*/
+
+static const int32 kMaxGroups = 32;
+
+
+RegexMatcher::RegexMatcher(const char* expression)
+	:
+	fStatus(B_NO_INIT)
+{
+	if (expression != NULL)
+		SetTo(expression);
+}
+
+
+RegexMatcher::~RegexMatcher()
+{
+	_Unset();
+}
+
+
+status_t
+RegexMatcher::SetTo(const char* expression)
+{
+	_Unset();
+
+	BString plain;
+	int32 group = 0;
+	bool inBracket = false;
+	const char* pos = expression;
+
+	while (*pos != '\0') {
+		char c = *pos;
+
+		if (inBracket) {
+			// Classes like [:alpha:] end with a ']' of their own
+			if (c == '[' && (pos[1] == ':' || pos[1] == '.' || pos[1] == '=')) {
+				const char terminator[3] = { pos[1], ']', '\0' };
+				const char* end = strstr(pos + 2, terminator);
+				if (end != NULL) {
+					plain.Append(pos, end + 2 - pos);
+					pos = end + 2;
+					continue;
+				}
+			}
+			if (c == ']')
+				inBracket = false;
+			plain.Append(c, 1);
+			pos++;
+			continue;
+		}
+
+		// Only outside of brackets, a backslash escapes what follows
+		if (c == '\\' && pos[1] != '\0') {
+			plain.Append(pos, 2);
+			pos += 2;
+			continue;
+		}
+
+		if (c == '[') {
+			// A ']' right at the start is part of the set
+			inBracket = true;
+			plain.Append(c, 1);
+			pos++;
+			if (*pos == '^') {
+				plain.Append(*pos, 1);
+				pos++;
+			}
+			if (*pos == ']') {
+				plain.Append(*pos, 1);
+				pos++;
+			}
+			continue;
+		}
+
+		if (c == '(') {
+			group++;
+			plain.Append(c, 1);
+			pos++;
+
+			const char* name = NULL;
+			if (strncmp(pos, "?<", 2) == 0)
+				name = pos + 2;
+			else if (strncmp(pos, "?P<", 3) == 0)
+				name = pos + 3;
+
+			const char* end = name != NULL ? strchr(name, '>') : NULL;
+			if (end != NULL && end > name) {
+				while (fGroupNames.CountStrings() < group - 1)
+					fGroupNames.Add("");
+				fGroupNames.Add(BString(name, end - name));
+				pos = end + 1;
+			}
+			continue;
+		}
+
+		plain.Append(c, 1);
+		pos++;
+	}
+
+	int result = regcomp(&fRegex, plain.String(), REG_EXTENDED);
+	if (result != 0) {
+		char error[256];
+		regerror(result, &fRegex, error, sizeof(error));
+		fError = error;
+		regfree(&fRegex);
+		return fStatus = B_BAD_VALUE;
+	}
+
+	return fStatus = B_OK;
+}
+
+
+bool
+RegexMatcher::Match(const char* string, PatternContext* context) const
+{
+	if (fStatus != B_OK)
+		return false;
+
+	if (context == NULL)
+		return regexec(&fRegex, string, 0, NULL, 0) == 0;
+
+	regmatch_t matches[kMaxGroups + 1];
+	size_t count = min_c(fRegex.re_nsub + 1, (size_t)kMaxGroups + 1);
+	if (regexec(&fRegex, string, count, matches, 0) != 0)
+		return false;
+
+	for (size_t i = 1; i < count; i++) {
+		const char* name = (int32)i <= fGroupNames.CountStrings()
+			? fGroupNames.StringAt(i - 1).String() : "";
+		if (matches[i].rm_so < 0)
+			context->AddCapture(name, "", 0);
+		else {
+			context->AddCapture(name, string + matches[i].rm_so,
+				matches[i].rm_eo - matches[i].rm_so);
+		}
+	}
+
+	return true;
+}
+
+
+void
+RegexMatcher::_Unset()
+{
+	if (fStatus == B_OK)
+		regfree(&fRegex);
+
+	fStatus = B_NO_INIT;
+	fError = "";
+	fGroupNames.MakeEmpty();
+}
@@ -0,0 +1,45 @@
+/*
+	RegexMatcher.h: A regular expression of a test, compiled once and then
+					matched against every file
+	Released under the MIT license.
+*/
+
+#ifndef REGEX_MATCHER_H
+#define REGEX_MATCHER_H
+
+#include <regex.h>
+
+#include <String.h>
+#include <StringList.h>
+
+class PatternContext;
+
+class RegexMatcher
+{
+public:
+							RegexMatcher(const char* expression = NULL);
+							~RegexMatcher();
+
+	// POSIX extended syntax, plus groups named with (?<name>...)
+			status_t		SetTo(const char* expression);
+			status_t		InitCheck() const { return fStatus; }
+			const char*		Error() const { return fError.String(); }
+
+	// On a match, adds what the groups found to the captures of the context,
+	// if one is given
+			bool			Match(const char* string,
+								PatternContext* context = NULL) const;
+
+private:
+							RegexMatcher(const RegexMatcher& other);
+			RegexMatcher&	operator=(const RegexMatcher& other);
+
+			void			_Unset();
+
+			regex_t			fRegex;
+			status_t		fStatus;
+			BString			fError;
+			BStringList		fGroupNames;
+};
+
+#endif	// REGEX_MATCHER_H
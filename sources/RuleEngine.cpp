@@ -0,0 +1,518 @@
+/*
+	RuleEngine.cpp: The rules and everything needed to run them on files,
+				shared by the Filer and the AutoFiler
+	Released under the MIT license.
+*/
+
+#include "RuleEngine.h"
+
+#include <stdio.h>
+
+#include <File.h>
+#include <FindDirectory.h>
+#include <Message.h>
+#include <Path.h>
+
+#include "ActionJournal.h"
+#include "CommandBatch.h"
+#include "FilerDefs.h"
+#include "FilerRule.h"
+#include "FSUtils.h"
+#include "ProcessRunner.h"
+#include "RuleRunner.h"
+
+/*
+	The Filer loads the rules when it starts and is gone after processing
+	its files. The AutoFiler keeps running, loads them once as well, and
+	loads them again whenever they are saved. The lock keeps the rules from
+	being replaced while a file is going through them. Files only need to
+	read them, so the AutoFiler's workers may file several at a time.
+
+	A watched folder may be limited to some of the rules, named in the
+	saved folders, directly or through rule sets. The rule sets are saved
+	next to the rules, as "set" messages with a "name" and the names of
+	their "rule"s. The rules of each folder are looked up once, whenever
+	the rules or the folders change, and kept sorted by folder, so a file
+	only goes through the rules of its folder.
+
+	Asking the user about a conflict may take them a while, and the lock
+	isn't held meanwhile, so the rules can be saved and loaded again. The
+	file goes on through the rules it started with: those that are replaced
+	then are only deleted once no file is being filed anymore.
+*/
+
+struct CompiledSubset {
+	CompiledSubset()
+		:
+		rules(20, false)
+	{
+	}
+
+	RuleSubset				subset;
+	BObjectList<FilerRule>	rules;
+};
+
+
+static const BObjectList<FilerRule> sNoRules(1, false);
+
+// In place of the Filer's own, if set
+static BString sSettingsFolder;
+
+
+static int
+CompareSubsets(const CompiledSubset* first, const CompiledSubset* second)
+{
+	const node_ref& a = first->subset.folder;
+	const node_ref& b = second->subset.folder;
+	if (a.device != b.device)
+		return a.device < b.device ? -1 : 1;
+	if (a.node != b.node)
+		return a.node < b.node ? -1 : 1;
+	return 0;
+}
+
+
+RuleEngine::RuleEngine()
+	:
+	fRuleList(new BObjectList<FilerRule>(20, true)),
+	fRetired(20, true),
+	fFiling(0),
+	fSubsets(20, true),
+	fNamedSets(20, true),
+	fMatchSetting(false),
+	fUseJournal(true),
+	fBatchJobs(1),
+	fCommandBatch(new CommandBatch),
+	fJournal(NULL)
+{
+	pthread_rwlock_init(&fLock, NULL);
+	pthread_mutex_init(&fFilingLock, NULL);
+}
+
+
+RuleEngine::~RuleEngine()
+{
+	delete fJournal;
+	delete fCommandBatch;
+	delete fRuleList;
+	pthread_mutex_destroy(&fFilingLock);
+	pthread_rwlock_destroy(&fLock);
+}
+
+
+void
+RuleEngine::LoadSettings()
+{
+	BMessage msg;
+	if (ReadSettings(msg) != B_OK)
+		return;
+
+	pthread_rwlock_wrlock(&fLock);
+
+	if (msg.FindBool("match", &fMatchSetting) != B_OK)
+		fMatchSetting = false;
+
+	// Number of batched shell commands run side by side, 0 means one per CPU
+	if (msg.FindInt32("batchjobs", &fBatchJobs) != B_OK)
+		fBatchJobs = 1;
+
+	// Limits for the programs started by actions: how many may run at a
+	// time, and how many seconds each one gets
+	int32 value;
+	if (msg.FindInt32("maxprocesses", &value) == B_OK)
+		ProcessRunner::Default()->SetConcurrency(value);
+	if (msg.FindInt32("commandtimeout", &value) == B_OK)
+		ProcessRunner::Default()->SetTimeout(value * 1000000LL);
+
+	// Copies get a checksum attribute, taken while copying, and may be read
+	// back to check them against it
+	bool hash;
+	bool verify;
+	if (msg.FindBool("hashcopies", &hash) != B_OK)
+		hash = true;
+	if (msg.FindBool("verifycopies", &verify) != B_OK)
+		verify = false;
+	SetCopyOptions(hash, verify);
+
+	// Keeps track of the actions, so rules interrupted by a crash can be
+	// resumed
+	if (msg.FindBool("journal", &fUseJournal) != B_OK)
+		fUseJournal = true;
+
+	pthread_rwlock_unlock(&fLock);
+}
+
+
+status_t
+RuleEngine::LoadRules()
+{
+	BObjectList<FilerRule> rules(20, false);
+	status_t status = ::LoadRules(&rules, sSettingsFolder.IsEmpty() ? NULL
+		: sSettingsFolder.String());
+	if (status != B_OK) {
+		for (int32 i = 0; i < rules.CountItems(); i++)
+			delete rules.ItemAt(i);
+		return status;
+	}
+
+	// Without rule sets, there are none
+	BMessage ruleSets;
+	BPath path;
+	if (GetSettingsPath(path, kRuleSetsFile) == B_OK) {
+		BFile file(path.Path(), B_READ_ONLY);
+		if (file.InitCheck() == B_OK)
+			ruleSets.Unflatten(&file);
+	}
+
+	// The list itself stays, as the rules tab of the Filer works on it
+	pthread_rwlock_wrlock(&fLock);
+	pthread_mutex_lock(&fFilingLock);
+	while (!fRuleList->IsEmpty()) {
+		FilerRule* rule = fRuleList->RemoveItemAt(0);
+		if (fFiling > 0)
+			fRetired.AddItem(rule);
+		else
+			delete rule;
+	}
+	pthread_mutex_unlock(&fFilingLock);
+	fRuleList->AddList(&rules);
+	fRuleSets = ruleSets;
+	for (int32 i = 0; i < fSubsets.CountItems(); i++)
+		_Compile(*fSubsets.ItemAt(i));
+	_CompileRuleSets();
+	pthread_rwlock_unlock(&fLock);
+	return B_OK;
+}
+
+
+void
+RuleEngine::SetSubsets(const BObjectList<RuleSubset>& subsets)
+{
+	// Handed over to fSubsets below
+	BObjectList<CompiledSubset> compiled(subsets.CountItems(), false);
+	for (int32 i = 0; i < subsets.CountItems(); i++) {
+		const RuleSubset* subset = subsets.ItemAt(i);
+		if (subset->rules.IsEmpty() && subset->sets.IsEmpty())
+			continue;
+
+		CompiledSubset* folder = new CompiledSubset;
+		folder->subset = *subset;
+		compiled.AddItem(folder);
+	}
+	compiled.SortItems(CompareSubsets);
+
+	pthread_rwlock_wrlock(&fLock);
+	fSubsets.MakeEmpty();
+	for (int32 i = 0; i < compiled.CountItems(); i++) {
+		_Compile(*compiled.ItemAt(i));
+		fSubsets.AddItem(compiled.ItemAt(i));
+	}
+	pthread_rwlock_unlock(&fLock);
+}
+
+
+status_t
+RuleEngine::OpenJournal()
+{
+	if (!fUseJournal || fJournal != NULL)
+		return B_OK;
+
+	fJournal = new ActionJournal;
+	status_t status = fJournal->Open();
+	if (status != B_OK) {
+		printf("Couldn't open the action journal\n");
+		delete fJournal;
+		fJournal = NULL;
+	}
+	return status;
+}
+
+
+int32
+RuleEngine::ResumeInterrupted(ConflictChoice& conflicts)
+{
+	if (fJournal == NULL)
+		return 0;
+
+	BeginBatch();
+
+	ConflictListener* listener = conflicts.listener;
+	conflicts.listener = this;
+
+	pthread_rwlock_rdlock(&fLock);
+	_StartFiling();
+	BObjectList<FilerRule> rules(20, false);
+	_GetRules(rules, node_ref(), NULL);
+	RuleRunner runner(fCommandBatch, fJournal, &conflicts);
+	int32 count = fJournal->Recover(&rules, runner);
+	pthread_rwlock_unlock(&fLock);
+	_DoneFiling();
+
+	conflicts.listener = listener;
+
+	EndBatch();
+	return count;
+}
+
+
+void
+RuleEngine::BeginBatch()
+{
+	ResetCopySpace();
+}
+
+
+void
+RuleEngine::FileRef(entry_ref ref, ConflictChoice& conflicts,
+	const node_ref& folder, const char* ruleSet,
+	BObjectList<RuleOutcome>* outcomes)
+{
+	ConflictListener* listener = conflicts.listener;
+	conflicts.listener = this;
+
+	pthread_rwlock_rdlock(&fLock);
+	_StartFiling();
+
+	// The lists may change while the user is asked about a conflict
+	BObjectList<FilerRule> rules(20, false);
+	_GetRules(rules, folder, ruleSet);
+	bool matchSetting = fMatchSetting;
+
+	RuleRunner runner(fCommandBatch, fJournal, &conflicts);
+
+	for (int32 i = 0; i < rules.CountItems(); i++)
+	{
+		FilerRule* rule = rules.ItemAt(i);
+
+		if (rule->Disabled())
+			continue;
+
+		bool passed;
+		status_t res = runner.RunRule(rule, ref, &passed);
+
+		if (passed && outcomes != NULL) {
+			RuleOutcome* outcome = new RuleOutcome;
+			outcome->rule = rule->GetDescription();
+			outcome->status = res;
+			outcomes->AddItem(outcome);
+		}
+
+		// default stop here if rule was successful
+		// note that the loop will continue if a rule has an error
+		if (res == B_OK && matchSetting == true) {
+			printf("Applying first matching rule only!\n");
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&fLock);
+	_DoneFiling();
+
+	conflicts.listener = listener;
+}
+
+
+bool
+RuleEngine::IsHeavy(const entry_ref& ref, const node_ref& folder,
+	const char* ruleSet)
+{
+	pthread_rwlock_rdlock(&fLock);
+
+	RuleRunner runner;
+	bool heavy = false;
+	const BObjectList<FilerRule>* rules = _RulesFor(folder, ruleSet);
+
+	for (int32 i = 0; i < rules->CountItems(); i++) {
+		FilerRule* rule = rules->ItemAt(i);
+		if (rule->Disabled() || !runner.PassesTests(rule, ref))
+			continue;
+
+		for (int32 j = 0; j < rule->CountActions(); j++) {
+			int8 type;
+			if (rule->ActionAt(j)->FindInt8("type", &type) == B_OK
+				&& (type == ACTION_COPY || type == ACTION_ARCHIVE)) {
+				heavy = true;
+				break;
+			}
+		}
+
+		// Other rules may only run on it with "continue" actions, which is
+		// good enough a guess
+		break;
+	}
+
+	pthread_rwlock_unlock(&fLock);
+	return heavy;
+}
+
+
+void
+RuleEngine::EndBatch()
+{
+	if (fCommandBatch->CountCommands() > 0)
+		fCommandBatch->Run(fBatchJobs);
+
+	ProcessRunner::Default()->WaitForAll();
+}
+
+
+void
+RuleEngine::SetSettingsFolder(const char* path)
+{
+	sSettingsFolder = path;
+}
+
+
+status_t
+RuleEngine::GetSettingsPath(BPath& path, const char* name)
+{
+	status_t status;
+	if (!sSettingsFolder.IsEmpty())
+		status = path.SetTo(sSettingsFolder.String());
+	else {
+		status = find_directory(B_USER_SETTINGS_DIRECTORY, &path);
+		if (status == B_OK)
+			status = path.Append(kSettingsFolder);
+	}
+	if (status == B_OK && name != NULL)
+		status = path.Append(name);
+	return status;
+}
+
+
+status_t
+RuleEngine::ReadSettings(BMessage& settings)
+{
+	BPath path;
+	status_t status = GetSettingsPath(path, kSettingsFile);
+	if (status != B_OK)
+		return status;
+
+	BFile file(path.Path(), B_READ_ONLY);
+	status = file.InitCheck();
+	if (status != B_OK)
+		return status;
+
+	return settings.Unflatten(&file);
+}
+
+
+void
+RuleEngine::AskingUser()
+{
+	pthread_rwlock_unlock(&fLock);
+}
+
+
+void
+RuleEngine::DoneAsking()
+{
+	pthread_rwlock_rdlock(&fLock);
+}
+
+
+// Called with the lock held, so the rules can't be replaced meanwhile
+void
+RuleEngine::_StartFiling()
+{
+	pthread_mutex_lock(&fFilingLock);
+	fFiling++;
+	pthread_mutex_unlock(&fFilingLock);
+}
+
+
+// Called once the file is done with its rules, and the lock is let go of
+void
+RuleEngine::_DoneFiling()
+{
+	pthread_mutex_lock(&fFilingLock);
+	if (--fFiling == 0)
+		fRetired.MakeEmpty();
+	pthread_mutex_unlock(&fFilingLock);
+}
+
+
+void
+RuleEngine::_GetRules(BObjectList<FilerRule>& rules, const node_ref& folder,
+	const char* ruleSet) const
+{
+	const BObjectList<FilerRule>* list = _RulesFor(folder, ruleSet);
+	for (int32 i = 0; i < list->CountItems(); i++)
+		rules.AddItem(list->ItemAt(i));
+}
+
+
+const BObjectList<FilerRule>*
+RuleEngine::_RulesFor(const node_ref& folder, const char* ruleSet) const
+{
+	if (ruleSet != NULL && ruleSet[0] != '\0') {
+		for (int32 i = 0; i < fNamedSets.CountItems(); i++) {
+			const CompiledSubset* set = fNamedSets.ItemAt(i);
+			if (set->subset.sets.StringAt(0) == ruleSet)
+				return &set->rules;
+		}
+
+		// An unknown rule set has no rules
+		return &sNoRules;
+	}
+
+	if (fSubsets.IsEmpty())
+		return fRuleList;
+
+	CompiledSubset key;
+	key.subset.folder = folder;
+	const CompiledSubset* subset = fSubsets.BinarySearch(key, CompareSubsets);
+	return subset != NULL ? &subset->rules : fRuleList;
+}
+
+
+void
+RuleEngine::_Compile(CompiledSubset& compiled)
+{
+	const RuleSubset& subset = compiled.subset;
+
+	BStringList names(subset.rules);
+	for (int32 i = 0; i < subset.sets.CountStrings(); i++) {
+		bool found = false;
+		BMessage set;
+		for (int32 j = 0; fRuleSets.FindMessage("set", j, &set) == B_OK;
+				j++) {
+			if (subset.sets.StringAt(i) != set.GetString("name", ""))
+				continue;
+
+			BString name;
+			for (int32 k = 0; set.FindString("rule", k, &name) == B_OK; k++)
+				names.Add(name);
+			found = true;
+			break;
+		}
+
+		if (!found) {
+			printf("\tRule set '%s' not found\n",
+				subset.sets.StringAt(i).String());
+		}
+	}
+
+	// The rules keep their order
+	compiled.rules.MakeEmpty();
+	for (int32 i = 0; i < fRuleList->CountItems(); i++) {
+		FilerRule* rule = fRuleList->ItemAt(i);
+		if (names.HasString(rule->GetDescription()))
+			compiled.rules.AddItem(rule);
+	}
+}
+
+
+void
+RuleEngine::_CompileRuleSets()
+{
+	fNamedSets.MakeEmpty();
+
+	BMessage set;
+	for (int32 i = 0; fRuleSets.FindMessage("set", i, &set) == B_OK; i++) {
+		CompiledSubset* named = new CompiledSubset;
+		named->subset.sets.Add(set.GetString("name", ""));
+		_Compile(*named);
+		fNamedSets.AddItem(named);
+	}
+}
@@ -0,0 +1,126 @@
+/*
+	RuleEngine.h: The rules and everything needed to run them on files,
+				shared by the Filer and the AutoFiler
+	Released under the MIT license.
+*/
+
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+#include <pthread.h>
+
+#include <Entry.h>
+#include <Message.h>
+#include <Node.h>
+#include <String.h>
+#include <StringList.h>
+
+#include "ObjectList.h"
+#include "RuleRunner.h"
+
+class ActionJournal;
+class BPath;
+class CommandBatch;
+class FilerRule;
+struct CompiledSubset;
+
+// A rule a file passed the tests of, and how running its actions went
+struct RuleOutcome {
+	BString		rule;
+	status_t	status;
+};
+
+// The rules a watched folder is limited to, by name, directly or through
+// the named rule sets. With neither, all rules are run.
+struct RuleSubset {
+	node_ref	folder;
+	BStringList	rules;
+	BStringList	sets;
+};
+
+class RuleEngine : private ConflictListener
+{
+public:
+							RuleEngine();
+							~RuleEngine();
+
+	// Reads the Filer settings. Changes to them only apply to files
+	// processed afterwards.
+			void			LoadSettings();
+	// Replaces the rules, and the rule sets, with those saved last. If they
+	// can't be read, the old ones are kept.
+			status_t		LoadRules();
+
+	// Replaces the rules each folder is limited to
+			void			SetSubsets(const BObjectList<RuleSubset>& subsets);
+
+	// Starts keeping track of the actions, and picks up what earlier
+	// processes left unfinished
+			status_t		OpenJournal();
+			int32			ResumeInterrupted(ConflictChoice& conflicts);
+
+	// Files processed between these two share one look at the free space
+	// of the target volumes, and their batched shell commands are run at
+	// the end. FileRef() may be called by several threads at once, but not
+	// while the batch ends. Files of a watched folder only go through the
+	// rules of that folder, or those of the rule set, if one is given. The
+	// rules the file matched are added to the outcomes.
+			void			BeginBatch();
+			void			FileRef(entry_ref ref, ConflictChoice& conflicts,
+								const node_ref& folder = node_ref(),
+								const char* ruleSet = NULL,
+								BObjectList<RuleOutcome>* outcomes = NULL);
+			void			EndBatch();
+
+	// Whether the first rule the file passes the tests of copies or archives
+	// it, which takes a while with big files
+			bool			IsHeavy(const entry_ref& ref,
+								const node_ref& folder = node_ref(),
+								const char* ruleSet = NULL);
+
+			BObjectList<FilerRule>* Rules() const { return fRuleList; }
+
+			bool			MatchSetting() const { return fMatchSetting; }
+			void			SetMatchSetting(bool match)
+								{ fMatchSetting = match; }
+
+	// Replays are pointed at settings, and rules, of their own
+	static	void			SetSettingsFolder(const char* path);
+	static	status_t		GetSettingsPath(BPath& path,
+								const char* name = NULL);
+	// The Filer settings, as saved by the Filer
+	static	status_t		ReadSettings(BMessage& settings);
+
+private:
+	// The lock is let go of while the user is asked about a conflict
+	virtual	void			AskingUser();
+	virtual	void			DoneAsking();
+
+			void			_GetRules(BObjectList<FilerRule>& rules,
+								const node_ref& folder,
+								const char* ruleSet) const;
+			const BObjectList<FilerRule>* _RulesFor(const node_ref& folder,
+								const char* ruleSet) const;
+			void			_StartFiling();
+			void			_DoneFiling();
+			void			_Compile(CompiledSubset& subset);
+			void			_CompileRuleSets();
+
+			pthread_rwlock_t fLock;
+			BObjectList<FilerRule>* fRuleList;
+			// Replaced rules that files being filed may still go through,
+			// and how many are being filed
+			pthread_mutex_t	fFilingLock;
+			BObjectList<FilerRule> fRetired;
+			int32			fFiling;
+			BMessage		fRuleSets;
+			BObjectList<CompiledSubset> fSubsets;
+			BObjectList<CompiledSubset> fNamedSets;
+			bool			fMatchSetting;
+			bool			fUseJournal;
+			int32			fBatchJobs;
+			CommandBatch*	fCommandBatch;
+			ActionJournal*	fJournal;
+};
+
+#endif	// RULE_ENGINE_H
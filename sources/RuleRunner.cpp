@@ -20,12 +20,18 @@
 #include <Path.h>
 #include <Roster.h>
 
+#include "ActionJournal.h"
+#include "CommandBatch.h"
 #include "ConflictWindow.h"
 #include "CppSQLite3.h"
 #include "Database.h"
+#include "FilerDefs.h"
+#include "FolderNames.h"
 #include "FSUtils.h"
-#include "main.h"
 #include "PatternProcessor.h"
+#include "RegexMatcher.h"
+#include "ProcessRunner.h"
+#include "TargetFolder.h"
 
 /*
 	FilerAction message fields:
@@ -62,27 +68,40 @@
 */
 
 // The various compare functions used by IsMatch to do the actual comparing
-static bool IsNameMatch(const BMessage& test, const entry_ref& ref);
-static bool IsTypeMatch(const BMessage& test, const entry_ref& ref);
+// A test matching a regular expression adds what its groups found to the
+// captures of the context.
+static bool IsNameMatch(const BMessage& test, const entry_ref& ref,
+				const RegexMatcher* regex, PatternContext* context);
+static bool IsTypeMatch(const BMessage& test, const entry_ref& ref,
+				const RegexMatcher* regex, PatternContext* context);
 static bool IsSizeMatch(const BMessage& test, const entry_ref& ref);
-static bool IsLocationMatch(const BMessage& test, const entry_ref& ref);
+static bool IsLocationMatch(const BMessage& test, const entry_ref& ref,
+				const RegexMatcher* regex, PatternContext* context);
 //bool IsModifiedMatch(const BMessage& test, const entry_ref& ref);
-static bool IsAttributeMatch(const BMessage& test, const entry_ref& ref);
+static bool IsAttributeMatch(const BMessage& test, const entry_ref& ref,
+				const RegexMatcher* regex, PatternContext* context);
 static bool StringCompare(const BString& from, const BString& to, int8 modetype,
-				const bool& match_case);
+				const bool& match_case, const RegexMatcher* regex = NULL,
+				PatternContext* context = NULL);
 
 // The various action functions used by RunAction to do the heavy lifting
-static status_t MoveAction(const BMessage& action, entry_ref& ref,
-					const char* desc);
-static status_t CopyAction(const BMessage& action, entry_ref& ref,
-					const char* desc);
-static status_t RenameAction(const BMessage& action, entry_ref& ref);
+static status_t MoveAction(const BString& value, entry_ref& ref,
+					const char* desc, ConflictChoice& conflicts);
+static status_t CopyAction(const BString& value, entry_ref& ref,
+					const char* desc, ConflictChoice& conflicts);
+static status_t RenameAction(const BString& value, entry_ref& ref);
 static status_t OpenAction(entry_ref& ref);
-static status_t ArchiveAction(const BMessage& action, entry_ref& ref);
-static status_t CommandAction(const BMessage& action, entry_ref& ref);
+static status_t ArchiveAction(const BString& value, entry_ref& ref,
+					bool wait);
+static status_t CommandAction(const BString& value, entry_ref& ref,
+					CommandBatch* batch, bool wait, int32 filesAt);
 static status_t TrashAction(entry_ref& ref);
 static status_t DeleteAction(entry_ref& ref);
 
+// Where an action is going to put the file, for the journal
+static BString ActionTarget(int8 type, const BString& value,
+					const entry_ref& ref);
+
 
 // Some convenience functions. Deleting the returned BMessage is the
 // responsibility of the caller
@@ -155,33 +174,17 @@ const NamePair sModeTypes[] = {
 	LOCALIZE("is more than"),
 	LOCALIZE("is less than"),
 	LOCALIZE("is at least"),
-	LOCALIZE("is at most")
+	LOCALIZE("is at most"),
+	LOCALIZE("matches pattern"),
+	LOCALIZE("does not match pattern")
 //	LOCALIZE("is before"),
 //	LOCALIZE("is after")
 };
 static const unsigned nModeTypes = sizeof(sModeTypes) / sizeof(sModeTypes[0]);
 
-enum ModeType {
-	MODE_IS,
-	MODE_NOT,
-	MODE_START,
-	MODE_END,
-	MODE_CONTAIN,
-	MODE_EXCLUDE,
-	MODE_MORE,
-	MODE_LESS,
-	MODE_LEAST,
-	MODE_MOST
-//	MODE_BEFORE,
-//	MODE_AFTER
-};
-
 static const ModeType anyModes[] = {
 	MODE_IS,
 	MODE_NOT
-	// for future expansion
-//	"matches pattern"
-//	"does not match pattern"
 };
 static const unsigned nAnyModes = sizeof(anyModes) / sizeof(anyModes[0]);
 
@@ -189,7 +192,9 @@ static const ModeType stringModes[] = {
 	MODE_START,
 	MODE_END,
 	MODE_CONTAIN,
-	MODE_EXCLUDE
+	MODE_EXCLUDE,
+	MODE_MATCH,
+	MODE_NOMATCH
 };
 static const unsigned
 nStringModes = sizeof(stringModes) / sizeof(stringModes[0]);
@@ -251,7 +256,13 @@ const char* const kArchiveMime = "application/zip";
 const char* const kScriptMime = "text/plain";
 
 
-RuleRunner::RuleRunner()
+RuleRunner::RuleRunner(CommandBatch* commandBatch, ActionJournal* journal,
+	ConflictChoice* conflicts)
+	:
+	fCommandBatch(commandBatch),
+	fJournal(journal),
+	fConflicts(conflicts != NULL ? conflicts : &fOwnConflicts),
+	fLastAction(false)
 {
 }
 
@@ -356,7 +367,8 @@ RuleRunner::GetEditorTypeForTest(const char* testname)
 
 
 bool
-RuleRunner::IsMatch(const BMessage& test, const entry_ref& ref)
+RuleRunner::IsMatch(const BMessage& test, const entry_ref& ref,
+	const RegexMatcher* regex, PatternContext* context)
 {
 	int8 testtype;
 	if (test.FindInt8("name", &testtype) != B_OK) {
@@ -365,17 +377,17 @@ RuleRunner::IsMatch(const BMessage& test, const entry_ref& ref)
 	}
 
 	if (testtype == TEST_NAME)
-		return IsNameMatch(test, ref);
+		return IsNameMatch(test, ref, regex, context);
 	else if (testtype == TEST_SIZE)
 		return IsSizeMatch(test, ref);
 	else if (testtype == TEST_LOCATION)
-		return IsLocationMatch(test, ref);
+		return IsLocationMatch(test, ref, regex, context);
 	else if (testtype == TEST_TYPE)
-		return IsTypeMatch(test, ref);
+		return IsTypeMatch(test, ref, regex, context);
 //	else if (testtype == TEST_DATE)	//	"Last changed"
 //		return IsModifiedMatch(test, ref);
 	else if (testtype == TEST_ATTRIBUTE)
-		return IsAttributeMatch(test, ref);
+		return IsAttributeMatch(test, ref, regex, context);
 
 	return false;
 }
@@ -390,18 +402,41 @@ RuleRunner::RunAction(const BMessage& action, entry_ref& ref, const char* desc)
 		return B_ERROR;
 	}
 
+	BString value;
+	int32 filesAt = -1;
+	if (ActionHasTarget(type)) {
+		if (action.FindString("value", &value) != B_OK)
+			return B_ERROR;
+		if (type == ACTION_COMMAND
+			&& CommandBatch::IsBatchCommand(value.String())) {
+			BString command(value);
+			PatternContext context(ref);
+			CommandBatch::Expand(command.String(), context, value, filesAt);
+		} else
+			value = ProcessPatterns(value.String(), ref);
+	}
+
+	return _RunAction(type, value, ref, desc, filesAt);
+}
+
+
+status_t
+RuleRunner::_RunAction(int8 type, const BString& value, entry_ref& ref,
+	const char* desc, int32 filesAt)
+{
 	if (type == ACTION_MOVE)
-		return MoveAction(action, ref, desc);
+		return MoveAction(value, ref, desc, *fConflicts);
 	else if (type == ACTION_COPY)
-		return CopyAction(action, ref, desc);
+		return CopyAction(value, ref, desc, *fConflicts);
 	else if (type == ACTION_RENAME)
-		return RenameAction(action, ref);
+		return RenameAction(value, ref);
 	else if (type == ACTION_OPEN)
 		return OpenAction(ref);
 	else if (type == ACTION_ARCHIVE)
-		return ArchiveAction(action, ref);
+		return ArchiveAction(value, ref, !fLastAction);
 	else if (type == ACTION_COMMAND)
-		return CommandAction(action, ref);
+		return CommandAction(value, ref, fCommandBatch, !fLastAction,
+			filesAt);
 	else if (type == ACTION_TRASH)
 		return TrashAction(ref);
 	else if (type == ACTION_DELETE)
@@ -414,63 +449,132 @@ RuleRunner::RunAction(const BMessage& action, entry_ref& ref, const char* desc)
 
 
 status_t
-RuleRunner::RunRule(FilerRule* rule, entry_ref& ref)
+RuleRunner::RunRule(FilerRule* rule, entry_ref& ref, bool* passed)
 {
+	if (passed != NULL)
+		*passed = false;
+
 	if (!rule)
 		return B_ERROR;
 
-	bool pass;
 	const char* desc = rule->GetDescription();
 	printf("Running rule '%s'\n", desc);
 
+	// Collects what the regular expressions find for the actions
+	PatternContext context(ref);
+
+	if (PassesTests(rule, ref, &context)) {
+		if (passed != NULL)
+			*passed = true;
+		return RunActions(rule, ref, 0, -1, &context);
+	}
+
+	return CONTINUE_TESTS;
+}
+
+
+bool
+RuleRunner::PassesTests(FilerRule* rule, const entry_ref& ref,
+	PatternContext* context)
+{
 	if (rule->GetRuleMode() == FILER_RULE_ANY) {
-		pass = false;
 		for (int32 i = 0; i < rule->CountTests(); i++)
 		{
 			BMessage* test = rule->TestAt(i);
-			if (IsMatch(*test, ref)) {
-				pass = true;
-				break;
-			}
-		}
-	} else {	// And mode
-		pass = true;
-		for (int32 i = 0; i < rule->CountTests(); i++)
-		{
-			BMessage* test = rule->TestAt(i);
-			if (!IsMatch(*test, ref)) {
-				pass = false;
-				break;
-			}
+			if (IsMatch(*test, ref, rule->TestMatcherAt(i), context))
+				return true;
 		}
+		return false;
 	}
-	
-	if (pass) {
-		entry_ref realref;
-		BEntry(&ref, true).GetRef(&realref);
 
-		for (int32 i = 0; i < rule->CountActions(); i++)
-		{
-			BMessage* action = rule->ActionAt(i);
-
-			// Note that this call passes the same ref object from one call to the
-			// next. This allows the user to chain actions together. The only thing
-			// required to do this is for the particular action to change the ref
-			// passed to it.
-			status_t status = RunAction(*action, realref, desc);
-//			if (status == CONTINUE_TESTS)	// keep ref in sync with reality
-			ref = realref;
-			if (status != B_OK)
-				return status;
+	// And mode
+	for (int32 i = 0; i < rule->CountTests(); i++)
+	{
+		BMessage* test = rule->TestAt(i);
+		if (!IsMatch(*test, ref, rule->TestMatcherAt(i), context))
+			return false;
+	}
+	return true;
+}
+
+
+status_t
+RuleRunner::RunActions(FilerRule* rule, entry_ref& ref, int32 first,
+	int64 chain, PatternContext* context)
+{
+	entry_ref realref;
+	BEntry(&ref, true).GetRef(&realref);
+
+	// Whatever the patterns find out about the file is kept for the next
+	// action, until one of them changes the file
+	PatternContext ownContext(realref);
+	if (context == NULL)
+		context = &ownContext;
+
+	const char* desc = rule->GetDescription();
+	if (fJournal != NULL && chain < 0)
+		chain = fJournal->BeginChain(rule, realref, first, context);
+
+	BString value;
+
+	status_t status = B_OK;
+	for (int32 i = first; i < rule->CountActions(); i++)
+	{
+		BMessage* action = rule->ActionAt(i);
+
+		int8 type;
+		if (action->FindInt8("type", &type) != B_OK) {
+			status = B_ERROR;
+			break;
 		}
-		return B_OK;
+		if (ActionHasTarget(type) && !action->HasString("value")) {
+			status = B_ERROR;
+			break;
+		}
+
+		// A batch command is told by its template, not by what it expands to
+		context->SetTo(realref);
+		const PatternTemplate* pattern = rule->ActionTemplateAt(i);
+		int32 filesAt = -1;
+		if (type == ACTION_COMMAND
+			&& CommandBatch::IsBatchCommand(pattern->Pattern()))
+			CommandBatch::Expand(pattern->Pattern(), *context, value, filesAt);
+		else
+			pattern->Expand(*context, value);
+
+		if (chain >= 0) {
+			fJournal->WillRun(chain, i, type, realref,
+				ActionTarget(type, value, realref).String());
+		}
+
+		// Note that this call passes the same ref object from one call to the
+		// next. This allows the user to chain actions together. The only thing
+		// required to do this is for the particular action to change the ref
+		// passed to it.
+		// Programs started by the last action are left running on their
+		// own, there's nothing after them that needs their results.
+		fLastAction = i == rule->CountActions() - 1;
+		status = _RunAction(type, value, realref, desc, filesAt);
+		fLastAction = false;
+//		if (status == CONTINUE_TESTS)	// keep ref in sync with reality
+		ref = realref;
+
+		if (chain >= 0 && status == B_OK)
+			fJournal->Done(chain, i, realref);
+		if (status != B_OK)
+			break;
 	}
-	return CONTINUE_TESTS;
+
+	if (chain >= 0)
+		fJournal->EndChain(chain);
+
+	return status;
 }
 
 
 bool
-IsNameMatch(const BMessage& test, const entry_ref& ref)
+IsNameMatch(const BMessage& test, const entry_ref& ref,
+	const RegexMatcher* regex, PatternContext* context)
 {
 	BString value;
 	if (test.FindString("value", &value) != B_OK) {
@@ -484,7 +588,8 @@ IsNameMatch(const BMessage& test, const entry_ref& ref)
 		return false;
 	}
 
-	bool result = StringCompare(value, BString(ref.name), modetype, true);
+	bool result = StringCompare(value, BString(ref.name), modetype, true,
+		regex, context);
 	printf("\tName test: %s %s %s - %s\n", ref.name,
 		sModeTypes[modetype].locale, value.String(),
 		result ? "MATCH" : "NO MATCH");
@@ -494,7 +599,8 @@ IsNameMatch(const BMessage& test, const entry_ref& ref)
 
 
 bool
-IsTypeMatch(const BMessage& test, const entry_ref& ref)
+IsTypeMatch(const BMessage& test, const entry_ref& ref,
+	const RegexMatcher* regex, PatternContext* context)
 {
 	BString value;
 	if (test.FindString("value", &value) != B_OK) {
@@ -515,7 +621,8 @@ IsTypeMatch(const BMessage& test, const entry_ref& ref)
 	if (BMimeType::GuessMimeType(&ref, &mimeType) != B_OK)
 		return false;
 
-	bool result = StringCompare(value, mimeType.Type(), modetype, true);
+	bool result = StringCompare(value, mimeType.Type(), modetype, true,
+		regex, context);
 	printf("\tType test: %s %s %s - %s\n", ref.name,
 		sModeTypes[modetype].locale, value.String(),
 		result ? "MATCH" : "NO MATCH");
@@ -592,7 +699,8 @@ IsSizeMatch(const BMessage& test, const entry_ref& ref)
 
 
 bool
-IsLocationMatch(const BMessage& test, const entry_ref& ref)
+IsLocationMatch(const BMessage& test, const entry_ref& ref,
+	const RegexMatcher* regex, PatternContext* context)
 {
 	BString value;
 	if (test.FindString("value", &value) != B_OK) {
@@ -614,10 +722,12 @@ IsLocationMatch(const BMessage& test, const entry_ref& ref)
 	BString filepath(path.Path());
 	filepath.RemoveLast(path.Leaf());
 
-	if (value[value.CountChars() - 1] != '/')
+	if (value[value.CountChars() - 1] != '/'
+		&& modetype != MODE_MATCH && modetype != MODE_NOMATCH)
 		value << "/";
 
-	bool result = StringCompare(value, filepath.String(), modetype, true);
+	bool result = StringCompare(value, filepath.String(), modetype, true,
+		regex, context);
 
 	printf("\tLocation test: %s %s %s - %s\n", filepath.String(),
 		sModeTypes[modetype].locale, value.String(),
@@ -638,7 +748,8 @@ IsModifiedMatch(const BMessage& test, const entry_ref& ref)
 
 
 bool
-IsAttributeMatch(const BMessage& test, const entry_ref& ref)
+IsAttributeMatch(const BMessage& test, const entry_ref& ref,
+	const RegexMatcher* regex, PatternContext* context)
 {
 	BString value;
 	if (test.FindString("value", &value) != B_OK) {
@@ -670,7 +781,8 @@ IsAttributeMatch(const BMessage& test, const entry_ref& ref)
 	if (node.ReadAttrString(attribute.String(), &string) != B_OK)
 		return false;
 
-	bool result = StringCompare(value, string, modetype, true);
+	bool result = StringCompare(value, string, modetype, true, regex,
+		context);
 
 	BString attrname;
 	if (test.FindString("attrname", &attrname) != B_OK)
@@ -686,13 +798,31 @@ IsAttributeMatch(const BMessage& test, const entry_ref& ref)
 
 bool
 StringCompare(const BString& from, const BString& to, int8 modetype,
-	const bool& match_case)
+	const bool& match_case, const RegexMatcher* regex, PatternContext* context)
 {
 	if (modetype < 0) {
 		debugger("NULL mode in StringCompare");
 		return false;
 	}
 
+	if (modetype == MODE_MATCH || modetype == MODE_NOMATCH) {
+		// Without the one compiled with the rule, it's compiled just for this
+		RegexMatcher temporary;
+		if (regex == NULL) {
+			temporary.SetTo(from.String());
+			regex = &temporary;
+		}
+		if (regex->InitCheck() != B_OK) {
+			printf("\tInvalid pattern %s: %s\n", from.String(),
+				regex->Error());
+			return false;
+		}
+
+		if (modetype == MODE_NOMATCH)
+			return !regex->Match(to.String());
+		return regex->Match(to.String(), context);
+	}
+
 	if (modetype == MODE_IS)
 		if (match_case)
 			return from.Compare(to) == 0;
@@ -732,84 +862,130 @@ StringCompare(const BString& from, const BString& to, int8 modetype,
 }
 
 
+BString
+ActionTarget(int8 type, const BString& value, const entry_ref& ref)
+{
+	BPath path;
+	if (type == ACTION_MOVE || type == ACTION_COPY)
+		path.SetTo(value.String(), ref.name);
+	else if (type == ACTION_RENAME) {
+		if (value.ByteAt(0) == '/')
+			path.SetTo(value.String());
+		else if (BPath(&ref).GetParent(&path) == B_OK)
+			path.Append(value.String());
+	} else if (type == ACTION_TRASH) {
+		if (find_directory(B_TRASH_DIRECTORY, &path) == B_OK)
+			path.Append(ref.name);
+	}
+
+	return BString(path.Path());
+}
+
+
 static status_t
-MoveOrCopy(const BMessage& action, const entry_ref& ref, const char* desc,
-	bool move)
+MoveOrCopy(const BString& value, entry_ref& ref, const char* desc,
+	ConflictChoice& conflicts, bool move)
 {
 	BEntry source(&ref);
 	if (source.InitCheck() != B_OK)
 		return B_ERROR;
 
-	BString value;
-	if (action.FindString("value", &value) != B_OK)
-		return B_ERROR;
-
-	value = ProcessPatterns(value.String(), ref);
-
 	const char* destDir = value.String();
-	BEntry entry(destDir, true);
-	if (entry.InitCheck() != B_OK)
+	TargetFolder target;
+	if (target.SetTo(destDir, true) != B_OK)
 		return B_ERROR;
 
-	if (entry.Exists()) {
-		if(!entry.IsDirectory())
-			return B_ERROR;
-	} else if (create_directory(destDir, 0777) != B_OK)
-		return B_ERROR;
-
-	App* app = static_cast<App*>(be_app);
-	bool doAll = app->DoAll();
-	bool replace = app->Replace();
+	bool doAll = conflicts.doAll;
+	bool replace = conflicts.replace;
+	bool keepBoth = conflicts.keepBoth;
 
-	entry_ref destRef;
 	const char* name = ref.name;
-	bool conflict = false;
+	BString destName;
+	status_t status;
+	bool refreshed = false;
+
+	for (int32 attempt = 0;; attempt++) {
+		BDirectory& directory = target.Directory();
+		bool conflict = !(replace && doAll) && NameTaken(directory, name);
+
+		if (conflict && !doAll) {
+			BEntry parent;
+			source.GetParent(&parent);
+			if (parent.InitCheck() != B_OK)
+				return B_ERROR;
+
+			BPath path;
+			parent.GetPath(&path);
+			if (path.InitCheck() != B_OK)
+				return B_ERROR;
+
+			entry_ref destRef;
+			BEntry(&directory, name).GetRef(&destRef);
+
+			if (conflicts.listener != NULL)
+				conflicts.listener->AskingUser();
+			ConflictWindow* window = new ConflictWindow(path.Path(), ref,
+				destDir, destRef, desc);
+			int32 choice = window->Go(doAll);
+			if (conflicts.listener != NULL)
+				conflicts.listener->DoneAsking();
+			replace = choice == CONFLICT_REPLACE;
+			keepBoth = choice == CONFLICT_KEEP_BOTH;
+
+			conflicts.replace = replace;
+			conflicts.keepBoth = keepBoth;
+			conflicts.doAll = doAll;
+		}
 
-	if (!(replace && doAll)) {
-		BString destPath(destDir);
+		if (conflict && !replace && !keepBoth) {
+			printf("\tSkipped %s\n", name);
+			return B_OK;
+		}
 
-		if (destDir[strlen(destDir) - 1] != '/')
-			destPath += '/';
+		destName = name;
+		if (conflict && keepBoth)
+			GetFreeName(directory, name, destName);
 
-		destPath += name;
+		// Only replaces what the user agreed to
+		bool clobber = replace && (conflict || doAll);
+		status = move ? MoveFile(&source, target, clobber, destName.String())
+			: CopyFile(&source, target, clobber, destName.String());
 
-		BEntry dest(destPath);
-		if (dest.InitCheck() != B_OK)
-			return B_ERROR;
+		// The folder may have been removed since it was looked up
+		if (status == B_ENTRY_NOT_FOUND && !refreshed) {
+			refreshed = true;
+			target.Forget();
+			if (target.SetTo(destDir, true) != B_OK)
+				break;
+			continue;
+		}
 
-		conflict = dest.Exists();
-		if (conflict)
-			dest.GetRef(&destRef);
+		// Someone else took the name after we looked, which makes this a
+		// conflict after all
+		if (status != B_FILE_EXISTS || attempt == 10)
+			break;
+		NameAdded(target.Directory(), destName.String());
 	}
 
-	if (conflict && !doAll) {
-		BEntry parent;
-		source.GetParent(&parent);
-		if (parent.InitCheck() != B_OK)
-			return B_ERROR;
-
-		BPath path;
-		parent.GetPath(&path);
-		if (path.InitCheck() != B_OK)
-			return B_ERROR;
-
-		ConflictWindow* window = new ConflictWindow(path.Path(), ref, destDir,
-			destRef, desc);
-		replace = window->Go(doAll);
-
-		app->Replace(replace);
-		app->DoAll(doAll);
-	}
+	if (status == B_OK) {
+		NameAdded(target.Directory(), destName.String());
+		if (move) {
+			node_ref sourceFolder;
+			sourceFolder.device = ref.device;
+			sourceFolder.node = ref.directory;
+			NameRemoved(sourceFolder, name);
+		}
 
-	if (conflict && !replace) {
-		printf("\tSkipped %s\n", name);
-		return B_OK;
-	}
+		if (destName != name) {
+			printf("\t%s %s to %s as %s\n", move ? "Moved" : "Copied", name,
+				destDir, destName.String());
+		} else
+			printf("\t%s %s to %s\n", move ? "Moved" : "Copied", name, destDir);
 
-	status_t status = (move ? MoveFile : CopyFile)(&source, &entry, false);
-	if (status == B_OK)
-		printf("\t%s %s to %s\n", move ? "Moved" : "Copied", name, destDir);
-	else
+		// Later actions go on with the file where it is now
+		if (move)
+			source.GetRef(&ref);
+	} else
 		printf("\tCouldn't %s %s to %s. Stopping here.\n\t\t"
 			"Error Message: %s\n", move ? "move" : "copy", name, destDir,
 			strerror(status));
@@ -819,29 +995,25 @@ MoveOrCopy(const BMessage& action, const entry_ref& ref, const char* desc,
 
 
 status_t
-MoveAction(const BMessage& action, entry_ref& ref, const char* desc)
+MoveAction(const BString& value, entry_ref& ref, const char* desc,
+	ConflictChoice& conflicts)
 {
-	return MoveOrCopy(action, ref, desc, true);
+	return MoveOrCopy(value, ref, desc, conflicts, true);
 }
 
 
 status_t
-CopyAction(const BMessage& action, entry_ref& ref, const char* desc)
+CopyAction(const BString& value, entry_ref& ref, const char* desc,
+	ConflictChoice& conflicts)
 {
-	return MoveOrCopy(action, ref, desc, false);
+	return MoveOrCopy(value, ref, desc, conflicts, false);
 }
 
 
 status_t
-RenameAction(const BMessage& action, entry_ref& ref)
+RenameAction(const BString& value, entry_ref& ref)
 {
-	BString value;
 	status_t status;
-	status = action.FindString("value", &value);
-	if (status != B_OK)
-		return status;
-	value = ProcessPatterns(value.String(), ref);
-
 	BEntry entry(value.String(), true);
 	status = entry.InitCheck();
 	if (status != B_OK || entry.Exists())
@@ -906,14 +1078,10 @@ OpenAction(entry_ref& ref)
 
 
 status_t
-ArchiveAction(const BMessage& action, entry_ref& ref)
+ArchiveAction(const BString& archive, entry_ref& ref, bool wait)
 {
-	BString value;
+	BString value(archive);
 	status_t status;
-	status = action.FindString("value", &value);
-	if (status != B_OK)
-		return status;
-	value = ProcessPatterns(value.String(), ref);
 
 	if (value.IsEmpty()) {
 		printf("\tCouldn't create archive\n\t\tEmpty archive name\n");
@@ -935,14 +1103,32 @@ ArchiveAction(const BMessage& action, entry_ref& ref)
 			value << '/' << path.Leaf();
 	}
 
-	BString command = "";
-	command << "cd '" << parentstr << "'; zip -9 -u -r -y '" << value << "' '"
-		<< path.Leaf() << "'";
+	// zip stores the paths it's given, so it has to be run from inside the
+	// parent folder. The shell only does the "cd", all names are handed over
+	// as arguments of their own.
+	BStringList arguments;
+	ProcessRunner::ShellArguments(
+		"cd \"$1\" && exec zip -9 -u -r -y \"$2\" \"$3\"", arguments);
+	arguments.Add("zip");
+	arguments.Add(parentstr);
+	arguments.Add(value);
+	arguments.Add(path.Leaf());
+
+	if (!wait) {
+		status = ProcessRunner::Default()->Start(arguments);
+		if (status != B_OK) {
+			printf("\tCouldn't create archive %s\n\t\tError Message: %s\n",
+				value.String(), strerror(status));
+		} else
+			printf("\tAdding %s to Archive %s\n", ref.name, value.String());
+		return B_OK;
+	}
 
-	int result = system(command.String());
-	if (result) {
-		printf("\tCouldn't create archive %s\n\t\tError code: %d\n",
-			value.String(), result);
+	int32 result;
+	status = ProcessRunner::Default()->Run(arguments, &result);
+	if (status != B_OK || result) {
+		printf("\tCouldn't create archive %s\n\t\tError code: %" B_PRId32
+			"\n", value.String(), status != B_OK ? status : result);
 	} else
 		printf("\tAdded %s to Archive %s\n", ref.name, value.String());
 
@@ -951,19 +1137,45 @@ ArchiveAction(const BMessage& action, entry_ref& ref)
 
 
 status_t
-CommandAction(const BMessage& action, entry_ref& ref)
+CommandAction(const BString& value, entry_ref& ref, CommandBatch* batch,
+	bool wait, int32 filesAt)
 {
-	BString value;
 	status_t status;
-	status = action.FindString("value", &value);
-	if (status != B_OK)
-		return status;
-	value = ProcessPatterns(value.String(), ref);
 
-	int result = system(value.String());
-	if (result) {
+	if (filesAt >= 0) {
+		if (batch != NULL) {
+			batch->AddFile(value.String(), filesAt, ref);
+			printf("\tShell Command: queued %s for %s\n", ref.name,
+				value.String());
+			return B_OK;
+		}
+
+		// Nobody collects the files, so this one makes up a batch of its own
+		CommandBatch single;
+		single.AddFile(value.String(), filesAt, ref);
+		single.Run();
+		return B_OK;
+	}
+
+	BStringList arguments;
+	ProcessRunner::ShellArguments(value.String(), arguments);
+
+	if (!wait) {
+		status = ProcessRunner::Default()->Start(arguments);
+		if (status != B_OK) {
+			printf("\tShell Command: %s\n\t\tCouldn't start it: %s\n",
+				value.String(), strerror(status));
+		} else
+			printf("\tShell Command: %s\n", value.String());
+		return B_OK;
+	}
+
+	int32 result;
+	status = ProcessRunner::Default()->Run(arguments, &result);
+	if (status != B_OK || result) {
 		printf("\tShell Command: %s\n\t\tPossible error: "
-			"command returned %d\n", value.String(), result);
+			"command returned %" B_PRId32 "\n", value.String(),
+			status != B_OK ? status : result);
 	} else
 		printf("\tShell Command: %s\n", value.String());
 
@@ -977,9 +1189,9 @@ TrashAction(entry_ref& ref)
 	BPath path;
 	find_directory(B_TRASH_DIRECTORY, &path);
 
-	BEntry entry(path.Path(), true);
-	status_t status = entry.InitCheck();
-	if (status != B_OK || !entry.Exists() || !entry.IsDirectory())
+	TargetFolder trash;
+	status_t status = trash.SetTo(path.Path());
+	if (status != B_OK)
 		return B_ERROR;
 
 	BEntry source(&ref);
@@ -987,7 +1199,7 @@ TrashAction(entry_ref& ref)
 	if (status != B_OK)
 		return B_ERROR;
 
-	status = MoveFile(&source, &entry, false);
+	status = MoveFile(&source, trash, false);
 	if (status == B_OK) {
 		printf("\tMoved %s to the Trash\n", ref.name);
 		source.GetRef(&ref);
@@ -1076,14 +1288,18 @@ GetDataTypeForMode(int8 modetype)
 
 
 status_t
-LoadRules(BObjectList<FilerRule>* ruleList)
+LoadRules(BObjectList<FilerRule>* ruleList, const char* folder)
 {
 	BPath path;
-	find_directory(B_USER_SETTINGS_DIRECTORY, &path);
+	if (folder != NULL)
+		path.SetTo(folder);
+	else {
+		find_directory(B_USER_SETTINGS_DIRECTORY, &path);
+		path.Append(kSettingsFolder);
+	}
 
-	path.Append("Filer");
 	status_t ret = create_directory(path.Path(), 0777);
-	path.Append("FilerRules");
+	path.Append(kRulesFile);
 	if (ret != B_OK)
 		return ret;
 
@@ -1096,7 +1312,8 @@ LoadRules(BObjectList<FilerRule>* ruleList)
 	ret = rulesMsg.Unflatten(&file);
 
 	// Import from SQL if necessary
-	if (ret != B_OK && ret != B_NO_MEMORY && LoadSQLRules(ruleList) == B_OK) {
+	if (ret != B_OK && ret != B_NO_MEMORY && folder == NULL
+		&& LoadSQLRules(ruleList) == B_OK) {
 		ret = BEntry(path.Path()).Rename("FilerRules.sql");
 		if (ret == B_OK)
 			return SaveRules(ruleList);
@@ -1119,9 +1336,9 @@ SaveRules(const BObjectList<FilerRule>* ruleList)
 	BPath path;
 	find_directory(B_USER_SETTINGS_DIRECTORY, &path);
 
-	path.Append("Filer");
+	path.Append(kSettingsFolder);
 	status_t ret = create_directory(path.Path(), 0777);
-	path.Append("FilerRules");
+	path.Append(kRulesFile);
 	if (ret != B_OK)
 		return ret;
 
@@ -12,6 +12,11 @@
 
 #include "FilerRule.h"
 
+class ActionJournal;
+class CommandBatch;
+class PatternContext;
+class RegexMatcher;
+
 struct NamePair
 {
 	const char* const english;
@@ -49,6 +54,24 @@ enum TestType {
 	TEST_ATTRIBUTE
 };
 
+// Stored with the tests, new ones have to be added at the end
+enum ModeType {
+	MODE_IS,
+	MODE_NOT,
+	MODE_START,
+	MODE_END,
+	MODE_CONTAIN,
+	MODE_EXCLUDE,
+	MODE_MORE,
+	MODE_LESS,
+	MODE_LEAST,
+	MODE_MOST,
+	MODE_MATCH,
+	MODE_NOMATCH
+//	MODE_BEFORE,
+//	MODE_AFTER
+};
+
 enum {
 	ACTION_MOVE,
 	ACTION_COPY,
@@ -64,10 +87,43 @@ enum {
 // Pos-non-zero status value to specify checking more rules after match
 #define CONTINUE_TESTS 1
 
+// Told before and after the user is asked about a conflict, which may take
+// them a while, so that what's held meanwhile can be let go of
+class ConflictListener
+{
+public:
+	virtual					~ConflictListener() {}
+
+	virtual	void			AskingUser() = 0;
+	virtual	void			DoneAsking() = 0;
+};
+
+// What to do when a file is moved or copied to where there already is one
+// by that name. Unless the user chose to do the same for all of them, they
+// are asked, and their answer is stored here.
+struct ConflictChoice
+{
+	ConflictChoice()
+		:
+		doAll(false),
+		replace(false),
+		keepBoth(false),
+		listener(NULL)
+	{
+	}
+
+	bool	doAll;
+	bool	replace;
+	bool	keepBoth;
+	ConflictListener* listener;
+};
+
 class RuleRunner
 {
 public:
-						RuleRunner();
+						RuleRunner(CommandBatch* commandBatch = NULL,
+							ActionJournal* journal = NULL,
+							ConflictChoice* conflicts = NULL);
 						~RuleRunner();
 
 	static	void		GetTestTypes(BMessage& msg);
@@ -78,16 +134,36 @@ public:
 
 //	static	BString		GetEditorTypeForTest(const char* testname);
 
-			bool		IsMatch(const BMessage& test, const entry_ref& ref);
+			bool		IsMatch(const BMessage& test, const entry_ref& ref,
+							const RegexMatcher* regex = NULL,
+							PatternContext* context = NULL);
 			status_t	RunAction(const BMessage& test, entry_ref& ref,
 							const char* desc = NULL);
-			status_t	RunRule(FilerRule* rule, entry_ref& ref);
+			status_t	RunRule(FilerRule* rule, entry_ref& ref,
+							bool* passed = NULL);
+			bool		PassesTests(FilerRule* rule, const entry_ref& ref,
+							PatternContext* context = NULL);
+			status_t	RunActions(FilerRule* rule, entry_ref& ref,
+							int32 first = 0, int64 chain = -1,
+							PatternContext* context = NULL);
+
+private:
+			status_t	_RunAction(int8 type, const BString& value,
+							entry_ref& ref, const char* desc,
+							int32 filesAt = -1);
+
+			CommandBatch*	fCommandBatch;
+			ActionJournal*	fJournal;
+			ConflictChoice*	fConflicts;
+			ConflictChoice	fOwnConflicts;
+			bool			fLastAction;
 };
 
 int32		GetDataTypeForTest(int8 testtype);
 int32		GetDataTypeForMode(int8 modetype);
 
-status_t	LoadRules(BObjectList<FilerRule>* ruleList);
+status_t	LoadRules(BObjectList<FilerRule>* ruleList,
+				const char* folder = NULL);
 status_t	SaveRules(const BObjectList<FilerRule>* ruleList);
 
 status_t	LoadSQLRules(BObjectList<FilerRule>* ruleList);
@@ -0,0 +1,217 @@
+/*
+	StatsSocket.cpp: Hands the AutoFiler's stats, as text, to whoever connects
+				to its local socket
+	Released under the MIT license.
+*/
+
+#include "StatsSocket.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <Directory.h>
+#include <FindDirectory.h>
+#include <Path.h>
+
+#include "FilerDefs.h"
+
+/*
+	Besides asking the AutoFiler with "hey AutoFiler get Stats", the stats
+	can be read from a shell with a tool like "nc -U" on the socket in the
+	Filer settings folder. Only the user can connect to it. Each connection
+	gets them once, and is closed.
+*/
+
+static const char* const kSocketName = "AutoFiler_stats";
+
+// How long to wait for the AutoFiler to answer
+static const bigtime_t kReplyTimeout = 2000000;
+
+
+StatsSocket::StatsSocket(const BMessenger& target)
+	:
+	fTarget(target),
+	fSocket(-1),
+	fThread(-1)
+{
+}
+
+
+StatsSocket::~StatsSocket()
+{
+	Stop();
+}
+
+
+status_t
+StatsSocket::Start()
+{
+	status_t status = GetPath(fPath);
+	if (status != B_OK)
+		return status;
+
+	struct sockaddr_un address;
+	if (fPath.Length() >= (int32)sizeof(address.sun_path))
+		return B_NAME_TOO_LONG;
+
+	fSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fSocket < 0)
+		return errno;
+
+	// One left by an AutoFiler that crashed is in the way
+	unlink(fPath.String());
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, fPath.String());
+
+	if (bind(fSocket, (struct sockaddr*)&address, sizeof(address)) != 0
+		|| chmod(fPath.String(), 0600) != 0
+		|| listen(fSocket, 4) != 0) {
+		status = errno;
+		close(fSocket);
+		fSocket = -1;
+		return status;
+	}
+
+	fThread = spawn_thread(_ServeThread, "stats socket", B_LOW_PRIORITY,
+		this);
+	if (fThread < 0 || resume_thread(fThread) != B_OK) {
+		Stop();
+		return B_ERROR;
+	}
+
+	return B_OK;
+}
+
+
+void
+StatsSocket::Stop()
+{
+	if (fSocket < 0)
+		return;
+
+	// Gets the thread out of accept(). The socket is only closed once the
+	// thread is done with it.
+	shutdown(fSocket, SHUT_RDWR);
+	if (fThread >= 0) {
+		status_t result;
+		wait_for_thread(fThread, &result);
+		fThread = -1;
+	}
+
+	close(fSocket);
+	fSocket = -1;
+	unlink(fPath.String());
+}
+
+
+status_t
+StatsSocket::GetPath(BString& path)
+{
+	BPath settings;
+	status_t status = find_directory(B_USER_SETTINGS_DIRECTORY, &settings);
+	if (status != B_OK)
+		return status;
+
+	settings.Append(kSettingsFolder);
+	create_directory(settings.Path(), 0777);
+
+	settings.Append(kSocketName);
+	path = settings.Path();
+	return B_OK;
+}
+
+
+void
+StatsSocket::FormatMessage(const BMessage& message, BString& text,
+	int32 indent)
+{
+	BString prefix;
+	prefix.Append('\t', indent);
+
+	char* name;
+	type_code type;
+	int32 count;
+	for (int32 i = 0; message.GetInfo(B_ANY_TYPE, i, &name, &type, &count)
+			== B_OK; i++) {
+		for (int32 j = 0; j < count; j++) {
+			text << prefix << name << ":";
+
+			switch (type) {
+				case B_INT32_TYPE:
+					text << " " << message.GetInt32(name, j, 0) << "\n";
+					break;
+				case B_INT64_TYPE:
+					text << " " << message.GetInt64(name, j, 0) << "\n";
+					break;
+				case B_DOUBLE_TYPE:
+				{
+					BString value;
+					value.SetToFormat("%.2f", message.GetDouble(name, j, 0));
+					text << " " << value << "\n";
+					break;
+				}
+				case B_BOOL_TYPE:
+					text << " " << (message.GetBool(name, j, false)
+						? "true" : "false") << "\n";
+					break;
+				case B_STRING_TYPE:
+					text << " " << message.GetString(name, j, "") << "\n";
+					break;
+				case B_MESSAGE_TYPE:
+				{
+					BMessage inner;
+					message.FindMessage(name, j, &inner);
+					text << "\n";
+					FormatMessage(inner, text, indent + 1);
+					break;
+				}
+				default:
+					text << " ?\n";
+					break;
+			}
+		}
+	}
+}
+
+
+void
+StatsSocket::_Serve()
+{
+	int client;
+	while ((client = accept(fSocket, NULL, NULL)) >= 0) {
+		BMessage request(MSG_GET_STATUS);
+		BMessage reply;
+		BString text;
+		if (fTarget.SendMessage(&request, &reply, kReplyTimeout,
+				kReplyTimeout) == B_OK)
+			FormatMessage(reply, text);
+		else
+			text = "The AutoFiler doesn't answer\n";
+
+		const char* data = text.String();
+		ssize_t left = text.Length();
+		while (left > 0) {
+			ssize_t written = write(client, data, left);
+			if (written <= 0)
+				break;
+			data += written;
+			left -= written;
+		}
+		close(client);
+	}
+}
+
+
+status_t
+StatsSocket::_ServeThread(void* data)
+{
+	((StatsSocket*)data)->_Serve();
+	return B_OK;
+}
@@ -0,0 +1,43 @@
+/*
+	StatsSocket.h: Hands the AutoFiler's stats, as text, to whoever connects
+				to its local socket
+	Released under the MIT license.
+*/
+
+#ifndef STATS_SOCKET_H
+#define STATS_SOCKET_H
+
+#include <Message.h>
+#include <Messenger.h>
+#include <OS.h>
+#include <String.h>
+
+class StatsSocket
+{
+public:
+	// The stats are asked of the target with MSG_GET_STATUS
+							StatsSocket(const BMessenger& target);
+							~StatsSocket();
+
+			status_t		Start();
+			void			Stop();
+
+	// Where the socket is
+	static	status_t		GetPath(BString& path);
+
+	// The message's fields, one per line, those of messages in it indented
+	static	void			FormatMessage(const BMessage& message,
+								BString& text, int32 indent = 0);
+
+private:
+			void			_Serve();
+
+	static	status_t		_ServeThread(void* data);
+
+			BMessenger		fTarget;
+			BString			fPath;
+			int				fSocket;
+			thread_id		fThread;
+};
+
+#endif	// STATS_SOCKET_H
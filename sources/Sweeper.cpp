@@ -0,0 +1,684 @@
+/*
+	Sweeper.cpp: Runs the rules on the files of a watched folder on a schedule,
+				once they're old enough
+	Released under the MIT license.
+*/
+
+#include "Sweeper.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Autolock.h>
+#include <DataIO.h>
+#include <Directory.h>
+#include <Entry.h>
+#include <File.h>
+#include <FindDirectory.h>
+#include <Message.h>
+#include <OS.h>
+#include <Path.h>
+
+#include "FilerDefs.h"
+#include "RuleEngine.h"
+#include "Throttle.h"
+
+/*
+	Rules that are about files being left alone for a while don't get an
+	event when that happens. The sweeps, read from the "sweep" messages of
+	the Filer settings, look for them instead:
+
+		"folder"	the path of the folder
+		"schedule"	when to sweep it, like a crontab line, e.g. "0 3 * * *"
+		"olderthan"	how many days a file has to be left alone
+		"ruleset"	the rule set to run on the files, optional
+
+	Each sweep keeps an index of the files it has seen, by node, with the
+	time they were changed and their size. A file is only handed over once,
+	when it first turns up old enough, and again only after it was changed.
+	The folder is only read again once a file in it could be old enough, or
+	when files were added to it.
+
+	A sweep only reads so many files per second ("sweepentriespersecond"),
+	in a thread of low priority, so it doesn't get in the way. It saves
+	where it is every now and then, and when the AutoFiler is quit. The
+	files it has already looked at are skipped when it's picked up again.
+
+	Files only count as filed once the AutoFiler took them, which it may
+	not while it's quitting, so sending them gives up then. Those that
+	weren't taken are looked at again next time.
+*/
+
+// Default for "sweepentriespersecond"
+static const int32 kDefaultEntryRate = 200;
+
+// Files sent in one message
+static const int32 kSendCount = 64;
+
+// How long to wait for the AutoFiler to take them before checking for
+// quitting again
+static const bigtime_t kSendTimeout = 100000;
+
+// Files looked at between saving the index
+static const int32 kSaveInterval = 1024;
+
+static const uint32 kIndexMagic = 'Swpi';
+static const char* const kSweepsFolder = "Sweeps";
+
+// Enough for any schedule to come around
+static const int32 kMaxScheduleSteps = 100000;
+
+struct SweptEntry {
+	ino_t		node;
+	int64		modified;
+	int64		size;
+	// The start of the sweep that last looked at it
+	int64		stamp;
+	bool		filed;
+};
+
+struct SweepIndex {
+	SweepIndex()
+		:
+		entries(100, true),
+		started(0),
+		completed(0)
+	{
+	}
+
+	BObjectList<SweptEntry>	entries;
+	// The sweep being run, or 0
+	time_t					started;
+	time_t					completed;
+};
+
+
+static int
+CompareEntries(const SweptEntry* a, const SweptEntry* b)
+{
+	if (a->node < b->node)
+		return -1;
+	return a->node > b->node ? 1 : 0;
+}
+
+
+// Parses one field of a schedule: "*", numbers, ranges and steps,
+// separated by commas
+static bool
+ParseField(const char* spec, int32 min, int32 max, uint64& mask)
+{
+	mask = 0;
+
+	const char* pos = spec;
+	while (true) {
+		char* end;
+		int32 first = min;
+		int32 last = max;
+		if (*pos == '*')
+			pos++;
+		else {
+			first = strtol(pos, &end, 10);
+			if (end == pos)
+				return false;
+			pos = end;
+			last = first;
+
+			if (*pos == '-') {
+				pos++;
+				last = strtol(pos, &end, 10);
+				if (end == pos)
+					return false;
+				pos = end;
+			}
+		}
+
+		int32 step = 1;
+		if (*pos == '/') {
+			pos++;
+			step = strtol(pos, &end, 10);
+			if (end == pos || step <= 0)
+				return false;
+			pos = end;
+		}
+
+		if (first < min || last > max || first > last)
+			return false;
+		for (int32 i = first; i <= last; i += step)
+			mask |= 1ULL << i;
+
+		if (*pos == '\0')
+			return true;
+		if (*pos != ',')
+			return false;
+		pos++;
+	}
+}
+
+
+SweepSchedule::SweepSchedule()
+	:
+	minutes(0),
+	hours(0),
+	days(0),
+	months(0),
+	weekdays(0),
+	anyDay(true),
+	anyWeekday(true)
+{
+}
+
+
+bool
+SweepSchedule::SetTo(const char* spec)
+{
+	char fields[5][64];
+	char extra[2];
+	if (spec == NULL || sscanf(spec, "%63s %63s %63s %63s %63s %1s",
+			fields[0], fields[1], fields[2], fields[3], fields[4], extra) != 5)
+		return false;
+
+	uint64 mask[5];
+	if (!ParseField(fields[0], 0, 59, mask[0])
+		|| !ParseField(fields[1], 0, 23, mask[1])
+		|| !ParseField(fields[2], 1, 31, mask[2])
+		|| !ParseField(fields[3], 1, 12, mask[3])
+		|| !ParseField(fields[4], 0, 7, mask[4]))
+		return false;
+
+	minutes = mask[0];
+	hours = mask[1];
+	days = mask[2];
+	months = mask[3];
+	// Sunday is 0 or 7
+	weekdays = (mask[4] | mask[4] >> 7) & 0x7f;
+
+	// Like cron, a day matches either field if both are given
+	anyDay = fields[2][0] == '*';
+	anyWeekday = fields[4][0] == '*';
+	return true;
+}
+
+
+time_t
+SweepSchedule::NextAfter(time_t after) const
+{
+	struct tm date;
+	localtime_r(&after, &date);
+	date.tm_sec = 0;
+	date.tm_min++;
+
+	for (int32 i = 0; i < kMaxScheduleSteps; i++) {
+		date.tm_isdst = -1;
+		time_t next = mktime(&date);
+		localtime_r(&next, &date);
+
+		bool dayMatches = (days & (1UL << date.tm_mday)) != 0;
+		bool weekdayMatches = (weekdays & (1UL << date.tm_wday)) != 0;
+		if (!anyDay && !anyWeekday)
+			dayMatches = dayMatches || weekdayMatches;
+		else
+			dayMatches = dayMatches && weekdayMatches;
+
+		if ((months & (1UL << (date.tm_mon + 1))) == 0) {
+			date.tm_mon++;
+			date.tm_mday = 1;
+			date.tm_hour = 0;
+			date.tm_min = 0;
+		} else if (!dayMatches) {
+			date.tm_mday++;
+			date.tm_hour = 0;
+			date.tm_min = 0;
+		} else if ((hours & (1UL << date.tm_hour)) == 0) {
+			date.tm_hour++;
+			date.tm_min = 0;
+		} else if ((minutes & (1ULL << date.tm_min)) == 0)
+			date.tm_min++;
+		else
+			return next;
+	}
+
+	return -1;
+}
+
+
+Sweeper::Sweeper(const BMessenger& target)
+	:
+	fTarget(target),
+	fLock("sweeper"),
+	fSweeps(20, true),
+	fDue(20, true),
+	fEntryRate(kDefaultEntryRate),
+	fThread(-1),
+	fRunning(0),
+	fQuitting(0)
+{
+}
+
+
+Sweeper::~Sweeper()
+{
+	atomic_set(&fQuitting, 1);
+	if (fThread >= 0) {
+		status_t result;
+		wait_for_thread(fThread, &result);
+	}
+}
+
+
+void
+Sweeper::LoadSettings()
+{
+	BMessage msg;
+	RuleEngine::ReadSettings(msg);
+
+	int32 rate;
+	if (msg.FindInt32("sweepentriespersecond", &rate) != B_OK || rate <= 0)
+		rate = kDefaultEntryRate;
+
+	BAutolock _(fLock);
+
+	fEntryRate = rate;
+	fSweeps.MakeEmpty();
+
+	BMessage sweepMsg;
+	for (int32 i = 0; msg.FindMessage("sweep", i, &sweepMsg) == B_OK; i++) {
+		Sweep* sweep = new Sweep;
+		sweep->folder = sweepMsg.GetString("folder", "");
+		sweep->ruleSet = sweepMsg.GetString("ruleset", "");
+		sweep->olderThan = sweepMsg.GetInt32("olderthan", 0) * 86400;
+
+		const char* schedule = sweepMsg.GetString("schedule", NULL);
+		if (sweep->folder.IsEmpty() || !sweep->schedule.SetTo(schedule)) {
+			printf("\tSkipping the sweep of '%s', its schedule is invalid\n",
+				sweep->folder.String());
+			delete sweep;
+			continue;
+		}
+
+		// Without an age, every file in the folder would be filed
+		if (sweep->olderThan <= 0) {
+			printf("\tSkipping the sweep of '%s', it has no \"olderthan\"\n",
+				sweep->folder.String());
+			delete sweep;
+			continue;
+		}
+
+		// One index per folder and rule set
+		sweep->indexName = sweep->folder;
+		if (!sweep->ruleSet.IsEmpty())
+			sweep->indexName << "+" << sweep->ruleSet;
+		sweep->indexName.ReplaceAll('/', '_');
+
+		// The last time it was done tells when it's next, and one that was
+		// cut short goes on right away
+		SweepIndex index;
+		if (_LoadIndex(*sweep, index) != B_OK)
+			sweep->next = sweep->schedule.NextAfter(time(NULL));
+		else if (index.started > 0)
+			sweep->next = index.started;
+		else
+			sweep->next = sweep->schedule.NextAfter(index.completed);
+
+		fSweeps.AddItem(sweep);
+	}
+}
+
+
+void
+Sweeper::StartDue()
+{
+	if (atomic_get(&fRunning) != 0)
+		return;
+
+	if (fThread >= 0) {
+		status_t result;
+		wait_for_thread(fThread, &result);
+		fThread = -1;
+	}
+
+	BAutolock _(fLock);
+
+	time_t now = time(NULL);
+	fDue.MakeEmpty();
+	for (int32 i = 0; i < fSweeps.CountItems(); i++) {
+		Sweep* sweep = fSweeps.ItemAt(i);
+		if (sweep->next < 0 || sweep->next > now)
+			continue;
+
+		fDue.AddItem(new Sweep(*sweep));
+		sweep->next = sweep->schedule.NextAfter(now);
+	}
+
+	if (fDue.IsEmpty())
+		return;
+
+	atomic_set(&fRunning, 1);
+	fThread = spawn_thread(_SweepThread, "sweeper", B_LOW_PRIORITY, this);
+	if (fThread < 0 || resume_thread(fThread) != B_OK) {
+		fThread = -1;
+		atomic_set(&fRunning, 0);
+	}
+}
+
+
+void
+Sweeper::_RunSweeps(BObjectList<Sweep>& sweeps)
+{
+	for (int32 i = 0; i < sweeps.CountItems(); i++) {
+		if (!_Run(*sweeps.ItemAt(i)))
+			break;
+	}
+}
+
+
+bool
+Sweeper::_Run(const Sweep& sweep)
+{
+	BDirectory directory(sweep.folder.String());
+	node_ref folder;
+	if (directory.InitCheck() != B_OK || directory.GetNodeRef(&folder) != B_OK)
+		return true;
+
+	SweepIndex index;
+	_LoadIndex(sweep, index);
+	if (index.started > 0)
+		printf("\tResuming the sweep of %s\n", sweep.folder.String());
+	else {
+		time_t modified;
+		if (directory.GetModificationTime(&modified) == B_OK
+			&& modified < index.completed
+			&& time(NULL) < _NextDue(sweep, index))
+			return true;
+
+		index.started = time(NULL);
+	}
+
+	TokenBucket rate;
+	rate.SetRate(fEntryRate);
+
+	BMessage refs(MSG_SWEPT);
+	if (!sweep.ruleSet.IsEmpty())
+		refs.AddString("ruleset", sweep.ruleSet);
+	BObjectList<SweptEntry> sent(kSendCount, false);
+	int32 seen = 0;
+
+	time_t now = time(NULL);
+	char buffer[8192];
+	struct dirent* dirents = (struct dirent*)buffer;
+
+	int32 direntCount;
+	while ((direntCount = directory.GetNextDirents(dirents, sizeof(buffer)))
+			> 0) {
+		struct dirent* dirent = dirents;
+		for (int32 i = 0; i < direntCount; i++, dirent = (struct dirent*)
+				((char*)dirent + dirent->d_reclen)) {
+			const char* name = dirent->d_name;
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+				continue;
+
+			// Left for the next time
+			if (atomic_get(&fQuitting) != 0) {
+				_Send(refs, sent, index.started);
+				_SaveIndex(sweep, index);
+				return false;
+			}
+
+			SweptEntry key;
+			key.node = dirent->d_ino;
+			SweptEntry* entry = const_cast<SweptEntry*>(
+				index.entries.BinarySearch(key, CompareEntries));
+
+			// Looked at before the sweep was cut short
+			if (entry != NULL && entry->stamp == index.started)
+				continue;
+
+			bigtime_t wait = rate.Take(1, system_time());
+			if (wait > 0)
+				snooze(wait);
+
+			struct stat st;
+			if (directory.GetStatFor(name, &st) != B_OK
+				|| S_ISDIR(st.st_mode))
+				continue;
+
+			if (entry == NULL) {
+				entry = new SweptEntry;
+				entry->node = st.st_ino;
+				entry->stamp = 0;
+				entry->filed = false;
+				index.entries.BinaryInsert(entry, CompareEntries);
+			} else if (entry->modified != st.st_mtime
+				|| entry->size != st.st_size)
+				entry->filed = false;
+
+			entry->modified = st.st_mtime;
+			entry->size = st.st_size;
+
+			// It's only looked at once it was sent
+			if (!entry->filed && now - st.st_mtime >= sweep.olderThan) {
+				entry_ref ref(folder.device, folder.node, name);
+				refs.AddRef("refs", &ref);
+				sent.AddItem(entry);
+				if (sent.CountItems() == kSendCount
+					&& !_Send(refs, sent, index.started)) {
+					_SaveIndex(sweep, index);
+					return false;
+				}
+			} else
+				entry->stamp = index.started;
+
+			if (++seen % kSaveInterval == 0) {
+				bool taken = _Send(refs, sent, index.started);
+				_SaveIndex(sweep, index);
+				if (!taken)
+					return false;
+			}
+		}
+	}
+
+	if (!_Send(refs, sent, index.started)) {
+		_SaveIndex(sweep, index);
+		return false;
+	}
+
+	// The files that weren't there anymore are forgotten
+	for (int32 i = index.entries.CountItems() - 1; i >= 0; i--) {
+		if (index.entries.ItemAt(i)->stamp != index.started)
+			delete index.entries.RemoveItemAt(i);
+	}
+
+	index.completed = index.started;
+	index.started = 0;
+	_SaveIndex(sweep, index);
+
+	printf("\tSwept %s, %" B_PRId32 " files\n", sweep.folder.String(), seen);
+	return true;
+}
+
+
+// When a file the last sweep saw could first be old enough. A file changed
+// since then was changed after it started, and files added since then changed
+// the folder.
+time_t
+Sweeper::_NextDue(const Sweep& sweep, const SweepIndex& index)
+{
+	if (index.completed <= 0)
+		return 0;
+
+	time_t due = index.completed + sweep.olderThan;
+	for (int32 i = 0; i < index.entries.CountItems(); i++) {
+		const SweptEntry* entry = index.entries.ItemAt(i);
+		if (!entry->filed && entry->modified + sweep.olderThan < due)
+			due = entry->modified + sweep.olderThan;
+	}
+	return due;
+}
+
+
+// Returns false if the files couldn't be sent, as the AutoFiler is
+// quitting
+bool
+Sweeper::_Send(BMessage& refs, BObjectList<SweptEntry>& sent, time_t stamp)
+{
+	if (sent.IsEmpty())
+		return true;
+
+	// The AutoFiler may be too busy to take them, or waiting for this
+	// thread to quit
+	status_t status;
+	while ((status = fTarget.SendMessage(&refs, (BHandler*)NULL,
+			kSendTimeout)) == B_TIMED_OUT && atomic_get(&fQuitting) == 0)
+		;
+
+	if (status == B_OK) {
+		for (int32 i = 0; i < sent.CountItems(); i++) {
+			SweptEntry* entry = sent.ItemAt(i);
+			entry->filed = true;
+			entry->stamp = stamp;
+		}
+	}
+
+	refs.RemoveName("refs");
+	sent.MakeEmpty();
+	return status == B_OK;
+}
+
+
+status_t
+Sweeper::_IndexPath(const Sweep& sweep, BString& path)
+{
+	BPath settings;
+	status_t status = find_directory(B_USER_SETTINGS_DIRECTORY, &settings);
+	if (status != B_OK)
+		return status;
+
+	settings.Append(kSettingsFolder);
+	settings.Append(kSweepsFolder);
+	create_directory(settings.Path(), 0777);
+
+	path = settings.Path();
+	path << "/" << sweep.indexName;
+	return B_OK;
+}
+
+
+status_t
+Sweeper::_LoadIndex(const Sweep& sweep, SweepIndex& index)
+{
+	BString path;
+	status_t status = _IndexPath(sweep, path);
+	if (status != B_OK)
+		return status;
+
+	BFile file(path.String(), B_READ_ONLY);
+	status = file.InitCheck();
+	if (status != B_OK)
+		return status;
+
+	uint32 magic;
+	int64 started;
+	int64 completed;
+	int32 count;
+	if (file.Read(&magic, sizeof(magic)) != sizeof(magic)
+		|| magic != kIndexMagic
+		|| file.Read(&started, sizeof(started)) != sizeof(started)
+		|| file.Read(&completed, sizeof(completed)) != sizeof(completed)
+		|| file.Read(&count, sizeof(count)) != sizeof(count))
+		return B_BAD_DATA;
+
+	index.started = started;
+	index.completed = completed;
+	index.entries.MakeEmpty();
+
+	// They were saved in order
+	for (int32 i = 0; i < count; i++) {
+		int64 node;
+		uint8 filed;
+		SweptEntry* entry = new SweptEntry;
+		if (file.Read(&node, sizeof(node)) != sizeof(node)
+			|| file.Read(&entry->modified, sizeof(entry->modified))
+				!= sizeof(entry->modified)
+			|| file.Read(&entry->size, sizeof(entry->size))
+				!= sizeof(entry->size)
+			|| file.Read(&entry->stamp, sizeof(entry->stamp))
+				!= sizeof(entry->stamp)
+			|| file.Read(&filed, sizeof(filed)) != sizeof(filed)) {
+			delete entry;
+			break;
+		}
+
+		entry->node = node;
+		entry->filed = filed != 0;
+		index.entries.AddItem(entry);
+	}
+
+	return B_OK;
+}
+
+
+status_t
+Sweeper::_SaveIndex(const Sweep& sweep, const SweepIndex& index)
+{
+	BString path;
+	status_t status = _IndexPath(sweep, path);
+	if (status != B_OK)
+		return status;
+
+	BMallocIO buffer;
+	int64 started = index.started;
+	int64 completed = index.completed;
+	int32 count = index.entries.CountItems();
+	buffer.Write(&kIndexMagic, sizeof(kIndexMagic));
+	buffer.Write(&started, sizeof(started));
+	buffer.Write(&completed, sizeof(completed));
+	buffer.Write(&count, sizeof(count));
+
+	for (int32 i = 0; i < count; i++) {
+		const SweptEntry* entry = index.entries.ItemAt(i);
+		int64 node = entry->node;
+		uint8 filed = entry->filed ? 1 : 0;
+		buffer.Write(&node, sizeof(node));
+		buffer.Write(&entry->modified, sizeof(entry->modified));
+		buffer.Write(&entry->size, sizeof(entry->size));
+		buffer.Write(&entry->stamp, sizeof(entry->stamp));
+		buffer.Write(&filed, sizeof(filed));
+	}
+
+	// Written next to it first, so a crash leaves the old one
+	BString temporary(path);
+	temporary << ".new";
+	BFile file(temporary.String(), B_WRITE_ONLY | B_CREATE_FILE
+		| B_ERASE_FILE);
+	status = file.InitCheck();
+	if (status != B_OK)
+		return status;
+
+	ssize_t written = file.Write(buffer.Buffer(), buffer.BufferLength());
+	if (written != (ssize_t)buffer.BufferLength())
+		return written < 0 ? written : B_IO_ERROR;
+	file.Sync();
+
+	if (rename(temporary.String(), path.String()) != 0)
+		return B_ERROR;
+	return B_OK;
+}
+
+
+status_t
+Sweeper::_SweepThread(void* data)
+{
+	Sweeper* sweeper = (Sweeper*)data;
+
+	sweeper->fLock.Lock();
+	BObjectList<Sweep> sweeps(20, true);
+	for (int32 i = 0; i < sweeper->fDue.CountItems(); i++)
+		sweeps.AddItem(new Sweep(*sweeper->fDue.ItemAt(i)));
+	sweeper->fLock.Unlock();
+
+	sweeper->_RunSweeps(sweeps);
+
+	atomic_set(&sweeper->fRunning, 0);
+	return B_OK;
+}
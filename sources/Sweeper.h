@@ -0,0 +1,93 @@
+/*
+	Sweeper.h: Runs the rules on the files of a watched folder on a schedule,
+				once they're old enough
+	Released under the MIT license.
+*/
+
+#ifndef SWEEPER_H
+#define SWEEPER_H
+
+#include <time.h>
+
+#include <Locker.h>
+#include <Messenger.h>
+#include <String.h>
+
+#include "ObjectList.h"
+
+struct SweepIndex;
+struct SweptEntry;
+
+// When to sweep, in the five fields of a crontab line: minute, hour, day of
+// the month, month and day of the week
+struct SweepSchedule {
+			SweepSchedule();
+
+	// Returns false if it's not a valid schedule
+	bool	SetTo(const char* spec);
+	// The first time after the given one the schedule matches, or -1 if it
+	// never does
+	time_t	NextAfter(time_t after) const;
+
+	uint64	minutes;
+	uint32	hours;
+	uint32	days;
+	uint32	months;
+	uint32	weekdays;
+	bool	anyDay;
+	bool	anyWeekday;
+};
+
+struct Sweep {
+	BString			folder;
+	SweepSchedule	schedule;
+	// How long a file has to be left alone before it's filed, in seconds
+	time_t			olderThan;
+	// Run instead of the folder's rules, if set
+	BString			ruleSet;
+	// Where the sweep keeps track of the files it has seen
+	BString			indexName;
+	time_t			next;
+};
+
+class Sweeper
+{
+public:
+	// The files found are sent to the target in MSG_SWEPT messages
+							Sweeper(const BMessenger& target);
+	// Stops the sweep being run, which is picked up again next time
+							~Sweeper();
+
+	// Reads the sweeps from the Filer settings
+			void			LoadSettings();
+
+	// Starts the sweeps that are due, one after the other, unless they're
+	// still being run
+			void			StartDue();
+
+private:
+			void			_RunSweeps(BObjectList<Sweep>& sweeps);
+			bool			_Run(const Sweep& sweep);
+			time_t			_NextDue(const Sweep& sweep,
+								const SweepIndex& index);
+			bool			_Send(BMessage& refs,
+								BObjectList<SweptEntry>& sent,
+								time_t stamp);
+			status_t		_IndexPath(const Sweep& sweep, BString& path);
+			status_t		_LoadIndex(const Sweep& sweep, SweepIndex& index);
+			status_t		_SaveIndex(const Sweep& sweep,
+								const SweepIndex& index);
+
+	static	status_t		_SweepThread(void* data);
+
+			BMessenger		fTarget;
+			BLocker			fLock;
+			BObjectList<Sweep> fSweeps;
+			BObjectList<Sweep> fDue;
+			double			fEntryRate;
+			thread_id		fThread;
+			int32			fRunning;
+			int32			fQuitting;
+};
+
+#endif	// SWEEPER_H
@@ -0,0 +1,299 @@
+/*
+	TargetFolder.cpp: The folder files are moved or copied to, looked up once
+					per path and then kept open
+	Released under the MIT license.
+*/
+
+#include "TargetFolder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <Autolock.h>
+#include <Looper.h>
+#include <NodeMonitor.h>
+#include <Path.h>
+
+#include "ObjectList.h"
+
+/*
+	When thousands of files go to "/boot/home/Pictures/%REVERSEDATE%", the
+	pattern still has to be expanded for every one of them, but the folder
+	it names is only looked up, and created if needed, the first time. After
+	that, files are put there relative to the open folder, without going
+	through its path again.
+
+	The cache is kept honest by watching the folders, and all folders above
+	them, for being renamed, moved or removed, which clears it. As that
+	notice arrives a bit later, an action failing in a cached folder should
+	Forget() it and try once more.
+*/
+
+static const int32 kMaxFolders = 64;
+
+
+struct CachedFolder {
+	CachedFolder()
+		:
+		fd(-1)
+	{
+	}
+
+	~CachedFolder()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+
+	BString		path;
+	node_ref	nodeRef;
+	BDirectory	directory;
+	int			fd;
+};
+
+
+class FolderWatcher : public BLooper
+{
+public:
+	FolderWatcher()
+		:
+		BLooper("target folders")
+	{
+	}
+
+	virtual void MessageReceived(BMessage* message)
+	{
+		if (message->what != B_NODE_MONITOR) {
+			BLooper::MessageReceived(message);
+			return;
+		}
+
+		int32 opcode;
+		if (message->FindInt32("opcode", &opcode) == B_OK
+			&& (opcode == B_ENTRY_MOVED || opcode == B_ENTRY_REMOVED))
+			ClearTargetFolders();
+	}
+};
+
+
+static BLocker sFoldersLock("target folders");
+static BObjectList<CachedFolder> sFolders(kMaxFolders, true);
+static BObjectList<node_ref> sWatched(20, true);
+static FolderWatcher* sWatcher = NULL;
+
+
+static int
+OpenFolder(const char* path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+
+static CachedFolder*
+FindFolder(const char* path)
+{
+	for (int32 i = 0; i < sFolders.CountItems(); i++) {
+		CachedFolder* folder = sFolders.ItemAt(i);
+		if (folder->path == path) {
+			if (i > 0) {
+				sFolders.RemoveItemAt(i);
+				sFolders.AddItem(folder, 0);
+			}
+			return folder;
+		}
+	}
+	return NULL;
+}
+
+
+static void
+WatchFolder(BEntry entry)
+{
+	if (sWatcher == NULL) {
+		sWatcher = new FolderWatcher;
+		sWatcher->Run();
+	}
+
+	// Up to the root, as renaming any of the folders above changes where
+	// the path leads to
+	do {
+		node_ref nodeRef;
+		if (entry.GetNodeRef(&nodeRef) != B_OK)
+			break;
+
+		bool watched = false;
+		for (int32 i = 0; i < sWatched.CountItems(); i++) {
+			if (*sWatched.ItemAt(i) == nodeRef) {
+				watched = true;
+				break;
+			}
+		}
+		if (watched)
+			break;
+
+		if (watch_node(&nodeRef, B_WATCH_NAME, sWatcher) == B_OK)
+			sWatched.AddItem(new node_ref(nodeRef));
+	} while (entry.GetParent(&entry) == B_OK);
+}
+
+
+static CachedFolder*
+ResolveFolder(const char* path, bool create, status_t& status)
+{
+	BEntry entry(path, true);
+	status = entry.InitCheck();
+	if (status != B_OK)
+		return NULL;
+
+	if (!entry.Exists()) {
+		if (!create) {
+			status = B_ENTRY_NOT_FOUND;
+			return NULL;
+		}
+
+		status = create_directory(path, 0777);
+		if (status != B_OK)
+			return NULL;
+		entry.SetTo(path, true);
+	} else if (!entry.IsDirectory()) {
+		status = B_NOT_A_DIRECTORY;
+		return NULL;
+	}
+
+	CachedFolder* folder = new CachedFolder;
+	folder->path = path;
+	status = folder->directory.SetTo(&entry);
+	if (status == B_OK)
+		status = folder->directory.GetNodeRef(&folder->nodeRef);
+	if (status == B_OK) {
+		folder->fd = OpenFolder(path);
+		if (folder->fd < 0)
+			status = errno;
+	}
+
+	if (status != B_OK) {
+		delete folder;
+		return NULL;
+	}
+
+	WatchFolder(entry);
+
+	sFolders.AddItem(folder, 0);
+	if (sFolders.CountItems() > kMaxFolders)
+		delete sFolders.RemoveItemAt(sFolders.CountItems() - 1);
+
+	return folder;
+}
+
+
+TargetFolder::TargetFolder()
+	:
+	fFD(-1),
+	fStatus(B_NO_INIT)
+{
+}
+
+
+TargetFolder::~TargetFolder()
+{
+	Unset();
+}
+
+
+status_t
+TargetFolder::SetTo(const char* path, bool create)
+{
+	Unset();
+
+	if (path == NULL || path[0] == '\0')
+		return fStatus = B_BAD_VALUE;
+
+	fPath = path;
+
+	BAutolock _(sFoldersLock);
+
+	CachedFolder* folder = FindFolder(path);
+	if (folder == NULL) {
+		folder = ResolveFolder(path, create, fStatus);
+		if (folder == NULL)
+			return fStatus;
+	}
+
+	// Both are duplicates of what's in the cache, so they stay valid when
+	// the cache lets go of it
+	fDirectory = folder->directory;
+	fNodeRef = folder->nodeRef;
+	fFD = dup(folder->fd);
+	if (fFD < 0)
+		return fStatus = errno;
+
+	fcntl(fFD, F_SETFD, FD_CLOEXEC);
+	return fStatus = fDirectory.InitCheck();
+}
+
+
+status_t
+TargetFolder::SetTo(const BEntry& entry)
+{
+	Unset();
+
+	BPath path;
+	fStatus = entry.GetPath(&path);
+	if (fStatus != B_OK)
+		return fStatus;
+
+	fPath = path.Path();
+	fStatus = fDirectory.SetTo(&entry);
+	if (fStatus == B_OK)
+		fStatus = fDirectory.GetNodeRef(&fNodeRef);
+	if (fStatus != B_OK)
+		return fStatus;
+
+	fFD = OpenFolder(path.Path());
+	if (fFD < 0)
+		return fStatus = errno;
+
+	return fStatus = B_OK;
+}
+
+
+void
+TargetFolder::Unset()
+{
+	if (fFD >= 0)
+		close(fFD);
+	fFD = -1;
+	fDirectory.Unset();
+	fPath = "";
+	fStatus = B_NO_INIT;
+}
+
+
+void
+TargetFolder::Forget()
+{
+	BAutolock _(sFoldersLock);
+
+	for (int32 i = 0; i < sFolders.CountItems(); i++) {
+		if (sFolders.ItemAt(i)->path == fPath) {
+			delete sFolders.RemoveItemAt(i);
+			break;
+		}
+	}
+}
+
+
+void
+ClearTargetFolders()
+{
+	BAutolock _(sFoldersLock);
+
+	sFolders.MakeEmpty();
+	sWatched.MakeEmpty();
+	if (sWatcher != NULL)
+		stop_watching(sWatcher);
+}
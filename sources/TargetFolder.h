@@ -0,0 +1,48 @@
+/*
+	TargetFolder.h: The folder files are moved or copied to, looked up once
+					per path and then kept open
+	Released under the MIT license.
+*/
+
+#ifndef TARGET_FOLDER_H
+#define TARGET_FOLDER_H
+
+#include <Directory.h>
+#include <Entry.h>
+#include <Node.h>
+#include <String.h>
+
+class TargetFolder
+{
+public:
+							TargetFolder();
+							~TargetFolder();
+
+	// Looks the path up in the cache, resolving it, and creating the folder
+	// if asked to, only if it isn't known yet
+			status_t		SetTo(const char* path, bool create = false);
+	// Not cached, for one-off use
+			status_t		SetTo(const BEntry& entry);
+			void			Unset();
+
+	// Drops the path from the cache, after the folder turned out to be no
+	// longer where it was
+			void			Forget();
+
+			status_t		InitCheck() const { return fStatus; }
+			BDirectory&		Directory() { return fDirectory; }
+			int				FD() const { return fFD; }
+			const char*		Path() const { return fPath.String(); }
+			const node_ref&	NodeRef() const { return fNodeRef; }
+
+private:
+			BDirectory		fDirectory;
+			int				fFD;
+			BString			fPath;
+			node_ref		fNodeRef;
+			status_t		fStatus;
+};
+
+void		ClearTargetFolders();
+
+#endif	// TARGET_FOLDER_H
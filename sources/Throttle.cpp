@@ -0,0 +1,194 @@
+/*
+	Throttle.cpp: Keeps the AutoFiler from filing more files, or bytes, per
+				second than it's allowed to
+	Released under the MIT license.
+*/
+
+#include "Throttle.h"
+
+#include <Autolock.h>
+#include <Message.h>
+#include <OS.h>
+
+#include "RuleEngine.h"
+
+/*
+	The limits are read from the Filer settings: "filespersecond" and
+	"kbpersecond" for all files, "folderfilespersecond" and
+	"folderkbpersecond" for those of each watched folder. Without them, or
+	with 0, there's no limit.
+
+	Each limit is a token bucket, filled at the allowed rate and holding up
+	to one second's worth. A file takes what it needs, even more than is
+	there, and the worker waits for the bucket to fill up again. A big file
+	thus holds up the files after it, and the rate evens out.
+
+	With "idleonly", files going to be copied or archived wait until the
+	CPUs were idle for most of a second.
+*/
+
+// Less than this share of the CPU time being used is idle
+static const double kIdleLoad = 0.25;
+
+// Default for "bulksize", in KiB
+static const int32 kDefaultBulkSize = 1024;
+
+struct FolderLimits {
+	node_ref	folder;
+	TokenBucket	files;
+	TokenBucket	bytes;
+};
+
+
+TokenBucket::TokenBucket()
+	:
+	rate(0),
+	tokens(0),
+	last(0)
+{
+}
+
+
+void
+TokenBucket::SetRate(double newRate)
+{
+	rate = newRate;
+	tokens = rate;
+	last = system_time();
+}
+
+
+bigtime_t
+TokenBucket::Take(double amount, bigtime_t now)
+{
+	if (rate <= 0)
+		return 0;
+
+	tokens += rate * (now - last) / 1000000.0;
+	if (tokens > rate)
+		tokens = rate;
+	last = now;
+
+	tokens -= amount;
+	if (tokens >= 0)
+		return 0;
+
+	return (bigtime_t)(-tokens / rate * 1000000.0);
+}
+
+
+Throttle::Throttle()
+	:
+	fLock("throttle"),
+	fFolderFileRate(0),
+	fFolderByteRate(0),
+	fFolders(20, true),
+	fBulkSize(kDefaultBulkSize * 1024LL),
+	fIdleOnly(false),
+	fLastCheck(0),
+	fLastActive(0)
+{
+}
+
+
+Throttle::~Throttle()
+{
+}
+
+
+void
+Throttle::LoadSettings()
+{
+	BMessage msg;
+	RuleEngine::ReadSettings(msg);
+
+	int32 files;
+	int32 kb;
+	int32 folderFiles;
+	int32 folderKB;
+	int32 bulkSize;
+	if (msg.FindInt32("filespersecond", &files) != B_OK)
+		files = 0;
+	if (msg.FindInt32("kbpersecond", &kb) != B_OK)
+		kb = 0;
+	if (msg.FindInt32("folderfilespersecond", &folderFiles) != B_OK)
+		folderFiles = 0;
+	if (msg.FindInt32("folderkbpersecond", &folderKB) != B_OK)
+		folderKB = 0;
+	if (msg.FindInt32("bulksize", &bulkSize) != B_OK)
+		bulkSize = kDefaultBulkSize;
+
+	BAutolock _(fLock);
+
+	fFiles.SetRate(files);
+	fBytes.SetRate(kb * 1024.0);
+	fFolderFileRate = folderFiles;
+	fFolderByteRate = folderKB * 1024.0;
+	fFolders.MakeEmpty();
+
+	fBulkSize = bulkSize * 1024LL;
+	if (msg.FindBool("idleonly", &fIdleOnly) != B_OK)
+		fIdleOnly = false;
+}
+
+
+bigtime_t
+Throttle::Reserve(const node_ref& folder, off_t size)
+{
+	BAutolock _(fLock);
+
+	bigtime_t now = system_time();
+	bigtime_t wait = max_c(fFiles.Take(1, now), fBytes.Take(size, now));
+
+	if (fFolderFileRate <= 0 && fFolderByteRate <= 0)
+		return wait;
+
+	// There are only a few watched folders
+	FolderLimits* limits = NULL;
+	for (int32 i = 0; i < fFolders.CountItems(); i++) {
+		if (fFolders.ItemAt(i)->folder == folder) {
+			limits = fFolders.ItemAt(i);
+			break;
+		}
+	}
+
+	if (limits == NULL) {
+		limits = new FolderLimits;
+		limits->folder = folder;
+		limits->files.SetRate(fFolderFileRate);
+		limits->bytes.SetRate(fFolderByteRate);
+		fFolders.AddItem(limits);
+	}
+
+	wait = max_c(wait, limits->files.Take(1, now));
+	return max_c(wait, limits->bytes.Take(size, now));
+}
+
+
+bool
+Throttle::IsSystemIdle()
+{
+	system_info system;
+	if (get_system_info(&system) != B_OK)
+		return true;
+
+	cpu_info* cpus = new cpu_info[system.cpu_count];
+	bigtime_t active = 0;
+	if (get_cpu_info(0, system.cpu_count, cpus) == B_OK) {
+		for (uint32 i = 0; i < system.cpu_count; i++)
+			active += cpus[i].active_time;
+	}
+	delete[] cpus;
+
+	bigtime_t now = system_time();
+	bool idle = false;
+	if (fLastCheck > 0 && now > fLastCheck) {
+		double load = (double)(active - fLastActive)
+			/ ((now - fLastCheck) * (double)system.cpu_count);
+		idle = load < kIdleLoad;
+	}
+
+	fLastCheck = now;
+	fLastActive = active;
+	return idle;
+}
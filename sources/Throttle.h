@@ -0,0 +1,65 @@
+/*
+	Throttle.h: Keeps the AutoFiler from filing more files, or bytes, per
+				second than it's allowed to
+	Released under the MIT license.
+*/
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <Locker.h>
+#include <Node.h>
+
+#include "ObjectList.h"
+
+struct FolderLimits;
+
+struct TokenBucket {
+			TokenBucket();
+
+	void	SetRate(double rate);
+	// Takes the amount, and returns how long to wait until it was there
+	bigtime_t Take(double amount, bigtime_t now);
+
+	double		rate;
+	double		tokens;
+	bigtime_t	last;
+};
+
+class Throttle
+{
+public:
+							Throttle();
+							~Throttle();
+
+	// Reads the limits from the Filer settings
+			void			LoadSettings();
+
+	// Accounts for a file of the watched folder, and returns how long to
+	// wait before filing it
+			bigtime_t		Reserve(const node_ref& folder, off_t size);
+
+	// Files at least this big, or that weren't changed lately, are filed
+	// after the others
+			off_t			BulkSize() const { return fBulkSize; }
+
+	// Heavy actions are only run while the system is quiet
+			bool			IdleOnly() const { return fIdleOnly; }
+	// Whether the CPUs were mostly idle since the last call
+			bool			IsSystemIdle();
+
+private:
+			BLocker			fLock;
+			double			fFolderFileRate;
+			double			fFolderByteRate;
+			TokenBucket		fFiles;
+			TokenBucket		fBytes;
+			BObjectList<FolderLimits> fFolders;
+
+			off_t			fBulkSize;
+			bool			fIdleOnly;
+			bigtime_t		fLastCheck;
+			bigtime_t		fLastActive;
+};
+
+#endif	// THROTTLE_H
@@ -0,0 +1,231 @@
+/*
+	Watcher.cpp: Keeps an eye on the folders and files the AutoFiler is
+				interested in, and tells it about their changes
+	Released under the MIT license.
+*/
+
+#include "Watcher.h"
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include <NodeMonitor.h>
+
+#include "FilerDefs.h"
+
+
+#ifdef RLIMIT_NOVMON
+// What the kernel allows at most
+static const rlim_t kMaxNodeMonitors = 65536;
+#endif
+
+
+Watcher*
+Watcher::Create(const BHandler* target)
+{
+	return new NodeMonitorWatcher(target);
+}
+
+
+Watcher::~Watcher()
+{
+}
+
+
+void
+Watcher::ArchiveEvent(const WatchEvent& event, BMessage& message)
+{
+	// Moves only happen within a volume
+	dev_t device = event.node.device;
+	if (device < 0) {
+		device = event.directory.device >= 0 ? event.directory.device
+			: event.fromDirectory.device;
+	}
+
+	message.what = MSG_WATCH_EVENT;
+	message.AddInt32("opcode", event.opcode);
+	message.AddInt32("device", device);
+	message.AddInt64("node", event.node.node);
+	message.AddInt64("directory", event.directory.node);
+	message.AddInt64("from directory", event.fromDirectory.node);
+	message.AddString("name", event.name);
+}
+
+
+bool
+Watcher::UnarchiveEvent(const BMessage* message, WatchEvent& event)
+{
+	if (message->what != MSG_WATCH_EVENT
+		|| message->FindInt32("opcode", &event.opcode) != B_OK)
+		return false;
+
+	dev_t device = message->GetInt32("device", -1);
+	event.node = node_ref(device, message->GetInt64("node", -1));
+	event.directory = node_ref(device, message->GetInt64("directory", -1));
+	event.fromDirectory = node_ref(device,
+		message->GetInt64("from directory", -1));
+	event.name = message->GetString("name", "");
+	return true;
+}
+
+
+NodeMonitorWatcher::NodeMonitorWatcher(const BHandler* target)
+	:
+	fTarget(target)
+{
+#ifdef RLIMIT_NOVMON
+	// Every watched folder takes a node monitor, and a team only gets a
+	// few thousand of them to begin with
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOVMON, &limit) == 0) {
+		rlim_t wanted = kMaxNodeMonitors;
+		if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < wanted)
+			wanted = limit.rlim_max;
+		if (limit.rlim_cur < wanted) {
+			limit.rlim_cur = wanted;
+			if (setrlimit(RLIMIT_NOVMON, &limit) != 0)
+				printf("\tCouldn't raise the node monitor limit\n");
+		}
+	}
+#endif
+}
+
+
+status_t
+NodeMonitorWatcher::WatchFolder(const node_ref& node, bool root)
+{
+	return watch_node(&node, root ? B_WATCH_ALL : B_WATCH_DIRECTORY, fTarget);
+}
+
+
+status_t
+NodeMonitorWatcher::WatchFile(const node_ref& node)
+{
+	return watch_node(&node, B_WATCH_STAT | B_WATCH_ATTR, fTarget);
+}
+
+
+void
+NodeMonitorWatcher::Unwatch(const node_ref& node)
+{
+	watch_node(&node, B_STOP_WATCHING, fTarget);
+}
+
+
+void
+NodeMonitorWatcher::UnwatchAll()
+{
+	stop_watching(fTarget);
+}
+
+
+status_t
+NodeMonitorWatcher::WatchVolumes()
+{
+	return watch_node(NULL, B_WATCH_MOUNT, fTarget);
+}
+
+
+bool
+NodeMonitorWatcher::GetEvent(const BMessage* message, WatchEvent& event)
+{
+	int32 opcode;
+	if (message->what != B_NODE_MONITOR
+		|| message->FindInt32("opcode", &opcode) != B_OK)
+		return false;
+
+	int32 device;
+	int64 node;
+	int64 directory;
+	message->FindInt32("device", &device);
+	if (message->FindInt64("node", &node) != B_OK)
+		node = -1;
+
+	event.node = node_ref(device, node);
+	event.directory = node_ref();
+	event.fromDirectory = node_ref();
+	event.name = message->GetString("name", "");
+
+	switch (opcode) {
+		case B_ENTRY_CREATED:
+			event.opcode = WATCH_CREATED;
+			message->FindInt64("directory", &directory);
+			event.directory = node_ref(device, directory);
+			return true;
+
+		case B_ENTRY_MOVED:
+			event.opcode = WATCH_MOVED;
+			message->FindInt64("to directory", &directory);
+			event.directory = node_ref(device, directory);
+			message->FindInt64("from directory", &directory);
+			event.fromDirectory = node_ref(device, directory);
+			return true;
+
+		case B_ENTRY_REMOVED:
+			event.opcode = WATCH_REMOVED;
+			message->FindInt64("directory", &directory);
+			event.directory = node_ref(device, directory);
+			return true;
+
+		case B_STAT_CHANGED:
+			event.opcode = WATCH_STAT_CHANGED;
+			return true;
+
+		case B_ATTR_CHANGED:
+			event.opcode = WATCH_ATTR_CHANGED;
+			return true;
+
+		case B_DEVICE_MOUNTED:
+			event.opcode = WATCH_MOUNTED;
+			message->FindInt32("new device", &device);
+			event.node = node_ref(device, -1);
+			return true;
+
+		case B_DEVICE_UNMOUNTED:
+			event.opcode = WATCH_UNMOUNTED;
+			event.node = node_ref(device, -1);
+			return true;
+	}
+
+	return false;
+}
+
+
+status_t
+ReplayWatcher::WatchFolder(const node_ref& node, bool root)
+{
+	return B_OK;
+}
+
+
+status_t
+ReplayWatcher::WatchFile(const node_ref& node)
+{
+	return B_OK;
+}
+
+
+void
+ReplayWatcher::Unwatch(const node_ref& node)
+{
+}
+
+
+void
+ReplayWatcher::UnwatchAll()
+{
+}
+
+
+status_t
+ReplayWatcher::WatchVolumes()
+{
+	return B_OK;
+}
+
+
+bool
+ReplayWatcher::GetEvent(const BMessage* message, WatchEvent& event)
+{
+	return UnarchiveEvent(message, event);
+}
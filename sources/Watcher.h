@@ -0,0 +1,110 @@
+/*
+	Watcher.h: Keeps an eye on the folders and files the AutoFiler is
+				interested in, and tells it about their changes
+	Released under the MIT license.
+*/
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <Handler.h>
+#include <Message.h>
+#include <Node.h>
+#include <String.h>
+
+/*
+	Everything the AutoFiler watches goes through a Watcher, so the node
+	monitor can be swapped for another way to learn about changes. Each
+	Watcher sends messages of its own to its target, and turns them into
+	WatchEvents.
+*/
+
+enum {
+	WATCH_CREATED,
+	WATCH_MOVED,
+	WATCH_REMOVED,
+	WATCH_STAT_CHANGED,
+	WATCH_ATTR_CHANGED,
+	// The volume of the node was mounted or unmounted
+	WATCH_MOUNTED,
+	WATCH_UNMOUNTED
+};
+
+struct WatchEvent {
+	int32		opcode;
+	// What the event is about. Of entries that are gone, it may not be
+	// known, and is left at -1.
+	node_ref	node;
+	// Where the entry is, and for moves, where it was. A move out of the
+	// watched folders comes with no directory.
+	node_ref	directory;
+	node_ref	fromDirectory;
+	BString		name;
+};
+
+class Watcher
+{
+public:
+	// The one that works on this system
+	static	Watcher*			Create(const BHandler* target);
+
+	virtual						~Watcher();
+
+	// Events as sent in MSG_WATCH_EVENT messages
+	static	void				ArchiveEvent(const WatchEvent& event,
+									BMessage& message);
+	static	bool				UnarchiveEvent(const BMessage* message,
+									WatchEvent& event);
+
+	// The watched folders themselves report changes of their own as well,
+	// their subfolders only report entries coming and going
+	virtual	status_t			WatchFolder(const node_ref& node,
+									bool root) = 0;
+	// Changes of the contents and attributes of a single file
+	virtual	status_t			WatchFile(const node_ref& node) = 0;
+	virtual	void				Unwatch(const node_ref& node) = 0;
+	virtual	void				UnwatchAll() = 0;
+	// Volumes being mounted and unmounted, until UnwatchAll()
+	virtual	status_t			WatchVolumes() = 0;
+
+	// Returns false if the message didn't come from the Watcher
+	virtual	bool				GetEvent(const BMessage* message,
+									WatchEvent& event) = 0;
+};
+
+
+// Sends B_NODE_MONITOR messages to the handler
+class NodeMonitorWatcher : public Watcher
+{
+public:
+								NodeMonitorWatcher(const BHandler* target);
+
+	virtual	status_t			WatchFolder(const node_ref& node, bool root);
+	virtual	status_t			WatchFile(const node_ref& node);
+	virtual	void				Unwatch(const node_ref& node);
+	virtual	void				UnwatchAll();
+	virtual	status_t			WatchVolumes();
+
+	virtual	bool				GetEvent(const BMessage* message,
+									WatchEvent& event);
+
+private:
+			const BHandler*		fTarget;
+};
+
+
+// Watches nothing, the events are sent by an EventReplayer
+class ReplayWatcher : public Watcher
+{
+public:
+	virtual	status_t			WatchFolder(const node_ref& node, bool root);
+	virtual	status_t			WatchFile(const node_ref& node);
+	virtual	void				Unwatch(const node_ref& node);
+	virtual	void				UnwatchAll();
+	virtual	status_t			WatchVolumes();
+
+	virtual	bool				GetEvent(const BMessage* message,
+									WatchEvent& event);
+};
+
+#endif	// WATCHER_H
@@ -0,0 +1,387 @@
+/*
+	WorkQueue.cpp: The files handed to the AutoFiler's filing workers, at most
+				one of them per folder at a time
+	Released under the MIT license.
+*/
+
+#include "WorkQueue.h"
+
+#include <OS.h>
+
+/*
+	The queue holds a fixed number of files, so the workers falling behind
+	doesn't take up memory. What doesn't fit yet stays in the EventQueue.
+	A file keeps its slot until the worker is done with it, so it can be
+	put back.
+
+	Files of one folder are filed in the order they arrived: a worker taking
+	a file claims its folder, and the other workers skip the files of that
+	folder until it's done. As the files are looked at from the oldest on,
+	the first one of a folder is always the next one taken from it.
+
+	Among the folders, the files of the highest priority class are taken
+	first. Heavy files put back until the system is idle hold up the other
+	files of their folder, but no worker. They're kept aside, along with the
+	files of their folder that came after them, so they don't take up the
+	slots the other folders' files need.
+*/
+
+
+static node_ref
+FolderOf(const entry_ref& ref)
+{
+	return node_ref(ref.device, ref.directory);
+}
+
+
+WorkQueue::WorkQueue(int32 capacity, int32 workers)
+	:
+	fJobs(new FilingJob[capacity]),
+	fCapacity(capacity),
+	fHead(0),
+	fCount(0),
+	fDeferred(20, true),
+	fClaimed(new node_ref[workers]),
+	fClaimedCount(0),
+	fWorkers(workers),
+	fSystemIdle(false),
+	fClosed(false)
+{
+	pthread_mutex_init(&fLock, NULL);
+	pthread_cond_init(&fReady, NULL);
+	pthread_cond_init(&fRoom, NULL);
+}
+
+
+WorkQueue::~WorkQueue()
+{
+	pthread_cond_destroy(&fRoom);
+	pthread_cond_destroy(&fReady);
+	pthread_mutex_destroy(&fLock);
+	delete[] fClaimed;
+	delete[] fJobs;
+}
+
+
+status_t
+WorkQueue::Push(const entry_ref& ref, int64 ticket, int32 priority,
+	bool wait, const char* ruleSet, bigtime_t seen)
+{
+	pthread_mutex_lock(&fLock);
+
+	while (!fClosed && fCount + fClaimedCount >= fCapacity && wait)
+		pthread_cond_wait(&fRoom, &fLock);
+
+	status_t status = B_OK;
+	if (fClosed)
+		status = B_CANCELED;
+	else if (_IsDeferred(FolderOf(ref))) {
+		// It waits behind the heavy file of its folder
+		FilingJob* job = new FilingJob;
+		job->ref = ref;
+		job->ticket = ticket;
+		job->priority = priority;
+		job->ruleSet = ruleSet;
+		job->queued = system_time();
+		job->seen = seen;
+		job->heavy = false;
+		fDeferred.AddItem(job);
+	} else if (fCount + fClaimedCount >= fCapacity)
+		status = B_WOULD_BLOCK;
+	else {
+		FilingJob& job = _JobAt(fCount);
+		job.ref = ref;
+		job.ticket = ticket;
+		job.priority = priority;
+		job.ruleSet = ruleSet;
+		job.queued = system_time();
+		job.seen = seen;
+		job.heavy = false;
+		fCount++;
+		pthread_cond_signal(&fReady);
+	}
+
+	pthread_mutex_unlock(&fLock);
+	return status;
+}
+
+
+status_t
+WorkQueue::Pop(FilingJob& job)
+{
+	pthread_mutex_lock(&fLock);
+
+	// Files put aside come first. Once closed, the files left are kept for
+	// the next time.
+	int32 deferred = -1;
+	int32 index = -1;
+	while (!fClosed && (deferred = _FindDeferred()) < 0
+		&& (index = _FindReady()) < 0)
+		pthread_cond_wait(&fReady, &fLock);
+
+	if (fClosed) {
+		pthread_mutex_unlock(&fLock);
+		return B_CANCELED;
+	}
+
+	if (deferred >= 0) {
+		FilingJob* found = fDeferred.RemoveItemAt(deferred);
+		job = *found;
+		delete found;
+	} else {
+		job = _JobAt(index);
+		_RemoveAt(index);
+	}
+
+	if (fClaimedCount < fWorkers)
+		fClaimed[fClaimedCount++] = FolderOf(job.ref);
+
+	pthread_mutex_unlock(&fLock);
+	return B_OK;
+}
+
+
+void
+WorkQueue::Done(const FilingJob& job)
+{
+	pthread_mutex_lock(&fLock);
+
+	node_ref folder = FolderOf(job.ref);
+	for (int32 i = 0; i < fClaimedCount; i++) {
+		if (fClaimed[i] == folder) {
+			fClaimed[i] = fClaimed[--fClaimedCount];
+			break;
+		}
+	}
+
+	// The folder's next file may be waiting, or the queue be drained
+	pthread_cond_broadcast(&fReady);
+	pthread_cond_signal(&fRoom);
+	pthread_mutex_unlock(&fLock);
+}
+
+
+void
+WorkQueue::PutBack(const FilingJob& job)
+{
+	pthread_mutex_lock(&fLock);
+	fDeferred.AddItem(new FilingJob(job), 0);
+	pthread_mutex_unlock(&fLock);
+}
+
+
+void
+WorkQueue::Defer(const FilingJob& job)
+{
+	pthread_mutex_lock(&fLock);
+
+	// Ahead of any other files of its folder put aside, which can only
+	// have come after it
+	node_ref folder = FolderOf(job.ref);
+	int32 position = 0;
+	while (position < fDeferred.CountItems()
+		&& FolderOf(fDeferred.ItemAt(position)->ref) != folder)
+		position++;
+
+	FilingJob* deferred = new FilingJob(job);
+	deferred->heavy = true;
+	fDeferred.AddItem(deferred, position);
+
+	// The files of its folder still waiting follow it
+	for (int32 i = 0; i < fCount; i++) {
+		if (FolderOf(_JobAt(i).ref) != folder)
+			continue;
+
+		fDeferred.AddItem(new FilingJob(_JobAt(i)));
+		_RemoveAt(i--);
+	}
+
+	for (int32 i = 0; i < fClaimedCount; i++) {
+		if (fClaimed[i] == folder) {
+			fClaimed[i] = fClaimed[--fClaimedCount];
+			break;
+		}
+	}
+
+	pthread_cond_broadcast(&fReady);
+	pthread_cond_broadcast(&fRoom);
+	pthread_mutex_unlock(&fLock);
+}
+
+
+void
+WorkQueue::SetSystemIdle(bool idle)
+{
+	pthread_mutex_lock(&fLock);
+	fSystemIdle = idle;
+	if (idle)
+		pthread_cond_broadcast(&fReady);
+	pthread_mutex_unlock(&fLock);
+}
+
+
+void
+WorkQueue::Close()
+{
+	pthread_mutex_lock(&fLock);
+	fClosed = true;
+	pthread_cond_broadcast(&fReady);
+	pthread_cond_broadcast(&fRoom);
+	pthread_mutex_unlock(&fLock);
+}
+
+
+void
+WorkQueue::TakeRemaining(BObjectList<FilingJob>& jobs)
+{
+	pthread_mutex_lock(&fLock);
+
+	while (!fDeferred.IsEmpty())
+		jobs.AddItem(fDeferred.RemoveItemAt(0));
+	while (fCount > 0) {
+		jobs.AddItem(new FilingJob(_JobAt(0)));
+		_RemoveAt(0);
+	}
+
+	pthread_mutex_unlock(&fLock);
+}
+
+
+bool
+WorkQueue::IsClosed()
+{
+	pthread_mutex_lock(&fLock);
+	bool closed = fClosed;
+	pthread_mutex_unlock(&fLock);
+	return closed;
+}
+
+
+int32
+WorkQueue::CountFree()
+{
+	pthread_mutex_lock(&fLock);
+	int32 count = fCapacity - fCount - fClaimedCount;
+	pthread_mutex_unlock(&fLock);
+	return count;
+}
+
+
+int32
+WorkQueue::CountQueued()
+{
+	pthread_mutex_lock(&fLock);
+	int32 count = fCount;
+	pthread_mutex_unlock(&fLock);
+	return count;
+}
+
+
+int32
+WorkQueue::CountDeferred()
+{
+	pthread_mutex_lock(&fLock);
+	int32 count = fDeferred.CountItems();
+	pthread_mutex_unlock(&fLock);
+	return count;
+}
+
+
+bool
+WorkQueue::IsIdle()
+{
+	pthread_mutex_lock(&fLock);
+	bool idle = fClaimedCount == 0 && _FindReady() < 0
+		&& _FindDeferred() < 0;
+	pthread_mutex_unlock(&fLock);
+	return idle;
+}
+
+
+int32
+WorkQueue::_FindReady() const
+{
+	int32 found = -1;
+	for (int32 i = 0; i < fCount; i++) {
+		if ((found < 0 || _JobAt(i).priority < _JobAt(found).priority)
+			&& _IsReady(i)) {
+			found = i;
+			if (_JobAt(found).priority == PRIORITY_INTERACTIVE)
+				break;
+		}
+	}
+	return found;
+}
+
+
+bool
+WorkQueue::_IsReady(int32 index) const
+{
+	const FilingJob& job = _JobAt(index);
+	node_ref folder = FolderOf(job.ref);
+	if (_IsClaimed(folder) || _IsDeferred(folder))
+		return false;
+
+	// Only the first file of a folder is up next
+	for (int32 i = 0; i < index; i++) {
+		if (FolderOf(_JobAt(i).ref) == folder)
+			return false;
+	}
+	return true;
+}
+
+
+int32
+WorkQueue::_FindDeferred() const
+{
+	for (int32 i = 0; i < fDeferred.CountItems(); i++) {
+		const FilingJob* job = fDeferred.ItemAt(i);
+		if (job->heavy && !fSystemIdle)
+			continue;
+
+		node_ref folder = FolderOf(job->ref);
+		if (_IsClaimed(folder))
+			continue;
+
+		// Only the first file of a folder is up next
+		bool first = true;
+		for (int32 j = 0; j < i && first; j++)
+			first = FolderOf(fDeferred.ItemAt(j)->ref) != folder;
+		if (first)
+			return i;
+	}
+	return -1;
+}
+
+
+bool
+WorkQueue::_IsDeferred(const node_ref& folder) const
+{
+	for (int32 i = 0; i < fDeferred.CountItems(); i++) {
+		if (FolderOf(fDeferred.ItemAt(i)->ref) == folder)
+			return true;
+	}
+	return false;
+}
+
+
+bool
+WorkQueue::_IsClaimed(const node_ref& folder) const
+{
+	for (int32 i = 0; i < fClaimedCount; i++) {
+		if (fClaimed[i] == folder)
+			return true;
+	}
+	return false;
+}
+
+
+// The files before it move up, so the order stays
+void
+WorkQueue::_RemoveAt(int32 index)
+{
+	for (int32 i = index; i > 0; i--)
+		_JobAt(i) = _JobAt(i - 1);
+	fHead = (fHead + 1) % fCapacity;
+	fCount--;
+}
@@ -0,0 +1,109 @@
+/*
+	WorkQueue.h: The files handed to the AutoFiler's filing workers, at most
+				one of them per folder at a time
+	Released under the MIT license.
+*/
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <pthread.h>
+
+#include <Entry.h>
+#include <Node.h>
+#include <String.h>
+
+#include "ObjectList.h"
+
+// Files of a higher class are filed first
+enum {
+	PRIORITY_INTERACTIVE = 0,
+	PRIORITY_NORMAL,
+	PRIORITY_BULK
+};
+
+struct FilingJob {
+	entry_ref	ref;
+	// The file's ticket in the EventQueue, or -1 if it wasn't queued there
+	int64		ticket;
+	int32		priority;
+	// The rule set to run on it instead of the folder's rules, if any
+	BString		ruleSet;
+	// When it was handed to the workers
+	bigtime_t	queued;
+	// When its event came in, as real time, or 0 if that isn't known
+	bigtime_t	seen;
+	// Only filed while the system is idle
+	bool		heavy;
+};
+
+class WorkQueue
+{
+public:
+							WorkQueue(int32 capacity, int32 workers);
+							~WorkQueue();
+
+	// Returns B_WOULD_BLOCK if the queue is full and it wasn't asked to
+	// wait for room, and B_CANCELED once the queue was closed
+			status_t		Push(const entry_ref& ref, int64 ticket,
+								int32 priority = PRIORITY_NORMAL,
+								bool wait = false,
+								const char* ruleSet = NULL,
+								bigtime_t seen = 0);
+
+	// Waits for a file whose folder no other worker is busy with, which is
+	// the worker's until it calls Done(). Returns B_CANCELED once the queue
+	// was closed.
+			status_t		Pop(FilingJob& job);
+			void			Done(const FilingJob& job);
+	// A file that was taken, but isn't filed after all, is kept for
+	// TakeRemaining(). The worker still calls Done().
+			void			PutBack(const FilingJob& job);
+	// Puts a heavy file aside, ahead of the other files of its folder, until
+	// the system is idle. It gives up its slot, and so do they.
+			void			Defer(const FilingJob& job);
+			void			SetSystemIdle(bool idle);
+
+	// Lets the workers finish the files they took, but hands out no more,
+	// and takes no more
+			void			Close();
+			bool			IsClosed();
+	// Moves the files that weren't filed to jobs, once the workers are gone
+			void			TakeRemaining(BObjectList<FilingJob>& jobs);
+
+			int32			CountFree();
+			int32			CountQueued();
+			int32			CountDeferred();
+	// No worker busy, and nothing queued that could be filed now
+			bool			IsIdle();
+
+private:
+			int32			_FindReady() const;
+			bool			_IsReady(int32 index) const;
+			int32			_FindDeferred() const;
+			bool			_IsDeferred(const node_ref& folder) const;
+			bool			_IsClaimed(const node_ref& folder) const;
+			void			_RemoveAt(int32 index);
+			FilingJob&		_JobAt(int32 index) const
+								{ return fJobs[(fHead + index) % fCapacity]; }
+
+			pthread_mutex_t	fLock;
+			pthread_cond_t	fReady;
+			pthread_cond_t	fRoom;
+
+			FilingJob*		fJobs;
+			int32			fCapacity;
+			int32			fHead;
+			int32			fCount;
+
+			// Heavy files, and the files of their folders after them
+			BObjectList<FilingJob> fDeferred;
+
+			node_ref*		fClaimed;
+			int32			fClaimedCount;
+			int32			fWorkers;
+			bool			fSystemIdle;
+			bool			fClosed;
+};
+
+#endif	// WORK_QUEUE_H
@@ -21,7 +21,6 @@
 #include "FilerDefs.h"
 #include "FilerRule.h"
 #include "MainWindow.h"
-#include "RuleRunner.h"
 
 // Created upon startup instead of when spawning a RuleEditWindow for
 // better performance
@@ -31,48 +30,22 @@ BMessage gArchivedTypeMenu;
 App::App()
 	:
 	BApplication(kFilerSignature),
- 	fRefList(NULL),
- 	fRuleList(NULL),
 	fMainWin(NULL),
 	fQuitRequested(false),
-	fMatchSetting(false),
-	fDoAll(false),
-	fReplace(false)
+	fRefList(NULL)
 {
 	fRefList = new BObjectList<entry_ref>(20, true);
-	fRuleList = new BObjectList<FilerRule>(20, true);
 	
 //	SetupTypeMenu();
 
-	LoadRuleSettings();
-	LoadRules(fRuleList);
+	fEngine.LoadSettings();
+	fEngine.LoadRules();
 }
 
 
 App::~App()
 {
 	delete fRefList;
-	delete fRuleList;
-}
-
-
-void
-App::LoadRuleSettings()
-{
-	BPath path;
-	BMessage msg;
-
-	if (find_directory(B_USER_SETTINGS_DIRECTORY, &path) == B_OK) {
-		status_t ret = path.Append(kSettingsFolder);
-		if (ret == B_OK) {
-			path.Append(kSettingsFile);
-			BFile file(path.Path(), B_READ_ONLY);
-
-			if ((file.InitCheck() == B_OK) && (msg.Unflatten(&file) == B_OK))
-				if (msg.FindBool("match", &fMatchSetting) != B_OK)
-					fMatchSetting = false;
-		}
-	}
 }
 
 
@@ -84,8 +57,9 @@ App::MessageReceived(BMessage* msg)
 		case MSG_AUTO_FILER:
 		{
 			BMessage reply('frpl');
-			reply.AddBool(kDoAll, fDoAll);
-			reply.AddBool(kReplace, fReplace);
+			reply.AddBool(kDoAll, fConflicts.doAll);
+			reply.AddBool(kReplace, fConflicts.replace);
+			reply.AddBool(kKeepBoth, fConflicts.keepBoth);
 			msg->SendReply(&reply);
 			break;
 		}
@@ -135,8 +109,9 @@ App::RefsReceived(BMessage* msg)
 
 		if (msg->FindBool(kDoAll, &tmp) == B_OK)
 		{
-			fDoAll = tmp;
-			msg->FindBool(kReplace, &fReplace);
+			fConflicts.doAll = tmp;
+			msg->FindBool(kReplace, &fConflicts.replace);
+			msg->FindBool(kKeepBoth, &fConflicts.keepBoth);
 		}
 	}
 }
@@ -166,6 +141,9 @@ App::ArgvReceived(int32 argc, char** argv)
 void
 App::ReadyToRun()
 {
+	if (fEngine.OpenJournal() == B_OK)
+		fEngine.ResumeInterrupted(fConflicts);
+
 	if (fRefList->CountItems() > 0 || fQuitRequested) {
 		ProcessFiles();
 		PostMessage(B_QUIT_REQUESTED);
@@ -191,35 +169,22 @@ App::SetDecimalMark()
 void
 App::ProcessFiles()
 {
+	fEngine.BeginBatch();
+
 	for (int32 i = 0; i < fRefList->CountItems(); i++)
 	{
 		entry_ref ref = *fRefList->ItemAt(i);
 		FileRef(ref);
 	}
+
+	fEngine.EndBatch();
 }
 
 
 void
 App::FileRef(entry_ref ref)
 {
-	RuleRunner runner;
-	
-	for (int32 i = 0; i < fRuleList->CountItems(); i++)
-	{
-		FilerRule* rule = fRuleList->ItemAt(i);
-
-		if (rule->Disabled())
-			continue;
-
-		status_t res = runner.RunRule(rule,ref);
-
-		// default stop here if rule was successful
-		// note that the loop will continue if a rule has an error
-		if (res == B_OK && fMatchSetting == true) {
-			printf("Applying first matching rule only!\n");
-			break;
-		}
-	}
+	fEngine.FileRef(ref, fConflicts);
 }
 
 
@@ -15,6 +15,8 @@
 #include <Message.h>
 
 #include "ObjectList.h"
+#include "RuleEngine.h"
+#include "RuleRunner.h"
 
 class FilerRule;
 class MainWindow;
@@ -35,18 +37,13 @@ public:
 	void			FileRef(entry_ref ref);
 	char			GetDecimalMark() { return fDecimalMark; }
 
-	bool			GetMatchSetting() const { return fMatchSetting; }
-	void			ToggleMatchSetting() { fMatchSetting = !fMatchSetting; }
+	bool			GetMatchSetting() const { return fEngine.MatchSetting(); }
+	void			ToggleMatchSetting()
+						{ fEngine.SetMatchSetting(!fEngine.MatchSetting()); }
 
-	bool			DoAll() const { return fDoAll; }
-	void			DoAll(bool doAll) { fDoAll = doAll; }
-	bool			Replace() const { return fReplace; }
-	void			Replace(bool replace) { fReplace = replace; }
-
-	BObjectList<FilerRule>*	GetRuleList() const { return fRuleList; }
+	BObjectList<FilerRule>*	GetRuleList() const { return fEngine.Rules(); }
 
 private:
-	void			LoadRuleSettings();
 	void			ProcessFiles();
 	void			SetDecimalMark();
 
@@ -54,13 +51,11 @@ private:
 
 	char			fDecimalMark;
 	bool			fQuitRequested;
-	bool 			fMatchSetting;
 
-	bool			fDoAll;
-	bool			fReplace;
+	RuleEngine		fEngine;
+	ConflictChoice	fConflicts;
 
 	BObjectList<entry_ref>*	fRefList;
-	BObjectList<FilerRule>*	fRuleList;
 };
 
 #endif	// MAIN_H